@@ -0,0 +1,146 @@
+/**
+ * Copyright (C) 2016, Vadim Fedorov <coderiks@gmail.com>
+ *
+ * This program is free software: you can use, modify and/or
+ * redistribute it under the terms of the simplified BSD
+ * License. You should have received a copy of this license along
+ * this program. If not, see
+ * <http://www.opensource.org/licenses/bsd-license.html>.
+ */
+
+#include <algorithm>
+#include <cstdlib>
+#include "block_traversal.h"
+
+using std::vector;
+
+namespace
+{
+	/**
+	 * Spread bits of a value, so that there is a zero bit between every two of them.
+	 */
+	inline unsigned long long spread_bits(uint value)
+	{
+		unsigned long long bits = value;
+		bits = (bits | (bits << 16)) & 0x0000FFFF0000FFFFull;
+		bits = (bits | (bits << 8)) & 0x00FF00FF00FF00FFull;
+		bits = (bits | (bits << 4)) & 0x0F0F0F0F0F0F0F0Full;
+		bits = (bits | (bits << 2)) & 0x3333333333333333ull;
+		bits = (bits | (bits << 1)) & 0x5555555555555555ull;
+		return bits;
+	}
+
+
+	inline int sign(int value)
+	{
+		return (value > 0) - (value < 0);
+	}
+
+
+	/**
+	 * Divide by two rounding towards negative infinity.
+	 */
+	inline int floor_half(int value)
+	{
+		return (value >= 0) ? value / 2 : -((1 - value) / 2);
+	}
+}
+
+
+void BlockTraversal::order(int x_0, int y_0, int x_1, int y_1,
+						   Traversals::Traversal traversal,
+						   vector<Point> &points)
+{
+	points.clear();
+	int size_x = x_1 - x_0;
+	int size_y = y_1 - y_0;
+	if (size_x <= 0 || size_y <= 0) {
+		return;
+	}
+	points.reserve(size_x * size_y);
+
+	if (traversal == Traversals::hilbert) {
+		// NOTE: the curve is started along the longer side, so that it can cover a rectangle of any proportions
+		if (size_x >= size_y) {
+			hilbert(x_0, y_0, size_x, 0, 0, size_y, points);
+		} else {
+			hilbert(x_0, y_0, 0, size_y, size_x, 0, points);
+		}
+		return;
+	}
+
+	for (int y = y_0; y < y_1; y++) {
+		for (int x = x_0; x < x_1; x++) {
+			points.push_back(Point(x, y));
+		}
+	}
+
+	if (traversal == Traversals::morton) {
+		std::sort(points.begin(), points.end(), [x_0, y_0] (const Point &left, const Point &right) {
+			return morton_code(left.x - x_0, left.y - y_0) < morton_code(right.x - x_0, right.y - y_0);
+		});
+	}
+}
+
+
+unsigned long long BlockTraversal::morton_code(uint x, uint y)
+{
+	return spread_bits(x) | (spread_bits(y) << 1);
+}
+
+/* Private */
+
+/**
+ * Generalized Hilbert curve covering a rectangle of an arbitrary size.
+ * The rectangle starts at (x, y) and is spanned by vectors a (the major direction) and b,
+ * which are axis aligned. It is recursively split in two parts along a, if it is much longer
+ * than wide, or in three parts otherwise, such that every part is entered next to the exit of
+ * the previous one. Splits are shifted by one to keep the parts of even size where possible,
+ * so the curve has no jumps (only a few diagonal steps for rectangles with odd sides).
+ */
+void BlockTraversal::hilbert(int x, int y, int a_x, int a_y, int b_x, int b_y, vector<Point> &points)
+{
+	int width = std::abs(a_x + a_y);
+	int height = std::abs(b_x + b_y);
+	int da_x = sign(a_x), da_y = sign(a_y);		// unit major direction
+	int db_x = sign(b_x), db_y = sign(b_y);		// unit orthogonal direction
+
+	// Trivial cases of a single row or column
+	if (height == 1) {
+		for (int i = 0; i < width; i++, x += da_x, y += da_y) {
+			points.push_back(Point(x, y));
+		}
+		return;
+	}
+	if (width == 1) {
+		for (int i = 0; i < height; i++, x += db_x, y += db_y) {
+			points.push_back(Point(x, y));
+		}
+		return;
+	}
+
+	int a2_x = floor_half(a_x), a2_y = floor_half(a_y);
+	int b2_x = floor_half(b_x), b2_y = floor_half(b_y);
+	int width_2 = std::abs(a2_x + a2_y);
+	int height_2 = std::abs(b2_x + b2_y);
+
+	if (2 * width > 3 * height) {
+		// Long rectangle: split in two halves along the major direction
+		if ((width_2 % 2) && width > 2) {
+			a2_x += da_x;
+			a2_y += da_y;
+		}
+		hilbert(x, y, a2_x, a2_y, b_x, b_y, points);
+		hilbert(x + a2_x, y + a2_y, a_x - a2_x, a_y - a2_y, b_x, b_y, points);
+	} else {
+		// Standard case: go up, across and back down
+		if ((height_2 % 2) && height > 2) {
+			b2_x += db_x;
+			b2_y += db_y;
+		}
+		hilbert(x, y, b2_x, b2_y, a2_x, a2_y, points);
+		hilbert(x + b2_x, y + b2_y, a_x, a_y, b_x - b2_x, b_y - b2_y, points);
+		hilbert(x + (a_x - da_x) + (b2_x - db_x), y + (a_y - da_y) + (b2_y - db_y),
+				-b2_x, -b2_y, -(a_x - a2_x), -(a_y - a2_y), points);
+	}
+}
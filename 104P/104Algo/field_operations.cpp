@@ -8,8 +8,28 @@
  * <http://www.opensource.org/licenses/bsd-license.html>.
  */
 
+#include <vector>
 #include "field_operations.h"
 
+namespace
+{
+	/**
+	 * Apply symmetric boundary conditions ( | 3 2 1 0 | 0 1 2 3 | 3 2 1 0 | ) on a range [lower, upper).
+	 */
+	inline int reflect(int id, int lower, int upper)
+	{
+		while ((id < lower) || (id >= upper)) {
+			if (id < lower) {
+				id = 2 * lower - id - 1;
+			}
+			if (id >= upper) {
+				id = 2 * upper - id - 1;
+			}
+		}
+		return id;
+	}
+}
+
 void FieldOperations::centered_gradient(const float *in, float *dx, float *dy, const int nx, const int ny)
 {
 	float filter_der[5] = {-1.0/12.0, 8.0/12.0, 0.0, -8.0/12.0, 1.0/12.0};
@@ -93,4 +113,66 @@ void FieldOperations::separate_convolution(const float *in, float *out,
 
 	// Free memory
 	delete [] buffer;
-}
\ No newline at end of file
+}
+
+void FieldOperations::centered_gradient(const ImageFx<float> &in, Image<float> &dx, Image<float> &dy)
+{
+	float filter_der[5] = {-1.0/12.0, 8.0/12.0, 0.0, -8.0/12.0, 1.0/12.0};
+	float filter_id[1]  = {1.0};
+
+	separate_convolution(in, dx, filter_der, filter_id, 5, 1);
+	separate_convolution(in, dy, filter_id, filter_der, 1, 5);
+}
+
+
+/**
+ * @note Coordinates are relative to the view, the parent image spans [-halo.left, size_x + halo.right) and
+ *       [-halo.top, size_y + halo.bottom). The order of operations is the same as for the whole image,
+ *       so the results are identical.
+ */
+void FieldOperations::separate_convolution(const ImageFx<float> &in, Image<float> &out,
+										   const float *filter_x, const float *filter_y,
+										   int filter_x_size, int filter_y_size)
+{
+	int size_x = in.size_x();
+	int size_y = in.size_y();
+	Halo halo = in.halo();
+	int lower_x = -(int)halo.left;
+	int upper_x = size_x + halo.right;
+	int lower_y = -(int)halo.top;
+	int upper_y = size_y + halo.bottom;
+
+	// Rows of the parent, which are reached by the filter along y axis
+	int radius_x = (filter_x_size - 1) / 2;
+	int radius_y = (filter_y_size - 1) / 2;
+	int row_begin = std::max(lower_y, -(filter_y_size - 1));
+	int row_end = std::min(upper_y, size_y + filter_y_size - 1);
+
+	// Do convolution along x axis
+	std::vector<float> buffer((row_end - row_begin) * size_x);
+	for (int y = row_begin; y < row_end; y++) {
+		const float *in_row = in.row(y);
+		float *buffer_row = buffer.data() + (y - row_begin) * size_x;
+		for (int x = 0; x < size_x; x++) {
+			float sum = 0.0;
+			for (int i = filter_x_size - 1; i >= 0; i--) {
+				int id = reflect(x + radius_x - i, lower_x, upper_x);
+				sum += filter_x[i] * in_row[id];
+			}
+			buffer_row[x] = sum;
+		}
+	}
+
+	// Do convolution along y axis
+	for (int y = 0; y < size_y; y++) {
+		float *out_row = out.row(y);
+		for (int x = 0; x < size_x; x++) {
+			float sum = 0.0;
+			for (int i = filter_y_size - 1; i >= 0; i--) {
+				int id = reflect(y + radius_y - i, lower_y, upper_y);
+				sum += filter_y[i] * buffer[(id - row_begin) * size_x + x];
+			}
+			out_row[x] = sum;
+		}
+	}
+}
@@ -0,0 +1,44 @@
+/**
+ * Copyright (C) 2016, Vadim Fedorov <coderiks@gmail.com>
+ *
+ * This program is free software: you can use, modify and/or
+ * redistribute it under the terms of the simplified BSD
+ * License. You should have received a copy of this license along
+ * this program. If not, see
+ * <http://www.opensource.org/licenses/bsd-license.html>.
+ */
+
+#ifndef BLOCK_TRAVERSAL_H_
+#define BLOCK_TRAVERSAL_H_
+
+#include <vector>
+#include "point.h"
+#include "shape.h"
+
+namespace Traversals
+{
+	enum Traversal {scanline, morton, hilbert};
+}
+
+/**
+ * Orders of visiting points of a rectangular block.
+ * Along the Morton (Z-order) and Hilbert curves consecutive points stay close in both directions,
+ * so that neighbourhoods of consecutive points (e.g. elliptical regions) mostly overlap and remain in cache.
+ */
+class BlockTraversal
+{
+public:
+	/// Fill points of a block [x_0, x_1) x [y_0, y_1) in a given order.
+	/// @note The previous content of @param points is discarded.
+	static void order(int x_0, int y_0, int x_1, int y_1,
+					  Traversals::Traversal traversal,
+					  std::vector<Point> &points);
+
+	/// Get position of a point along the Morton curve (bits of x and y interleaved, x in the lower bit).
+	static unsigned long long morton_code(uint x, uint y);
+
+private:
+	static void hilbert(int x, int y, int a_x, int a_y, int b_x, int b_y, std::vector<Point> &points);
+};
+
+#endif /* BLOCK_TRAVERSAL_H_ */
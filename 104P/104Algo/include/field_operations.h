@@ -11,6 +11,8 @@
 #ifndef FIELD_OPERATIONS_H_
 #define FIELD_OPERATIONS_H_
 
+#include "image.h"
+
 class FieldOperations
 {
 public:
@@ -19,6 +21,20 @@ public:
 									 int size_x, int size_y,
 									 const float *filter_x, const float *filter_y,
 									 int filter_x_size, int filter_y_size);
+
+	/// Compute gradient of a single channel image or of its view.
+	/// Pixels of the halo are used near the sides of a view, so tiles of an image
+	/// can be processed independently with the same result as the whole image.
+	/// @param dx [out] Image (or view) of the same size as @param in.
+	/// @param dy [out] Image (or view) of the same size as @param in.
+	static void centered_gradient(const ImageFx<float> &in, Image<float> &dx, Image<float> &dy);
+
+	/// Convolve a single channel image or its view with a separable filter.
+	/// Symmetric boundary conditions are applied at the sides of the parent image.
+	/// @param out [out] Image (or view) of the same size as @param in.
+	static void separate_convolution(const ImageFx<float> &in, Image<float> &out,
+									 const float *filter_x, const float *filter_y,
+									 int filter_x_size, int filter_y_size);
 };
 
 #endif /* FIELD_OPERATIONS_H_ */
@@ -0,0 +1,300 @@
+/**
+ * Copyright (C) 2016, Vadim Fedorov <coderiks@gmail.com>
+ *
+ * This program is free software: you can use, modify and/or
+ * redistribute it under the terms of the simplified BSD
+ * License. You should have received a copy of this license along
+ * this program. If not, see
+ * <http://www.opensource.org/licenses/bsd-license.html>.
+ */
+
+#include <algorithm>
+#include <stdexcept>
+#include "bit_mask.h"
+
+
+BitMask::BitMask()
+ : _words(), _size_x(0), _size_y(0), _words_per_row(0)
+{
+
+}
+
+
+BitMask::BitMask(uint size_x, uint size_y, bool default_value)
+ : _size_x(size_x), _size_y(size_y), _words_per_row((size_x + WORD_SIZE - 1) / WORD_SIZE)
+{
+	_words = std::vector<Word>(_words_per_row * _size_y, (default_value) ? ~(Word)0 : 0);
+	clear_padding();
+}
+
+
+BitMask::BitMask(const ImageFx<bool> &source)
+ : _size_x(source.size_x()), _size_y(source.size_y()), _words_per_row((source.size_x() + WORD_SIZE - 1) / WORD_SIZE)
+{
+	_words = std::vector<Word>(_words_per_row * _size_y, 0);
+	if (!source) {
+		return;
+	}
+
+	uint number_of_channels = source.number_of_channels();
+	for (uint y = 0; y < _size_y; y++) {
+		const bool *source_row = source.row(y);
+		Word *words = &_words[y * _words_per_row];
+		for (uint word = 0; word < _words_per_row; word++) {
+			uint x_0 = word * WORD_SIZE;
+			uint length = (_size_x - x_0 < WORD_SIZE) ? _size_x - x_0 : WORD_SIZE;
+			Word bits = 0;
+			for (uint i = 0; i < length; i++) {
+				bits |= (Word)source_row[(x_0 + i) * number_of_channels] << i;
+			}
+			words[word] = bits;
+		}
+	}
+}
+
+
+BitMask::~BitMask()
+{
+
+}
+
+
+BitMask::operator bool() const
+{
+	return !_words.empty();
+}
+
+
+bool BitMask::is_empty() const
+{
+	return _words.empty();
+}
+
+
+uint BitMask::size_x() const
+{
+	return _size_x;
+}
+
+
+uint BitMask::size_y() const
+{
+	return _size_y;
+}
+
+
+Shape BitMask::size() const
+{
+	return Shape(_size_x, _size_y);
+}
+
+
+uint BitMask::words_per_row() const
+{
+	return _words_per_row;
+}
+
+
+BitMask::iterator BitMask::begin() const
+{
+	return iterator(this, first());
+}
+
+
+BitMask::iterator BitMask::end() const
+{
+	return iterator(this, Point(_size_x, _size_y));
+}
+
+
+bool BitMask::test(Point p) const
+{
+	if (p.x < 0 || (uint)p.x >= _size_x || p.y < 0 || (uint)p.y >= _size_y) {
+		return false;
+	}
+
+	return get(p.x, p.y);
+}
+
+
+void BitMask::set(uint x, uint y, bool value)
+{
+	Word &word = _words[y * _words_per_row + x / WORD_SIZE];
+	Word bit = (Word)1 << (x % WORD_SIZE);
+	word = (value) ? (word | bit) : (word & ~bit);
+}
+
+
+const BitMask::Word* BitMask::row(uint y) const
+{
+	return _words.data() + y * _words_per_row;
+}
+
+
+uint BitMask::count() const
+{
+	uint count = 0;
+	for (auto it = _words.begin(); it != _words.end(); ++it) {
+		count += __builtin_popcountll(*it);
+	}
+
+	return count;
+}
+
+
+uint BitMask::count(uint y, uint x_0, uint x_1) const
+{
+	const Word *words = row(y);
+	uint count = 0;
+	for (uint word = x_0 / WORD_SIZE; word <= x_1 / WORD_SIZE; word++) {
+		count += __builtin_popcountll(words[word] & span_bits(word, x_0, x_1));
+	}
+
+	return count;
+}
+
+
+void BitMask::spans(uint y, uint x_0, uint x_1, std::vector<std::pair<uint, uint> > &runs) const
+{
+	for_each_span(y, x_0, x_1, [&runs] (uint s_0, uint s_1) {
+		runs.push_back(std::make_pair(s_0, s_1));
+	});
+}
+
+
+std::vector<Point> BitMask::masked_points() const
+{
+	std::vector<Point> points;
+	points.reserve(count());
+	for (uint y = 0; y < _size_y; y++) {
+		const Word *words = row(y);
+		for (uint word = 0; word < _words_per_row; word++) {
+			for (Word bits = words[word]; bits; bits &= bits - 1) {
+				points.push_back(Point(word * WORD_SIZE + __builtin_ctzll(bits), y));
+			}
+		}
+	}
+
+	return points;
+}
+
+
+BitMask& BitMask::operator&= (const BitMask &other)
+{
+	if (size() != other.size()) {
+		throw std::invalid_argument("BitMask: masks of different sizes can not be intersected.");
+	}
+
+	for (uint i = 0; i < _words.size(); i++) {
+		_words[i] &= other._words[i];
+	}
+
+	return *this;
+}
+
+
+BitMask& BitMask::operator|= (const BitMask &other)
+{
+	if (size() != other.size()) {
+		throw std::invalid_argument("BitMask: masks of different sizes can not be united.");
+	}
+
+	for (uint i = 0; i < _words.size(); i++) {
+		_words[i] |= other._words[i];
+	}
+
+	return *this;
+}
+
+
+void BitMask::invert()
+{
+	for (auto it = _words.begin(); it != _words.end(); ++it) {
+		*it = ~(*it);
+	}
+	clear_padding();
+}
+
+
+Image<bool> BitMask::to_image() const
+{
+	if (is_empty()) {
+		return Image<bool>();
+	}
+
+	Image<bool> image(_size_x, _size_y, 1u, false);
+	for (uint y = 0; y < _size_y; y++) {
+		bool *image_row = image.row(y);
+		const Word *words = row(y);
+		for (uint word = 0; word < _words_per_row; word++) {
+			for (Word bits = words[word]; bits; bits &= bits - 1) {
+				image_row[word * WORD_SIZE + __builtin_ctzll(bits)] = true;
+			}
+		}
+	}
+
+	return image;
+}
+
+
+Point BitMask::first() const
+{
+	return next(Point(-1, 0));
+}
+
+
+Point BitMask::last() const
+{
+	return prev(Point(_size_x, (int)_size_y - 1));
+}
+
+
+Point BitMask::next(const Point &current) const
+{
+	uint from_x = current.x + 1;
+	for (uint y = current.y; y < _size_y; y++) {
+		if (from_x < _size_x) {
+			uint x = find(row(y), from_x, _size_x - 1, true);
+			if (x < _size_x) {
+				return Point(x, y);
+			}
+		}
+		from_x = 0;
+	}
+
+	return Point(_size_x, _size_y);
+}
+
+
+Point BitMask::prev(const Point &current) const
+{
+	int from_x = std::min(current.x - 1, (int)_size_x - 1);
+	for (int y = current.y; y >= 0; y--) {
+		const Word *words = row(y);
+		for (int word = from_x / (int)WORD_SIZE; from_x >= 0 && word >= 0; word--) {
+			Word bits = words[word] & span_bits(word, 0, from_x);
+			if (bits) {
+				return Point(word * WORD_SIZE + WORD_SIZE - 1 - __builtin_clzll(bits), y);
+			}
+		}
+		from_x = _size_x - 1;
+	}
+
+	return Point(-1, -1);
+}
+
+
+/* Private */
+
+inline void BitMask::clear_padding()
+{
+	uint tail = _size_x % WORD_SIZE;
+	if (tail == 0) {
+		return;
+	}
+
+	Word padding_mask = ((Word)1 << tail) - 1;
+	for (uint y = 0; y < _size_y; y++) {
+		_words[y * _words_per_row + _words_per_row - 1] &= padding_mask;
+	}
+}
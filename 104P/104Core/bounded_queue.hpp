@@ -0,0 +1,91 @@
+/**
+ * Copyright (C) 2016, Vadim Fedorov <coderiks@gmail.com>
+ *
+ * This program is free software: you can use, modify and/or
+ * redistribute it under the terms of the simplified BSD
+ * License. You should have received a copy of this license along
+ * this program. If not, see
+ * <http://www.opensource.org/licenses/bsd-license.html>.
+ */
+
+#include <utility>
+#include <algorithm>
+#include "bounded_queue.h"
+
+
+template <class T>
+BoundedQueue<T>::BoundedQueue(std::size_t capacity)
+ : _capacity(std::max(capacity, (std::size_t)1)), _is_closed(false)
+{
+
+}
+
+
+template <class T>
+bool BoundedQueue<T>::push(T item)
+{
+	std::unique_lock<std::mutex> lock(_mutex);
+	_not_full.wait(lock, [this] () { return _is_closed || _items.size() < _capacity; });
+	if (_is_closed) {
+		return false;
+	}
+
+	_items.push_back(std::move(item));
+	lock.unlock();
+	_not_empty.notify_one();
+
+	return true;
+}
+
+
+template <class T>
+bool BoundedQueue<T>::pop(T &item)
+{
+	std::unique_lock<std::mutex> lock(_mutex);
+	_not_empty.wait(lock, [this] () { return _is_closed || !_items.empty(); });
+	if (_items.empty()) {
+		return false;
+	}
+
+	item = std::move(_items.front());
+	_items.pop_front();
+	lock.unlock();
+	_not_full.notify_one();
+
+	return true;
+}
+
+
+template <class T>
+void BoundedQueue<T>::close()
+{
+	{
+		std::lock_guard<std::mutex> lock(_mutex);
+		_is_closed = true;
+	}
+	_not_full.notify_all();
+	_not_empty.notify_all();
+}
+
+
+template <class T>
+bool BoundedQueue<T>::is_closed() const
+{
+	std::lock_guard<std::mutex> lock(_mutex);
+	return _is_closed;
+}
+
+
+template <class T>
+std::size_t BoundedQueue<T>::size() const
+{
+	std::lock_guard<std::mutex> lock(_mutex);
+	return _items.size();
+}
+
+
+template <class T>
+std::size_t BoundedQueue<T>::capacity() const
+{
+	return _capacity;
+}
@@ -15,7 +15,7 @@
 
 template <class T>
 ImageFx<T>::ImageFx()
- : _size_x(0), _size_y(0), _number_of_channels(0), _color_space(ColorSpaces::unknown), _data()
+ : _size_x(0), _size_y(0), _number_of_channels(0), _color_space(ColorSpaces::unknown), _data(), _stride(0), _halo()
 {
 
 }
@@ -92,7 +92,7 @@ ImageFx<T>::ImageFx(Shape size, uint number_of_channels, T default_value)
 template <class T>
 ImageFx<T>::ImageFx(const ImageFx<T> &source)
  : _size_x(source._size_x), _size_y(source._size_y), _number_of_channels(source._number_of_channels),
-   _color_space(source._color_space), _data(source._data)
+   _color_space(source._color_space), _data(source._data), _stride(source._stride), _halo(source._halo)
 {
 
 }
@@ -101,12 +101,29 @@ ImageFx<T>::ImageFx(const ImageFx<T> &source)
 template <class T>
 ImageFx<T>::ImageFx(const Image<T> &source)
  : _size_x(source._size_x), _size_y(source._size_y), _number_of_channels(source._number_of_channels),
-   _color_space(source._color_space), _data(source._data)
+   _color_space(source._color_space), _data(source._data), _stride(source._stride), _halo(source._halo)
 {
 
 }
 
 
+template <class T>
+ImageFx<T>::ImageFx(const T *data, uint size_x, uint size_y, uint number_of_channels, uint stride)
+ : _color_space(ColorSpaces::unknown)
+{
+	// NOTE: an empty deleter leaves the buffer with its owner
+	wrap(const_cast<T*>(data), size_x, size_y, number_of_channels, stride, Deleter());
+}
+
+
+template <class T>
+ImageFx<T>::ImageFx(const T *data, uint size_x, uint size_y, uint number_of_channels, uint stride, Deleter deleter)
+ : _color_space(ColorSpaces::unknown)
+{
+	wrap(const_cast<T*>(data), size_x, size_y, number_of_channels, stride, deleter);
+}
+
+
 template <class T>
 ImageFx<T>& ImageFx<T>::operator= (const ImageFx<T> &other)
 {
@@ -121,6 +138,8 @@ ImageFx<T>& ImageFx<T>::operator= (const ImageFx<T> &other)
 	this->_number_of_channels = other._number_of_channels;
 	this->_color_space = other._color_space;
 	this->_data = other._data;
+	this->_stride = other._stride;
+	this->_halo = other._halo;
 
 	return *this;
 }
@@ -135,6 +154,8 @@ ImageFx<T>& ImageFx<T>::operator= (const Image<T> &other)
 	this->_number_of_channels = other._number_of_channels;
 	this->_color_space = other._color_space;
 	this->_data = other._data;
+	this->_stride = other._stride;
+	this->_halo = other._halo;
 
 	return *this;
 }
@@ -334,6 +355,44 @@ const uint ImageFx<T>::number_of_pixels() const
 }
 
 
+template <class T>
+uint ImageFx<T>::stride() const
+{
+	return _stride;
+}
+
+
+template <class T>
+bool ImageFx<T>::is_contiguous() const
+{
+	return _stride == _size_x * _number_of_channels || _size_y <= 1;
+}
+
+
+template <class T>
+Halo ImageFx<T>::halo() const
+{
+	return _halo;
+}
+
+
+template <class T>
+const T* ImageFx<T>::row(int y) const
+{
+	return _data.get() + (std::ptrdiff_t)y * _stride;
+}
+
+
+template <class T>
+ImageFx<T> ImageFx<T>::view(uint x, uint y, uint size_x, uint size_y) const
+{
+	ImageFx<T> view(*this);
+	view.make_view(x, y, size_x, size_y);
+
+	return view;
+}
+
+
 /**
  * Invokes deep copy.
  */
@@ -348,7 +407,7 @@ ImageFx<T> ImageFx<T>::clone() const
 
 	if (this->_data) {
 		clone.init(this->_size_x, this->_size_y, this->_number_of_channels);
-		memcpy(clone._data.get(), this->_data.get(),  this->_number_of_channels * this->_size_y * this->_size_x * sizeof(T));
+		clone.copy_rows(*this);
 	}
 
 	return clone;
@@ -357,16 +416,110 @@ ImageFx<T> ImageFx<T>::clone() const
 /* Protected */
 
 template <class T>
-inline void ImageFx<T>::init(uint size_x, uint size_y, uint number_of_channels)
+inline void ImageFx<T>::init(uint size_x, uint size_y, uint number_of_channels, bool aligned_rows)
 {
-	_data = std::shared_ptr<T>(new T[size_x * size_y * number_of_channels](), std::default_delete<T[]>());
+	_stride = size_x * number_of_channels;
+	if (aligned_rows && ALIGNMENT % sizeof(T) == 0) {
+		uint elements_per_alignment = ALIGNMENT / sizeof(T);
+		_stride = (_stride + elements_per_alignment - 1) / elements_per_alignment * elements_per_alignment;
+	}
+	_halo = Halo();
+	_data = allocate((std::size_t)_stride * size_y);
 }
 
 
 template <class T>
 void ImageFx<T>::fill_internal(const T &value)
 {
-	std::fill_n(_data.get(), _number_of_channels * _size_y * _size_x, value);
+	for (uint y = 0; y < _size_y; y++) {
+		std::fill_n(_data.get() + (std::size_t)y * _stride, _number_of_channels * _size_x, value);
+	}
+}
+
+
+/**
+ * Copy data of an image of the same size row by row.
+ */
+template <class T>
+void ImageFx<T>::copy_rows(const ImageFx<T> &source)
+{
+	for (uint y = 0; y < _size_y; y++) {
+		std::copy_n(source.row(y), _number_of_channels * _size_x, _data.get() + (std::size_t)y * _stride);
+	}
+}
+
+
+/**
+ * Turn the image into a view of its rectangular region.
+ */
+template <class T>
+void ImageFx<T>::make_view(uint x, uint y, uint size_x, uint size_y)
+{
+	if (x + size_x > _size_x || y + size_y > _size_y) {
+		throw std::out_of_range("region of a view is out of range");
+	}
+
+	if (_data) {
+		// NOTE: the aliasing constructor shares ownership of the whole buffer
+		_data = std::shared_ptr<T>(_data, _data.get() + index(x, y, 0));
+	}
+	_halo.left += x;
+	_halo.top += y;
+	_halo.right += _size_x - x - size_x;
+	_halo.bottom += _size_y - y - size_y;
+	_size_x = size_x;
+	_size_y = size_y;
+}
+
+
+/**
+ * Share an external buffer, which is released by a given deleter (if any).
+ */
+template <class T>
+void ImageFx<T>::wrap(T *data, uint size_x, uint size_y, uint number_of_channels, uint stride, Deleter deleter)
+{
+	if (stride == 0) {
+		stride = size_x * number_of_channels;
+	}
+	if (stride < size_x * number_of_channels) {
+		if (deleter) {
+			deleter(data);
+		}
+		throw std::invalid_argument("stride is less than the length of a row");
+	}
+
+	_size_x = size_x;
+	_size_y = size_y;
+	_number_of_channels = number_of_channels;
+	_stride = stride;
+	_halo = Halo();
+	if (data) {
+		_data = (deleter) ? std::shared_ptr<T>(data, deleter) : std::shared_ptr<T>(data, [] (T *) {});
+	} else {
+		_data.reset();
+	}
+}
+
+
+/**
+ * Allocate memory aligned to ALIGNMENT bytes and value-initialize its elements.
+ */
+template <class T>
+std::shared_ptr<T> ImageFx<T>::allocate(std::size_t length)
+{
+	char *memory = new char[length * sizeof(T) + ALIGNMENT - 1];
+	T *data = reinterpret_cast<T*>((reinterpret_cast<std::uintptr_t>(memory) + ALIGNMENT - 1) &
+								   ~(std::uintptr_t)(ALIGNMENT - 1));
+	for (std::size_t i = 0; i < length; i++) {
+		new (data + i) T();
+	}
+
+	return std::shared_ptr<T>(data, [memory, length] (T *data) {
+		for (std::size_t i = 0; i < length; i++) {
+			data[i].~T();
+		}
+		delete [] memory;
+	});
 }
 
 
@@ -374,7 +527,7 @@ template <class T>
 inline uint ImageFx<T>::index(uint x, uint y, uint channel) const
 {
 	//return _size_x * (_size_y * channel + y) + x;	// NOTE: channel by channel
-	return _number_of_channels * (_size_x * y + x) + channel;
+	return _stride * y + _number_of_channels * x + channel;
 }
 
 
@@ -470,17 +623,36 @@ Image<T>::Image(const ImageFx<T> &source)
 		this->_number_of_channels = source._number_of_channels;
 		this->_color_space = source._color_space;
 		ImageFx<T>::init(source._size_x, source._size_y, source._number_of_channels);
-		memcpy(this->_data.get(), source._data.get(),  source._number_of_channels * source._size_y * source._size_x * sizeof(T));
+		ImageFx<T>::copy_rows(source);
 	} else {
 		this->_size_x = 0;
 		this->_size_y = 0;
 		this->_number_of_channels = 0;
 		this->_color_space = ColorSpaces::unknown;
 		this->_data.reset();
+		this->_stride = 0;
+		this->_halo = Halo();
 	}
 }
 
 
+template <class T>
+Image<T>::Image(T *data, uint size_x, uint size_y, uint number_of_channels, uint stride)
+ : ImageFx<T>(data, size_x, size_y, number_of_channels, stride)
+{
+
+}
+
+
+template <class T>
+Image<T>::Image(T *data, uint size_x, uint size_y, uint number_of_channels, uint stride,
+				typename ImageFx<T>::Deleter deleter)
+ : ImageFx<T>(data, size_x, size_y, number_of_channels, stride, deleter)
+{
+
+}
+
+
 template <class T>
 Image<T>& Image<T>::operator= (const Image<T> &other)
 {
@@ -498,6 +670,8 @@ Image<T>& Image<T>::operator= (const Image<T> &other)
 	this->_number_of_channels = other._number_of_channels;
 	this->_color_space = other._color_space;
 	this->_data = other._data;
+	this->_stride = other._stride;
+	this->_halo = other._halo;
 
 	return *this;
 }
@@ -512,19 +686,34 @@ Image<T>& Image<T>::operator= (const ImageFx<T> &other)
 		this->_number_of_channels = other._number_of_channels;
 		this->_color_space = other._color_space;
 		Image<T>::init(other._size_x, other._size_y, other._number_of_channels);
-		memcpy(this->_data.get(), other._data.get(),  other._number_of_channels * other._size_y * other._size_x * sizeof(T));
+		Image<T>::copy_rows(other);
 	} else {
 		this->_size_x = 0;
 		this->_size_y = 0;
 		this->_number_of_channels = 0;
 		this->_color_space = ColorSpaces::unknown;
 		this->_data.reset();
+		this->_stride = 0;
+		this->_halo = Halo();
 	}
 
 	return *this;
 }
 
 
+template <class T>
+Image<T> Image<T>::with_aligned_rows(uint size_x, uint size_y, uint number_of_channels)
+{
+	Image<T> image;
+	image._size_x = size_x;
+	image._size_y = size_y;
+	image._number_of_channels = number_of_channels;
+	image.init(size_x, size_y, number_of_channels, true);
+
+	return image;
+}
+
+
 template <class T>
 void Image<T>::set_color_space(ColorSpaces::ColorSpace value)
 {
@@ -618,6 +807,23 @@ T* Image<T>::raw()
 }
 
 
+template <class T>
+T* Image<T>::row(int y)
+{
+	return this->_data.get() + (std::ptrdiff_t)y * this->_stride;
+}
+
+
+template <class T>
+Image<T> Image<T>::view(uint x, uint y, uint size_x, uint size_y)
+{
+	Image<T> view(*this);
+	view.make_view(x, y, size_x, size_y);
+
+	return view;
+}
+
+
 template <class T>
 Image<T> Image<T>::clone() const
 {
@@ -629,7 +835,7 @@ Image<T> Image<T>::clone() const
 
 	if (this->_data) {
 		clone.init(this->_size_x, this->_size_y, this->_number_of_channels);
-		memcpy(clone._data.get(), this->_data.get(),  this->_number_of_channels * this->_size_y * this->_size_x * sizeof(T));
+		clone.copy_rows(*this);
 	}
 
 	return clone;
@@ -0,0 +1,172 @@
+/**
+ * Copyright (C) 2016, Vadim Fedorov <coderiks@gmail.com>
+ *
+ * This program is free software: you can use, modify and/or
+ * redistribute it under the terms of the simplified BSD
+ * License. You should have received a copy of this license along
+ * this program. If not, see
+ * <http://www.opensource.org/licenses/bsd-license.html>.
+ */
+
+#ifndef BIT_MASK_H_
+#define BIT_MASK_H_
+
+#include <vector>
+#include <cstdint>
+#include "image.h"
+#include "point.h"
+#include "shape.h"
+#include "mask_iterator.h"
+#include "i_iterable_mask.h"
+
+/**
+ * Bit-packed 2d binary mask, 64 pixels per word. Every row starts at a word boundary,
+ * bits of a word correspond to increasing X coordinates starting from the least significant bit.
+ * Masked points are located with count-trailing-zeros instructions, so that iteration,
+ * counting and intersection with row spans cost O(words) instead of O(pixels), and words
+ * without masked points are skipped entirely.
+ *
+ * @note Padding bits after the end of every row are kept unset.
+ */
+class BitMask : public IIterableMask
+{
+public:
+	typedef uint64_t Word;
+	typedef MaskIterator iterator;
+
+	constexpr static uint WORD_SIZE = 64;
+
+	BitMask();
+	BitMask(uint size_x, uint size_y, bool default_value = false);
+
+	/// Pack the first channel of a given binary image.
+	explicit BitMask(const ImageFx<bool> &source);
+
+	virtual ~BitMask();
+
+	/// Is current mask not empty.
+	operator bool() const;
+
+	/// Is current mask empty.
+	bool is_empty() const;
+
+	uint size_x() const;
+	uint size_y() const;
+	Shape size() const;
+	uint words_per_row() const;
+
+	/// Return iterators to the begin/end of the masked region
+	iterator begin() const;
+	iterator end() const;
+
+	/// Returns the element without range checking.
+	inline bool get(uint x, uint y) const;
+
+	/// Returns the element with range checking.
+	/// @return Value at a given coordinates or 'false', if out of range.
+	bool test(Point p) const;
+
+	/// Set the element without range checking.
+	void set(uint x, uint y, bool value);
+
+	/// Return pointer to the words of a given row.
+	const Word* row(uint y) const;
+
+	/// Number of masked points.
+	uint count() const;
+
+	/// Number of masked points within the span [x_0, x_1] of row y.
+	uint count(uint y, uint x_0, uint x_1) const;
+
+	/// Call func(s_0, s_1) for every maximal run [s_0, s_1] of masked points within the span [x_0, x_1] of row y.
+	/// @note Runs are visited from left to right.
+	template <class Func>
+	inline void for_each_span(uint y, uint x_0, uint x_1, Func func) const;
+
+	/// Append the runs of masked points within the span [x_0, x_1] of row y as pairs of their first and last X.
+	void spans(uint y, uint x_0, uint x_1, std::vector<std::pair<uint, uint> > &runs) const;
+
+	/// Returns masked points as a vector.
+	std::vector<Point> masked_points() const;
+
+	/// Intersect (unite) with a mask of the same size.
+	BitMask& operator&= (const BitMask &other);
+	BitMask& operator|= (const BitMask &other);
+
+	/// Invert current mask.
+	void invert();
+
+	/// Unpack into a single channel binary image.
+	Image<bool> to_image() const;
+
+	/// Methods used by MaskIterator
+	virtual Point first() const;
+	virtual Point last() const;
+	virtual Point next(const Point &current) const;
+	virtual Point prev(const Point &current) const;
+
+private:
+	std::vector<Word> _words;
+	uint _size_x, _size_y;
+	uint _words_per_row;
+
+	/// Bits of a given word of a row, which lie within the span [x_0, x_1].
+	inline static Word span_bits(uint word, uint x_0, uint x_1);
+
+	/// First X >= x in the span [x, x_1] of a given row where the bit equals to 'value', or x_1 + 1.
+	inline static uint find(const Word *row, uint x, uint x_1, bool value);
+
+	inline void clear_padding();
+};
+
+
+inline bool BitMask::get(uint x, uint y) const
+{
+	return (_words[y * _words_per_row + x / WORD_SIZE] >> (x % WORD_SIZE)) & 1;
+}
+
+
+template <class Func>
+inline void BitMask::for_each_span(uint y, uint x_0, uint x_1, Func func) const
+{
+	const Word *words = row(y);
+	for (uint x = find(words, x_0, x_1, true); x <= x_1; ) {
+		uint end = find(words, x, x_1, false);
+		func(x, end - 1);
+		if (end > x_1) {
+			break;
+		}
+		x = find(words, end, x_1, true);
+	}
+}
+
+
+inline BitMask::Word BitMask::span_bits(uint word, uint x_0, uint x_1)
+{
+	uint word_x_0 = word * WORD_SIZE;
+	Word bits = ~(Word)0;
+	if (x_0 > word_x_0) {
+		bits &= bits << (x_0 - word_x_0);
+	}
+	if (x_1 < word_x_0 + WORD_SIZE - 1) {
+		bits &= ~(Word)0 >> (word_x_0 + WORD_SIZE - 1 - x_1);
+	}
+	return bits;
+}
+
+
+inline uint BitMask::find(const Word *row, uint x, uint x_1, bool value)
+{
+	Word invert = (value) ? 0 : ~(Word)0;
+	uint last_word = x_1 / WORD_SIZE;
+	for (uint word = x / WORD_SIZE; word <= last_word; word++) {
+		Word bits = (row[word] ^ invert) & span_bits(word, x, x_1);
+		if (bits) {
+			return word * WORD_SIZE + __builtin_ctzll(bits);
+		}
+	}
+
+	return x_1 + 1;
+}
+
+#endif /* BIT_MASK_H_ */
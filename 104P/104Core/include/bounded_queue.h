@@ -0,0 +1,61 @@
+/**
+ * Copyright (C) 2016, Vadim Fedorov <coderiks@gmail.com>
+ *
+ * This program is free software: you can use, modify and/or
+ * redistribute it under the terms of the simplified BSD
+ * License. You should have received a copy of this license along
+ * this program. If not, see
+ * <http://www.opensource.org/licenses/bsd-license.html>.
+ */
+
+#ifndef BOUNDED_QUEUE_H_
+#define BOUNDED_QUEUE_H_
+
+#include <cstddef>
+#include <deque>
+#include <mutex>
+#include <condition_variable>
+
+/**
+ * Queue of limited capacity connecting stages of a pipeline run by different threads.
+ * Producers wait while the queue is full (back-pressure), consumers wait while it is empty.
+ * Once closed, the queue accepts no more items and consumers get the remaining ones.
+ */
+template <class T>
+class BoundedQueue
+{
+public:
+	explicit BoundedQueue(std::size_t capacity);
+
+	BoundedQueue(const BoundedQueue<T> &other) = delete;
+	BoundedQueue<T>& operator= (const BoundedQueue<T> &other) = delete;
+
+	/// Append an item, waiting while the queue is full.
+	/// @return false, if the queue is closed (the item is dropped).
+	bool push(T item);
+
+	/// Take the oldest item, waiting while the queue is empty.
+	/// @return false, if the queue is closed and empty.
+	bool pop(T &item);
+
+	/// Stop accepting items and wake up all waiting threads.
+	void close();
+
+	bool is_closed() const;
+
+	std::size_t size() const;
+	std::size_t capacity() const;
+
+private:
+	std::deque<T> _items;
+	std::size_t _capacity;
+	bool _is_closed;
+	mutable std::mutex _mutex;
+	std::condition_variable _not_full;
+	std::condition_variable _not_empty;
+};
+
+// NOTE: include implementation, because BoundedQueue is a template
+#include "../bounded_queue.hpp"
+
+#endif /* BOUNDED_QUEUE_H_ */
@@ -12,8 +12,12 @@
 #define IMAGE_H_
 
 #include <cstring>
+#include <cstddef>
+#include <cstdint>
+#include <new>
 #include <algorithm>
 #include <memory>
+#include <functional>
 #include <stdexcept>
 #include "point.h"
 #include "shape.h"
@@ -26,12 +30,27 @@ namespace ColorSpaces
 template <class T>
 class Image;	// forward declaration
 
+
+/**
+ * Numbers of pixels of a parent image, which are available beyond every side of a view.
+ */
+struct Halo
+{
+	uint left, top, right, bottom;
+};
+
+
 /**
  * Container for a 2d image with point type T. Manages memory internally by
  * references counting. Constructing from the same type and assignment of
  * a value of the same type lead to a data sharing. Method clone() should be
  * used for explicit deep copy invocation.
  *
+ * Memory is aligned to ALIGNMENT bytes. Rows are stored stride() elements apart,
+ * which is more than size_x() * number_of_channels() for images with padded (aligned)
+ * rows and for views of a part of another image. A view shares data with its parent
+ * and can read pixels of the parent around it (the halo), e.g. for convolutions.
+ *
  * @note By design class provides no capabilities for changing its data,
  * therefore, 'Fx' suffix here should be considered as 'Fixed', 'Immutable'.
  * The main intended use case for ImageFx<T> is a read-only parameter of a function.
@@ -41,6 +60,11 @@ class ImageFx
 {
 friend class Image<T>;
 public:
+	constexpr static uint ALIGNMENT = 64;	// in bytes
+
+	/// Function releasing an external buffer.
+	typedef std::function<void(T*)> Deleter;
+
 	ImageFx();
 	ImageFx(uint size_x, uint size_y);
 	ImageFx(uint size_x, uint size_y, uint number_of_channels);
@@ -52,6 +76,16 @@ public:
 	ImageFx(Shape size, uint number_of_channels, T default_value);
 	ImageFx(const ImageFx<T> &source);						// without data copying, ref++
 	ImageFx(const Image<T> &source);						// without data copying, ref++
+
+	/// Wrap an external buffer without copying. The buffer is not owned and must outlive the image (and its copies).
+	/// @param data Pointer to the first element, all channels of a pixel are stored together.
+	/// @param stride Number of elements between the beginnings of consecutive rows, 0 for size_x * number_of_channels.
+	/// @note Throws std::invalid_argument exception, if stride is less than size_x * number_of_channels.
+	ImageFx(const T *data, uint size_x, uint size_y, uint number_of_channels, uint stride);
+
+	/// Wrap an external buffer without copying and take its ownership.
+	/// @param deleter Releases the buffer, when the last image sharing it is destroyed.
+	ImageFx(const T *data, uint size_x, uint size_y, uint number_of_channels, uint stride, Deleter deleter);
 	~ImageFx() = default;
 
 	ImageFx<T>& operator= (const ImageFx<T> &other);		// without data copying, ref++
@@ -91,24 +125,51 @@ public:
 	bool try_get_value(const Point &p, uint channel, T& value) const;
 
 	/// Return pointer to internal data.
+	/// @note Data can be accessed as a plain array only if is_contiguous(), otherwise see row().
 	const T* raw() const;
 
-	/// Return length of internal data.
+	/// Return length of internal data (excluding padding of rows).
 	const uint raw_length() const;
 
 	const uint number_of_pixels() const;
 
+	/// Get number of elements between the beginnings of consecutive rows.
+	uint stride() const;
+
+	/// Check if rows follow each other without gaps, i.e. data is a plain array of raw_length() elements.
+	bool is_contiguous() const;
+
+	/// Get numbers of pixels of the parent image around a view (zeros, if the image is not a view).
+	Halo halo() const;
+
+	/// Return pointer to the first element of a given row.
+	/// @note Pixels of the halo can be reached with y in [-halo().top, size_y() + halo().bottom)
+	///       and with x offsets in [-halo().left, size_x() + halo().right).
+	const T* row(int y) const;
+
+	/// Create a read-only view of a rectangular region, which shares data with the current image.
+	/// @note Throws std::out_of_range exception, if the region does not fit into the image.
+	ImageFx<T> view(uint x, uint y, uint size_x, uint size_y) const;
+
 	/// Invoke deep copy.
+	/// @note The copy is always contiguous.
 	ImageFx<T> clone() const;
 
 protected:
-	std::shared_ptr<T> _data;
+	std::shared_ptr<T> _data;			// points to the first element of the image (or view)
 	uint _size_x, _size_y;
 	uint _number_of_channels;
 	ColorSpaces::ColorSpace _color_space;
+	uint _stride;
+	Halo _halo;
 
-	inline void init(uint size_x, uint size_y, uint number_of_channels);
+	inline void init(uint size_x, uint size_y, uint number_of_channels, bool aligned_rows = false);
 	void fill_internal(const T &value);
+	void copy_rows(const ImageFx<T> &source);
+	void make_view(uint x, uint y, uint size_x, uint size_y);
+	void wrap(T *data, uint size_x, uint size_y, uint number_of_channels, uint stride, Deleter deleter);
+
+	static std::shared_ptr<T> allocate(std::size_t length);
 
 	inline uint index(uint x, uint y, uint channel) const;
 };
@@ -121,6 +182,7 @@ protected:
  * used for explicit deep copy invocation.
  *
  * @note Extends the ImageFx<T> class with the data modification capabilities.
+ * Modifications made through a view are visible in its parent and vice versa.
  */
 template <class T>
 class Image : public ImageFx<T>
@@ -138,15 +200,27 @@ public:
 	Image(const Image<T> &source);						// without data copying, ref++
 	Image(const ImageFx<T> &source);					// deep copy
 
+	/// Wrap an external buffer without copying (@see ImageFx), the buffer is not owned.
+	Image(T *data, uint size_x, uint size_y, uint number_of_channels, uint stride);
+
+	/// Wrap an external buffer without copying and take its ownership.
+	Image(T *data, uint size_x, uint size_y, uint number_of_channels, uint stride, typename ImageFx<T>::Deleter deleter);
+
 	Image<T>& operator= (const Image<T> &other);		// without data copying, ref++
 	Image<T>& operator= (const ImageFx<T> &other);		// deep copy
 
+	/// Create an image with every row starting at the ALIGNMENT boundary (rows are padded, if needed).
+	/// @note Rows are not padded, if the size of T does not divide ALIGNMENT.
+	static Image<T> with_aligned_rows(uint size_x, uint size_y, uint number_of_channels = 1);
+
 	void set_color_space(ColorSpaces::ColorSpace value);
 
 	// Prevent hiding of const versions of these methods.
 	using ImageFx<T>::operator();
 	using ImageFx<T>::at;
 	using ImageFx<T>::raw;
+	using ImageFx<T>::row;
+	using ImageFx<T>::view;
 
 	/// Return a reference to the element without range checking.
 	T& operator() (uint x, uint y);
@@ -167,7 +241,15 @@ public:
 	/// Return pointer to internal data.
 	T* raw();
 
+	/// Return pointer to the first element of a given row.
+	T* row(int y);
+
+	/// Create a view of a rectangular region, which shares data with the current image.
+	/// @note Throws std::out_of_range exception, if the region does not fit into the image.
+	Image<T> view(uint x, uint y, uint size_x, uint size_y);
+
 	/// Invoke deep copy.
+	/// @note The copy is always contiguous.
 	Image<T> clone() const;
 };
 
@@ -12,9 +12,12 @@
 #define MASK_H_
 
 #include <vector>
+#include <atomic>
+#include <mutex>
 #include <stdexcept>
 
 #include "image.h"
+#include "bit_mask.h"
 #include "mask_iterator.h"
 #include "i_iterable_mask.h"
 
@@ -26,6 +29,7 @@ class MaskIterator;
  * Container for a 2d binary mask based on the ImageFx<bool> class.
  * Provides capabilities for iterating through the masked points and
  * retrieving masked points as a vector.
+ * A bit-packed copy of the mask (@see BitMask) is maintained lazily, iterators walk it directly.
  *
  * @note By design class provides no capabilities for changing its data,
  * therefore, 'Fx' suffix here should be considered as 'Fixed', 'Immutable'.
@@ -83,6 +87,11 @@ public:
 	/// Returns masked points as a vector.
 	std::vector<Point> masked_points() const;
 
+	/// Returns the bit-packed copy of the first channel, it is built on the first call.
+	/// @note Safe to call from multiple threads, as long as the mask is not modified meanwhile.
+	///       Once built, the copy is returned without locking.
+	const BitMask& bits() const;
+
 	/// Methods used by MaskIterator
 	virtual Point first() const;
 	virtual Point last() const;
@@ -97,9 +106,13 @@ protected:
 		bool is_first_last_valid;
 		bool is_points_cache_valid;
 		std::vector<Point> points_cache;
+		std::atomic<bool> is_bits_cache_valid;
+		BitMask bits_cache;
+		std::mutex bits_mutex;
 
 		__Internal(Point first, Point last, bool is_first_last_valid)
-				: first(first), last(last), is_first_last_valid(is_first_last_valid), is_points_cache_valid(false) {}
+				: first(first), last(last), is_first_last_valid(is_first_last_valid), is_points_cache_valid(false),
+				  is_bits_cache_valid(false) {}
 	};
 
 	mutable std::shared_ptr<__Internal> _internal;
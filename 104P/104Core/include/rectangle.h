@@ -0,0 +1,66 @@
+/**
+ * Copyright (C) 2016, Vadim Fedorov <coderiks@gmail.com>
+ *
+ * This program is free software: you can use, modify and/or
+ * redistribute it under the terms of the simplified BSD
+ * License. You should have received a copy of this license along
+ * this program. If not, see
+ * <http://www.opensource.org/licenses/bsd-license.html>.
+ */
+
+
+#ifndef RECTANGLE_H_
+#define RECTANGLE_H_
+
+#include <iostream>
+#include "point.h"
+#include "shape.h"
+
+/**
+ * Axis-aligned rectangle of points [x_0, x_1) x [y_0, y_1).
+ */
+struct Rectangle
+{
+	int x_0, y_0, x_1, y_1;
+
+	Rectangle();
+	Rectangle(int x_0, int y_0, int x_1, int y_1);
+
+	/// Rectangle covering a domain of a given size.
+	explicit Rectangle(const Shape &shape);
+
+	/// Square of points within a given (Chebyshev) distance from the center.
+	static Rectangle around(Point center, int radius);
+
+	bool operator== (const Rectangle &other) const;
+	bool operator!= (const Rectangle &other) const;
+
+	bool is_empty() const;
+
+	int size_x() const;
+	int size_y() const;
+	Shape size() const;
+
+	/// Top left point.
+	Point origin() const;
+
+	bool contains(const Point &p) const;
+	bool contains(int x, int y) const;
+
+	/// Get the common part of two rectangles (empty, if they do not overlap).
+	Rectangle intersection(const Rectangle &other) const;
+
+	/// Get the smallest rectangle containing both rectangles (empty ones are ignored).
+	Rectangle bounding_box(const Rectangle &other) const;
+
+	friend std::ostream& operator<< (std::ostream &out, const Rectangle &rectangle);
+};
+
+inline std::ostream& operator<< (std::ostream &out, const Rectangle &rectangle)
+{
+	out << "[" << rectangle.x_0 << ", " << rectangle.x_1 << ") x [" << rectangle.y_0 << ", " << rectangle.y_1 << ")";
+	return out;
+}
+
+
+#endif /* RECTANGLE_H_ */
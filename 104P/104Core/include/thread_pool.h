@@ -0,0 +1,161 @@
+/**
+ * Copyright (C) 2016, Vadim Fedorov <coderiks@gmail.com>
+ *
+ * This program is free software: you can use, modify and/or
+ * redistribute it under the terms of the simplified BSD
+ * License. You should have received a copy of this license along
+ * this program. If not, see
+ * <http://www.opensource.org/licenses/bsd-license.html>.
+ */
+
+#ifndef THREAD_POOL_H_
+#define THREAD_POOL_H_
+
+#include <atomic>
+#include <condition_variable>
+#include <deque>
+#include <exception>
+#include <functional>
+#include <memory>
+#include <mutex>
+#include <thread>
+#include <vector>
+#include "shape.h"
+
+class TaskGroup;
+
+/**
+ * Pool of worker threads with work stealing.
+ * Every worker owns a queue of tasks and steals tasks from the queues of other workers when its own one is empty.
+ * Tasks are taken from every queue in the order of submission, so that the tasks with higher cost hints start first.
+ * Tasks are always submitted through a TaskGroup, which tracks their completion. Threads waiting for
+ * a group execute pending tasks meanwhile, so groups can be nested (e.g. parallel bundles x parallel tiles)
+ * without blocking workers, and any number of threads may share a single pool without oversubscribing cores.
+ */
+class ThreadPool
+{
+friend class TaskGroup;
+public:
+	/// @param number_of_threads Number of worker threads. If 0, the number of hardware threads minus one
+	///                          is used (the thread waiting for tasks is busy executing them as well).
+	explicit ThreadPool(uint number_of_threads = 0);
+	~ThreadPool();
+
+	ThreadPool(const ThreadPool&) = delete;
+	ThreadPool& operator=(const ThreadPool&) = delete;
+
+	/// Get number of worker threads.
+	uint number_of_threads() const;
+
+	/// Get number of threads that can execute tasks simultaneously (workers and one waiting thread).
+	uint concurrency() const;
+
+	/// Get the pool shared by all the library entry points.
+	/// @note The pool is created on the first call.
+	static ThreadPool& shared();
+
+	/// Execute body(begin_i, end_i) for subranges of [begin, end) of at most 'grain' elements and wait for them.
+	/// @see TaskGroup::run_range()
+	void parallel_for(int begin, int end, int grain,
+					  const std::function<void(int, int)> &body,
+					  const std::function<float(int, int)> &cost = nullptr);
+
+	/// Execute body(x_0, y_0, x_1, y_1) for tiles of a given domain and wait for them.
+	/// @see TaskGroup::run_tiles()
+	void parallel_for_tiles(Shape size, int tile_size,
+							const std::function<void(int, int, int, int)> &body,
+							const std::function<float(int, int, int, int)> &cost = nullptr);
+
+private:
+	struct Task
+	{
+		std::function<void()> function;
+		TaskGroup *group;
+	};
+
+	struct Queue
+	{
+		std::mutex mutex;
+		std::deque<Task*> tasks;
+	};
+
+	std::vector<std::thread> _threads;
+	std::vector<std::unique_ptr<Queue> > _queues;	// one per worker
+	std::atomic<int> _number_of_queued;
+	std::atomic<uint> _next_queue;					// queue for the next task submitted from outside
+	std::mutex _mutex;
+	std::condition_variable _wake_up;
+	bool _stop;
+
+	void work(uint id);
+	void submit(std::vector<Task*> &tasks);
+	bool run_pending_task();
+	Task* take_task(int id);
+	void execute(Task *task);
+
+	int current_worker() const;
+};
+
+
+/**
+ * Set of tasks executed by a thread pool that can be waited for and cancelled together.
+ * Cancellation prevents execution of the tasks that have not started yet, running tasks may
+ * check is_cancelled() to stop early. Child groups are cancelled along with their parent.
+ * If a task throws, the group is cancelled and the first exception is rethrown by wait().
+ * @note The group waits for its tasks on destruction.
+ */
+class TaskGroup
+{
+friend class ThreadPool;
+public:
+	explicit TaskGroup(ThreadPool &pool = ThreadPool::shared());
+
+	/// Create a group of nested tasks executed by the pool of the parent and cancelled along with it.
+	explicit TaskGroup(TaskGroup &parent);
+	~TaskGroup();
+
+	TaskGroup(const TaskGroup&) = delete;
+	TaskGroup& operator=(const TaskGroup&) = delete;
+
+	/// Schedule a single task.
+	void run(std::function<void()> task);
+
+	/// Schedule body(begin_i, end_i) for subranges of [begin, end) of at most 'grain' elements.
+	/// @param cost [optional] Hint on the relative cost of a subrange. More expensive subranges are started first.
+	void run_range(int begin, int end, int grain,
+				   const std::function<void(int, int)> &body,
+				   const std::function<float(int, int)> &cost = nullptr);
+
+	/// Schedule body(x_0, y_0, x_1, y_1) for square tiles covering a domain of a given size.
+	/// @param cost [optional] Hint on the relative cost of a tile. More expensive tiles are started first.
+	void run_tiles(Shape size, int tile_size,
+				   const std::function<void(int, int, int, int)> &body,
+				   const std::function<float(int, int, int, int)> &cost = nullptr);
+
+	/// Wait until all the scheduled tasks are finished, executing pending tasks meanwhile.
+	/// @note Rethrows the first exception thrown by a task.
+	void wait();
+
+	/// Cancel the tasks that have not started yet, including those of child groups.
+	void cancel();
+
+	/// Check whether the group (or any of its parents) was cancelled.
+	bool is_cancelled() const;
+
+	/// Get the pool executing the tasks.
+	ThreadPool& pool() const;
+
+private:
+	ThreadPool &_pool;
+	const TaskGroup *_parent;
+	std::atomic<int> _number_of_pending;
+	std::atomic<bool> _is_cancelled;
+	std::exception_ptr _exception;
+	std::mutex _mutex;
+	std::condition_variable _finished;
+
+	void submit(std::vector<std::pair<float, std::function<void()> > > &tasks);
+	void finish(std::exception_ptr exception);
+};
+
+#endif /* THREAD_POOL_H_ */
@@ -0,0 +1,88 @@
+/**
+ * Copyright (C) 2016, Vadim Fedorov <coderiks@gmail.com>
+ *
+ * This program is free software: you can use, modify and/or
+ * redistribute it under the terms of the simplified BSD
+ * License. You should have received a copy of this license along
+ * this program. If not, see
+ * <http://www.opensource.org/licenses/bsd-license.html>.
+ */
+
+#ifndef TILED_IMAGE_H_
+#define TILED_IMAGE_H_
+
+#include <memory>
+#include "image.h"
+#include "point.h"
+#include "shape.h"
+
+namespace FieldLayouts
+{
+	enum FieldLayout {row_major, tiled};
+}
+
+/**
+ * Read-only copy of a 2d image stored in square tiles. Every tile holds its pixels
+ * contiguously in row-major order (all channels of a pixel together), tiles follow each other
+ * in row-major order as well. Regions that span many rows (e.g. tall or rotated ellipses) touch
+ * then a few tiles instead of many rows of a wide image, which reduces cache and TLB misses.
+ * Memory is managed by references counting, the same way as in ImageFx<T>.
+ *
+ * @note Boundary tiles are padded up to the full size, so a pixel offset is computed without branches.
+ */
+template <class T = float>
+class TiledImage
+{
+public:
+	constexpr static uint DEFAULT_TILE_SIZE = 64;
+
+	TiledImage();
+
+	/// Copy a given image into tiles.
+	/// @param tile_size Size of a tile, it is rounded up to the nearest power of two.
+	explicit TiledImage(const ImageFx<T> &source, uint tile_size = DEFAULT_TILE_SIZE);
+
+	/// Is current image not empty.
+	operator bool() const;
+
+	/// Is current image empty.
+	bool is_empty() const;
+
+	uint size_x() const;
+	uint size_y() const;
+	Shape size() const;
+	uint number_of_channels() const;
+	uint tile_size() const;
+
+	/// Get offset of the first channel of a given pixel in the internal data.
+	inline uint offset(uint x, uint y) const;
+
+	/// Get the last X coordinate of the tile containing a given one.
+	/// @note Pixels of a row are stored contiguously from x up to run_end(x) inclusively.
+	inline uint run_end(uint x) const;
+
+	/// Return read-only value without range checking.
+	const T& operator() (uint x, uint y) const;
+	const T& operator() (uint x, uint y, uint channel) const;
+	const T& operator() (const Point &p) const;
+	const T& operator() (const Point &p, uint channel) const;
+
+	/// Return pointer to internal data.
+	const T* raw() const;
+
+	/// Copy the data back into an image with the usual row-major layout.
+	Image<T> to_image() const;
+
+private:
+	std::shared_ptr<T> _data;
+	uint _size_x, _size_y;
+	uint _number_of_channels;
+	uint _tile_shift;			// log2 of the tile size
+	uint _tile_mask;			// tile size - 1
+	uint _number_of_tiles_x;
+};
+
+// NOTE: include implementation, because TiledImage is a template
+#include "../tiled_image.hpp"
+
+#endif /* TILED_IMAGE_H_ */
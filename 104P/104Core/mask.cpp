@@ -144,25 +144,25 @@ MaskFx& MaskFx::operator= (const MaskFx &other)
 
 MaskFx::iterator MaskFx::begin() const
 {
-	return iterator(this, first());
+	return iterator(&bits(), first());
 }
 
 
 MaskFx::iterator MaskFx::end() const
 {
-	return iterator(this, Point(_size_x, _size_y));
+	return iterator(&bits(), Point(_size_x, _size_y));
 }
 
 
 MaskFx::iterator MaskFx::rbegin() const
 {
-	return iterator(this, last(), true);
+	return iterator(&bits(), last(), true);
 }
 
 
 MaskFx::iterator MaskFx::rend() const
 {
-	return iterator(this, Point(-1, -1), true);
+	return iterator(&bits(), Point(-1, -1), true);
 }
 
 
@@ -275,13 +275,7 @@ MaskFx MaskFx::clone_invert() const
 std::vector<Point> MaskFx::masked_points() const
 {
 	if (!_internal->is_points_cache_valid) {
-		_internal->points_cache.clear();
-
-		// fill points cache
-		for(iterator it = begin(); it != end(); ++it) {
-			_internal->points_cache.push_back(*it);
-		}
-
+		_internal->points_cache = bits().masked_points();
 		_internal->is_points_cache_valid = true;
 	}
 
@@ -289,6 +283,21 @@ std::vector<Point> MaskFx::masked_points() const
 }
 
 
+const BitMask& MaskFx::bits() const
+{
+	// Double-checked locking: the mutex is taken only while the bit mask is (re)built
+	if (!_internal->is_bits_cache_valid.load(std::memory_order_acquire)) {
+		std::lock_guard<std::mutex> lock(_internal->bits_mutex);
+		if (!_internal->is_bits_cache_valid.load(std::memory_order_relaxed)) {
+			_internal->bits_cache = BitMask(*this);
+			_internal->is_bits_cache_valid.store(true, std::memory_order_release);
+		}
+	}
+
+	return _internal->bits_cache;
+}
+
+
 Point MaskFx::first() const
 {
 	if (!_internal->is_first_last_valid) {
@@ -311,35 +320,13 @@ Point MaskFx::last() const
 
 Point MaskFx::next(const Point &current) const
 {
-	int from_x = current.x + 1;
-	bool *data = _data.get();
-	for (uint y = current.y; y < _size_y; y++) {
-		for (uint x = from_x; x < _size_x; x++) {
-			if (data[index(x, y, 0)]) {
-				return Point(x, y);
-			}
-		}
-		from_x = 0;
-	}
-
-	return Point(_size_x, _size_y);
+	return bits().next(current);
 }
 
 
 Point MaskFx::prev(const Point &current) const
 {
-	int from_x = current.x - 1;
-	bool *data = _data.get();
-	for (int y = current.y; y >= 0; y--) {
-		for (int x = from_x; x >= 0; x--) {
-			if (data[index(x, y, 0)]) {
-				return Point(x, y);
-			}
-		}
-		from_x = _size_x - 1;
-	}
-
-	return Point(-1, -1);
+	return bits().prev(current);
 }
 
 
@@ -353,33 +340,9 @@ inline void MaskFx::init_internal(Point first, Point last, bool is_first_last_va
 
 inline void MaskFx::actualize_first_last() const
 {
-	_internal->first = Point(_size_x, _size_y);
-	_internal->last = Point(-1, -1);
-
-	bool *data = _data.get();
-
-	bool is_last_found = false;
-	for (int y = _size_y - 1; (!is_last_found) && (y >= 0); y--) {
-		for (int x = _size_x - 1; (!is_last_found) && (x >= 0); x--) {
-			if (data[index(x, y, 0)]) {
-				_internal->last = Point(x, y);
-				is_last_found = true;
-			}
-		}
-	}
-
-	if (is_last_found) {
-		bool _is_first_found = false;
-		for (uint y = 0; (!_is_first_found) && (y < _size_y); y++) {
-			for (uint x = 0; (!_is_first_found) && (x < _size_x); x++) {
-				if (data[index(x, y, 0)]) {
-					_internal->first = Point(x, y);
-					_is_first_found = true;
-				}
-			}
-		}
-	}
-
+	const BitMask &bit_mask = bits();
+	_internal->first = bit_mask.first();
+	_internal->last = (_internal->first.y < (int)_size_y) ? bit_mask.last() : Point(-1, -1);
 	_internal->is_first_last_valid = true;
 }
 
@@ -518,6 +481,7 @@ bool& Mask::operator() (uint x, uint y)
 {
 	_internal->is_first_last_valid = false;
 	_internal->is_points_cache_valid = false;
+	_internal->is_bits_cache_valid = false;
 
 	return _data.get()[index(x, y, 0)];
 }
@@ -527,6 +491,7 @@ bool& Mask::operator() (uint x, uint y, uint channel)
 {
 	_internal->is_first_last_valid = false;
 	_internal->is_points_cache_valid = false;
+	_internal->is_bits_cache_valid = false;
 
 	return _data.get()[index(x, y, channel)];
 }
@@ -536,6 +501,7 @@ bool& Mask::operator() (Point p)
 {
 	_internal->is_first_last_valid = false;
 	_internal->is_points_cache_valid = false;
+	_internal->is_bits_cache_valid = false;
 
 	return _data.get()[index(p.x, p.y, 0)];
 }
@@ -545,6 +511,7 @@ bool& Mask::operator() (Point p, uint channel)
 {
 	_internal->is_first_last_valid = false;
 	_internal->is_points_cache_valid = false;
+	_internal->is_bits_cache_valid = false;
 
 	return _data.get()[index(p.x, p.y, channel)];
 }
@@ -558,6 +525,7 @@ bool& Mask::at(uint x, uint y)
 
 	_internal->is_first_last_valid = false;
 	_internal->is_points_cache_valid = false;
+	_internal->is_bits_cache_valid = false;
 
 	return _data.get()[index(x, y, 0)];
 }
@@ -571,6 +539,7 @@ bool& Mask::at(uint x, uint y, uint channel)
 
 	_internal->is_first_last_valid = false;
 	_internal->is_points_cache_valid = false;
+	_internal->is_bits_cache_valid = false;
 
 	return _data.get()[index(x, y, channel)];
 }
@@ -584,6 +553,7 @@ bool& Mask::at(Point p)
 
 	_internal->is_first_last_valid = false;
 	_internal->is_points_cache_valid = false;
+	_internal->is_bits_cache_valid = false;
 
 	return _data.get()[index(p.x, p.y, 0)];
 }
@@ -597,6 +567,7 @@ bool& Mask::at(Point p, uint channel)
 
 	_internal->is_first_last_valid = false;
 	_internal->is_points_cache_valid = false;
+	_internal->is_bits_cache_valid = false;
 
 	return _data.get()[index(p.x, p.y, channel)];
 }
@@ -610,6 +581,7 @@ void Mask::mask(uint x, uint y)
 
 	_internal->is_first_last_valid = false;
 	_internal->is_points_cache_valid = false;
+	_internal->is_bits_cache_valid = false;
 
 	_data.get()[index(x, y, 0)] = true;
 }
@@ -623,6 +595,7 @@ void Mask::mask(uint x, uint y, uint channel)
 
 	_internal->is_first_last_valid = false;
 	_internal->is_points_cache_valid = false;
+	_internal->is_bits_cache_valid = false;
 
 	_data.get()[index(x, y, channel)] = true;
 }
@@ -636,6 +609,7 @@ void Mask::mask(Point p)
 
 	_internal->is_first_last_valid = false;
 	_internal->is_points_cache_valid = false;
+	_internal->is_bits_cache_valid = false;
 
 	_data.get()[index(p.x, p.y, 0)] = true;
 }
@@ -649,6 +623,7 @@ void Mask::mask(Point p, uint channel)
 
 	_internal->is_first_last_valid = false;
 	_internal->is_points_cache_valid = false;
+	_internal->is_bits_cache_valid = false;
 
 	_data.get()[index(p.x, p.y, channel)] = true;
 }
@@ -662,6 +637,7 @@ void Mask::unmask(uint x, uint y)
 
 	_internal->is_first_last_valid = false;
 	_internal->is_points_cache_valid = false;
+	_internal->is_bits_cache_valid = false;
 
 	_data.get()[index(x, y, 0)] = false;
 }
@@ -675,6 +651,7 @@ void Mask::unmask(uint x, uint y, uint channel)
 
 	_internal->is_first_last_valid = false;
 	_internal->is_points_cache_valid = false;
+	_internal->is_bits_cache_valid = false;
 
 	_data.get()[index(x, y, channel)] = true;
 }
@@ -688,6 +665,7 @@ void Mask::unmask(Point p)
 
 	_internal->is_first_last_valid = false;
 	_internal->is_points_cache_valid = false;
+	_internal->is_bits_cache_valid = false;
 
 	_data.get()[index(p.x, p.y, 0)] = true;
 }
@@ -701,6 +679,7 @@ void Mask::unmask(Point p, uint channel)
 
 	_internal->is_first_last_valid = false;
 	_internal->is_points_cache_valid = false;
+	_internal->is_bits_cache_valid = false;
 
 	_data.get()[index(p.x, p.y, channel)] = true;
 }
@@ -756,4 +735,5 @@ void Mask::invert()
 
 	_internal->is_first_last_valid = false;
 	_internal->is_points_cache_valid = false;
+	_internal->is_bits_cache_valid = false;
 }
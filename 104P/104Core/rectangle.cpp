@@ -0,0 +1,116 @@
+/**
+ * Copyright (C) 2016, Vadim Fedorov <coderiks@gmail.com>
+ *
+ * This program is free software: you can use, modify and/or
+ * redistribute it under the terms of the simplified BSD
+ * License. You should have received a copy of this license along
+ * this program. If not, see
+ * <http://www.opensource.org/licenses/bsd-license.html>.
+ */
+
+
+#include <algorithm>
+#include "rectangle.h"
+
+Rectangle::Rectangle()
+ : x_0(0), y_0(0), x_1(0), y_1(0)
+{
+
+}
+
+
+Rectangle::Rectangle(int x_0, int y_0, int x_1, int y_1)
+ : x_0(x_0), y_0(y_0), x_1(x_1), y_1(y_1)
+{
+
+}
+
+
+Rectangle::Rectangle(const Shape &shape)
+ : x_0(0), y_0(0), x_1(shape.size_x), y_1(shape.size_y)
+{
+
+}
+
+
+Rectangle Rectangle::around(Point center, int radius)
+{
+	return Rectangle(center.x - radius, center.y - radius, center.x + radius + 1, center.y + radius + 1);
+}
+
+
+bool Rectangle::operator== (const Rectangle &other) const
+{
+	return x_0 == other.x_0 && y_0 == other.y_0 && x_1 == other.x_1 && y_1 == other.y_1;
+}
+
+
+bool Rectangle::operator!= (const Rectangle &other) const
+{
+	return !((*this) == other);
+}
+
+
+bool Rectangle::is_empty() const
+{
+	return x_1 <= x_0 || y_1 <= y_0;
+}
+
+
+int Rectangle::size_x() const
+{
+	return std::max(x_1 - x_0, 0);
+}
+
+
+int Rectangle::size_y() const
+{
+	return std::max(y_1 - y_0, 0);
+}
+
+
+Shape Rectangle::size() const
+{
+	return Shape(size_x(), size_y());
+}
+
+
+Point Rectangle::origin() const
+{
+	return Point(x_0, y_0);
+}
+
+
+bool Rectangle::contains(const Point &p) const
+{
+	return contains(p.x, p.y);
+}
+
+
+bool Rectangle::contains(int x, int y) const
+{
+	return x >= x_0 && y >= y_0 && x < x_1 && y < y_1;
+}
+
+
+Rectangle Rectangle::intersection(const Rectangle &other) const
+{
+	Rectangle result(std::max(x_0, other.x_0), std::max(y_0, other.y_0),
+					 std::min(x_1, other.x_1), std::min(y_1, other.y_1));
+
+	return (result.is_empty()) ? Rectangle() : result;
+}
+
+
+Rectangle Rectangle::bounding_box(const Rectangle &other) const
+{
+	if (is_empty()) {
+		return other;
+	}
+	if (other.is_empty()) {
+		return *this;
+	}
+
+	return Rectangle(std::min(x_0, other.x_0), std::min(y_0, other.y_0),
+					 std::max(x_1, other.x_1), std::max(y_1, other.y_1));
+}
@@ -0,0 +1,412 @@
+/**
+ * Copyright (C) 2016, Vadim Fedorov <coderiks@gmail.com>
+ *
+ * This program is free software: you can use, modify and/or
+ * redistribute it under the terms of the simplified BSD
+ * License. You should have received a copy of this license along
+ * this program. If not, see
+ * <http://www.opensource.org/licenses/bsd-license.html>.
+ */
+
+#include <algorithm>
+#include "thread_pool.h"
+
+using std::vector;
+using std::pair;
+
+namespace
+{
+	// Pool and id of the worker running on the current thread (if any)
+	thread_local const ThreadPool *current_pool = nullptr;
+	thread_local int current_id = -1;
+}
+
+
+ThreadPool::ThreadPool(uint number_of_threads)
+: _number_of_queued(0),
+  _next_queue(0),
+  _stop(false)
+{
+	if (number_of_threads == 0) {
+		number_of_threads = std::max(std::thread::hardware_concurrency(), 2u) - 1;
+	}
+
+	_queues.resize(number_of_threads);
+	for (uint i = 0; i < number_of_threads; i++) {
+		_queues[i].reset(new Queue());
+	}
+
+	_threads.reserve(number_of_threads);
+	for (uint i = 0; i < number_of_threads; i++) {
+		_threads.push_back(std::thread(&ThreadPool::work, this, i));
+	}
+}
+
+
+ThreadPool::~ThreadPool()
+{
+	{
+		std::lock_guard<std::mutex> lock(_mutex);
+		_stop = true;
+	}
+	_wake_up.notify_all();
+
+	for (auto it = _threads.begin(); it != _threads.end(); ++it) {
+		it->join();
+	}
+}
+
+
+uint ThreadPool::number_of_threads() const
+{
+	return _threads.size();
+}
+
+
+uint ThreadPool::concurrency() const
+{
+	return _threads.size() + 1;
+}
+
+
+ThreadPool& ThreadPool::shared()
+{
+	static ThreadPool pool;
+	return pool;
+}
+
+
+void ThreadPool::parallel_for(int begin, int end, int grain,
+							  const std::function<void(int, int)> &body,
+							  const std::function<float(int, int)> &cost)
+{
+	TaskGroup group(*this);
+	group.run_range(begin, end, grain, body, cost);
+	group.wait();
+}
+
+
+void ThreadPool::parallel_for_tiles(Shape size, int tile_size,
+									const std::function<void(int, int, int, int)> &body,
+									const std::function<float(int, int, int, int)> &cost)
+{
+	TaskGroup group(*this);
+	group.run_tiles(size, tile_size, body, cost);
+	group.wait();
+}
+
+/* Private */
+
+/**
+ * Main loop of a worker thread.
+ */
+void ThreadPool::work(uint id)
+{
+	current_pool = this;
+	current_id = id;
+
+	while (true) {
+		if (run_pending_task()) {
+			continue;
+		}
+
+		std::unique_lock<std::mutex> lock(_mutex);
+		_wake_up.wait(lock, [this] { return _stop || _number_of_queued > 0; });
+		if (_stop && _number_of_queued == 0) {
+			break;
+		}
+	}
+
+	current_pool = nullptr;
+	current_id = -1;
+}
+
+
+/**
+ * Put tasks to the queues. Tasks are given in the order they should be started in.
+ * Tasks submitted by a worker go to its own queue, otherwise they are distributed among all the queues.
+ */
+void ThreadPool::submit(vector<Task*> &tasks)
+{
+	if (tasks.empty()) {
+		return;
+	}
+
+	// NOTE: the counter is increased first, so that it never underestimates the number of queued tasks
+	{
+		std::lock_guard<std::mutex> lock(_mutex);
+		_number_of_queued += tasks.size();
+	}
+
+	// NOTE: tasks are taken from the back of the queues, so they are pushed in reverse order
+	int id = current_worker();
+	if (id >= 0) {
+		Queue &queue = *_queues[id];
+		std::lock_guard<std::mutex> lock(queue.mutex);
+		queue.tasks.insert(queue.tasks.end(), tasks.rbegin(), tasks.rend());
+	} else {
+		for (auto it = tasks.rbegin(); it != tasks.rend(); ++it) {
+			Queue &queue = *_queues[_next_queue++ % _queues.size()];
+			std::lock_guard<std::mutex> lock(queue.mutex);
+			queue.tasks.push_back(*it);
+		}
+	}
+
+	if (tasks.size() > 1) {
+		_wake_up.notify_all();
+	} else {
+		_wake_up.notify_one();
+	}
+}
+
+
+/**
+ * Take a task from the queues and execute it on the current thread.
+ * @return False, if there were no pending tasks.
+ */
+bool ThreadPool::run_pending_task()
+{
+	Task *task = take_task(current_worker());
+	if (!task) {
+		return false;
+	}
+
+	execute(task);
+	return true;
+}
+
+
+/**
+ * Take the next task from the own queue of a worker, or steal it from other queues.
+ * @param id Id of the worker, or -1 for the threads that are not workers of this pool.
+ */
+ThreadPool::Task* ThreadPool::take_task(int id)
+{
+	if (_number_of_queued <= 0) {
+		return nullptr;
+	}
+
+	Task *task = nullptr;
+	if (id >= 0) {
+		Queue &queue = *_queues[id];
+		std::lock_guard<std::mutex> lock(queue.mutex);
+		if (!queue.tasks.empty()) {
+			task = queue.tasks.back();
+			queue.tasks.pop_back();
+		}
+	}
+
+	int number_of_queues = _queues.size();
+	int start = (id >= 0) ? id + 1 : _next_queue % number_of_queues;
+	for (int i = 0; i < number_of_queues && !task; i++) {
+		int victim = (start + i) % number_of_queues;
+		if (victim == id) {
+			continue;
+		}
+
+		Queue &queue = *_queues[victim];
+		std::lock_guard<std::mutex> lock(queue.mutex);
+		if (!queue.tasks.empty()) {
+			task = queue.tasks.back();
+			queue.tasks.pop_back();
+		}
+	}
+
+	if (task) {
+		_number_of_queued--;
+	}
+
+	return task;
+}
+
+
+/**
+ * Execute a task (unless its group was cancelled) and report its completion to the group.
+ */
+void ThreadPool::execute(Task *task)
+{
+	TaskGroup *group = task->group;
+	std::exception_ptr exception;
+	if (!group->is_cancelled()) {
+		try {
+			task->function();
+		} catch (...) {
+			exception = std::current_exception();
+		}
+	}
+
+	delete task;
+	group->finish(exception);
+}
+
+
+/**
+ * Get id of the worker running on the current thread, or -1 if the thread is not a worker of this pool.
+ */
+inline int ThreadPool::current_worker() const
+{
+	return (current_pool == this) ? current_id : -1;
+}
+
+
+
+TaskGroup::TaskGroup(ThreadPool &pool)
+: _pool(pool),
+  _parent(nullptr),
+  _number_of_pending(0),
+  _is_cancelled(false)
+{
+
+}
+
+
+TaskGroup::TaskGroup(TaskGroup &parent)
+: _pool(parent._pool),
+  _parent(&parent),
+  _number_of_pending(0),
+  _is_cancelled(false)
+{
+
+}
+
+
+TaskGroup::~TaskGroup()
+{
+	try {
+		wait();
+	} catch (...) {
+		// NOTE: exceptions can not be propagated from the destructor
+	}
+}
+
+
+void TaskGroup::run(std::function<void()> task)
+{
+	vector<pair<float, std::function<void()> > > tasks(1, pair<float, std::function<void()> >(0.0f, std::move(task)));
+	submit(tasks);
+}
+
+
+void TaskGroup::run_range(int begin, int end, int grain,
+						  const std::function<void(int, int)> &body,
+						  const std::function<float(int, int)> &cost)
+{
+	grain = std::max(grain, 1);
+
+	vector<pair<float, std::function<void()> > > tasks;
+	tasks.reserve((std::max(end - begin, 0) + grain - 1) / grain);
+	for (int range_begin = begin; range_begin < end; range_begin += grain) {
+		int range_end = std::min(range_begin + grain, end);
+		float range_cost = (cost) ? cost(range_begin, range_end) : 0.0f;
+		tasks.push_back(pair<float, std::function<void()> >(range_cost, [body, range_begin, range_end] () {
+			body(range_begin, range_end);
+		}));
+	}
+
+	submit(tasks);
+}
+
+
+void TaskGroup::run_tiles(Shape size, int tile_size,
+						  const std::function<void(int, int, int, int)> &body,
+						  const std::function<float(int, int, int, int)> &cost)
+{
+	tile_size = std::max(tile_size, 1);
+	int size_x = size.size_x;
+	int size_y = size.size_y;
+
+	vector<pair<float, std::function<void()> > > tasks;
+	tasks.reserve(((size_x + tile_size - 1) / tile_size) * ((size_y + tile_size - 1) / tile_size));
+	for (int y_0 = 0; y_0 < size_y; y_0 += tile_size) {
+		for (int x_0 = 0; x_0 < size_x; x_0 += tile_size) {
+			int x_1 = std::min(x_0 + tile_size, size_x);
+			int y_1 = std::min(y_0 + tile_size, size_y);
+			float tile_cost = (cost) ? cost(x_0, y_0, x_1, y_1) : 0.0f;
+			tasks.push_back(pair<float, std::function<void()> >(tile_cost, [body, x_0, y_0, x_1, y_1] () {
+				body(x_0, y_0, x_1, y_1);
+			}));
+		}
+	}
+
+	submit(tasks);
+}
+
+
+void TaskGroup::wait()
+{
+	while (_number_of_pending > 0) {
+		if (_pool.run_pending_task()) {
+			continue;
+		}
+
+		// All the remaining tasks are being executed by other threads
+		std::unique_lock<std::mutex> lock(_mutex);
+		_finished.wait(lock, [this] { return _number_of_pending == 0; });
+	}
+
+	// NOTE: synchronize with the thread that finished the last task, it may still hold the mutex
+	std::lock_guard<std::mutex> lock(_mutex);
+	if (_exception) {
+		std::exception_ptr exception = _exception;
+		_exception = nullptr;
+		std::rethrow_exception(exception);
+	}
+}
+
+
+void TaskGroup::cancel()
+{
+	_is_cancelled = true;
+}
+
+
+bool TaskGroup::is_cancelled() const
+{
+	return _is_cancelled || (_parent && _parent->is_cancelled());
+}
+
+
+ThreadPool& TaskGroup::pool() const
+{
+	return _pool;
+}
+
+/* Private */
+
+/**
+ * Pass tasks to the pool. Tasks with higher cost go first, otherwise the order is preserved.
+ */
+void TaskGroup::submit(vector<pair<float, std::function<void()> > > &tasks)
+{
+	std::stable_sort(tasks.begin(), tasks.end(),
+					 [] (const pair<float, std::function<void()> > &left,
+						 const pair<float, std::function<void()> > &right) {
+		return left.first > right.first;
+	});
+
+	vector<ThreadPool::Task*> pool_tasks;
+	pool_tasks.reserve(tasks.size());
+	for (auto it = tasks.begin(); it != tasks.end(); ++it) {
+		pool_tasks.push_back(new ThreadPool::Task{std::move(it->second), this});
+	}
+
+	_number_of_pending += pool_tasks.size();
+	_pool.submit(pool_tasks);
+}
+
+
+/**
+ * Register completion of a task.
+ */
+void TaskGroup::finish(std::exception_ptr exception)
+{
+	std::lock_guard<std::mutex> lock(_mutex);
+	if (exception && !_exception) {
+		_exception = exception;
+		_is_cancelled = true;
+	}
+
+	if (--_number_of_pending == 0) {
+		_finished.notify_all();
+	}
+}
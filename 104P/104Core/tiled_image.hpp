@@ -0,0 +1,175 @@
+/**
+ * Copyright (C) 2016, Vadim Fedorov <coderiks@gmail.com>
+ *
+ * This program is free software: you can use, modify and/or
+ * redistribute it under the terms of the simplified BSD
+ * License. You should have received a copy of this license along
+ * this program. If not, see
+ * <http://www.opensource.org/licenses/bsd-license.html>.
+ */
+
+#include "tiled_image.h"
+
+
+template <class T>
+TiledImage<T>::TiledImage()
+ : _data(), _size_x(0), _size_y(0), _number_of_channels(0), _tile_shift(0), _tile_mask(0), _number_of_tiles_x(0)
+{
+
+}
+
+
+template <class T>
+TiledImage<T>::TiledImage(const ImageFx<T> &source, uint tile_size)
+ : _data(), _size_x(source.size_x()), _size_y(source.size_y()), _number_of_channels(source.number_of_channels()),
+   _tile_shift(0)
+{
+	while ((1u << _tile_shift) < tile_size) {
+		_tile_shift++;
+	}
+	_tile_mask = (1u << _tile_shift) - 1;
+	_number_of_tiles_x = (_size_x + _tile_mask) >> _tile_shift;
+	uint number_of_tiles_y = (_size_y + _tile_mask) >> _tile_shift;
+
+	if (!source) {
+		return;
+	}
+
+	uint length = (_number_of_tiles_x * number_of_tiles_y << (2 * _tile_shift)) * _number_of_channels;
+	_data = std::shared_ptr<T>(new T[length](), std::default_delete<T[]>());
+
+	// Copy row runs within tiles
+	T *data = _data.get();
+	for (uint y = 0; y < _size_y; y++) {
+		const T *source_row = source.row(y);
+		for (uint x = 0; x < _size_x; x = run_end(x) + 1) {
+			uint length_x = std::min(run_end(x) + 1, _size_x) - x;
+			std::copy_n(source_row + x * _number_of_channels,
+						length_x * _number_of_channels,
+						data + offset(x, y));
+		}
+	}
+}
+
+
+template <class T>
+TiledImage<T>::operator bool() const
+{
+	return (bool)_data;
+}
+
+
+template <class T>
+bool TiledImage<T>::is_empty() const
+{
+	return !_data;
+}
+
+
+template <class T>
+uint TiledImage<T>::size_x() const
+{
+	return _size_x;
+}
+
+
+template <class T>
+uint TiledImage<T>::size_y() const
+{
+	return _size_y;
+}
+
+
+template <class T>
+Shape TiledImage<T>::size() const
+{
+	return Shape(_size_x, _size_y);
+}
+
+
+template <class T>
+uint TiledImage<T>::number_of_channels() const
+{
+	return _number_of_channels;
+}
+
+
+template <class T>
+uint TiledImage<T>::tile_size() const
+{
+	return 1u << _tile_shift;
+}
+
+
+template <class T>
+inline uint TiledImage<T>::offset(uint x, uint y) const
+{
+	uint tile = (y >> _tile_shift) * _number_of_tiles_x + (x >> _tile_shift);
+	uint within_tile = ((y & _tile_mask) << _tile_shift) + (x & _tile_mask);
+	return ((tile << (2 * _tile_shift)) + within_tile) * _number_of_channels;
+}
+
+
+template <class T>
+inline uint TiledImage<T>::run_end(uint x) const
+{
+	return x | _tile_mask;
+}
+
+
+template <class T>
+const T& TiledImage<T>::operator() (uint x, uint y) const
+{
+	return _data.get()[offset(x, y)];
+}
+
+
+template <class T>
+const T& TiledImage<T>::operator() (uint x, uint y, uint channel) const
+{
+	return _data.get()[offset(x, y) + channel];
+}
+
+
+template <class T>
+const T& TiledImage<T>::operator() (const Point &p) const
+{
+	return _data.get()[offset(p.x, p.y)];
+}
+
+
+template <class T>
+const T& TiledImage<T>::operator() (const Point &p, uint channel) const
+{
+	return _data.get()[offset(p.x, p.y) + channel];
+}
+
+
+template <class T>
+const T* TiledImage<T>::raw() const
+{
+	return _data.get();
+}
+
+
+template <class T>
+Image<T> TiledImage<T>::to_image() const
+{
+	if (!_data) {
+		return Image<T>();
+	}
+
+	Image<T> image(_size_x, _size_y, _number_of_channels);
+	T *image_data = image.raw();
+	const T *data = _data.get();
+	for (uint y = 0; y < _size_y; y++) {
+		for (uint x = 0; x < _size_x; x = run_end(x) + 1) {
+			uint length_x = std::min(run_end(x) + 1, _size_x) - x;
+			std::copy_n(data + offset(x, y),
+						length_x * _number_of_channels,
+						image_data + (y * _size_x + x) * _number_of_channels);
+		}
+	}
+
+	return image;
+}
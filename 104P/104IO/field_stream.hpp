@@ -0,0 +1,69 @@
+/**
+ * Copyright (C) 2016, Vadim Fedorov <coderiks@gmail.com>
+ *
+ * This program is free software: you can use, modify and/or
+ * redistribute it under the terms of the simplified BSD
+ * License. You should have received a copy of this license along
+ * this program. If not, see
+ * <http://www.opensource.org/licenses/bsd-license.html>.
+ */
+
+#include "field_stream.h"
+
+
+template <class T>
+FieldStream<T>::FieldStream(const std::string &name, FieldFormats::FieldFormat format, const ImageFx<T> &field,
+							uint number_of_channels, ConvertFunc convert)
+ : _field(field), _number_of_channels(number_of_channels), _convert(convert),
+   _row(field.size_x() * number_of_channels)
+{
+	_writer = std::make_shared<FieldWriter>(name, format, field.size_x(), field.size_y(), number_of_channels);
+	_stream = std::make_shared<RowStream>(field.size(), [this] (uint y_0, uint y_1) {
+		write_rows(y_0, y_1);
+	});
+}
+
+
+template <class T>
+bool FieldStream<T>::is_open() const
+{
+	return _writer->is_open();
+}
+
+
+template <class T>
+const std::string& FieldStream<T>::name() const
+{
+	return _writer->name();
+}
+
+
+template <class T>
+void FieldStream<T>::complete(int x_0, int y_0, int x_1, int y_1)
+{
+	_stream->complete(x_0, y_0, x_1, y_1);
+}
+
+
+template <class T>
+void FieldStream<T>::close()
+{
+	// Write the remaining rows, e.g. if only a part of the field was computed
+	write_rows(_stream->rows_completed(), _field.size_y());
+	_writer->close();
+}
+
+
+/* Private */
+
+template <class T>
+void FieldStream<T>::write_rows(uint y_0, uint y_1)
+{
+	for (uint y = y_0; y < y_1; y++) {
+		const T *field_row = _field.row(y);
+		for (uint x = 0; x < _field.size_x(); x++) {
+			_convert(field_row[x * _field.number_of_channels()], _row.data() + x * _number_of_channels);
+		}
+		_writer->write_rows(_row.data(), 1);
+	}
+}
@@ -0,0 +1,204 @@
+/**
+ * Copyright (C) 2016, Vadim Fedorov <coderiks@gmail.com>
+ *
+ * This program is free software: you can use, modify and/or
+ * redistribute it under the terms of the simplified BSD
+ * License. You should have received a copy of this license along
+ * this program. If not, see
+ * <http://www.opensource.org/licenses/bsd-license.html>.
+ */
+
+#include <sstream>
+#include <cstdint>
+#include <algorithm>
+#include "field_writer.h"
+
+extern "C" {
+#include "../iio/iio.h"
+}
+
+
+FieldWriter::FieldWriter(const std::string &name, FieldFormats::FieldFormat format,
+						 uint size_x, uint size_y, uint number_of_channels)
+ : _name(name), _format(format), _size_x(size_x), _size_y(size_y), _number_of_channels(number_of_channels),
+   _rows_written(0), _is_open(false)
+{
+	std::string ext = extension(format);
+	if (_name.size() < ext.size() || _name.compare(_name.size() - ext.size(), ext.size(), ext) != 0) {
+		_name += ext;
+	}
+
+	if (_format == FieldFormats::npy) {
+		_file.open(_name.c_str(), std::ios_base::out | std::ios_base::binary);
+		_is_open = _file.is_open();
+		if (_is_open) {
+			write_npy_header();
+		}
+	} else {
+		_buffer.reserve((std::size_t)_size_x * _size_y * _number_of_channels);
+		_is_open = true;
+	}
+}
+
+
+FieldWriter::~FieldWriter()
+{
+	close();
+}
+
+
+bool FieldWriter::is_open() const
+{
+	return _is_open;
+}
+
+
+const std::string& FieldWriter::name() const
+{
+	return _name;
+}
+
+
+void FieldWriter::write_rows(const float *data, uint number_of_rows, uint stride)
+{
+	if (!_is_open) {
+		return;
+	}
+
+	uint row_length = _size_x * _number_of_channels;
+	if (stride == 0) {
+		stride = row_length;
+	}
+	number_of_rows = std::min(number_of_rows, _size_y - _rows_written);
+
+	for (uint y = 0; y < number_of_rows; y++) {
+		const float *row = data + (std::size_t)y * stride;
+		if (_format == FieldFormats::npy) {
+			_file.write(reinterpret_cast<const char*>(row), row_length * sizeof(float));
+		} else {
+			_buffer.insert(_buffer.end(), row, row + row_length);
+		}
+	}
+	_rows_written += number_of_rows;
+}
+
+
+void FieldWriter::write_rows(const ImageFx<float> &rows)
+{
+	if (!rows || rows.size_x() != _size_x || rows.number_of_channels() != _number_of_channels) {
+		return;
+	}
+
+	write_rows(rows.row(0), rows.size_y(), rows.stride());
+}
+
+
+void FieldWriter::close()
+{
+	if (!_is_open) {
+		return;
+	}
+
+	// Fill missing rows, so that the file is valid anyway
+	std::vector<float> zeros(_size_x * _number_of_channels, 0.0f);
+	while (_rows_written < _size_y) {
+		write_rows(zeros.data(), 1);
+	}
+
+	if (_format == FieldFormats::npy) {
+		_file.close();
+	} else {
+		std::vector<char> name(_name.begin(), _name.end());
+		name.push_back('\0');
+		iio_save_image_float_vec(name.data(), _buffer.data(), _size_x, _size_y, _number_of_channels);
+		_buffer = std::vector<float>();
+	}
+	_is_open = false;
+}
+
+
+std::string FieldWriter::extension(FieldFormats::FieldFormat format)
+{
+	return (format == FieldFormats::npy) ? ".npy" : ".tiff";
+}
+
+
+bool FieldWriter::write(const std::string &name, FieldFormats::FieldFormat format, const ImageFx<float> &image)
+{
+	FieldWriter writer(name, format, image.size_x(), image.size_y(), image.number_of_channels());
+	writer.write_rows(image);
+	bool is_open = writer.is_open();
+	writer.close();
+
+	return is_open;
+}
+
+
+/* Private */
+
+/**
+ * Write the NPY (version 1.0) header of a little or big endian float32 array in C order.
+ */
+void FieldWriter::write_npy_header()
+{
+	uint16_t endian_test = 1;
+	bool is_little_endian = *reinterpret_cast<uint8_t*>(&endian_test) == 1;
+
+	std::ostringstream header;
+	header << "{'descr': '" << (is_little_endian ? '<' : '>') << "f4', 'fortran_order': False, 'shape': ("
+		   << _size_y << ", " << _size_x;
+	if (_number_of_channels > 1) {
+		header << ", " << _number_of_channels;
+	}
+	header << "), }";
+
+	// Magic string (6 bytes), version (2 bytes) and header length (2 bytes) precede the header,
+	// which is padded with spaces and terminated by '\n', so that the data is aligned
+	std::string dictionary = header.str();
+	uint preamble_length = 10;
+	uint total_length = (preamble_length + dictionary.size() + 1 + NPY_HEADER_ALIGNMENT - 1) /
+						NPY_HEADER_ALIGNMENT * NPY_HEADER_ALIGNMENT;
+	dictionary.append(total_length - preamble_length - dictionary.size() - 1, ' ');
+	dictionary.push_back('\n');
+
+	uint16_t header_length = dictionary.size();
+	const char preamble[] = {'\x93', 'N', 'U', 'M', 'P', 'Y', 1, 0,
+							 (char)(header_length & 0xFF), (char)(header_length >> 8)};
+	_file.write(preamble, sizeof(preamble));
+	_file.write(dictionary.data(), dictionary.size());
+}
+
+
+/* ==================== RowStream ==================== */
+
+RowStream::RowStream(Shape size, RowsFunc rows_func)
+ : _size(size), _rows_func(rows_func), _pixels_done(size.size_y, 0), _next_row(0)
+{
+
+}
+
+
+void RowStream::complete(int x_0, int y_0, int x_1, int y_1)
+{
+	std::lock_guard<std::mutex> lock(_mutex);
+	for (int y = y_0; y < y_1; y++) {
+		_pixels_done[y] += x_1 - x_0;
+	}
+
+	// Pass the completed rows following the previously passed ones
+	uint end_row = _next_row;
+	while (end_row < _size.size_y && _pixels_done[end_row] >= _size.size_x) {
+		end_row++;
+	}
+	if (end_row > _next_row) {
+		_rows_func(_next_row, end_row);
+		_next_row = end_row;
+	}
+}
+
+
+uint RowStream::rows_completed() const
+{
+	std::lock_guard<std::mutex> lock(_mutex);
+	return _next_row;
+}
@@ -0,0 +1,66 @@
+/**
+ * Copyright (C) 2016, Vadim Fedorov <coderiks@gmail.com>
+ *
+ * This program is free software: you can use, modify and/or
+ * redistribute it under the terms of the simplified BSD
+ * License. You should have received a copy of this license along
+ * this program. If not, see
+ * <http://www.opensource.org/licenses/bsd-license.html>.
+ */
+
+#ifndef FIELD_STREAM_H_
+#define FIELD_STREAM_H_
+
+#include <memory>
+#include <vector>
+#include <string>
+#include <functional>
+#include "image.h"
+#include "field_writer.h"
+
+/**
+ * Writes a dense field, which is computed block by block in arbitrary order, into a binary file.
+ * Rows are converted into floats and written as soon as all their pixels are reported as computed.
+ */
+template <class T>
+class FieldStream
+{
+public:
+	/// Function converting a value of the field into number_of_channels floats.
+	typedef std::function<void(const T&, float*)> ConvertFunc;
+
+	/// @param field Field to be computed, it is shared (not copied).
+	FieldStream(const std::string &name, FieldFormats::FieldFormat format, const ImageFx<T> &field,
+				uint number_of_channels, ConvertFunc convert);
+
+	// NOTE: rows are written by a callback bound to this object
+	FieldStream(const FieldStream<T> &other) = delete;
+	FieldStream<T>& operator= (const FieldStream<T> &other) = delete;
+
+	/// Was the file created successfully.
+	bool is_open() const;
+
+	/// Get the full name of the file.
+	const std::string& name() const;
+
+	/// Mark the block [x_0, x_1) x [y_0, y_1) as computed. Safe to call from multiple threads.
+	void complete(int x_0, int y_0, int x_1, int y_1);
+
+	/// Finish the file (rows not reported as computed are written as well).
+	void close();
+
+private:
+	ImageFx<T> _field;
+	uint _number_of_channels;
+	ConvertFunc _convert;
+	std::shared_ptr<FieldWriter> _writer;
+	std::shared_ptr<RowStream> _stream;
+	std::vector<float> _row;
+
+	void write_rows(uint y_0, uint y_1);
+};
+
+// NOTE: include implementation, because FieldStream is a template
+#include "../field_stream.hpp"
+
+#endif /* FIELD_STREAM_H_ */
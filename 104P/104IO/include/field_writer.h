@@ -0,0 +1,114 @@
+/**
+ * Copyright (C) 2016, Vadim Fedorov <coderiks@gmail.com>
+ *
+ * This program is free software: you can use, modify and/or
+ * redistribute it under the terms of the simplified BSD
+ * License. You should have received a copy of this license along
+ * this program. If not, see
+ * <http://www.opensource.org/licenses/bsd-license.html>.
+ */
+
+#ifndef FIELD_WRITER_H_
+#define FIELD_WRITER_H_
+
+#include <string>
+#include <vector>
+#include <fstream>
+#include <mutex>
+#include <functional>
+#include "image.h"
+#include "shape.h"
+
+namespace FieldFormats
+{
+	enum FieldFormat {npy, tiff};
+}
+
+/**
+ * Writes a field of float values with one or more channels in a binary format row by row,
+ * so that rows can be written as soon as they are computed:
+ * 'npy' - NumPy array of shape (size_y, size_x) or (size_y, size_x, channels), rows are appended to the file;
+ * 'tiff' - multi-channel float TIFF written by IIO, rows are collected and the file is written on close().
+ *
+ * @note IIO stores fields, which contain only integers in [0, 255], as 8-bit images.
+ */
+class FieldWriter
+{
+public:
+	/// Create the file (for NPY write the header).
+	/// @param name File name, the extension is appended, if it is missing (@see extension()).
+	FieldWriter(const std::string &name, FieldFormats::FieldFormat format,
+				uint size_x, uint size_y, uint number_of_channels = 1);
+
+	/// Calls close().
+	~FieldWriter();
+
+	/// Was the file created successfully.
+	bool is_open() const;
+
+	/// Get the full name of the file.
+	const std::string& name() const;
+
+	/// Append consecutive rows following the previously written ones.
+	/// @param data Values of all channels of a pixel stored together, rows are stride elements apart.
+	/// @param stride Number of elements between the beginnings of rows, 0 for size_x * number_of_channels.
+	void write_rows(const float *data, uint number_of_rows, uint stride = 0);
+
+	/// Append rows of an image or a view with matching width and number of channels.
+	void write_rows(const ImageFx<float> &rows);
+
+	/// Finish the file. Missing rows are filled with zeros.
+	void close();
+
+	/// Get the file name extension (with the dot) of a given format.
+	static std::string extension(FieldFormats::FieldFormat format);
+
+	/// Write a whole image at once.
+	static bool write(const std::string &name, FieldFormats::FieldFormat format, const ImageFx<float> &image);
+
+private:
+	constexpr static uint NPY_HEADER_ALIGNMENT = 64;
+
+	std::string _name;
+	FieldFormats::FieldFormat _format;
+	uint _size_x, _size_y;
+	uint _number_of_channels;
+	uint _rows_written;
+	bool _is_open;
+	std::ofstream _file;
+	std::vector<float> _buffer;		// rows collected for formats that can not be streamed
+
+	void write_npy_header();
+};
+
+
+/**
+ * Collects blocks of a field computed in arbitrary order (e.g. by a thread pool) and
+ * passes ranges of rows to a given function as soon as all their pixels are computed.
+ * Rows are passed in order, one range at a time, so that they can be written by a FieldWriter
+ * while the rest of the field is still being computed.
+ */
+class RowStream
+{
+public:
+	/// Function receiving the completed rows [y_0, y_1).
+	typedef std::function<void(uint, uint)> RowsFunc;
+
+	RowStream(Shape size, RowsFunc rows_func);
+
+	/// Mark the block [x_0, x_1) x [y_0, y_1) as computed. Safe to call from multiple threads.
+	/// @note Completed rows are passed to the function from within this call.
+	void complete(int x_0, int y_0, int x_1, int y_1);
+
+	/// Number of rows passed to the function so far.
+	uint rows_completed() const;
+
+private:
+	Shape _size;
+	RowsFunc _rows_func;
+	std::vector<uint> _pixels_done;		// number of computed pixels in every row
+	uint _next_row;
+	mutable std::mutex _mutex;
+};
+
+#endif /* FIELD_WRITER_H_ */
@@ -62,6 +62,10 @@ public:
 	/// Read a sequence of optical flow files from a folder
 	static std::vector<Image<float> > read_all_flows(const std::string &folder, const std::string &prefix = std::string());
 
+	/// Get names of the files in a folder (in alphabetic order, prepended by the folder) or listed
+	/// in a text file (one name per line, empty lines and lines starting with '#' are skipped).
+	static std::vector<std::string> list_files(const std::string &folder_or_list);
+
 	// Various methods for color space conversion
 	static Image<float> rgb_to_gray(ImageFx<float> image);
 	static Image<float> rgb_to_lab(ImageFx<float> image);
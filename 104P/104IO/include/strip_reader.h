@@ -0,0 +1,60 @@
+/**
+ * Copyright (C) 2016, Vadim Fedorov <coderiks@gmail.com>
+ *
+ * This program is free software: you can use, modify and/or
+ * redistribute it under the terms of the simplified BSD
+ * License. You should have received a copy of this license along
+ * this program. If not, see
+ * <http://www.opensource.org/licenses/bsd-license.html>.
+ */
+
+#ifndef STRIP_READER_H_
+#define STRIP_READER_H_
+
+#include <string>
+#include <fstream>
+#include "image.h"
+#include "shape.h"
+
+/**
+ * Reads a grayscale image strip by strip (ranges of rows), so that images, which do not fit into memory,
+ * can be processed. Rows of binary PGM/PPM files (8 or 16 bits per sample) and of 2D NPY arrays of float32
+ * are read directly from the file. Other formats are loaded entirely by IIO and strips are copied from memory.
+ * Colored images are converted to gray the same way as by IOUtility::read_mono_image().
+ * @note Not thread-safe, strips shall be read by one thread at a time.
+ */
+class StripReader
+{
+public:
+	explicit StripReader(const std::string &name);
+
+	/// Was the image opened successfully.
+	bool is_open() const;
+
+	/// Are strips read from the file (otherwise the whole image is kept in memory).
+	bool is_streamed() const;
+
+	uint size_x() const;
+	uint size_y() const;
+	Shape size() const;
+
+	/// Read rows [y_0, y_1) into a new mono image of size size_x() x (y_1 - y_0).
+	/// @return Empty image, if rows could not be read.
+	Image<float> read(uint y_0, uint y_1);
+
+private:
+	enum Encoding {none, pnm, npy, memory};
+
+	Encoding _encoding;
+	uint _size_x, _size_y;
+	uint _number_of_channels;		// number of samples per pixel in the file
+	uint _bytes_per_sample;
+	std::streamoff _data_offset;	// position of the first row in the file
+	std::ifstream _file;
+	Image<float> _image;			// the whole image, if it could not be read by strips
+
+	bool read_pnm_header();
+	bool read_npy_header();
+};
+
+#endif /* STRIP_READER_H_ */
@@ -119,19 +119,9 @@ Image<float> IOUtility::read_mono_image(const std::string &name)
 		return Image<float>();
 	}
 
-	Image<float> image(width, height);
-    image.set_color_space(ColorSpaces::mono);
-
-	// copy from image_data to Image<float>
-	for (int y = 0; y < height; y++) {
-		for (int x = 0; x < width; x++) {
-			int index = (y * width + x);
-			float value = image_data[index];
-			image(x, y) = value;
-		}
-	}
-
-	free(image_data);
+	// NOTE: buffer allocated by iio is used as is and released with free()
+	Image<float> image(image_data, width, height, 1, 0, [] (float *data) { free(data); });
+	image.set_color_space(ColorSpaces::mono);
 
 	return image;
 }
@@ -168,20 +158,9 @@ Image<float> IOUtility::read_rgb_image(const std::string &name)
 		exit(1);
 	}
 
-	Image<float> image(width, height, (uint)3);
-    image.set_color_space(ColorSpaces::RGB);
-
-	// copy from image_data to Image<float>
-	for (int y = 0; y < height; y++) {
-		for (int x = 0; x < width; x++) {
-			int index = 3 * (y * width + x);
-			image(x, y, 0) = image_data[index];
-			image(x, y, 1) = image_data[index + 1];
-			image(x, y, 2) = image_data[index + 2];
-		}
-	}
-
-	free(image_data);
+	// NOTE: buffer allocated by iio is used as is and released with free()
+	Image<float> image(image_data, width, height, 3, 0, [] (float *data) { free(data); });
+	image.set_color_space(ColorSpaces::RGB);
 
 	return image;
 }
@@ -348,6 +327,47 @@ std::vector<Image<float> > IOUtility::read_all_flows(const std::string &folder,
 }
 
 
+std::vector<std::string> IOUtility::list_files(const std::string &folder_or_list)
+{
+	std::vector<std::string> filenames;
+
+	tinydir_dir dir;
+	if (tinydir_open(&dir, folder_or_list.c_str()) == 0) {
+		while (dir.has_next) {
+			tinydir_file file;
+			tinydir_readfile(&dir, &file);
+
+			if (file.is_dir == 0) {
+				filenames.push_back(folder_or_list + '/' + file.name);
+			}
+
+			tinydir_next(&dir);
+		}
+
+		tinydir_close(&dir);
+
+		// Make sure file names are in alphabetic order
+		std::sort(filenames.begin(), filenames.end());
+
+		return filenames;
+	}
+
+	// Not a folder, read the list
+	std::ifstream file(folder_or_list.c_str());
+	std::string line;
+	while (std::getline(file, line)) {
+		// Trim spaces (and '\r' of lists written on Windows)
+		std::size_t begin = line.find_first_not_of(" \t\r");
+		std::size_t end = line.find_last_not_of(" \t\r");
+		if (begin != std::string::npos && line[begin] != '#') {
+			filenames.push_back(line.substr(begin, end - begin + 1));
+		}
+	}
+
+	return filenames;
+}
+
+
 Image<float> IOUtility::rgb_to_gray(ImageFx<float> image)
 {
 	if (image.number_of_channels() != 3) {
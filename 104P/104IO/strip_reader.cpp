@@ -0,0 +1,215 @@
+/**
+ * Copyright (C) 2016, Vadim Fedorov <coderiks@gmail.com>
+ *
+ * This program is free software: you can use, modify and/or
+ * redistribute it under the terms of the simplified BSD
+ * License. You should have received a copy of this license along
+ * this program. If not, see
+ * <http://www.opensource.org/licenses/bsd-license.html>.
+ */
+
+#include <vector>
+#include <algorithm>
+#include <cstdint>
+#include <cstring>
+#include <cstdio>
+#include <cctype>
+#include "strip_reader.h"
+#include "io_utility.h"
+
+
+StripReader::StripReader(const std::string &name)
+ : _encoding(none), _size_x(0), _size_y(0), _number_of_channels(1), _bytes_per_sample(1), _data_offset(0)
+{
+	_file.open(name.c_str(), std::ios_base::in | std::ios_base::binary);
+	if (_file.is_open()) {
+		if (read_pnm_header()) {
+			_encoding = pnm;
+		} else {
+			_file.clear();
+			_file.seekg(0);
+			if (read_npy_header()) {
+				_encoding = npy;
+			}
+		}
+	}
+
+	// Fall back to loading the whole image
+	if (_encoding == none) {
+		_file.close();
+		_image = IOUtility::read_mono_image(name);
+		if (_image) {
+			_encoding = memory;
+			_size_x = _image.size_x();
+			_size_y = _image.size_y();
+		}
+	}
+}
+
+
+bool StripReader::is_open() const
+{
+	return _encoding != none;
+}
+
+
+bool StripReader::is_streamed() const
+{
+	return _encoding == pnm || _encoding == npy;
+}
+
+
+uint StripReader::size_x() const
+{
+	return _size_x;
+}
+
+
+uint StripReader::size_y() const
+{
+	return _size_y;
+}
+
+
+Shape StripReader::size() const
+{
+	return Shape(_size_x, _size_y);
+}
+
+
+Image<float> StripReader::read(uint y_0, uint y_1)
+{
+	y_1 = std::min(y_1, _size_y);
+	if (_encoding == none || y_0 >= y_1) {
+		return Image<float>();
+	}
+
+	Image<float> strip(_size_x, y_1 - y_0);
+	strip.set_color_space(ColorSpaces::mono);
+
+	if (_encoding == memory) {
+		for (uint y = y_0; y < y_1; y++) {
+			const float *row = _image.row(y);
+			std::copy(row, row + _size_x, strip.row(y - y_0));
+		}
+
+		return strip;
+	}
+
+	// Read rows of samples one by one
+	std::size_t row_length = (std::size_t)_size_x * _number_of_channels * _bytes_per_sample;
+	std::vector<unsigned char> buffer(row_length);
+	_file.clear();
+	_file.seekg(_data_offset + (std::streamoff)y_0 * row_length);
+	for (uint y = y_0; y < y_1; y++) {
+		if (!_file.read(reinterpret_cast<char*>(buffer.data()), row_length)) {
+			return Image<float>();
+		}
+
+		float *row = strip.row(y - y_0);
+		if (_encoding == npy) {
+			std::memcpy(row, buffer.data(), _size_x * sizeof(float));
+			continue;
+		}
+
+		// NOTE: 16-bit samples of PNM files are big-endian
+		for (uint x = 0; x < _size_x; x++) {
+			const unsigned char *pixel = buffer.data() + (std::size_t)x * _number_of_channels * _bytes_per_sample;
+			float samples[3];
+			for (uint c = 0; c < _number_of_channels; c++) {
+				const unsigned char *sample = pixel + c * _bytes_per_sample;
+				samples[c] = (_bytes_per_sample == 2) ? (float)((sample[0] << 8) | sample[1]) : (float)sample[0];
+			}
+
+			row[x] = (_number_of_channels == 1) ? samples[0]
+												: .299 * samples[0] + .587 * samples[1] + .114 * samples[2];
+		}
+	}
+
+	return strip;
+}
+
+
+/* Private */
+
+/**
+ * Read the header of a binary PGM (P5) or PPM (P6) file.
+ */
+bool StripReader::read_pnm_header()
+{
+	char magic[2];
+	if (!_file.read(magic, 2) || magic[0] != 'P' || (magic[1] != '5' && magic[1] != '6')) {
+		return false;
+	}
+
+	// Read width, height and the maximum value, skipping whitespaces and comments
+	uint values[3];
+	for (int i = 0; i < 3; i++) {
+		int c = _file.get();
+		while (c == '#' || std::isspace(c)) {
+			if (c == '#') {
+				while (c != '\n' && c != EOF) {
+					c = _file.get();
+				}
+			}
+			c = _file.get();
+		}
+		_file.unget();
+		if (!(_file >> values[i]) || values[i] == 0) {
+			return false;
+		}
+	}
+
+	// Exactly one whitespace precedes the data
+	if (!std::isspace(_file.get()) || values[2] > 65535) {
+		return false;
+	}
+
+	_size_x = values[0];
+	_size_y = values[1];
+	_number_of_channels = (magic[1] == '5') ? 1 : 3;
+	_bytes_per_sample = (values[2] > 255) ? 2 : 1;
+	_data_offset = _file.tellg();
+
+	return true;
+}
+
+
+/**
+ * Read the header of an NPY file containing a 2D array of little-endian float32 values in C order.
+ */
+bool StripReader::read_npy_header()
+{
+	char preamble[10];
+	if (!_file.read(preamble, 10) || std::memcmp(preamble, "\x93NUMPY", 6) != 0 || preamble[6] != 1) {
+		return false;
+	}
+
+	uint header_length = (uint8_t)preamble[8] | ((uint8_t)preamble[9] << 8);
+	std::string header(header_length, ' ');
+	if (!_file.read(&header[0], header_length)) {
+		return false;
+	}
+
+	uint16_t endian_test = 1;
+	bool is_little_endian = *reinterpret_cast<uint8_t*>(&endian_test) == 1;
+	if (header.find("'descr': '<f4'") == std::string::npos || !is_little_endian ||
+		header.find("'fortran_order': False") == std::string::npos) {
+		return false;
+	}
+
+	// Only arrays of shape (size_y, size_x) are accepted
+	std::size_t shape = header.find("'shape': (");
+	char closing = 0;
+	if (shape == std::string::npos ||
+		std::sscanf(header.c_str() + shape, "'shape': (%u, %u%c", &_size_y, &_size_x, &closing) != 3 ||
+		closing != ')') {
+		return false;
+	}
+
+	_number_of_channels = 1;
+	_bytes_per_sample = sizeof(float);
+	_data_offset = 10 + header_length;
+
+	return true;
+}
@@ -11,21 +11,30 @@
 #include "affine_patch_distance.h"
 
 using std::vector;
+using std::pair;
 
 namespace msas
 {
 
+std::atomic<unsigned long> AffinePatchDistance::_weights_id_counter(0);
+
 AffinePatchDistance::AffinePatchDistance(int grid_size)
 : _scale(1.0f),
   _bilateral_k_color(0.0f),
   _bilateral_k_spatial(1.0f),
+  _node_tolerance(0.0f),
+  _patch_format(PatchFormats::float32),
   _use_bilateral(false),
   _grid_size(grid_size),
+  _orientation_grid_size(0),
   _reference_channel(-1),
-  _use_cache(true)
+  _use_cache(true),
+  _total_weight(0.0),
+  _weights_id(0),
+  _pruning_error(0.0)
 {
-	_grid = _normalization.create_regular_grid(_grid_size);
-	_weights.reset(calculate_weights(_grid.get(), _scale));
+	_full_grid = _normalization.create_regular_grid(_grid_size);
+	update_weights();
 }
 
 
@@ -38,7 +47,8 @@ AffinePatchDistance::~AffinePatchDistance()
 msas::DistanceInfo AffinePatchDistance::calculate(const msas::StructureTensorBundle &source_bundle,
 												  Point source_point,
 												  const msas::StructureTensorBundle &target_bundle,
-												  Point target_point)
+												  Point target_point,
+												  float bound)
 {
 	// Get normalized patches
 
@@ -65,18 +75,29 @@ msas::DistanceInfo AffinePatchDistance::calculate(const msas::StructureTensorBun
 	int source_id = -2;
 	msas::DistanceInfo min_distance;
 	if (_use_bilateral) {
-		min_distance.distance = calculate_geodesic(*normalized_source, *normalized_target, target_radius, number_of_channels, source_id, target_id);
+		// Bilateral weights depend on the target patch only, so they are computed once and cached along with it
+		if ((*normalized_target)[0].weights_id != _weights_id) {
+			calculate_bilateral_weights(*normalized_target, target_radius, number_of_channels);
+		}
+
+		min_distance.distance = calculate_geodesic(*normalized_source, *normalized_target, target_radius, number_of_channels, bound, source_id, target_id);
 	} else {
-		min_distance.distance = calculate_gaussian(*normalized_source, *normalized_target, target_radius, number_of_channels, source_id, target_id);
+		min_distance.distance = calculate_gaussian(*normalized_source, *normalized_target, target_radius, number_of_channels, bound, source_id, target_id);
 	}
 
 	// Fill min_distance
 	min_distance.first_point = source_point;
 	min_distance.second_point = target_point;
-	min_distance.first_transform = Matrix::multiply((*normalized_source)[source_id].extra_transform,
-													(*normalized_source)[source_id].base_transform);
-	min_distance.second_transform = Matrix::multiply((*normalized_target)[target_id].extra_transform,
-													 (*normalized_target)[target_id].base_transform);
+	if (source_id >= 0 && target_id >= 0) {
+		min_distance.first_transform = Matrix::multiply((*normalized_source)[source_id].extra_transform,
+														(*normalized_source)[source_id].base_transform);
+		min_distance.second_transform = Matrix::multiply((*normalized_target)[target_id].extra_transform,
+														 (*normalized_target)[target_id].base_transform);
+	} else {
+		// All the comparisons were abandoned (or none of them was possible)
+		min_distance.first_transform = Matrix::zero();
+		min_distance.second_transform = Matrix::zero();
+	}
 
 	if (!_use_cache) {
 		delete normalized_source;
@@ -110,6 +131,7 @@ void AffinePatchDistance::set_bilateral_k_color(float value)
 {
 	_bilateral_k_color = value;
 	_use_bilateral = std::abs(_bilateral_k_color) > EPS;
+	update_weights_id();
 }
 
 
@@ -126,6 +148,52 @@ void AffinePatchDistance::set_bilateral_k_spatial(float value)
 }
 
 
+float AffinePatchDistance::node_tolerance()
+{
+	return _node_tolerance;
+}
+
+
+void AffinePatchDistance::set_node_tolerance(float value)
+{
+	_node_tolerance = value;
+	update_weights();
+}
+
+
+float AffinePatchDistance::pruning_error()
+{
+	return (float)_pruning_error;
+}
+
+
+int AffinePatchDistance::orientation_grid_size() const
+{
+	return _orientation_grid_size;
+}
+
+
+void AffinePatchDistance::set_orientation_grid_size(int value)
+{
+	_orientation_grid_size = std::max(value, 0);
+	_orientation_grid = (_orientation_grid_size > 0) ?
+						_normalization.create_orientation_grid(_orientation_grid_size) :
+						std::shared_ptr<GridInfo>();
+}
+
+
+PatchFormats::PatchFormat AffinePatchDistance::patch_format() const
+{
+	return _patch_format;
+}
+
+
+void AffinePatchDistance::set_patch_format(PatchFormats::PatchFormat value)
+{
+	_patch_format = value;
+}
+
+
 std::shared_ptr<GridInfo> AffinePatchDistance::grid()
 {
 	return _grid;
@@ -150,10 +218,11 @@ void AffinePatchDistance::set_grid_size(int value)
 		_grid_size = value;
 
 		// Recompute grid
-		_grid = _normalization.create_regular_grid(_grid_size);
+		_full_grid = _normalization.create_regular_grid(_grid_size);
+		_grid.reset();
 
 		// Recompute weights
-		_weights.reset(calculate_weights(_grid.get(), _scale));
+		update_weights();
 	}
 }
 
@@ -167,6 +236,7 @@ int AffinePatchDistance::reference_channel() const
 void AffinePatchDistance::set_reference_channel(int value)
 {
 	_reference_channel = value;
+	update_weights_id();
 }
 
 
@@ -176,28 +246,111 @@ void AffinePatchDistance::set_use_cache(bool value)
 }
 
 
-void AffinePatchDistance::precompute_normalized_patches(const StructureTensorBundle &bundle)
+void AffinePatchDistance::normalize_patch(const StructureTensorBundle &bundle, Point point)
 {
-	if (!_use_cache) {
+	if (!_use_cache || !bundle.size().contains(point)) {
 		return;
 	}
 
-	#pragma omp parallel for schedule(dynamic,1) collapse(2) shared(bundle)
-	for (uint y = 0; y < bundle.size_y(); y++) {
-		for (uint x = 0; x < bundle.size_x(); x++) {
-			Point point(x, y);
-			vector<NormalizedPatch> *normalized_patch = bundle.normalized_patch(point.x, point.y);
-			normalize_patch_internal(bundle, point, *normalized_patch);
+	vector<NormalizedPatch> *normalized_patch = bundle.normalized_patch(point.x, point.y);
+	if (normalized_patch->empty()) {
+		normalize_patch_internal(bundle, point, *normalized_patch);
+	}
+
+	if (_use_bilateral && !normalized_patch->empty() && (*normalized_patch)[0].weights_id != _weights_id) {
+		calculate_bilateral_weights(*normalized_patch, bundle.radius(), bundle.image().number_of_channels());
+	}
+}
+
+
+void AffinePatchDistance::normalize_patches(const StructureTensorBundle &bundle,
+											const vector<Point> &points,
+											TaskGroup &parent)
+{
+	if (!_use_cache || points.empty()) {
+		return;
+	}
+
+	bundle.precompute_dyadics(parent);
+
+	TaskGroup group(parent);
+	group.run_range(0, points.size(), 1, [&] (int begin, int end) {
+		for (int i = begin; i < end && !group.is_cancelled(); i++) {
+			normalize_patch(bundle, points[i]);
 		}
+	});
+	group.wait();
+}
+
+
+LoadBalanceReport AffinePatchDistance::precompute_normalized_patches(const StructureTensorBundle &bundle)
+{
+	TaskGroup group;
+	return precompute_normalized_patches(bundle, group);
+}
+
+
+LoadBalanceReport AffinePatchDistance::precompute_normalized_patches(const StructureTensorBundle &bundle,
+																	 TaskGroup &parent)
+{
+	return precompute_normalized_patches(bundle, Rectangle(bundle.size()), parent);
+}
+
+
+LoadBalanceReport AffinePatchDistance::precompute_normalized_patches(const StructureTensorBundle &bundle,
+																	 const Rectangle &area)
+{
+	TaskGroup group;
+	return precompute_normalized_patches(bundle, area, group);
+}
+
+
+LoadBalanceReport AffinePatchDistance::precompute_normalized_patches(const StructureTensorBundle &bundle,
+																	 const Rectangle &area,
+																	 TaskGroup &parent)
+{
+	if (!_use_cache) {
+		return LoadBalanceReport();
 	}
+
+	// NOTE: the gradient is computed for the whole image, since regions of the area may extend beyond it,
+	// while structure tensors are computed lazily only at the points of the area
+	bundle.precompute_dyadics(parent);
+
+	// NOTE: cost of a normalization is dominated by the size of the elliptical region
+	CostModel cost_model = bundle.cost_model();
+	vector<CostBlock> blocks = cost_model.partition(area, parent.pool());
+	Traversals::Traversal traversal = bundle.structure_tensor().traversal();
+	cost_model.run(blocks, parent, [&] (int x_0, int y_0, int x_1, int y_1) {
+		vector<Point> points;
+		BlockTraversal::order(x_0, y_0, x_1, y_1, traversal, points);
+		for (auto it = points.begin(); it != points.end() && !parent.is_cancelled(); ++it) {
+			// NOTE: patches may be cached already (e.g. by overlapping areas or lazy normalization)
+			vector<NormalizedPatch> *normalized_patch = bundle.normalized_patch(it->x, it->y);
+			if (normalized_patch->empty()) {
+				normalize_patch_internal(bundle, *it, *normalized_patch);
+			}
+
+			if (_use_bilateral && !normalized_patch->empty() && (*normalized_patch)[0].weights_id != _weights_id) {
+				calculate_bilateral_weights(*normalized_patch, bundle.radius(), bundle.image().number_of_channels());
+			}
+		}
+	});
+
+	return CostModel::report(blocks);
 }
 
 /* Private */
 
 /**
  * Calculate patch distance using Gaussian weights.
+ * Grid nodes are visited in the descending order of their weights, so that the partial sum grows as fast as possible.
+ * Since the total weight of the compared nodes never exceeds '_total_weight', the partial sum normalized by it is
+ * a lower bound on the resulting distance, and a comparison is abandoned as soon as this bound exceeds either
+ * the given @param bound or the smallest distance found so far.
  * @param normalized_source Set of candidate normalizations of the source patch.
  * @param normalized_target Set of candidate normalizations of the target patch.
+ * @param bound Upper bound on the distance.
  * @param source_id [out] Id of the candidate source normalization that gives the smallest distance.
  * @param target_id [out] Id of the candidate target normalization that gives the smallest distance.
  */
@@ -205,11 +358,18 @@ float AffinePatchDistance::calculate_gaussian(const vector<NormalizedPatch> &nor
 											 const vector<NormalizedPatch> &normalized_target,
 											 float radius,
 											 int number_of_channels,
+											 float bound,
 											 int &source_id,
 											 int &target_id)
 {
-	int number_of_channels_used = (_reference_channel < 0 || _reference_channel >= number_of_channels)
-								  ? number_of_channels : 1;
+	// Use either all channels or only the reference one, if it is specified
+	int first_channel = 0;
+	int number_of_channels_used = number_of_channels;
+	if (_reference_channel >= 0 && _reference_channel < number_of_channels) {
+		first_channel = _reference_channel;
+		number_of_channels_used = 1;
+	}
+
 	double min_distance = std::numeric_limits<float>::max();
 	target_id = -2;
 	source_id = -2;
@@ -217,44 +377,14 @@ float AffinePatchDistance::calculate_gaussian(const vector<NormalizedPatch> &nor
 	// Calculate distance values for every combination of source and target normalizations
 	for (uint i = 0; i < normalized_target.size(); i++) {
 		for (uint j = 0; j < normalized_source.size(); j++) {
-			float** target_patch = normalized_target[i].patch.get();
-			float** source_patch = normalized_source[j].patch.get();
-
 			double distance = 0.0;
 			double total_weight = 0.0;
+			double abandon_threshold = std::min((double)bound, min_distance) * number_of_channels_used * _total_weight;
 
-			// Calculate distances using either all channels or only the reference one, if it is specified
-			if (_reference_channel < 0 || _reference_channel >= number_of_channels) {
-				for (int k = 0; k < _grid->nodes_length; k++) {
-					if (source_patch[0][k] < -256.0f ||
-						target_patch[0][k] < -256.0f) {    // we cannot compare points, if at least one of them is unknown
-						continue;
-					}
-
-					// Calculate color difference at k-th node
-					double color_distance = 0.0;
-					for (int ch = 0; ch < number_of_channels; ch++) {
-						color_distance += (source_patch[ch][k] - target_patch[ch][k]) *
-										  (source_patch[ch][k] - target_patch[ch][k]);
-					}
-
-					distance += _weights[k] * color_distance;
-					total_weight += _weights[k];
-				}
-			} else {
-				for (int k = 0; k < _grid->nodes_length; k++) {
-					if (source_patch[0][k] < -256.0f ||
-						target_patch[0][k] < -256.0f) {    // we cannot compare points, if at least one of them is unknown
-						continue;
-					}
-
-					// Calculate color difference at k-th node
-					double color_distance = (source_patch[_reference_channel][k] - target_patch[_reference_channel][k]) *
-											(source_patch[_reference_channel][k] - target_patch[_reference_channel][k]);
-
-					distance += _weights[k] * color_distance;
-					total_weight += _weights[k];
-				}
+			// Neither the bound, nor the current minimum can be improved by this combination
+			if (!compare_patches(normalized_source[j], normalized_target[i], _weights.get(), first_channel,
+								 number_of_channels_used, abandon_threshold, distance, total_weight)) {
+				continue;
 			}
 
 			// Normalize
@@ -279,8 +409,11 @@ float AffinePatchDistance::calculate_gaussian(const vector<NormalizedPatch> &nor
 
 /**
  * Calculate patch distance using approximated geodesic weights.
+ * Uses bilateral weights cached along with the target normalizations (@see calculate_bilateral_weights()),
+ * abandons comparisons in the same way as calculate_gaussian().
  * @param normalized_source Set of candidate normalizations of the source patch.
  * @param normalized_target Set of candidate normalizations of the target patch.
+ * @param bound Upper bound on the distance.
  * @param source_id [out] Id of the candidate source normalization that gives the smallest distance.
  * @param target_id [out] Id of the candidate target normalization that gives the smallest distance.
  */
@@ -288,86 +421,33 @@ float AffinePatchDistance::calculate_geodesic(const vector<NormalizedPatch> &nor
 											 const vector<NormalizedPatch> &normalized_target,
 											 float radius,
 											 int number_of_channels,
+											 float bound,
 											 int &source_id,
 											 int &target_id)
 {
-	float **target_patch = normalized_target[0].patch.get();
-	float **source_patch = normalized_source[0].patch.get();
-
-	// Compute color component for bilateral weights (geodesic weights approximation)
-	std::unique_ptr<float[]> central_color;
-	if (_reference_channel < 0 || _reference_channel >= number_of_channels) {
-		central_color.reset(new float[number_of_channels]);
-		for (int ch = 0; ch < number_of_channels; ch++) {
-			central_color[ch] = target_patch[ch][_grid->nodes_length / 2];
-		}
-	} else {
-		central_color.reset(new float[1]);
-		central_color[0] = target_patch[_reference_channel][_grid->nodes_length / 2];
+	// Use either all channels or only the reference one, if it is specified
+	int first_channel = 0;
+	int number_of_channels_used = number_of_channels;
+	if (_reference_channel >= 0 && _reference_channel < number_of_channels) {
+		first_channel = _reference_channel;
+		number_of_channels_used = 1;
 	}
-	float color_k = _bilateral_k_color / (2.0f * (radius / _scale) * (radius / _scale));
 
-	int number_of_channels_used = (_reference_channel < 0 || _reference_channel >= number_of_channels)
-								  ? number_of_channels : 1;
 	double min_distance = std::numeric_limits<float>::max();
 	target_id = -2;
 	source_id = -2;
 
 	for (uint i = 0; i < normalized_target.size(); i++) {
 		for (uint j = 0; j < normalized_source.size(); j++) {
-			target_patch = normalized_target[i].patch.get();
-			source_patch = normalized_source[j].patch.get();
-
 			double distance = 0.0;
 			double total_weight = 0.0;
+			double abandon_threshold = std::min((double)bound, min_distance) * number_of_channels_used *
+									   normalized_target[i].total_weight;
 
-			// Calculate distances using either all channels or only the reference one, if it is specified
-			if (_reference_channel < 0 || _reference_channel >= number_of_channels) {
-				for (int k = 0; k < _grid->nodes_length; k++) {
-					if (source_patch[0][k] < -256.0f ||
-						target_patch[0][k] <
-						-256.0f) {    // we cannot compare points, if at least one of them is unknown
-						continue;
-					}
-
-					// Calculate color difference at k-th node
-					double color_distance = 0.0;
-					for (int ch = 0; ch < number_of_channels; ch++) {
-						color_distance += (source_patch[ch][k] - target_patch[ch][k]) *
-										  (source_patch[ch][k] - target_patch[ch][k]);
-					}
-
-					// Calculate color weight
-					double central_distance = 0.0;
-					for (int ch = 0; ch < number_of_channels; ch++) {
-						central_distance += (central_color[ch] - target_patch[ch][k]) *
-											(central_color[ch] - target_patch[ch][k]);
-					}
-					double color_weight = LUT::exp_rcn(-color_k * central_distance);
-
-					distance += color_weight * _weights[k] * color_distance;
-					total_weight += color_weight * _weights[k];
-				}
-			} else {
-				for (int k = 0; k < _grid->nodes_length; k++) {
-					if (source_patch[0][k] < -256.0f ||
-						target_patch[0][k] <
-						-256.0f) {    // we cannot compare points, if at least one of them is unknown
-						continue;
-					}
-
-					// Calculate color difference at k-th node
-					double color_distance = (source_patch[_reference_channel][k] - target_patch[_reference_channel][k]) *
-											(source_patch[_reference_channel][k] - target_patch[_reference_channel][k]);
-
-					// Calculate color weight
-					double central_distance = (central_color[0] - target_patch[_reference_channel][k]) *
-											  (central_color[0] - target_patch[_reference_channel][k]);
-					double color_weight = LUT::exp_rcn(-color_k * central_distance);
-
-					distance += color_weight * _weights[k] * color_distance;
-					total_weight += color_weight * _weights[k];
-				}
+			// Neither the bound, nor the current minimum can be improved by this combination
+			if (!compare_patches(normalized_source[j], normalized_target[i], normalized_target[i].weights.get(),
+								 first_channel, number_of_channels_used, abandon_threshold, distance, total_weight)) {
+				continue;
 			}
 
 			// Normalize
@@ -390,10 +470,348 @@ float AffinePatchDistance::calculate_geodesic(const vector<NormalizedPatch> &nor
 }
 
 
+/**
+ * Compare two normalizations, using a kernel specialized for their storage format.
+ * @return False, if the comparison was abandoned.
+ */
+bool AffinePatchDistance::compare_patches(const NormalizedPatch &source,
+										  const NormalizedPatch &target,
+										  const float *weights,
+										  int first_channel,
+										  int number_of_channels_used,
+										  double abandon_threshold,
+										  double &distance,
+										  double &total_weight)
+{
+	if (source.format == target.format) {
+		switch (source.format) {
+			case PatchFormats::float32:
+				return accumulate_distance(Float32PatchView(source), Float32PatchView(target), weights, first_channel,
+										   number_of_channels_used, abandon_threshold, distance, total_weight);
+			case PatchFormats::uint8:
+				return accumulate_distance(Uint8PatchView(source), Uint8PatchView(target), weights, first_channel,
+										   number_of_channels_used, abandon_threshold, distance, total_weight);
+			case PatchFormats::float16:
+				return accumulate_distance(Float16PatchView(source), Float16PatchView(target), weights, first_channel,
+										   number_of_channels_used, abandon_threshold, distance, total_weight);
+		}
+	}
+
+	// Patches cached in different formats (e.g. by differently configured calculators)
+	return accumulate_distance(source, target, weights, first_channel, number_of_channels_used,
+							   abandon_threshold, distance, total_weight);
+}
+
+
+/**
+ * Accumulate weighted squared color differences over the grid nodes visited in the descending order of weights.
+ * @tparam Patch Accessor of a normalized patch (@see Float32PatchView).
+ * @return False, if the comparison was abandoned, i.e. the weighted sum exceeded @param abandon_threshold.
+ */
+template <class Patch>
+inline bool AffinePatchDistance::accumulate_distance(const Patch &source,
+													 const Patch &target,
+													 const float *weights,
+													 int first_channel,
+													 int number_of_channels_used,
+													 double abandon_threshold,
+													 double &distance,
+													 double &total_weight)
+{
+	for (int n = 0; n < _grid->nodes_length; n++) {
+		int k = _nodes_order[n];
+		if (!source.is_known(k) || !target.is_known(k)) {    // we cannot compare points, if at least one of them is unknown
+			continue;
+		}
+
+		// Calculate color difference at k-th node
+		double color_distance = 0.0;
+		for (int ch = first_channel; ch < first_channel + number_of_channels_used; ch++) {
+			float difference = source.value(ch, k) - target.value(ch, k);
+			color_distance += difference * difference;
+		}
+
+		distance += weights[k] * color_distance;
+		total_weight += weights[k];
+
+		if (distance > abandon_threshold) {
+			return false;
+		}
+	}
+
+	return true;
+}
+
+
+/**
+ * Accumulate the distance between patches packed in 8-bit codes, a block of consecutive nodes at a time.
+ * Patches quantized with the same scale are compared exactly in integers: the difference of values is
+ * scale * (c_s - c_t) + d, so sums of (c_s - c_t)^2 and of (c_s - c_t) over channels are accumulated
+ * in int32 arrays. Otherwise codes are decoded and compared in floats. Both loops run over contiguous codes.
+ * Blocks are visited in the descending order of their weights (@see update_weights()).
+ * @note Abandoning is checked once per block, which gives the same decision, since the sum only grows.
+ */
+bool AffinePatchDistance::accumulate_distance(const Uint8PatchView &source,
+											  const Uint8PatchView &target,
+											  const float *weights,
+											  int first_channel,
+											  int number_of_channels_used,
+											  double abandon_threshold,
+											  double &distance,
+											  double &total_weight)
+{
+	bool is_same_scale = source.scale == target.scale;
+	float scale = source.scale;
+	float offset = source.offset - target.offset;
+	float squared_offset = number_of_channels_used * offset * offset;
+
+	int32_t squares[NODES_BLOCK];
+	int32_t sums[NODES_BLOCK];
+	float color_distances[NODES_BLOCK];
+
+	int nodes_length = _grid->nodes_length;
+	int number_of_blocks = (nodes_length + NODES_BLOCK - 1) / NODES_BLOCK;
+	for (int b = 0; b < number_of_blocks; b++) {
+		int k_0 = _blocks_order[b] * NODES_BLOCK;
+		int block_length = std::min(NODES_BLOCK, nodes_length - k_0);
+
+		if (is_same_scale) {
+			std::fill(squares, squares + NODES_BLOCK, 0);
+			std::fill(sums, sums + NODES_BLOCK, 0);
+			for (int ch = first_channel; ch < first_channel + number_of_channels_used; ch++) {
+				const uint8_t *codes_s = source.data + ch * source.length + k_0;
+				const uint8_t *codes_t = target.data + ch * target.length + k_0;
+
+				#pragma omp simd
+				for (int n = 0; n < block_length; n++) {
+					int32_t difference = (int32_t)codes_s[n] - (int32_t)codes_t[n];
+					squares[n] += difference * difference;
+					sums[n] += difference;
+				}
+			}
+
+			#pragma omp simd
+			for (int n = 0; n < block_length; n++) {
+				color_distances[n] = scale * scale * squares[n] + 2.0f * scale * offset * sums[n] + squared_offset;
+			}
+		} else {
+			std::fill(color_distances, color_distances + NODES_BLOCK, 0.0f);
+			for (int ch = first_channel; ch < first_channel + number_of_channels_used; ch++) {
+				const uint8_t *codes_s = source.data + ch * source.length + k_0;
+				const uint8_t *codes_t = target.data + ch * target.length + k_0;
+
+				#pragma omp simd
+				for (int n = 0; n < block_length; n++) {
+					float difference = (codes_s[n] * source.scale + source.offset) -
+									   (codes_t[n] * target.scale + target.offset);
+					color_distances[n] += difference * difference;
+				}
+			}
+		}
+
+		// Nodes unknown in either of the patches are skipped
+		const uint8_t *known_s = source.data + k_0;
+		const uint8_t *known_t = target.data + k_0;
+		const float *block_weights = weights + k_0;
+		double block_distance = 0.0;
+		double block_weight = 0.0;
+		#pragma omp simd reduction(+:block_distance, block_weight)
+		for (int n = 0; n < block_length; n++) {
+			bool is_known = known_s[n] != UINT8_NO_VALUE && known_t[n] != UINT8_NO_VALUE;
+			block_distance += is_known ? block_weights[n] * (double)color_distances[n] : 0.0;
+			block_weight += is_known ? block_weights[n] : 0.0;
+		}
+
+		distance += block_distance;
+		total_weight += block_weight;
+		if (distance > abandon_threshold) {
+			return false;
+		}
+	}
+
+	return true;
+}
+
+
+/**
+ * Accumulate the distance between patches packed in half precision, a block of consecutive nodes at a time.
+ * Values of a block are converted at once (@see halves_to_floats()) and compared by a vectorized loop.
+ * Blocks are visited in the descending order of their weights (@see update_weights()).
+ * @note Abandoning is checked once per block, which gives the same decision, since the sum only grows.
+ */
+bool AffinePatchDistance::accumulate_distance(const Float16PatchView &source,
+											  const Float16PatchView &target,
+											  const float *weights,
+											  int first_channel,
+											  int number_of_channels_used,
+											  double abandon_threshold,
+											  double &distance,
+											  double &total_weight)
+{
+	float values_s[NODES_BLOCK];
+	float values_t[NODES_BLOCK];
+	float color_distances[NODES_BLOCK];
+
+	int nodes_length = _grid->nodes_length;
+	int number_of_blocks = (nodes_length + NODES_BLOCK - 1) / NODES_BLOCK;
+	for (int b = 0; b < number_of_blocks; b++) {
+		int k_0 = _blocks_order[b] * NODES_BLOCK;
+		int block_length = std::min(NODES_BLOCK, nodes_length - k_0);
+
+		std::fill(color_distances, color_distances + NODES_BLOCK, 0.0f);
+		for (int ch = first_channel; ch < first_channel + number_of_channels_used; ch++) {
+			halves_to_floats(source.data + ch * source.length + k_0, block_length, values_s);
+			halves_to_floats(target.data + ch * target.length + k_0, block_length, values_t);
+
+			#pragma omp simd
+			for (int n = 0; n < block_length; n++) {
+				float difference = values_s[n] - values_t[n];
+				color_distances[n] += difference * difference;
+			}
+		}
+
+		// Nodes unknown in either of the patches are skipped (their values are meaningless, NaNs with F16C)
+		const uint16_t *known_s = source.data + k_0;
+		const uint16_t *known_t = target.data + k_0;
+		const float *block_weights = weights + k_0;
+		double block_distance = 0.0;
+		double block_weight = 0.0;
+		#pragma omp simd reduction(+:block_distance, block_weight)
+		for (int n = 0; n < block_length; n++) {
+			bool is_known = known_s[n] != FLOAT16_NO_VALUE && known_t[n] != FLOAT16_NO_VALUE;
+			block_distance += is_known ? block_weights[n] * (double)color_distances[n] : 0.0;
+			block_weight += is_known ? block_weights[n] : 0.0;
+		}
+
+		distance += block_distance;
+		total_weight += block_weight;
+		if (distance > abandon_threshold) {
+			return false;
+		}
+	}
+
+	return true;
+}
+
+
 void AffinePatchDistance::update_weights()
 {
+	// Prune the grid, keep the current one if the set of nodes has not changed
+	if (_node_tolerance > 0.0f) {
+		std::unique_ptr<float[]> full_weights(calculate_weights(_full_grid.get(), _scale));
+		std::shared_ptr<GridInfo> pruned_grid = prune_grid(*_full_grid, full_weights.get(), _node_tolerance, _pruning_error);
+		if (!_grid || _grid->nodes_length != pruned_grid->nodes_length) {
+			_grid = pruned_grid;
+		}
+	} else {
+		_grid = _full_grid;
+		_pruning_error = 0.0;
+	}
+
 	// Recompute weights
 	_weights.reset(calculate_weights(_grid.get(), _scale));
+
+	// Sort grid nodes by their weights in descending order and compute the total weight
+	vector<pair<float, int> > weighted_nodes(_grid->nodes_length);
+	_total_weight = 0.0;
+	for (int i = 0; i < _grid->nodes_length; i++) {
+		weighted_nodes[i] = pair<float, int>(_weights[i], i);
+		_total_weight += _weights[i];
+	}
+
+	std::stable_sort(weighted_nodes.begin(), weighted_nodes.end(),
+					 [](const pair<float, int> &left, const pair<float, int> &right) { return left.first > right.first; });
+
+	_nodes_order.reset(new int[_grid->nodes_length]);
+	for (int i = 0; i < _grid->nodes_length; i++) {
+		_nodes_order[i] = weighted_nodes[i].second;
+	}
+
+	// Sort blocks of consecutive nodes by their total weights in the same way (for the kernels of packed patches)
+	int number_of_blocks = (_grid->nodes_length + NODES_BLOCK - 1) / NODES_BLOCK;
+	vector<pair<float, int> > weighted_blocks(number_of_blocks, pair<float, int>(0.0f, 0));
+	for (int i = 0; i < _grid->nodes_length; i++) {
+		weighted_blocks[i / NODES_BLOCK].first += _weights[i];
+		weighted_blocks[i / NODES_BLOCK].second = i / NODES_BLOCK;
+	}
+
+	std::stable_sort(weighted_blocks.begin(), weighted_blocks.end(),
+					 [](const pair<float, int> &left, const pair<float, int> &right) { return left.first > right.first; });
+
+	_blocks_order.reset(new int[number_of_blocks]);
+	for (int i = 0; i < number_of_blocks; i++) {
+		_blocks_order[i] = weighted_blocks[i].second;
+	}
+
+	update_weights_id();
+}
+
+
+/**
+ * Invalidate per-patch weights computed with the previous parameters.
+ * @note Ids are unique among all the instances, so that bundles can be shared between them.
+ */
+void AffinePatchDistance::update_weights_id()
+{
+	_weights_id = ++_weights_id_counter;
+}
+
+
+/**
+ * Compute bilateral weights (geodesic weights approximation) for every normalization of a patch
+ * and combine them with the spatial weights.
+ * @note Color component of the weights depends on the color at the center of the patch, so it is taken
+ * 		 from the first normalization.
+ */
+void AffinePatchDistance::calculate_bilateral_weights(vector<NormalizedPatch> &normalized_patch,
+													  float radius,
+													  int number_of_channels)
+{
+	if (normalized_patch.empty()) {
+		return;
+	}
+
+	// Compute color component for bilateral weights (geodesic weights approximation)
+	const NormalizedPatch &central_patch = normalized_patch[0];
+	int first_channel = 0;
+	int number_of_channels_used = number_of_channels;
+	if (_reference_channel >= 0 && _reference_channel < number_of_channels) {
+		first_channel = _reference_channel;
+		number_of_channels_used = 1;
+	}
+
+	std::unique_ptr<float[]> central_color(new float[number_of_channels_used]);
+	for (int ch = 0; ch < number_of_channels_used; ch++) {
+		central_color[ch] = central_patch.value(first_channel + ch, _grid->nodes_length / 2);
+	}
+	float color_k = _bilateral_k_color / (2.0f * (radius / _scale) * (radius / _scale));
+
+	for (auto it = normalized_patch.begin(); it != normalized_patch.end(); ++it) {
+		float *weights = new float[_grid->nodes_length];
+		double total_weight = 0.0;
+
+		for (int k = 0; k < _grid->nodes_length; k++) {
+			if (!it->is_known(k)) {	// unknown points are never compared
+				weights[k] = 0.0f;
+				continue;
+			}
+
+			// Calculate color weight
+			double central_distance = 0.0;
+			for (int ch = 0; ch < number_of_channels_used; ch++) {
+				float difference = central_color[ch] - it->value(first_channel + ch, k);
+				central_distance += difference * difference;
+			}
+			double color_weight = LUT::exp_rcn(-color_k * central_distance);
+
+			weights[k] = (float)(color_weight * _weights[k]);
+			total_weight += weights[k];
+		}
+
+		it->weights = std::shared_ptr<float>(weights, std::default_delete<float[]>());
+		it->total_weight = total_weight;
+		it->weights_id = _weights_id;
+	}
 }
 
 
@@ -417,29 +835,135 @@ float* AffinePatchDistance::calculate_weights(const GridInfo *grid, float sigma_
 }
 
 
+/**
+ * Drop the nodes with the smallest weights, as long as their cumulative weight does not exceed
+ * the @param tolerance fraction of the total weight.
+ * @note Nodes with (almost) equal weights are either all dropped or all kept, so that the pruned grid stays
+ * 		 symmetric and its central node is still in the middle of the nodes array.
+ * @param pruning_error [out] Fraction of the total weight of the dropped nodes.
+ */
+std::shared_ptr<GridInfo> AffinePatchDistance::prune_grid(const GridInfo &grid,
+														   const float *weights,
+														   float tolerance,
+														   double &pruning_error)
+{
+	vector<float> sorted_weights(weights, weights + grid.nodes_length);
+	std::sort(sorted_weights.begin(), sorted_weights.end());
+
+	double total_weight = 0.0;
+	for (size_t i = 0; i < grid.nodes_length; i++) {
+		total_weight += sorted_weights[i];
+	}
+
+	// Find the largest weight to be dropped
+	double max_discarded_weight = std::min(tolerance, 1.0f) * total_weight;
+	double discarded_weight = 0.0;
+	float cut_off = -1.0f;
+	size_t i = 0;
+	while (i < grid.nodes_length) {
+		double group_weight = 0.0;
+		size_t j = i;
+		while (j < grid.nodes_length && sorted_weights[j] <= sorted_weights[i] * (1.0f + EPS)) {
+			group_weight += sorted_weights[j];
+			j++;
+		}
+
+		if (j == grid.nodes_length || discarded_weight + group_weight > max_discarded_weight) {
+			break;
+		}
+
+		discarded_weight += group_weight;
+		cut_off = sorted_weights[j - 1];
+		i = j;
+	}
+	pruning_error = (total_weight > 0.0) ? discarded_weight / total_weight : 0.0;
+
+	// Copy the remaining nodes preserving their order
+	std::shared_ptr<GridInfo> pruned_grid = std::make_shared<GridInfo>();
+	pruned_grid->step = grid.step;
+	pruned_grid->size = grid.size;
+	pruned_grid->nodes.reset(new GridCoord[grid.nodes_length]);
+	pruned_grid->index.reset(new int[grid.index_length]);
+	pruned_grid->index_length = grid.index_length;
+	std::fill(pruned_grid->index.get(), pruned_grid->index.get() + grid.index_length, -1);
+
+	size_t length = 0;
+	for (size_t k = 0; k < grid.nodes_length; k++) {
+		if (weights[k] <= cut_off) {
+			continue;
+		}
+
+		const GridCoord &node = grid.nodes[k];
+		pruned_grid->nodes[length] = node;
+		pruned_grid->index[node.index_y * grid.size + node.index_x] = length;
+		length++;
+	}
+	pruned_grid->nodes_length = length;
+
+	return pruned_grid;
+}
+
+
 inline void AffinePatchDistance::normalize_patch_internal(const StructureTensorBundle &bundle,
 														  Point point,
 														  std::vector<NormalizedPatch> &normalized_patch)
 {
 	// Compute dominant orientations
+	// NOTE: the area of the elliptical region is pi / det, since the transformation maps it to a unit disc
+	NormalizationWorkspace &scratch = EllipseNormalization::workspace();
 	Matrix2f transformation = bundle.transform(point);
-	vector<Point> region = bundle.region(point);
-	vector<float> dominant_orientations = _normalization.calculate_dominant_orientations(bundle.gradient_x(),
-																						 bundle.gradient_y(),
-																						 region,
-																						 transformation,
-																						 point);
+	float det = std::abs(transformation[0] * transformation[3] - transformation[1] * transformation[2]);
+	vector<float> &dominant_orientations = scratch.orientations;
+	size_t capacity = dominant_orientations.capacity() + scratch.region.capacity();
+	if (_orientation_grid && (float)M_PI > det * _orientation_grid->nodes_length) {	// region is larger than the grid
+		_normalization.calculate_dominant_orientations(bundle.gradient_x(),
+													   bundle.gradient_y(),
+													   *_orientation_grid,
+													   transformation,
+													   point,
+													   dominant_orientations);
+	} else {
+		bundle.region(point, scratch.region);
+		_normalization.calculate_dominant_orientations(bundle.gradient_x(),
+													   bundle.gradient_y(),
+													   scratch.region,
+													   transformation,
+													   point,
+													   dominant_orientations);
+	}
+
+	if (dominant_orientations.capacity() + scratch.region.capacity() != capacity) {
+		scratch.allocations++;
+	}
 
 	// For every dominant orientation compute its corresponding patch normalization
-	for (auto it = dominant_orientations.begin(); it != dominant_orientations.end(); ++it) {
-		Matrix2f rotation = _normalization.rotation(*it);
-		std::shared_ptr<float*> normalization = _normalization.interpolate_to_grid(*_grid,
-																				   bundle.image(),
-																				   bundle.mask(),
-																				   Matrix::multiply(rotation,
-																									transformation),
-																				   point);
-		normalized_patch.push_back(NormalizedPatch(normalization, transformation, rotation));
+	size_t number_of_normalizations = dominant_orientations.size();
+	Matrix2f *rotations = scratch.reserve(scratch.rotations, number_of_normalizations);
+	Matrix2f *transforms = scratch.reserve(scratch.transforms, number_of_normalizations);
+	Point *centers = scratch.reserve(scratch.centers, number_of_normalizations);
+	for (size_t i = 0; i < number_of_normalizations; i++) {
+		rotations[i] = _normalization.rotation(dominant_orientations[i]);
+		transforms[i] = Matrix::multiply(rotations[i], transformation);
+		centers[i] = point;
+	}
+
+	// Interpolate all the normalizations into a single block of memory shared by them
+	uint number_of_channels = bundle.image().number_of_channels();
+	size_t nodes_length = _grid->nodes_length;
+	std::shared_ptr<float> values(new float[number_of_normalizations * number_of_channels * nodes_length],
+								  std::default_delete<float[]>());
+	_normalization.interpolate_to_grid(*_grid, bundle.image(), bundle.interpolation_mask(),
+									   scratch.transforms, scratch.centers, values.get());
+
+	for (size_t i = 0; i < number_of_normalizations; i++) {
+		float **channels = new float*[number_of_channels];
+		for (int ch = 0; ch < number_of_channels; ch++) {
+			channels[ch] = values.get() + (i * number_of_channels + ch) * nodes_length;
+		}
+		std::shared_ptr<float*> normalization(channels, [values](float **p) { delete[] p; });
+
+		normalized_patch.push_back(NormalizedPatch(normalization, transformation, rotations[i]));
+		_normalization.pack(normalized_patch.back(), _patch_format, nodes_length, number_of_channels);
 	}
 }
 
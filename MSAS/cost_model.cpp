@@ -0,0 +1,324 @@
+/**
+ * Copyright (C) 2016, Vadim Fedorov <coderiks@gmail.com>
+ *
+ * This program is free software: you can use, modify and/or
+ * redistribute it under the terms of the simplified BSD
+ * License. You should have received a copy of this license along
+ * this program. If not, see
+ * <http://www.opensource.org/licenses/bsd-license.html>.
+ */
+
+#include <cmath>
+#include <chrono>
+#include <algorithm>
+#include "cost_model.h"
+
+using std::vector;
+
+namespace msas
+{
+
+CostModel::CostModel(const ImageFx<float> &dyadics, float radius, float max_size_limit)
+: _size(dyadics.size())
+{
+	// Compute integral image of the gradient energy (trace of dyadic products)
+	int size_x = _size.size_x;
+	int size_y = _size.size_y;
+	vector<double> integral_energy((size_x + 1) * (size_y + 1), 0.0);
+	for (int y = 0; y < size_y; y++) {
+		const float *dyadics_data = dyadics.row(y);
+		double row_sum = 0.0;
+		for (int x = 0; x < size_x; x++) {
+			row_sum += dyadics_data[3 * x] + dyadics_data[3 * x + 2];
+			integral_energy[(y + 1) * (size_x + 1) + x + 1] = integral_energy[y * (size_x + 1) + x + 1] + row_sum;
+		}
+	}
+
+	initialize(integral_energy, radius, max_size_limit);
+}
+
+
+CostModel::CostModel(const ImageFx<float> &grad_x, const ImageFx<float> &grad_y, float radius, float max_size_limit)
+: _size(grad_x.size())
+{
+	// Compute integral image of the gradient energy
+	int size_x = _size.size_x;
+	int size_y = _size.size_y;
+	vector<double> integral_energy((size_x + 1) * (size_y + 1), 0.0);
+	for (int y = 0; y < size_y; y++) {
+		const float *grad_x_data = grad_x.row(y);
+		const float *grad_y_data = grad_y.row(y);
+		double row_sum = 0.0;
+		for (int x = 0; x < size_x; x++) {
+			row_sum += grad_x_data[x] * grad_x_data[x] + grad_y_data[x] * grad_y_data[x];
+			integral_energy[(y + 1) * (size_x + 1) + x + 1] = integral_energy[y * (size_x + 1) + x + 1] + row_sum;
+		}
+	}
+
+	initialize(integral_energy, radius, max_size_limit);
+}
+
+
+double CostModel::predict(int x_0, int y_0, int x_1, int y_1) const
+{
+	// NOTE: cells, which are partially covered by the rectangle, are accounted proportionally to the overlap
+	double cost = 0.0;
+	for (int cy = y_0 / CELL_SIZE; cy * CELL_SIZE < y_1; cy++) {
+		int cell_y_0 = cy * CELL_SIZE;
+		int cell_y_1 = std::min(cell_y_0 + CELL_SIZE, (int)_size.size_y);
+		int overlap_y = std::min(cell_y_1, y_1) - std::max(cell_y_0, y_0);
+		for (int cx = x_0 / CELL_SIZE; cx * CELL_SIZE < x_1; cx++) {
+			int cell_x_0 = cx * CELL_SIZE;
+			int cell_x_1 = std::min(cell_x_0 + CELL_SIZE, (int)_size.size_x);
+			int overlap_x = std::min(cell_x_1, x_1) - std::max(cell_x_0, x_0);
+			double fraction = (double)(overlap_x * overlap_y) / ((cell_x_1 - cell_x_0) * (cell_y_1 - cell_y_0));
+			cost += fraction * cell_cost(cx, cy, cx + 1, cy + 1);
+		}
+	}
+
+	return cost;
+}
+
+
+vector<CostBlock> CostModel::partition(int number_of_blocks) const
+{
+	return partition(Rectangle(_size), number_of_blocks);
+}
+
+
+vector<CostBlock> CostModel::partition(const ThreadPool &pool) const
+{
+	return partition(pool.concurrency() * BLOCKS_PER_THREAD);
+}
+
+
+vector<CostBlock> CostModel::partition(const Rectangle &area, int number_of_blocks) const
+{
+	vector<CostBlock> blocks;
+	Rectangle domain(_size);
+	Rectangle clipped_area = area.intersection(domain);
+	if (clipped_area.is_empty()) {
+		return blocks;
+	}
+
+	// NOTE: cells overlapping the area are split, then the blocks are clipped by the area
+	blocks.reserve(std::max(number_of_blocks, 1));
+	bisect(clipped_area.x_0 / CELL_SIZE, clipped_area.y_0 / CELL_SIZE,
+		   (clipped_area.x_1 + CELL_SIZE - 1) / CELL_SIZE, (clipped_area.y_1 + CELL_SIZE - 1) / CELL_SIZE,
+		   std::max(number_of_blocks, 1), blocks);
+	if (clipped_area != domain) {
+		for (auto it = blocks.begin(); it != blocks.end(); ++it) {
+			Rectangle block = Rectangle(it->x_0, it->y_0, it->x_1, it->y_1).intersection(clipped_area);
+			it->x_0 = block.x_0;
+			it->y_0 = block.y_0;
+			it->x_1 = block.x_1;
+			it->y_1 = block.y_1;
+			it->predicted_cost = predict(block.x_0, block.y_0, block.x_1, block.y_1);
+		}
+	}
+
+	return blocks;
+}
+
+
+vector<CostBlock> CostModel::partition(const Rectangle &area, const ThreadPool &pool) const
+{
+	return partition(area, pool.concurrency() * BLOCKS_PER_THREAD);
+}
+
+
+void CostModel::run(vector<CostBlock> &blocks,
+					TaskGroup &parent,
+					const std::function<void(int, int, int, int)> &body) const
+{
+	TaskGroup group(parent);
+	group.run_range(0, blocks.size(), 1, [&] (int begin, int end) {
+		for (int i = begin; i < end; i++) {
+			CostBlock &block = blocks[i];
+			auto time_start = std::chrono::steady_clock::now();
+			body(block.x_0, block.y_0, block.x_1, block.y_1);
+			std::chrono::duration<double> elapsed_seconds = std::chrono::steady_clock::now() - time_start;
+			block.actual_cost = elapsed_seconds.count();
+		}
+	}, [&] (int begin, int end) {
+		double cost = 0.0;
+		for (int i = begin; i < end; i++) {
+			cost += blocks[i].predicted_cost;
+		}
+		return (float)cost;
+	});
+	group.wait();
+}
+
+
+LoadBalanceReport CostModel::run(const std::function<void(int, int, int, int)> &body) const
+{
+	return run(Rectangle(_size), body);
+}
+
+
+LoadBalanceReport CostModel::run(const Rectangle &area, const std::function<void(int, int, int, int)> &body) const
+{
+	TaskGroup group;
+	vector<CostBlock> blocks = partition(area, group.pool());
+	run(blocks, group, body);
+
+	return report(blocks);
+}
+
+
+LoadBalanceReport CostModel::report(const vector<CostBlock> &blocks)
+{
+	LoadBalanceReport report;
+	report.number_of_blocks = blocks.size();
+	if (blocks.empty()) {
+		return report;
+	}
+
+	double max_predicted = 0.0;
+	double max_actual = 0.0;
+	for (auto it = blocks.begin(); it != blocks.end(); ++it) {
+		report.predicted_cost += it->predicted_cost;
+		report.actual_cost += it->actual_cost;
+		max_predicted = std::max(max_predicted, it->predicted_cost);
+		max_actual = std::max(max_actual, it->actual_cost);
+	}
+
+	double mean_predicted = report.predicted_cost / blocks.size();
+	double mean_actual = report.actual_cost / blocks.size();
+	report.predicted_imbalance = (mean_predicted > 0.0) ? max_predicted / mean_predicted : 0.0;
+	report.actual_imbalance = (mean_actual > 0.0) ? max_actual / mean_actual : 0.0;
+
+	double covariance = 0.0, variance_predicted = 0.0, variance_actual = 0.0;
+	for (auto it = blocks.begin(); it != blocks.end(); ++it) {
+		double predicted = it->predicted_cost - mean_predicted;
+		double actual = it->actual_cost - mean_actual;
+		covariance += predicted * actual;
+		variance_predicted += predicted * predicted;
+		variance_actual += actual * actual;
+	}
+	if (variance_predicted > 0.0 && variance_actual > 0.0) {
+		report.correlation = covariance / std::sqrt(variance_predicted * variance_actual);
+	}
+
+	return report;
+}
+
+/* Private */
+
+/**
+ * Predict costs of the cells and compute their summed area table.
+ */
+void CostModel::initialize(const vector<double> &integral_energy, float radius, float max_size_limit)
+{
+	int size_x = _size.size_x;
+	int size_y = _size.size_y;
+	_cells_x = (size_x + CELL_SIZE - 1) / CELL_SIZE;
+	_cells_y = (size_y + CELL_SIZE - 1) / CELL_SIZE;
+	_integral_cost = vector<double>((_cells_x + 1) * (_cells_y + 1), 0.0);
+
+	// NOTE: the regularization term maintaining max_size_limit acts as an additional energy
+	double beta = (max_size_limit >= 1.0f) ? radius * radius / (max_size_limit * max_size_limit) : 0.0;
+	double disk_area = M_PI * radius * radius;
+	double max_area = (double)size_x * size_y;
+	int max_half_size = std::max(size_x, size_y);
+
+	for (int cy = 0; cy < _cells_y; cy++) {
+		double row_sum = 0.0;
+		for (int cx = 0; cx < _cells_x; cx++) {
+			int x_0 = cx * CELL_SIZE;
+			int y_0 = cy * CELL_SIZE;
+			int x_1 = std::min(x_0 + CELL_SIZE, size_x);
+			int y_1 = std::min(y_0 + CELL_SIZE, size_y);
+			int x = (x_0 + x_1) / 2;
+			int y = (y_0 + y_1) / 2;
+
+			// Grow the square around the center of the cell until it is as large as the predicted region
+			double area = max_area;
+			for (int half_size = 1; half_size <= 2 * max_half_size; half_size *= 2) {
+				int wx_0 = std::max(x - half_size, 0);
+				int wy_0 = std::max(y - half_size, 0);
+				int wx_1 = std::min(x + half_size + 1, size_x);
+				int wy_1 = std::min(y + half_size + 1, size_y);
+				double energy = integral_energy[wy_1 * (size_x + 1) + wx_1] - integral_energy[wy_0 * (size_x + 1) + wx_1] -
+								integral_energy[wy_1 * (size_x + 1) + wx_0] + integral_energy[wy_0 * (size_x + 1) + wx_0];
+				energy = 0.5 * energy / ((wx_1 - wx_0) * (wy_1 - wy_0)) + beta;
+
+				double side = 2.0 * half_size + 1.0;
+				if (energy > 0.0 && disk_area <= energy * side * side) {
+					area = disk_area / energy;
+					break;
+				}
+			}
+
+			row_sum += (x_1 - x_0) * (y_1 - y_0) * (POINT_OVERHEAD + std::pow(std::min(area, max_area), AREA_EXPONENT));
+			_integral_cost[(cy + 1) * (_cells_x + 1) + cx + 1] = _integral_cost[cy * (_cells_x + 1) + cx + 1] + row_sum;
+		}
+	}
+}
+
+
+/**
+ * Recursively split a rectangle of cells along its longer side, so that the parts get the costs
+ * proportional to the number of blocks they are further split into.
+ */
+void CostModel::bisect(int x_0, int y_0, int x_1, int y_1, int number_of_blocks, vector<CostBlock> &blocks) const
+{
+	int length_x = x_1 - x_0;
+	int length_y = y_1 - y_0;
+	if (number_of_blocks <= 1 || (length_x == 1 && length_y == 1)) {
+		CostBlock block;
+		block.x_0 = x_0 * CELL_SIZE;
+		block.y_0 = y_0 * CELL_SIZE;
+		block.x_1 = std::min(x_1 * CELL_SIZE, (int)_size.size_x);
+		block.y_1 = std::min(y_1 * CELL_SIZE, (int)_size.size_y);
+		block.predicted_cost = cell_cost(x_0, y_0, x_1, y_1);
+		block.actual_cost = 0.0;
+		blocks.push_back(block);
+		return;
+	}
+
+	int first_number_of_blocks = number_of_blocks / 2;
+	double target_cost = cell_cost(x_0, y_0, x_1, y_1) * first_number_of_blocks / number_of_blocks;
+	bool split_x = length_x >= length_y;
+
+	// Find the split position, at which the cost of the first part is the closest to the target
+	int low = (split_x ? x_0 : y_0) + 1;
+	int high = (split_x ? x_1 : y_1) - 1;
+	while (low < high) {
+		int middle = (low + high) / 2;
+		double cost = split_x ? cell_cost(x_0, y_0, middle, y_1) : cell_cost(x_0, y_0, x_1, middle);
+		if (cost < target_cost) {
+			low = middle + 1;
+		} else {
+			high = middle;
+		}
+	}
+	int split = low;
+	double cost_after = split_x ? cell_cost(x_0, y_0, split, y_1) : cell_cost(x_0, y_0, x_1, split);
+	double cost_before = split_x ? cell_cost(x_0, y_0, split - 1, y_1) : cell_cost(x_0, y_0, x_1, split - 1);
+	if (split - 1 > (split_x ? x_0 : y_0) && target_cost - cost_before < cost_after - target_cost) {
+		split--;
+	}
+
+	if (split_x) {
+		bisect(x_0, y_0, split, y_1, first_number_of_blocks, blocks);
+		bisect(split, y_0, x_1, y_1, number_of_blocks - first_number_of_blocks, blocks);
+	} else {
+		bisect(x_0, y_0, x_1, split, first_number_of_blocks, blocks);
+		bisect(x_0, split, x_1, y_1, number_of_blocks - first_number_of_blocks, blocks);
+	}
+}
+
+
+/**
+ * Get total predicted cost of a rectangle of cells [x_0, x_1) x [y_0, y_1).
+ */
+inline double CostModel::cell_cost(int x_0, int y_0, int x_1, int y_1) const
+{
+	int stride = _cells_x + 1;
+	return _integral_cost[y_1 * stride + x_1] - _integral_cost[y_0 * stride + x_1] -
+		   _integral_cost[y_1 * stride + x_0] + _integral_cost[y_0 * stride + x_0];
+}
+
+}	// namespace msas
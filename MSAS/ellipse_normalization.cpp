@@ -16,6 +16,8 @@ using std::vector;
 namespace msas
 {
 
+constexpr float EllipseNormalization::SMOOTHING_KERNEL[];
+
 EllipseNormalization::EllipseNormalization(int num_bins, int num_orientations, float histogram_cut_off, float sigma)
 		: _num_bins(num_bins),
 		  _num_orientations(num_orientations),
@@ -89,11 +91,31 @@ std::shared_ptr<GridInfo> EllipseNormalization::create_regular_grid(int grid_siz
 }
 
 
+std::shared_ptr<GridInfo> EllipseNormalization::create_orientation_grid(int grid_size)
+{
+	return create_regular_grid(grid_size, std::min(3.0f * _sigma, 1.0f));
+}
+
+
 vector<float> EllipseNormalization::calculate_dominant_orientations(const Image<float> &gradient_x,
 																	const Image<float> &gradient_y,
 																	const vector<Point> &region,
 																	Matrix2f transform,
 																	Point center)
+{
+	vector<float> dominant_orientations;
+	calculate_dominant_orientations(gradient_x, gradient_y, region, transform, center, dominant_orientations);
+
+	return dominant_orientations;
+}
+
+
+void EllipseNormalization::calculate_dominant_orientations(const Image<float> &gradient_x,
+														   const Image<float> &gradient_y,
+														   const vector<Point> &region,
+														   Matrix2f transform,
+														   Point center,
+														   vector<float> &dominant_orientations)
 {
 	// Compute parameters
 	float bin_width = 2.0f * (float)M_PI / (float) _num_bins;
@@ -109,8 +131,8 @@ vector<float> EllipseNormalization::calculate_dominant_orientations(const Image<
 
 	// Ensure that transform is valid
 	if (std::isnan(det) || det == 0.0f) {
-		vector<float> default_orientations = {0.0f};
-		return default_orientations;
+		dominant_orientations.assign(1, 0.0f);
+		return;
 	}
 
 	// Calculate transposed inverse of 'transform' to transform gradients
@@ -121,7 +143,8 @@ vector<float> EllipseNormalization::calculate_dominant_orientations(const Image<
 
 	// Fill-in histogram
 	int histogram_length = _num_bins + 2;	// '+ 2' because we reserve first and last elements for circular convolution
-	float *histogram = new float[histogram_length]();
+	float *histogram = workspace().reserve(workspace().histogram, histogram_length);
+	std::fill(histogram, histogram + histogram_length, 0.0f);
 	for (auto it = region.cbegin(); it != region.cend(); ++it) {
 		// Transform gradient
 		float grad_x = gradient_x(it->x, it->y) * grad_tr_00 +
@@ -129,20 +152,6 @@ vector<float> EllipseNormalization::calculate_dominant_orientations(const Image<
 		float grad_y = gradient_x(it->x, it->y) * grad_tr_10 +
 					   gradient_y(it->x, it->y) * grad_tr_11;
 
-		// Calculate gradient direction and norm
-		float grad_norm = std::sqrt(grad_x * grad_x + grad_y * grad_y);
-		float angle = std::atan2(grad_y, grad_x);    // from X axis, in interval [-pi,+pi] radians
-
-		// Re-arrange angle: [0,+pi] -> [0,+pi] and [-pi,0] -> [+pi,+2pi]
-		if (angle < 0.0f) {
-			angle += 2.0f * M_PI;
-		}
-
-		// Locate a proper bin and calculate distance to it's center
-		float bin_pos = angle / bin_width;
-		int bin_id = (int)floor(bin_pos - 0.5f);
-		float bin_distance = bin_pos - bin_id - 0.5f;
-
 		// Calculate anisotropic intra-patch Gaussian weights
 		float delta_x = it->x - center.x;
 		float delta_y = it->y - center.y;
@@ -151,74 +160,109 @@ vector<float> EllipseNormalization::calculate_dominant_orientations(const Image<
 		float distance = dist_x * dist_x + dist_y * dist_y;
 		float weight = LUT::exp(-distance / two_sigma_squared) / gauss_normalization;
 
-		// Distribute gradient norm value between two closest bins
-		histogram[bin_id + 1] += (1.0f - bin_distance) * grad_norm * weight;		// '+ 1' because we reserve first element for circular convolution
-		histogram[bin_id + 2] += (bin_distance) * grad_norm * weight;
+		add_to_histogram(histogram, grad_x, grad_y, weight, bin_width);
 	}
 
-	// Merge values at the borders to make the histogram circular
-	histogram[0] += histogram[_num_bins];
-	histogram[_num_bins + 1] += histogram[1];
-	histogram[_num_bins] = histogram[0];
-	histogram[1] = histogram[_num_bins + 1];
+	select_dominant_orientations(histogram, bin_width, dominant_orientations);
+}
 
-	// Smooth histogram (convolve the histogram with [1/3, 1/3, 1/3] kernel several times)
-	float *buffer_src = histogram;
-	float *buffer_dst = new float[histogram_length]();
-	for(int i = 0 ; i < 6; i++)	{
-		for (int j = 1; j <= _num_bins; j++) {
-			buffer_dst[j] = (buffer_src[j - 1] +
-							 buffer_src[j] +
-							 buffer_src[j + 1]) / 3.0f;
-		}
 
-		// Update boundaries
-		buffer_dst[0] = buffer_dst[_num_bins];
-		buffer_dst[_num_bins + 1] = buffer_dst[1];
+vector<float> EllipseNormalization::calculate_dominant_orientations(const Image<float> &gradient_x,
+																	const Image<float> &gradient_y,
+																	const GridInfo &grid,
+																	Matrix2f transform,
+																	Point center)
+{
+	vector<float> dominant_orientations;
+	calculate_dominant_orientations(gradient_x, gradient_y, grid, transform, center, dominant_orientations);
 
-		// Swap buffers
-		std::swap(buffer_dst, buffer_src);
-	}
-	delete[] buffer_dst;
+	return dominant_orientations;
+}
 
-	histogram = buffer_src;
 
-	// Find maximum value in histogram
-	float max_value = -1.0f;
-	for(int i = 1; i <= _num_bins; ++i) {
-		max_value = std::max(max_value, histogram[i]);
+void EllipseNormalization::calculate_dominant_orientations(const Image<float> &gradient_x,
+														   const Image<float> &gradient_y,
+														   const GridInfo &grid,
+														   Matrix2f transform,
+														   Point center,
+														   vector<float> &dominant_orientations)
+{
+	// Compute parameters
+	float bin_width = 2.0f * (float)M_PI / (float) _num_bins;
+	float two_sigma_squared = 2.0f * _sigma * _sigma;
+	float gauss_normalization = (sqrt(2.0 * M_PI) * _sigma);
+	Shape size = gradient_x.size();
+
+	float transform_00 = transform[0];
+	float transform_01 = transform[1];
+	float transform_10 = transform[2];
+	float transform_11 = transform[3];
+
+	float det = transform_00 * transform_11 - transform_01 * transform_10;
+
+	// Ensure that transform is valid
+	if (std::isnan(det) || det == 0.0f) {
+		dominant_orientations.assign(1, 0.0f);
+		return;
 	}
 
-	// Locate candidate orientations
-	vector<float> dominant_orientations;
-	vector<pair<float, int> > candidate_orientations;
-	candidate_orientations.reserve(10);
-	float cut_off = _histogram_cut_off * max_value;
-	for(int i = 1; i <= _num_bins; ++i) {
-		if( (histogram[i] > cut_off) && (histogram[i] > histogram[i-1]) && (histogram[i] > histogram[i+1]) ) {
-			candidate_orientations.push_back(pair<float, int>(histogram[i], i));
+	// Calculate transposed inverse of 'transform' to transform gradients
+	float grad_tr_00 = transform_11 / det;
+	float grad_tr_01 = -transform_10 / det;
+	float grad_tr_10 = -transform_01 / det;
+	float grad_tr_11 = transform_00 / det;
+
+	// Fill-in histogram
+	// NOTE: every node represents the same area of the elliptical region, so the histogram differs from the one
+	//		 computed over the pixels of the region by a constant factor only.
+	int histogram_length = _num_bins + 2;	// '+ 2' because we reserve first and last elements for circular convolution
+	float *histogram = workspace().reserve(workspace().histogram, histogram_length);
+	std::fill(histogram, histogram + histogram_length, 0.0f);
+	for (int i = 0; i < grid.nodes_length; i++) {
+		// Map grid points to the elliptical patch
+		float x = (transform_11 * grid.nodes[i].x - transform_01 * grid.nodes[i].y) / det + center.x;
+		float y = (transform_00 * grid.nodes[i].y - transform_10 * grid.nodes[i].x) / det + center.y;
+
+		// Check that point is inside the image domain
+		if (x < 0.0f || x > (size.size_x - 1) || y < 0.0f || y > (size.size_y - 1)) {
+			continue;
 		}
-	}
 
-	// Sort candidate orientations by the histogram value
-	std::sort(candidate_orientations.begin(), candidate_orientations.end(), dsc_sort_by_first());
+		// Interpolate gradient (bilinear, falls back to the nearest pixel at the right and bottom edges)
+		int ix = std::min((int)x, (int)size.size_x - 2);
+		int iy = std::min((int)y, (int)size.size_y - 2);
+		ix = std::max(ix, 0);
+		iy = std::max(iy, 0);
+		int step_x = (size.size_x > 1) ? 1 : 0;
+		int next_y = (size.size_y > 1) ? iy + 1 : iy;
+		const float *grad_x_row = gradient_x.row(iy) + ix;
+		const float *grad_x_next_row = gradient_x.row(next_y) + ix;
+		const float *grad_y_row = gradient_y.row(iy) + ix;
+		const float *grad_y_next_row = gradient_y.row(next_y) + ix;
+		float dx = std::min(x - (float)ix, 1.0f);
+		float dy = std::min(y - (float)iy, 1.0f);
+
+		float image_grad_x = grad_x_row[0] * (1.0f - dx) * (1.0f - dy)
+							 + grad_x_row[step_x] * dx * (1.0f - dy)
+							 + grad_x_next_row[0] * (1.0f - dx) * dy
+							 + grad_x_next_row[step_x] * dx * dy;
+		float image_grad_y = grad_y_row[0] * (1.0f - dx) * (1.0f - dy)
+							 + grad_y_row[step_x] * dx * (1.0f - dy)
+							 + grad_y_next_row[0] * (1.0f - dx) * dy
+							 + grad_y_next_row[step_x] * dx * dy;
 
-	// Select at most '_num_orientations' best orientations
-	auto it = candidate_orientations.begin();
-	for (int i = 0; i < _num_orientations && it != candidate_orientations.end(); ++i, ++it) {
-		int id = it->second;
-		float angle = bin_width * ((float)id + 0.5f * (histogram[id-1] - histogram[id+1]) / (histogram[id-1] - 2.0f * histogram[id] + histogram[id+1]) + 0.5f);
-		dominant_orientations.push_back(angle);
-	}
+		// Transform gradient
+		float grad_x = image_grad_x * grad_tr_00 + image_grad_y * grad_tr_01;
+		float grad_y = image_grad_x * grad_tr_10 + image_grad_y * grad_tr_11;
 
-	delete[] histogram;
+		// Calculate isotropic Gaussian weights in the normalized coordinates
+		float distance = grid.nodes[i].x * grid.nodes[i].x + grid.nodes[i].y * grid.nodes[i].y;
+		float weight = LUT::exp(-distance / two_sigma_squared) / gauss_normalization;
 
-	// If no dominant orientation is detected, return the original one
-	if (dominant_orientations.size() == 0) {
-		dominant_orientations.push_back(0.0f);
+		add_to_histogram(histogram, grad_x, grad_y, weight, bin_width);
 	}
 
-	return dominant_orientations;
+	select_dominant_orientations(histogram, bin_width, dominant_orientations);
 }
 
 
@@ -229,16 +273,39 @@ std::shared_ptr<float*> EllipseNormalization::interpolate_to_grid(const GridInfo
 																  Point center)
 {
 	uint number_of_channels = image.number_of_channels();
-	Shape size = image.size();
 
 	// Allocate memory
 	float** interpolated_values = new float*[number_of_channels];
 	for (int ch = 0; ch < number_of_channels; ch++) {
-		interpolated_values[ch] = new float[grid.nodes_length]();
+		interpolated_values[ch] = new float[grid.nodes_length];
 	}
+	float* values = workspace().reserve(workspace().values, number_of_channels * grid.nodes_length);
+
+	// Interpolate channel by channel into a single block and scatter it
+	MaskFx interpolation_mask = (!mask.is_empty()) ? erode_mask(mask) : MaskFx();
+	interpolate_to_grid(grid, image, interpolation_mask, transform, center, values);
+	for (int ch = 0; ch < number_of_channels; ch++) {
+		std::copy(values + ch * grid.nodes_length, values + (ch + 1) * grid.nodes_length, interpolated_values[ch]);
+	}
+	std::shared_ptr<float*> ptr(interpolated_values, ArrayDeleter2d<float>(number_of_channels));
+
+	return ptr;
+}
+
+
+void EllipseNormalization::interpolate_to_grid(const GridInfo &grid,
+											   const ImageFx<float> &image,
+											   const MaskFx &interpolation_mask,
+											   Matrix2f transform,
+											   Point center,
+											   float *values)
+{
+	uint number_of_channels = image.number_of_channels();
+	Shape size = image.size();
+	int nodes_length = grid.nodes_length;
 
 	// Get raw pointers
-	const bool* mask_data = (!mask.is_empty()) ? mask.raw() : 0;
+	const bool* mask_data = (!interpolation_mask.is_empty()) ? interpolation_mask.raw() : 0;
 	const float* image_data = image.raw();
 
 	float transform_00 = transform[0];
@@ -247,126 +314,97 @@ std::shared_ptr<float*> EllipseNormalization::interpolate_to_grid(const GridInfo
 	float transform_11 = transform[3];
 	float det_transform = transform_00 * transform_11 - transform_01 * transform_10;
 
-	if (!mask_data) {
-		for (int i = 0; i < grid.nodes_length; i++) {
-			// Map grid points to the elliptical patch
-			float x = (transform_11 * grid.nodes[i].x - transform_01 * grid.nodes[i].y) / det_transform + center.x;
-			float y = (transform_00 * grid.nodes[i].y - transform_10 * grid.nodes[i].x) / det_transform + center.y;
+	// NOTE: at the right and bottom edges the top-left pixel is shifted inwards and the corresponding
+	//		 coefficient becomes 1.0, which gives linear interpolation along the edge without branching.
+	int max_x = std::max((int)size.size_x - 2, 0);
+	int max_y = std::max((int)size.size_y - 2, 0);
+	int step_x = (size.size_x > 1) ? (int)number_of_channels : 0;
+	int step_y = (size.size_y > 1) ? (int)image.stride() : 0;
+
+	// Map grid nodes to the elliptical patch: offsets of the top-left pixels (in elements of the image data)
+	// and interpolation coefficients. Nodes outside of the image domain (or the mask) get negative offsets.
+	// NOTE: a single lookup of the mask covers all four pixels.
+	NormalizationWorkspace &scratch = workspace();
+	int *offsets_data = scratch.reserve(scratch.offsets, nodes_length);
+	float *coeffs_x_data = scratch.reserve(scratch.coeffs_x, nodes_length);
+	float *coeffs_y_data = scratch.reserve(scratch.coeffs_y, nodes_length);
+	const GridCoord *nodes = grid.nodes.get();
+
+	#pragma omp simd
+	for (int i = 0; i < nodes_length; i++) {
+		float x = (transform_11 * nodes[i].x - transform_01 * nodes[i].y) / det_transform + center.x;
+		float y = (transform_00 * nodes[i].y - transform_10 * nodes[i].x) / det_transform + center.y;
+
+		// Check that point is inside the image domain (false for NaNs as well)
+		bool is_inside = x >= 0.0f && x <= (size.size_x - 1) && y >= 0.0f && y <= (size.size_y - 1);
+		x = is_inside ? x : 0.0f;
+		y = is_inside ? y : 0.0f;
+
+		int ix = std::min((int)x, max_x);
+		int iy = std::min((int)y, max_y);
+		bool is_masked = !mask_data || mask_data[iy * (int)size.size_x + ix];
+		offsets_data[i] = (is_inside && is_masked) ? iy * step_y + ix * step_x : -1;
+		coeffs_x_data[i] = x - (float)ix;
+		coeffs_y_data[i] = y - (float)iy;
+	}
 
-			// Check that point is inside the image domain
-			if (x < 0.0f || x > (size.size_x - 1) || y < 0.0f || y > (size.size_y - 1)) {
-				for (int ch = 0; ch < number_of_channels; ch++) {
-					interpolated_values[ch][i] = NO_VALUE;
-				}
+	// Do bilinear interpolation channel by channel
+	for (int ch = 0; ch < number_of_channels; ch++) {
+		float *channel_values = values + ch * nodes_length;
+		const float *channel_data = image_data + ch;
+		for (int i = 0; i < nodes_length; i++) {
+			int index = offsets_data[i];
+			if (index < 0) {
+				channel_values[i] = NO_VALUE;
 				continue;
 			}
 
-			int ix = (int) x;
-			int iy = (int) y;
-			int index = iy * size.size_x + ix;
-			float dx = x - (float) ix;
-			float dy = y - (float) iy;
-
-			// Do interpolation
-			if (ix + 1 < size.size_x && iy + 1 < size.size_y) {
-				// Bilinear interpolation
-				for (int ch = 0; ch < number_of_channels; ch++) {
-					float intensity = image_data[number_of_channels * index + ch] * (1.0f - dx) * (1.0f - dy)
-									  + image_data[number_of_channels * (index + 1) + ch] * dx * (1.0f - dy)
-									  + image_data[number_of_channels * (index + size.size_x) + ch] * (1.0f - dx) * dy
-									  + image_data[number_of_channels * (index + size.size_x + 1) + ch] * dx * dy;
-					interpolated_values[ch][i] = intensity;
-				}
-			} else if (ix + 1 < size.size_x) {
-				// Linear interpolation in X direction for the bottom edge
-				for (int ch = 0; ch < number_of_channels; ch++) {
-					float intensity = image_data[number_of_channels * index + ch] * (1.0f - dx)
-									  + image_data[number_of_channels * (index + 1) + ch] * dx;
-					interpolated_values[ch][i] = intensity;
-				}
-			} else if (iy + 1 < size.size_y) {
-				// Linear interpolation in Y direction for the right edge
-				for (int ch = 0; ch < number_of_channels; ch++) {
-					float intensity = image_data[number_of_channels * index + ch] * (1.0f - dy)
-									  + image_data[number_of_channels * (index + size.size_x) + ch] * dy;
-					interpolated_values[ch][i] = intensity;
-				}
-			} else {
-				// No interpolation for the bottom-right corner
-				for (int ch = 0; ch < number_of_channels; ch++) {
-					float intensity = image_data[number_of_channels * index + ch];
-					interpolated_values[ch][i] = intensity;
-				}
-			}
+			float dx = coeffs_x_data[i];
+			float dy = coeffs_y_data[i];
+			channel_values[i] = channel_data[index] * (1.0f - dx) * (1.0f - dy)
+								+ channel_data[index + step_x] * dx * (1.0f - dy)
+								+ channel_data[index + step_y] * (1.0f - dx) * dy
+								+ channel_data[index + step_x + step_y] * dx * dy;
 		}
-	} else {
-		for (int i = 0; i < grid.nodes_length; i++) {
-			// Map grid points to the elliptical patch
-			float x = (transform_11 * grid.nodes[i].x - transform_01 * grid.nodes[i].y) / det_transform + center.x;
-			float y = (transform_00 * grid.nodes[i].y - transform_10 * grid.nodes[i].x) / det_transform + center.y;
-
-			// Check that point is inside the image domain
-			if (x < 0.0f || x > (size.size_x - 1) || y < 0.0f || y > (size.size_y - 1)) {
-				for (int ch = 0; ch < number_of_channels; ch++) {
-					interpolated_values[ch][i] = NO_VALUE;
-				}
-				continue;
-			}
+	}
+}
 
-			int ix = (int) x;
-			int iy = (int) y;
-			int index = iy * size.size_x + ix;
 
-			// Check that point is included in the mask
-			if (!mask_data[index] || !mask_data[index + 1]
-				|| !mask_data[index + size.size_x] || !mask_data[index + size.size_x + 1]) {
-				for (int ch = 0; ch < number_of_channels; ch++) {
-					interpolated_values[ch][i] = NO_VALUE;
-				}
-				continue;
-			}
+void EllipseNormalization::interpolate_to_grid(const GridInfo &grid,
+											   const ImageFx<float> &image,
+											   const MaskFx &interpolation_mask,
+											   const vector<Matrix2f> &transforms,
+											   const vector<Point> &centers,
+											   float *values)
+{
+	size_t patch_length = image.number_of_channels() * grid.nodes_length;
+	for (size_t i = 0; i < transforms.size() && i < centers.size(); i++) {
+		interpolate_to_grid(grid, image, interpolation_mask, transforms[i], centers[i], values + i * patch_length);
+	}
+}
 
-			float dx = x - (float) ix;
-			float dy = y - (float) iy;
-
-			// Do interpolation
-			if (ix + 1 < size.size_x && iy + 1 < size.size_y) {
-				// Bilinear interpolation
-				for (int ch = 0; ch < number_of_channels; ch++) {
-					float intensity = image_data[number_of_channels * index + ch] * (1.0f - dx) * (1.0f - dy)
-									  + image_data[number_of_channels * (index + 1) + ch] * dx * (1.0f - dy)
-									  + image_data[number_of_channels * (index + size.size_x) + ch] * (1.0f - dx) * dy
-									  + image_data[number_of_channels * (index + size.size_x + 1) + ch] * dx * dy;
-					interpolated_values[ch][i] = intensity;
-				}
-			} else if (ix + 1 < size.size_x) {
-				// Linear interpolation in X direction for the bottom edge
-				for (int ch = 0; ch < number_of_channels; ch++) {
-					float intensity = image_data[number_of_channels * index + ch] * (1.0f - dx)
-									  + image_data[number_of_channels * (index + 1) + ch] * dx;
-					interpolated_values[ch][i] = intensity;
-				}
-			} else if (iy + 1 < size.size_y) {
-				// Linear interpolation in Y direction for the right edge
-				for (int ch = 0; ch < number_of_channels; ch++) {
-					float intensity = image_data[number_of_channels * index + ch] * (1.0f - dy)
-									  + image_data[number_of_channels * (index + size.size_x) + ch] * dy;
-					interpolated_values[ch][i] = intensity;
-				}
-			} else {
-				// No interpolation for the bottom-right corner
-				for (int ch = 0; ch < number_of_channels; ch++) {
-					float intensity = image_data[number_of_channels * index + ch];
-					interpolated_values[ch][i] = intensity;
-				}
+
+Mask EllipseNormalization::erode_mask(const MaskFx &mask)
+{
+	if (mask.is_empty()) {
+		return Mask();
+	}
+
+	// NOTE: missing neighbours at the right and bottom edges are never used in interpolation
+	int size_x = mask.size_x();
+	int size_y = mask.size_y();
+	Mask interpolation_mask(mask.size(), false);
+	for (int y = 0; y < size_y; y++) {
+		for (int x = 0; x < size_x; x++) {
+			int next_x = std::min(x + 1, size_x - 1);
+			int next_y = std::min(y + 1, size_y - 1);
+			if (mask.get(x, y) && mask.get(next_x, y) && mask.get(x, next_y) && mask.get(next_x, next_y)) {
+				interpolation_mask(x, y) = true;
 			}
 		}
 	}
 
-	std::shared_ptr<float*> ptr(interpolated_values, ArrayDeleter2d<float>(number_of_channels));
-
-	return ptr;
-
+	return interpolation_mask;
 }
 
 
@@ -374,21 +412,94 @@ std::shared_ptr<float*> EllipseNormalization::flip(const std::shared_ptr<float*>
 												   int grid_length,
 												   uint number_of_channels)
 {
-	// Flip normalized patch by reversing it
-	float** original_patch = normalized_patch.get();
 	float** flipped_patch = new float*[number_of_channels];
 	for (int ch = 0; ch < number_of_channels; ch++) {
 		flipped_patch[ch] = new float[grid_length];
-		for (int i = 0; i < grid_length; i++) {
-			flipped_patch[ch][i] = original_patch[ch][grid_length - i - 1];
-		}
 	}
+	flip(normalized_patch.get(), grid_length, number_of_channels, flipped_patch);
 
 	std::shared_ptr<float*> ptr(flipped_patch, ArrayDeleter2d<float>(number_of_channels));
 	return ptr;
 }
 
 
+void EllipseNormalization::flip(const float * const *normalized_patch,
+								int grid_length,
+								uint number_of_channels,
+								float **flipped_patch)
+{
+	// Flip normalized patch by reversing it
+	for (int ch = 0; ch < number_of_channels; ch++) {
+		for (int i = 0; i < grid_length; i++) {
+			flipped_patch[ch][i] = normalized_patch[ch][grid_length - i - 1];
+		}
+	}
+}
+
+
+void EllipseNormalization::pack(NormalizedPatch &normalized_patch,
+							   PatchFormats::PatchFormat format,
+							   int grid_length,
+							   uint number_of_channels)
+{
+	if (format == normalized_patch.format || normalized_patch.format != PatchFormats::float32) {
+		return;
+	}
+
+	float** patch = normalized_patch.patch.get();
+	if (format == PatchFormats::uint8) {
+		// Find range of the known values
+		float min_value = std::numeric_limits<float>::max();
+		float max_value = -std::numeric_limits<float>::max();
+		for (int ch = 0; ch < number_of_channels; ch++) {
+			for (int i = 0; i < grid_length; i++) {
+				if (patch[0][i] < -256.0f) {
+					continue;
+				}
+				min_value = std::min(min_value, patch[ch][i]);
+				max_value = std::max(max_value, patch[ch][i]);
+			}
+		}
+
+		float scale = (max_value > min_value) ? (max_value - min_value) / (UINT8_NO_VALUE - 1) : 1.0f;
+		float offset = (max_value >= min_value) ? min_value : 0.0f;
+
+		// Quantize
+		uint8_t *codes = new uint8_t[grid_length * number_of_channels];
+		for (int ch = 0; ch < number_of_channels; ch++) {
+			for (int i = 0; i < grid_length; i++) {
+				codes[ch * grid_length + i] = (patch[0][i] < -256.0f) ?
+											  UINT8_NO_VALUE :
+											  (uint8_t)std::min((int)((patch[ch][i] - offset) / scale + 0.5f),
+																UINT8_NO_VALUE - 1);
+			}
+		}
+
+		normalized_patch.packed_patch = std::shared_ptr<uint8_t>(codes, std::default_delete<uint8_t[]>());
+		normalized_patch.scale = scale;
+		normalized_patch.offset = offset;
+	} else if (format == PatchFormats::float16) {
+		uint16_t *codes = new uint16_t[grid_length * number_of_channels];
+		for (int ch = 0; ch < number_of_channels; ch++) {
+			for (int i = 0; i < grid_length; i++) {
+				codes[ch * grid_length + i] = (patch[0][i] < -256.0f) ?
+											  FLOAT16_NO_VALUE :
+											  float_to_half(patch[ch][i]);
+			}
+		}
+
+		normalized_patch.packed_patch = std::shared_ptr<uint8_t>((uint8_t *)codes,
+																 [](uint8_t *p) { delete[] (uint16_t *)p; });
+	} else {
+		return;
+	}
+
+	normalized_patch.format = format;
+	normalized_patch.length = grid_length;
+	normalized_patch.patch.reset();
+}
+
+
 Matrix2f EllipseNormalization::rotation(const float &orientation)
 {
 	// Rotation that aligns given orientation with X axis
@@ -401,4 +512,175 @@ Matrix2f EllipseNormalization::rotation(const float &orientation)
 	return rotation;
 }
 
+
+NormalizationWorkspace& EllipseNormalization::workspace()
+{
+	thread_local NormalizationWorkspace workspace;
+	return workspace;
+}
+
+
+size_t EllipseNormalization::allocations()
+{
+	return workspace().allocations;
+}
+
+/* Private */
+
+/**
+ * Distribute gradient norm between two closest bins of the orientation histogram.
+ */
+inline void EllipseNormalization::add_to_histogram(float *histogram,
+												   float grad_x,
+												   float grad_y,
+												   float weight,
+												   float bin_width)
+{
+	// Calculate gradient direction and norm
+	float grad_norm = std::sqrt(grad_x * grad_x + grad_y * grad_y);
+	float angle = std::atan2(grad_y, grad_x);    // from X axis, in interval [-pi,+pi] radians
+
+	// Re-arrange angle: [0,+pi] -> [0,+pi] and [-pi,0] -> [+pi,+2pi]
+	if (angle < 0.0f) {
+		angle += 2.0f * M_PI;
+	}
+
+	// Locate a proper bin and calculate distance to it's center
+	float bin_pos = angle / bin_width;
+	int bin_id = (int)floor(bin_pos - 0.5f);
+	float bin_distance = bin_pos - bin_id - 0.5f;
+
+	// Distribute gradient norm value between two closest bins
+	histogram[bin_id + 1] += (1.0f - bin_distance) * grad_norm * weight;		// '+ 1' because we reserve first element for circular convolution
+	histogram[bin_id + 2] += (bin_distance) * grad_norm * weight;
+}
+
+
+/**
+ * Smooth the orientation histogram and locate its highest peaks.
+ * @note Content of the @param histogram is not preserved.
+ */
+void EllipseNormalization::select_dominant_orientations(float *histogram,
+														float bin_width,
+														vector<float> &dominant_orientations)
+{
+	NormalizationWorkspace &scratch = workspace();
+
+	// Merge values at the borders to make the histogram circular
+	histogram[0] += histogram[_num_bins];
+	histogram[_num_bins + 1] += histogram[1];
+	histogram[_num_bins] = histogram[0];
+	histogram[1] = histogram[_num_bins + 1];
+
+	// Smooth histogram with a single circular convolution, which is equivalent to convolving it
+	// with [1/3, 1/3, 1/3] kernel six times (coefficients of (1 + x + x^2)^6 / 3^6)
+	const int half_length = SMOOTHING_KERNEL_LENGTH / 2;
+	float *extended = scratch.reserve(scratch.buffer, _num_bins + 2 * half_length);
+	std::copy(histogram + 1, histogram + _num_bins + 1, extended + half_length);
+	for (int i = 0; i < half_length; i++) {
+		extended[half_length - 1 - i] = extended[half_length + _num_bins - 1 - i % _num_bins];
+		extended[half_length + _num_bins + i] = extended[half_length + i % _num_bins];
+	}
+
+	#pragma omp simd
+	for (int j = 0; j < _num_bins; j++) {
+		float value = 0.0f;
+		for (int k = 0; k < SMOOTHING_KERNEL_LENGTH; k++) {
+			value += SMOOTHING_KERNEL[k] * extended[j + k];
+		}
+		histogram[j + 1] = value;
+	}
+
+	// Update boundaries
+	histogram[0] = histogram[_num_bins];
+	histogram[_num_bins + 1] = histogram[1];
+
+	// Find maximum value in histogram
+	float max_value = -1.0f;
+	for(int i = 1; i <= _num_bins; ++i) {
+		max_value = std::max(max_value, histogram[i]);
+	}
+
+	// Collect peaks above the cut-off value (branch-free compaction).
+	// NOTE: the kernel is exact, so a gradient at the border of two bins gives a plateau of equal bins,
+	//       a peak is collected at the right end of a plateau and dropped, if the plateau is not a local maximum.
+	float cut_off = _histogram_cut_off * max_value;
+	int *peaks = scratch.reserve(scratch.peaks, _num_bins + 1);
+	int number_of_peaks = 0;
+	for(int i = 1; i <= _num_bins; ++i) {
+		peaks[number_of_peaks] = i;
+		number_of_peaks += (histogram[i] > cut_off) & (histogram[i] >= histogram[i-1]) & (histogram[i] > histogram[i+1]);
+	}
+
+	int number_of_maxima = 0;
+	for (int i = 0; i < number_of_peaks; i++) {
+		int id = peaks[i];
+		peaks[number_of_maxima] = id;
+		number_of_maxima += plateau_length(histogram, id) > 0;
+	}
+	number_of_peaks = number_of_maxima;
+
+	// Select at most '_num_orientations' highest peaks.
+	// NOTE: the best candidates are kept sorted, every peak is pushed through them using conditional moves only.
+	vector<pair<float, int> > &candidate_orientations = scratch.candidates;
+	if (candidate_orientations.capacity() < _num_orientations) {
+		scratch.allocations++;
+	}
+	candidate_orientations.resize(_num_orientations);
+	pair<float, int> *candidates = candidate_orientations.data();
+	for (int k = 0; k < _num_orientations; k++) {
+		candidates[k].first = -1.0f;
+	}
+
+	for (int i = 0; i < number_of_peaks; i++) {
+		int id = peaks[i];
+		float value = histogram[id];
+		for (int k = 0; k < _num_orientations; k++) {
+			bool is_greater = value > candidates[k].first;
+			float candidate_value = candidates[k].first;
+			int candidate_id = candidates[k].second;
+			candidates[k].first = is_greater ? value : candidate_value;
+			candidates[k].second = is_greater ? id : candidate_id;
+			value = is_greater ? candidate_value : value;
+			id = is_greater ? candidate_id : id;
+		}
+	}
+
+	// Refine positions of the peaks, a parabola is centred on the plateau and passes through its neighbours
+	dominant_orientations.clear();
+	for (int k = 0; k < _num_orientations && candidates[k].first >= 0.0f; k++) {
+		int id = candidates[k].second;
+		int length = plateau_length(histogram, id);
+		int left_id = (id - length >= 0) ? id - length : id - length + _num_bins;
+		float center = (float)id - 0.5f * (length - 1);
+		float half_width = 0.5f * (length + 1);
+		float left = histogram[left_id];
+		float right = histogram[id+1];
+		float angle = bin_width * (center + half_width * 0.5f * (left - right) / (left - 2.0f * histogram[id] + right) + 0.5f);
+		dominant_orientations.push_back(angle);
+	}
+
+	// If no dominant orientation is detected, return the original one
+	if (dominant_orientations.size() == 0) {
+		dominant_orientations.push_back(0.0f);
+	}
+}
+
+
+/**
+ * Get the number of equal bins of the circular histogram ending at @param id,
+ * or 0, if the bin to the left of them is greater (the plateau is not a local maximum).
+ */
+int EllipseNormalization::plateau_length(const float *histogram, int id) const
+{
+	int length = 1;
+	int left_id = id - 1;
+	while (length < _num_bins && histogram[left_id] == histogram[id]) {
+		length++;
+		left_id = (left_id > 1) ? left_id - 1 : left_id - 1 + _num_bins;
+	}
+
+	return (histogram[left_id] < histogram[id]) ? length : 0;
+}
+
 }	// namespace msas
@@ -12,11 +12,16 @@
 #define AFFINE_PATCH_DISTANCE_H_
 
 #include <memory>
+#include <limits>
+#include <atomic>
 #include "ellipse_normalization.h"
 #include "distance_info.h"
 #include "structure_tensor_bundle.h"
+#include "cost_model.h"
 #include "point.h"
+#include "rectangle.h"
 #include "matrix.h"
+#include "thread_pool.h"
 
 namespace msas
 {
@@ -37,11 +42,15 @@ public:
 	/// @param source_point Point of interest in the first image.
 	/// @param target_bundle Bundle embedding the second image and its corresponding structure tensor field.
 	/// @param target_point Point of interest in the second image.
+	/// @param bound [optional] Upper bound on the distance. Comparisons, which are guaranteed to exceed it,
+	///              are abandoned early. If all of them are abandoned, the resulting distance is set to
+	///              std::numeric_limits<float>::max() and both transforms are set to zero.
 	/// @note @param source_bundle and @param target_bundle may coincide.
 	DistanceInfo calculate(const StructureTensorBundle &source_bundle,
 						   Point source_point,
 						   const StructureTensorBundle &target_bundle,
-						   Point target_point);
+						   Point target_point,
+						   float bound = std::numeric_limits<float>::max());
 
 	/// Get scale parameter (relative scale w.r.t. the radius)
 	float scale();
@@ -53,6 +62,8 @@ public:
 	float bilateral_k_color();
 
 	/// Set kappa-color for bilateral weights
+	/// @note Bilateral weights are cached along with normalized patches. They are computed during
+	///       precompute_normalized_patches(), otherwise on the first use of a patch as a target.
 	void set_bilateral_k_color(float value);
 
 	/// Get kappa-spatial for bilateral weights
@@ -61,7 +72,37 @@ public:
 	/// Set kappa-spatial for bilateral weights
 	void set_bilateral_k_spatial(float value);
 
-	/// Get the regular grid that is used in distance computation.
+	/// Get tolerance for pruning of the grid nodes.
+	float node_tolerance();
+
+	/// Set tolerance for pruning of the grid nodes. Nodes with the smallest spatial weights are dropped
+	/// as long as their cumulative weight does not exceed the given fraction of the total weight.
+	/// By default set to 0.0 (no pruning).
+	/// @note Pruned nodes are neither interpolated, nor cached, nor compared. Since the pruned grid depends
+	///       on the spatial weights, changing either the scale or kappa-spatial may cause recreation of the grid.
+	void set_node_tolerance(float value);
+
+	/// Get fraction of the total spatial weight discarded by pruning of the grid nodes (approximation error).
+	float pruning_error();
+
+	/// Get size of the grid used to sample gradients for the dominant orientations.
+	int orientation_grid_size() const;
+
+	/// Set size of the grid used to sample gradients for the dominant orientations, so that their cost
+	/// does not depend on the size of the elliptical regions. The finer the grid, the closer the orientations
+	/// are to the ones computed over all the pixels of a region. Regions that are not larger than the grid itself
+	/// are still processed pixel by pixel. By default set to 0 (all the pixels are used).
+	void set_orientation_grid_size(int value);
+
+	/// Get storage format of normalized patches.
+	PatchFormats::PatchFormat patch_format() const;
+
+	/// Set storage format of normalized patches (float32 by default). Compact formats (uint8 with per-patch
+	/// scale and offset, or float16) reduce memory footprint of the cache and bandwidth of the distance computation
+	/// at the cost of a quantization error. Only patches normalized afterwards are affected.
+	void set_patch_format(PatchFormats::PatchFormat value);
+
+	/// Get the regular grid that is used in distance computation (pruned, if the node tolerance is set).
 	std::shared_ptr<GridInfo> grid();
 
 	/// Get number of points in a normalized patch that is used in distance computation.
@@ -84,20 +125,60 @@ public:
 	/// Specify whether normalized patches should be cached or not (true by default).
 	void set_use_cache(bool value);
 
-    void precompute_normalized_patches(const StructureTensorBundle &bundle);
+	/// Normalize the patch at a given point and put it into the cache of the bundle, unless it is cached already.
+	/// @note Distances are computed in parallel lazily normalizing patches of different points, so patches
+	///       shared by all the comparisons (e.g. of a query point) should be normalized beforehand.
+	void normalize_patch(const StructureTensorBundle &bundle, Point point);
+
+	/// Normalize patches at given points of a bundle in parallel as tasks nested into a given group,
+	/// unless they are cached already.
+	/// @note The points shall be distinct.
+	void normalize_patches(const StructureTensorBundle &bundle, const std::vector<Point> &points, TaskGroup &parent);
+
+	/// Normalize patches at all the points of a bundle and put them into the cache of the bundle.
+	/// Blocks of roughly equal predicted cost are processed in parallel by the shared thread pool.
+	/// @return Predicted versus actual costs of the blocks.
+	/// @see StructureTensorBundle::cost_model()
+	LoadBalanceReport precompute_normalized_patches(const StructureTensorBundle &bundle);
+
+	/// Normalize patches at all the points of a bundle as tasks nested into a given group.
+	/// @note If the group is cancelled, the cache may remain incomplete.
+	LoadBalanceReport precompute_normalized_patches(const StructureTensorBundle &bundle, TaskGroup &parent);
+
+	/// Normalize patches only at the points of a given area of a bundle (e.g. a search window),
+	/// so that the cost is proportional to the area. Other patches are still normalized on demand.
+	LoadBalanceReport precompute_normalized_patches(const StructureTensorBundle &bundle, const Rectangle &area);
+
+	/// Normalize patches at the points of a given area as tasks nested into a given group.
+	LoadBalanceReport precompute_normalized_patches(const StructureTensorBundle &bundle,
+													const Rectangle &area,
+													TaskGroup &parent);
 
 private:
 	static constexpr float EPS = 0.0001f;
+	static constexpr int NODES_BLOCK = 16;	// consecutive nodes compared at once by the kernels of packed patches
 
 	EllipseNormalization _normalization;
-	std::shared_ptr<GridInfo> _grid;	// Note: we normalize patches to unit circles, so no need for two grids
+	std::shared_ptr<GridInfo> _full_grid;	// Note: we normalize patches to unit circles, so no need for two grids
+	std::shared_ptr<GridInfo> _grid;		// grid without the pruned nodes, used in all the computations
+	std::shared_ptr<GridInfo> _orientation_grid;	// grid to sample gradients at (null if all the pixels are used)
 	std::unique_ptr<float[]> _weights;
+	std::unique_ptr<int[]> _nodes_order;	// ids of the grid nodes sorted by their weights in descending order
+	std::unique_ptr<int[]> _blocks_order;	// ids of blocks of NODES_BLOCK consecutive nodes sorted in the same way
+	double _total_weight;					// sum of all the weights
+	unsigned long _weights_id;				// identifies parameters that per-patch (bilateral) weights depend on
+	double _pruning_error;					// fraction of the total weight discarded by pruning
+
+	static std::atomic<unsigned long> _weights_id_counter;
 
 	float _scale;
 	float _bilateral_k_color;
 	float _bilateral_k_spatial;
+	float _node_tolerance;
+	PatchFormats::PatchFormat _patch_format;
 	bool _use_bilateral;
 	int _grid_size;
+	int _orientation_grid_size;
 	int _reference_channel;
 	bool _use_cache;
 
@@ -105,6 +186,7 @@ private:
 							 const std::vector<NormalizedPatch> &normalized_target,
 							 float radius,
 							 int number_of_channels,
+							 float bound,
 							 int &source_id,
 							 int &target_id);
 
@@ -112,13 +194,59 @@ private:
 							 const std::vector<NormalizedPatch> &normalized_target,
 							 float radius,
 							 int number_of_channels,
+							 float bound,
 							 int &source_id,
 							 int &target_id);
 
+	bool compare_patches(const NormalizedPatch &source,
+						 const NormalizedPatch &target,
+						 const float *weights,
+						 int first_channel,
+						 int number_of_channels_used,
+						 double abandon_threshold,
+						 double &distance,
+						 double &total_weight);
+
+	template <class Patch>
+	inline bool accumulate_distance(const Patch &source,
+									const Patch &target,
+									const float *weights,
+									int first_channel,
+									int number_of_channels_used,
+									double abandon_threshold,
+									double &distance,
+									double &total_weight);
+
+	bool accumulate_distance(const Uint8PatchView &source,
+							 const Uint8PatchView &target,
+							 const float *weights,
+							 int first_channel,
+							 int number_of_channels_used,
+							 double abandon_threshold,
+							 double &distance,
+							 double &total_weight);
+
+	bool accumulate_distance(const Float16PatchView &source,
+							 const Float16PatchView &target,
+							 const float *weights,
+							 int first_channel,
+							 int number_of_channels_used,
+							 double abandon_threshold,
+							 double &distance,
+							 double &total_weight);
+
 	void update_weights();
 
+	void update_weights_id();
+
+	void calculate_bilateral_weights(std::vector<NormalizedPatch> &normalized_patch,
+									 float radius,
+									 int number_of_channels);
+
 	float* calculate_weights(const GridInfo *grid, float sigma_factor);
 
+	std::shared_ptr<GridInfo> prune_grid(const GridInfo &grid, const float *weights, float tolerance, double &pruning_error);
+
 	inline void normalize_patch_internal(const StructureTensorBundle &bundle,
 										 Point point,
 										 std::vector<NormalizedPatch> &normalized_patch);
@@ -0,0 +1,123 @@
+/**
+ * Copyright (C) 2016, Vadim Fedorov <coderiks@gmail.com>
+ *
+ * This program is free software: you can use, modify and/or
+ * redistribute it under the terms of the simplified BSD
+ * License. You should have received a copy of this license along
+ * this program. If not, see
+ * <http://www.opensource.org/licenses/bsd-license.html>.
+ */
+
+#ifndef COST_MODEL_H_
+#define COST_MODEL_H_
+
+#include <vector>
+#include <functional>
+#include "image.h"
+#include "rectangle.h"
+#include "thread_pool.h"
+
+namespace msas
+{
+
+/**
+ * Rectangular block of the domain, [x_0, x_1) x [y_0, y_1), processed by a dense pass as a single task.
+ */
+struct CostBlock
+{
+	int x_0, y_0, x_1, y_1;
+	double predicted_cost;		// in relative units
+	double actual_cost;			// time spent on the block in seconds (0 until the block is processed)
+};
+
+
+/**
+ * Summary of how well the predicted costs of blocks matched the actual ones.
+ */
+struct LoadBalanceReport
+{
+	int number_of_blocks;
+	double predicted_cost;		// total predicted cost
+	double actual_cost;			// total time spent on the blocks in seconds
+	double correlation;			// Pearson correlation between the predicted and actual costs of blocks
+	double predicted_imbalance;	// ratio of the largest predicted cost of a block to the mean one
+	double actual_imbalance;	// ratio of the longest time spent on a block to the mean one
+
+	LoadBalanceReport()
+			: number_of_blocks(0), predicted_cost(0.0), actual_cost(0.0), correlation(0.0),
+			  predicted_imbalance(0.0), actual_imbalance(0.0) {}
+};
+
+
+/**
+ * Predicts the cost of computing structure tensors (and everything that depends on the size of
+ * the elliptical regions) at every point, so that dense passes can be split into blocks of roughly equal cost.
+ * In flat areas the regions grow until they collect enough gradient energy, hence the cost of a point
+ * is predicted by the area of a disk, which is self-consistent with the mean gradient energy inside it:
+ * area = pi * R^2 / energy. The mean energy is taken from an integral image over squares of doubling size.
+ * The cost of a point is then POINT_OVERHEAD + area^AREA_EXPONENT, as fitted to timings of structure tensors.
+ * Predictions are made on a coarse grid of cells.
+ */
+class CostModel
+{
+public:
+	/// @param dyadics Precomputed dyadic products of gradient vectors, stored in 3 channels: dx*dx, dx*dy, dy*dy.
+	/// @param radius Value of R parameter of the structure tensors.
+	/// @param max_size_limit Max allowed radius of an ellipse in a uniform region (0 if there is no limit).
+	/// @note Images may wrap external buffers with padded rows (@see ImageFx::stride()), as well as be views.
+	CostModel(const ImageFx<float> &dyadics, float radius, float max_size_limit = 0.0f);
+
+	/// @param grad_x X component of an image gradient.
+	/// @param grad_y Y component of an image gradient.
+	CostModel(const ImageFx<float> &grad_x, const ImageFx<float> &grad_y, float radius, float max_size_limit = 0.0f);
+
+	/// Get predicted cost of a rectangle [x_0, x_1) x [y_0, y_1).
+	double predict(int x_0, int y_0, int x_1, int y_1) const;
+
+	/// Split the domain into a given number of blocks of roughly equal predicted cost (by recursive bisection).
+	std::vector<CostBlock> partition(int number_of_blocks) const;
+
+	/// Split the domain into the default number of blocks for a given pool.
+	std::vector<CostBlock> partition(const ThreadPool &pool) const;
+
+	/// Split a part of the domain into a given number of blocks of roughly equal predicted cost.
+	/// @note Blocks are clipped by the area (and by the domain), so that none of them is empty.
+	std::vector<CostBlock> partition(const Rectangle &area, int number_of_blocks) const;
+
+	/// Split a part of the domain into the default number of blocks for a given pool.
+	std::vector<CostBlock> partition(const Rectangle &area, const ThreadPool &pool) const;
+
+	/// Process blocks as tasks nested into a given group, measuring the actual cost of every block.
+	/// @param body Function called with the corners of a block: body(x_0, y_0, x_1, y_1).
+	void run(std::vector<CostBlock> &blocks,
+			 TaskGroup &parent,
+			 const std::function<void(int, int, int, int)> &body) const;
+
+	/// Partition the domain for the shared pool, process the blocks and wait for them.
+	/// @return Predicted versus actual costs of the blocks.
+	LoadBalanceReport run(const std::function<void(int, int, int, int)> &body) const;
+
+	/// Partition a part of the domain for the shared pool, process the blocks and wait for them.
+	LoadBalanceReport run(const Rectangle &area, const std::function<void(int, int, int, int)> &body) const;
+
+	/// Compare predicted and actual costs of processed blocks.
+	static LoadBalanceReport report(const std::vector<CostBlock> &blocks);
+
+private:
+	constexpr static int CELL_SIZE = 4;				// size of the cells costs are predicted for
+	constexpr static int BLOCKS_PER_THREAD = 8;
+	constexpr static double POINT_OVERHEAD = 32.0;	// cost of a point independent of the region size (in pixels)
+	constexpr static double AREA_EXPONENT = 0.75;	// iterations converge faster in large regions, so the cost grows sublinearly
+
+	Shape _size;
+	int _cells_x, _cells_y;
+	std::vector<double> _integral_cost;		// summed area table of the predicted costs of cells
+
+	void initialize(const std::vector<double> &integral_energy, float radius, float max_size_limit);
+	void bisect(int x_0, int y_0, int x_1, int y_1, int number_of_blocks, std::vector<CostBlock> &blocks) const;
+	inline double cell_cost(int x_0, int y_0, int x_1, int y_1) const;
+};
+
+}	// namespace msas
+
+#endif /* COST_MODEL_H_ */
@@ -17,6 +17,7 @@
 #include <memory>
 #include "lut_math.h"
 #include "grid_info.h"
+#include "normalized_patch.h"
 #include "image.h"
 #include "mask.h"
 #include "shape.h"
@@ -27,6 +28,41 @@
 namespace msas
 {
 
+/**
+ * Scratch buffers reused by EllipseNormalization between calls, so that normalization of patches
+ * does not allocate memory in steady state. Every thread has its own instance.
+ * @see EllipseNormalization::workspace()
+ */
+struct NormalizationWorkspace {
+	std::vector<float> histogram;
+	std::vector<float> buffer;
+	std::vector<std::pair<float, int> > candidates;
+	std::vector<int> peaks;
+	std::vector<int> offsets;
+	std::vector<float> coeffs_x;
+	std::vector<float> coeffs_y;
+	std::vector<float> values;
+	std::vector<Point> region;
+	std::vector<float> orientations;
+	std::vector<Matrix2f> rotations;
+	std::vector<Matrix2f> transforms;
+	std::vector<Point> centers;
+	size_t allocations;		// number of times the buffers had to grow
+
+	NormalizationWorkspace() : allocations(0) {}
+
+	/// Resize a buffer to a given length, counting reallocations.
+	template <class T>
+	T* reserve(std::vector<T> &buffer, size_t length) {
+		if (buffer.capacity() < length) {
+			allocations++;
+		}
+		buffer.resize(length);
+		return buffer.data();
+	}
+};
+
+
 /**
  * Encapsulates logic related to normalization of an elliptical region to a disc
  * and subsequent interpolation of it to a regular grid. Computation of dominant
@@ -47,6 +83,10 @@ public:
 	/// @note Since transformations are usually normalized by the radius, the default radius is set to 1.0f here
 	std::shared_ptr<GridInfo> create_regular_grid(int grid_size, float radius = 1.0f);
 
+	/// Create regular grid to sample gradients for the dominant orientations calculation.
+	/// @note The grid covers the disc of three sigmas, beyond which the intra-patch Gaussian weights are negligible.
+	std::shared_ptr<GridInfo> create_orientation_grid(int grid_size);
+
 	/// Calculate dominant orientations of gradient vectors within an elliptical region (patch).
 	/// @param gradient_x X component of an image gradient.
 	/// @param gradient_y Y component of an image gradient.
@@ -60,6 +100,39 @@ public:
 													   Matrix2f transform,
 													   Point center);
 
+	/// Calculate dominant orientations of gradient vectors within an elliptical region (patch).
+	/// @param dominant_orientations [out] Set of dominant orientations (angles in radians).
+	void calculate_dominant_orientations(const Image<float> &gradient_x,
+										 const Image<float> &gradient_y,
+										 const std::vector<Point> &region,
+										 Matrix2f transform,
+										 Point center,
+										 std::vector<float> &dominant_orientations);
+
+	/// Calculate dominant orientations of gradient vectors sampled at the nodes of a regular grid
+	/// mapped to an elliptical region (patch). Gradients are interpolated as in interpolate_to_grid(),
+	/// so the cost depends on the grid size only, not on the size of the region.
+	/// @param gradient_x X component of an image gradient.
+	/// @param gradient_y Y component of an image gradient.
+	/// @param grid Regular grid to sample gradients at (@see create_orientation_grid()).
+	/// @param transform Normalizing transformation that maps the elliptical region to a disk.
+	/// @param center Central point of the elliptical region.
+	/// @return Set of dominant orientations (angles in radians).
+	std::vector<float> calculate_dominant_orientations(const Image<float> &gradient_x,
+													   const Image<float> &gradient_y,
+													   const GridInfo &grid,
+													   Matrix2f transform,
+													   Point center);
+
+	/// Calculate dominant orientations of gradient vectors sampled at the nodes of a regular grid.
+	/// @param dominant_orientations [out] Set of dominant orientations (angles in radians).
+	void calculate_dominant_orientations(const Image<float> &gradient_x,
+										 const Image<float> &gradient_y,
+										 const GridInfo &grid,
+										 Matrix2f transform,
+										 Point center,
+										 std::vector<float> &dominant_orientations);
+
 	/// Normalize and interpolate an elliptical region (patch) to a regular grid.
 	/// @param grid Regular grid to be used in the interpolation.
 	/// @param image Original image.
@@ -67,21 +140,80 @@ public:
 	/// @param transform Normalizing transformation that maps the elliptical region to a disk.
 	/// @param center Central point of the elliptical region.
 	/// @return Set of interpolated color values that map ont-to-one to the grid nodes.
+	/// @note The mask is eroded on every call, use the versions with an interpolation mask for repeated calls.
 	std::shared_ptr<float*> interpolate_to_grid(const GridInfo &grid,
 												const ImageFx<float> &image,
 												const MaskFx &mask,
 												Matrix2f transform,
 												Point center);
 
+	/// Normalize and interpolate an elliptical region (patch) to a regular grid into a caller-provided memory.
+	/// @param grid Regular grid to be used in the interpolation.
+	/// @param image Original image.
+	/// @param interpolation_mask Mask of the points, which can be interpolated (@see erode_mask()).
+	/// @param transform Normalizing transformation that maps the elliptical region to a disk.
+	/// @param center Central point of the elliptical region.
+	/// @param values [out] Memory for 'number_of_channels * grid.nodes_length' interpolated values,
+	///               channels are stored one after another.
+	/// @note The image may have padded rows (e.g. wrap an external buffer with a row pitch) or be a view
+	///       (masks are always contiguous, since they deep copy their source).
+	void interpolate_to_grid(const GridInfo &grid,
+							 const ImageFx<float> &image,
+							 const MaskFx &interpolation_mask,
+							 Matrix2f transform,
+							 Point center,
+							 float *values);
+
+	/// Normalize and interpolate a batch of elliptical regions (patches) to a regular grid.
+	/// @param transforms Normalizing transformations of the regions.
+	/// @param centers Central points of the regions.
+	/// @param values [out] Memory for 'centers.size()' patches laid out one after another,
+	///               each of them as in the single patch version above.
+	void interpolate_to_grid(const GridInfo &grid,
+							 const ImageFx<float> &image,
+							 const MaskFx &interpolation_mask,
+							 const std::vector<Matrix2f> &transforms,
+							 const std::vector<Point> &centers,
+							 float *values);
+
+	/// Erode a mask, so that a point remains in it only if all four pixels, which are used to interpolate
+	/// values between this point and its right and bottom neighbours, are in the original mask.
+	static Mask erode_mask(const MaskFx &mask);
+
 	/// Rotate given normalized patch by 180 degrees.
 	std::shared_ptr<float*> flip(const std::shared_ptr<float*> normalized_patch,
 								 int grid_length,
 								 uint number_of_channels);
 
+	/// Rotate given normalized patch by 180 degrees into a caller-provided memory.
+	void flip(const float * const *normalized_patch,
+			  int grid_length,
+			  uint number_of_channels,
+			  float **flipped_patch);
+
+	/// Convert a normalized patch to a compact storage format, the float values are released.
+	/// Patches are quantized to uint8 codes using per-patch scale and offset, or converted to half precision floats.
+	/// Unknown nodes are marked by reserved codes.
+	/// @param normalized_patch Normalized patch stored as floats.
+	/// @param format Storage format.
+	/// @param grid_length Number of nodes in the patch.
+	/// @param number_of_channels Number of channels in the patch.
+	void pack(NormalizedPatch &normalized_patch,
+			  PatchFormats::PatchFormat format,
+			  int grid_length,
+			  uint number_of_channels);
+
 	/// Compute rotation matrix from a dominant orientation.
 	/// @param orientation Dominant orientation in radians.
 	Matrix2f rotation(const float &orientation);
 
+	/// Get scratch buffers of the calling thread.
+	static NormalizationWorkspace& workspace();
+
+	/// Get number of times scratch buffers of the calling thread were (re)allocated.
+	/// @note Stays constant in steady state.
+	static size_t allocations();
+
 private:
 	constexpr static float NO_VALUE = -9999.0f;
 
@@ -91,16 +223,21 @@ private:
 	constexpr static float 	DEFAULT_HISTOGRAM_CUT_OFF = 0.45;	// Note: in the SIFT paper was suggested to be 0.8
 	constexpr static float 	DEFAULT_SIGMA = 0.2f;
 
+	// Kernel for histogram smoothing, equivalent to six passes of [1/3, 1/3, 1/3] box filter
+	constexpr static int 	SMOOTHING_KERNEL_LENGTH = 13;
+	constexpr static float 	SMOOTHING_KERNEL[SMOOTHING_KERNEL_LENGTH] = {
+			1.0f / 729.0f, 6.0f / 729.0f, 21.0f / 729.0f, 50.0f / 729.0f, 90.0f / 729.0f, 126.0f / 729.0f,
+			141.0f / 729.0f,
+			126.0f / 729.0f, 90.0f / 729.0f, 50.0f / 729.0f, 21.0f / 729.0f, 6.0f / 729.0f, 1.0f / 729.0f};
+
 	int _num_bins;
 	int _num_orientations;		// maximum number of orientations to be returned
 	float _histogram_cut_off;	// portion of the highest peak in the histogram below which we cut-off smaller peaks
 	float _sigma;				// Gaussian sigma for weighting distance from a point to the patch center
 
-	struct dsc_sort_by_first {
-		bool operator()(const std::pair<float, int> &left, const std::pair<float, int> &right) {
-			return left.first > right.first;
-		}
-	};
+	inline void add_to_histogram(float *histogram, float grad_x, float grad_y, float weight, float bin_width);
+	void select_dominant_orientations(float *histogram, float bin_width, std::vector<float> &dominant_orientations);
+	int plateau_length(const float *histogram, int id) const;
 };
 
 }	// namespace msas
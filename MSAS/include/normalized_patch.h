@@ -13,6 +13,7 @@
 
 #include <memory>
 #include "matrix.h"
+#include "patch_format.h"
 
 namespace msas {
 
@@ -21,17 +22,95 @@ namespace msas {
  * the normalizing transformation and the additional orthogonal transformation (e.g. rotation).
  * Notice that the color values of the patch are stored as 1D array which elements
  * map one-to-one to the grid nodes.
- * @see GridInfo
+ * The values are stored either as floats in 'patch', or packed in 'packed_patch' in one of
+ * the compact formats (channels one after another, unknown nodes marked by reserved codes).
+ * Optionally, per-node weights that depend on the patch itself (e.g. bilateral weights)
+ * can be cached along with it. They are tagged by the id of the parameters they were computed with.
+ * @see GridInfo, EllipseNormalization::pack()
  */
 struct NormalizedPatch {
-	std::shared_ptr<float *> patch;        // normalized and interpolated patch
+	std::shared_ptr<float *> patch;        // normalized and interpolated patch (float32 format)
+	std::shared_ptr<uint8_t> packed_patch; // packed patch (uint8 and float16 formats)
+	PatchFormats::PatchFormat format;      // format the values are stored in
+	size_t length;               // number of nodes (for packed patches)
+	float scale;                 // value = code * scale + offset (uint8 format)
+	float offset;
 	Matrix2f base_transform;     // normalizing transformation
 	Matrix2f extra_transform;    // additional orthogonal transformation
+	std::shared_ptr<float> weights;        // [optional] per-node weights, map one-to-one to the grid nodes
+	double total_weight;         // sum of 'weights'
+	unsigned long weights_id;    // id of the parameters 'weights' were computed with (0 if there are no weights)
 
 	NormalizedPatch(std::shared_ptr<float *> patch,
 					Matrix2f base_transform,
 					Matrix2f extra_transform = Matrix::identity())
-			: patch(patch), base_transform(base_transform), extra_transform(extra_transform) {}
+			: patch(patch), format(PatchFormats::float32), length(0), scale(1.0f), offset(0.0f),
+			  base_transform(base_transform), extra_transform(extra_transform),
+			  total_weight(0.0), weights_id(0) {}
+
+	/// Check whether the color at k-th node is known.
+	inline bool is_known(int k) const {
+		switch (format) {
+			case PatchFormats::uint8:
+				return packed_patch.get()[k] != UINT8_NO_VALUE;
+			case PatchFormats::float16:
+				return ((const uint16_t *)packed_patch.get())[k] != FLOAT16_NO_VALUE;
+			default:
+				return patch.get()[0][k] >= -256.0f;
+		}
+	}
+
+	/// Get color value at k-th node for a given channel, regardless of the storage format.
+	inline float value(int channel, int k) const {
+		switch (format) {
+			case PatchFormats::uint8:
+				return packed_patch.get()[channel * length + k] * scale + offset;
+			case PatchFormats::float16:
+				return half_to_float(((const uint16_t *)packed_patch.get())[channel * length + k]);
+			default:
+				return patch.get()[channel][k];
+		}
+	}
+};
+
+
+/**
+ * Lightweight accessors of normalized patches stored in a particular format.
+ * They provide the same interface as NormalizedPatch, but without dispatching on the format.
+ */
+struct Float32PatchView {
+	float **data;
+
+	explicit Float32PatchView(const NormalizedPatch &patch) : data(patch.patch.get()) {}
+
+	inline bool is_known(int k) const { return data[0][k] >= -256.0f; }
+	inline float value(int channel, int k) const { return data[channel][k]; }
+};
+
+
+struct Uint8PatchView {
+	const uint8_t *data;
+	size_t length;
+	float scale;
+	float offset;
+
+	explicit Uint8PatchView(const NormalizedPatch &patch)
+			: data(patch.packed_patch.get()), length(patch.length), scale(patch.scale), offset(patch.offset) {}
+
+	inline bool is_known(int k) const { return data[k] != UINT8_NO_VALUE; }
+	inline float value(int channel, int k) const { return data[channel * length + k] * scale + offset; }
+};
+
+
+struct Float16PatchView {
+	const uint16_t *data;
+	size_t length;
+
+	explicit Float16PatchView(const NormalizedPatch &patch)
+			: data((const uint16_t *)patch.packed_patch.get()), length(patch.length) {}
+
+	inline bool is_known(int k) const { return data[k] != FLOAT16_NO_VALUE; }
+	inline float value(int channel, int k) const { return half_to_float(data[channel * length + k]); }
 };
 
 }
@@ -0,0 +1,94 @@
+/**
+ * Copyright (C) 2016, Vadim Fedorov <coderiks@gmail.com>
+ *
+ * This program is free software: you can use, modify and/or
+ * redistribute it under the terms of the simplified BSD
+ * License. You should have received a copy of this license along
+ * this program. If not, see
+ * <http://www.opensource.org/licenses/bsd-license.html>.
+ */
+
+#ifndef PATCH_FORMAT_H
+#define PATCH_FORMAT_H
+
+#include <cstdint>
+#include <cstring>
+#include <cmath>
+#ifdef __F16C__
+#include <immintrin.h>
+#endif
+
+namespace msas {
+
+namespace PatchFormats
+{
+	/// Storage formats of normalized patches.
+	/// float32 - plain floats; uint8 - 8-bit codes with per-patch scale and offset; float16 - half precision floats.
+	enum PatchFormat {float32, uint8, float16};
+}
+
+
+/**
+ * Reserved codes of unknown nodes for the compact storage formats.
+ */
+constexpr uint8_t UINT8_NO_VALUE = 255;			// codes 0..254 are used for values
+constexpr uint16_t FLOAT16_NO_VALUE = 0xFFFF;	// NaN, never produced by conversion of finite values
+
+
+/**
+ * Convert a finite float to half precision (round to nearest).
+ * @note Values beyond the half precision range are saturated.
+ */
+inline uint16_t float_to_half(float value)
+{
+	uint32_t bits;
+	std::memcpy(&bits, &value, sizeof(bits));
+	uint32_t sign = (bits >> 16) & 0x8000;
+
+	// Rebias the exponent by scaling, then round and drop the extra mantissa bits
+	float magnitude = std::abs(value) * 1.92592994e-34f;	// 2^-112
+	std::memcpy(&bits, &magnitude, sizeof(bits));
+	bits = (bits + 0x1000) >> 13;
+	if (bits > 0x7BFF) {
+		bits = 0x7BFF;
+	}
+
+	return (uint16_t)(sign | bits);
+}
+
+
+/**
+ * Convert half precision value to float.
+ * @note Infinities and NaNs are not supported.
+ */
+inline float half_to_float(uint16_t value)
+{
+	uint32_t bits = (uint32_t)(value & 0x7FFF) << 13;
+	float magnitude;
+	std::memcpy(&magnitude, &bits, sizeof(magnitude));
+	magnitude *= 5.19229686e+33f;	// 2^112
+
+	return (value & 0x8000) ? -magnitude : magnitude;
+}
+
+
+/**
+ * Convert an array of half precision values to floats.
+ * Uses F16C instructions when the target supports them (e.g. built with -mf16c or -march=native).
+ */
+inline void halves_to_floats(const uint16_t *values, int length, float *result)
+{
+	int i = 0;
+#ifdef __F16C__
+	for (; i + 8 <= length; i += 8) {
+		_mm256_storeu_ps(result + i, _mm256_cvtph_ps(_mm_loadu_si128((const __m128i *)(values + i))));
+	}
+#endif
+	for (; i < length; i++) {
+		result[i] = half_to_float(values[i]);
+	}
+}
+
+}	// namespace msas
+
+#endif //PATCH_FORMAT_H
@@ -0,0 +1,113 @@
+/**
+ * Copyright (C) 2016, Vadim Fedorov <coderiks@gmail.com>
+ *
+ * This program is free software: you can use, modify and/or
+ * redistribute it under the terms of the simplified BSD
+ * License. You should have received a copy of this license along
+ * this program. If not, see
+ * <http://www.opensource.org/licenses/bsd-license.html>.
+ */
+
+#ifndef SELF_SIMILARITY_SEARCH_H_
+#define SELF_SIMILARITY_SEARCH_H_
+
+#include <vector>
+#include <limits>
+#include "affine_patch_distance.h"
+#include "structure_tensor_bundle.h"
+#include "image.h"
+#include "point.h"
+#include "thread_pool.h"
+
+namespace msas
+{
+
+/**
+ * Finds the most similar (in terms of the affine invariant patch distance) neighbours of every pixel
+ * of a bundle within a square search window, as needed for non-local means and similar filters.
+ * The domain is processed tile by tile, so that patches of neighbouring pixels stay in cache, and
+ * every unordered pair of pixels is compared only once. Tiles are split into 3x3 phases, so that
+ * tiles processed in parallel never touch the same pixels.
+ * @note When bilateral weights are used, the distance is not symmetric. In this case the distance
+ * 		 computed with the point, which comes later in the scan order, as a target is used for both points.
+ */
+class SelfSimilaritySearch
+{
+public:
+	/// @param patch_distance Calculator of patch distances.
+	/// @param search_radius Radius of the search window (the window is (2 * radius + 1) pixels wide).
+	/// @param number_of_neighbours Maximum number of neighbours to be kept for every pixel.
+	SelfSimilaritySearch(AffinePatchDistance &patch_distance, int search_radius, int number_of_neighbours);
+
+	/// Find the best neighbours for every pixel of a bundle.
+	/// @note Pixel itself is not considered as its own neighbour.
+	void run(const StructureTensorBundle &bundle);
+
+	/// Find the best neighbours for every pixel of a bundle, running the tiles as tasks nested into a given group.
+	/// @note If the group is cancelled, the results are incomplete.
+	void run(const StructureTensorBundle &bundle, TaskGroup &parent);
+
+	/// Get neighbours found by the last run, stored in 'number_of_neighbours' channels sorted by distance.
+	/// @note Missing neighbours are set to Point(-1, -1).
+	Image<Point> neighbours() const;
+
+	/// Get distances to the neighbours found by the last run.
+	/// @note Distances to missing neighbours are set to std::numeric_limits<float>::max().
+	Image<float> distances() const;
+
+	/// Get non-local means weights, exp(-distance / h^2), of the neighbours normalized to sum up to one at every pixel.
+	Image<float> weights() const;
+
+	/// Compute non-local means estimate of a given image using the neighbours found by the last run.
+	/// @note The pixel itself is included with the weight of its best neighbour.
+	Image<float> filter(const ImageFx<float> &image) const;
+
+	/// Get/set radius of the search window.
+	int search_radius() const;
+	void set_search_radius(int value);
+
+	/// Get/set maximum number of neighbours to be kept for every pixel.
+	int number_of_neighbours() const;
+	void set_number_of_neighbours(int value);
+
+	/// Get/set size of tiles. Tiles are never smaller than the search radius.
+	int tile_size() const;
+	void set_tile_size(int value);
+
+	/// Get/set filtering parameter h of the non-local means weights.
+	float filtering_parameter() const;
+	void set_filtering_parameter(float value);
+
+private:
+	constexpr static int DEFAULT_TILE_SIZE = 32;
+	constexpr static float DEFAULT_FILTERING_PARAMETER = 10.0f;
+
+	struct Candidate
+	{
+		float distance;
+		Point point;
+
+		friend inline bool operator<(const Candidate &lhs, const Candidate &rhs) {
+			return lhs.distance < rhs.distance;
+		}
+	};
+
+	AffinePatchDistance &_patch_distance;
+	int _search_radius;
+	int _number_of_neighbours;
+	int _tile_size;
+	float _filtering_parameter;
+
+	Shape _size;
+	std::vector<Candidate> _candidates;		// max-heaps of 'number_of_neighbours' candidates for every pixel
+	std::vector<int> _counts;				// number of candidates in every heap
+
+	void process_tile(const StructureTensorBundle &bundle, int x_0, int y_0, int x_1, int y_1);
+
+	inline float worst_distance(int index) const;
+	inline void insert(int index, float distance, Point point);
+};
+
+}	// namespace msas
+
+#endif /* SELF_SIMILARITY_SEARCH_H_ */
@@ -0,0 +1,206 @@
+/**
+ * Copyright (C) 2016, Vadim Fedorov <coderiks@gmail.com>
+ *
+ * This program is free software: you can use, modify and/or
+ * redistribute it under the terms of the simplified BSD
+ * License. You should have received a copy of this license along
+ * this program. If not, see
+ * <http://www.opensource.org/licenses/bsd-license.html>.
+ */
+
+#ifndef SIMILARITY_MAP_H_
+#define SIMILARITY_MAP_H_
+
+#include <mutex>
+#include <atomic>
+#include <vector>
+#include <functional>
+#include "affine_patch_distance.h"
+#include "distance_info.h"
+#include "structure_tensor_bundle.h"
+#include "image.h"
+#include "point.h"
+#include "rectangle.h"
+
+namespace msas
+{
+
+/**
+ * Patches of a bundle, which have to be normalized for a computation:
+ * all the points of an area and separate points outside of it.
+ */
+struct RequiredPatches
+{
+	const StructureTensorBundle *bundle;
+	Rectangle area;
+	std::vector<Point> points;
+};
+
+
+/**
+ * Computes similarity (distance) maps: affine invariant patch distances between points of interest
+ * in the source bundle and the points of the target bundle. The target is processed in tiles, which are
+ * run in parallel by the shared thread pool. Patches missing in the caches of the bundles are normalized
+ * on the fly, the patches of the points of interest are normalized before the tiles are run.
+ * Maps of several points are computed in a single pass: every target point of a tile is compared to
+ * a block of points of interest at once, so that its patch is fetched from memory once per block.
+ * @note Maps may be computed simultaneously, if patches of the target points are precomputed
+ *       (@see AffinePatchDistance::precompute_normalized_patches()), since they are cached otherwise.
+ */
+class SimilarityMap
+{
+public:
+	/// Function called after the distances of a tile [x_0, x_1) x [y_0, y_1) are computed
+	/// (simultaneously for different tiles).
+	typedef std::function<void(int, int, int, int)> TileFunc;
+
+	explicit SimilarityMap(AffinePatchDistance &patch_distance);
+
+	/// Compute distances (square roots of the patch distances) between a point of the source bundle
+	/// and every point of the target bundle.
+	/// @param distances [out] Distances at the points of the target, reallocated unless it is of the target size.
+	/// @param tile_func [optional] Function called after every tile of distances is computed.
+	/// @note Source and target bundles may coincide.
+	void calculate(const StructureTensorBundle &source_bundle,
+				   Point source_point,
+				   const StructureTensorBundle &target_bundle,
+				   Image<float> &distances,
+				   TileFunc tile_func = TileFunc()) const;
+
+	/// Compute distances between a point of the source bundle and every point of the target bundle.
+	Image<float> calculate(const StructureTensorBundle &source_bundle,
+						   Point source_point,
+						   const StructureTensorBundle &target_bundle) const;
+
+	/// Compute distance maps of several points of the source bundle in a single pass over the target.
+	/// @param distances [out] Distances stored in one channel per point of interest (in the given order),
+	///                  reallocated unless it is of the target size with the right number of channels.
+	/// @param tile_func [optional] Function called after every tile of distances (of all points) is computed.
+	void calculate(const StructureTensorBundle &source_bundle,
+				   const std::vector<Point> &source_points,
+				   const StructureTensorBundle &target_bundle,
+				   Image<float> &distances,
+				   TileFunc tile_func = TileFunc()) const;
+
+	/// Compute distance maps of several points of the source bundle within an area of the target bundle only
+	/// (e.g. a search window or a region of interest), so that the cost is proportional to the area.
+	/// @param area Points of the target to compare with, clipped by the target domain.
+	/// @param distances [out] Distances at the points of the clipped area, relative to its top left point.
+	/// @param tile_func [optional] Function called after every tile of distances is computed,
+	///                  with bounds relative to the clipped area as well.
+	void calculate(const StructureTensorBundle &source_bundle,
+				   const std::vector<Point> &source_points,
+				   const StructureTensorBundle &target_bundle,
+				   const Rectangle &area,
+				   Image<float> &distances,
+				   TileFunc tile_func = TileFunc()) const;
+
+	/// Find k points of an area of the target bundle, which are the closest to a point of the source bundle,
+	/// without computing the distance map. Every tile keeps a bounded heap of its best matches, the worst of them
+	/// (or the worst of the k best matches merged from finished tiles) bounds the distance computations,
+	/// so that most of them are abandoned early.
+	/// @param area Points of the target to compare with, clipped by the target domain.
+	/// @param excluded_point [optional] Point of the target to skip (e.g. the point of interest within the same image).
+	/// @note k is limited by the number of points of the area.
+	/// @return At most k matches sorted by their distances (square roots of the patch distances) and then by
+	///         the scan order of their target points, with transforms of the best normalizations of both patches.
+	std::vector<DistanceInfo> find_best_matches(const StructureTensorBundle &source_bundle,
+												Point source_point,
+												const StructureTensorBundle &target_bundle,
+												const Rectangle &area,
+												int k,
+												Point excluded_point = Point(-1, -1)) const;
+
+	/// Find k best matches by a coarse-to-fine search, assuming that good matches form smooth basins: distances are
+	/// computed at the nodes of a lattice with the coarse stride, the nodes not worse than their 8 neighbours
+	/// are taken as basins and the best of them are refined densely within the refinement radius.
+	/// The cost is reduced roughly by the squared stride, but matches in narrow basins between the nodes may be missed.
+	/// @see find_best_matches()
+	std::vector<DistanceInfo> find_best_matches_coarse_to_fine(const StructureTensorBundle &source_bundle,
+															   Point source_point,
+															   const StructureTensorBundle &target_bundle,
+															   const Rectangle &area,
+															   int k,
+															   Point excluded_point = Point(-1, -1)) const;
+
+	/// @param number_of_evaluations [out] Number of target points compared with the point of interest.
+	std::vector<DistanceInfo> find_best_matches_coarse_to_fine(const StructureTensorBundle &source_bundle,
+															   Point source_point,
+															   const StructureTensorBundle &target_bundle,
+															   const Rectangle &area,
+															   int k,
+															   Point excluded_point,
+															   uint &number_of_evaluations) const;
+
+	/// Plan which patches have to be normalized in order to compare points of the source bundle with an area
+	/// of the target bundle: only the points of interest of the source and the area of the target.
+	/// If the bundles coincide, the union of them is planned for the single bundle.
+	/// @param area Area of the target, may be empty (e.g. if its patches are to be normalized on demand).
+	static std::vector<RequiredPatches> plan(const StructureTensorBundle &source_bundle,
+											 const std::vector<Point> &source_points,
+											 const StructureTensorBundle &target_bundle,
+											 const Rectangle &area);
+
+	/// Normalize the planned patches of all the bundles simultaneously as tasks nested into a given group.
+	/// @return Predicted versus actual costs of the blocks of the areas (in the order of the plan).
+	std::vector<LoadBalanceReport> precompute(const std::vector<RequiredPatches> &plan, TaskGroup &parent) const;
+
+	/// Get the area of the target within a given (Chebyshev) distance from any of the points of interest,
+	/// clipped by the target domain. If the radius is negative, the whole domain is returned.
+	/// @note The area is a bounding box, so for several distant points it includes the space between them.
+	static Rectangle search_area(const std::vector<Point> &source_points, int search_radius, Shape target_size);
+
+	/// Get/set size of tiles processed as separate tasks.
+	int tile_size() const;
+	void set_tile_size(int value);
+
+	/// Get/set number of points of interest every target point is compared to at once.
+	int query_block_size() const;
+	void set_query_block_size(int value);
+
+	/// Get/set distance between the nodes of the lattice of the coarse-to-fine search.
+	int coarse_stride() const;
+	void set_coarse_stride(int value);
+
+	/// Get/set radius of the windows around the basins, which are compared densely by the coarse-to-fine search.
+	int refinement_radius() const;
+	void set_refinement_radius(int value);
+
+	/// Get/set number of the best basins refined by the coarse-to-fine search.
+	int number_of_basins() const;
+	void set_number_of_basins(int value);
+
+private:
+	constexpr static int DEFAULT_TILE_SIZE = 16;
+	constexpr static int DEFAULT_QUERY_BLOCK_SIZE = 16;
+	constexpr static int DEFAULT_COARSE_STRIDE = 4;
+	constexpr static int DEFAULT_REFINEMENT_RADIUS = 4;
+	constexpr static int DEFAULT_NUMBER_OF_BASINS = 8;
+
+	AffinePatchDistance &_patch_distance;
+	int _tile_size;
+	int _query_block_size;
+	int _coarse_stride;
+	int _refinement_radius;
+	int _number_of_basins;
+
+	inline void match_point(const StructureTensorBundle &source_bundle,
+							Point source_point,
+							const StructureTensorBundle &target_bundle,
+							Point target_point,
+							int k,
+							const std::atomic<float> &merged_bound,
+							std::vector<DistanceInfo> &heap) const;
+	static inline void merge_matches(const std::vector<DistanceInfo> &heap,
+									 int k,
+									 std::vector<DistanceInfo> &matches,
+									 std::mutex &matches_mutex,
+									 std::atomic<float> &merged_bound);
+
+	static inline bool is_better_match(const DistanceInfo &first, const DistanceInfo &second);
+	static inline void push_match(std::vector<DistanceInfo> &heap, const DistanceInfo &match, int k);
+};
+
+}	// namespace msas
+
+#endif /* SIMILARITY_MAP_H_ */
@@ -16,13 +16,18 @@
 #include <memory>
 #include <functional>
 #include "image.h"
+#include "tiled_image.h"
+#include "block_traversal.h"
 #include "mask.h"
+#include "bit_mask.h"
 #include "point.h"
 #include "shape.h"
 #include "matrix.h"
 
 namespace msas {
 
+class CostModel;
+
 /**
  * Encapsulates iterative scheme for computing affine covariant structure tensors
  * and affine covariant regions (shape-adaptive patches) in 2D case. Implements also
@@ -55,6 +60,7 @@ public:
 	/// @param grad_y Y component of an image gradient.
 	/// @param point Point of interest.
 	/// @param mask Binary mask defining points that are allowed to contribute. When empty, all points are allowed.
+	/// @note Gradient images may be views or have padded rows, but both should share the same row stride.
 	Matrix2f calculate(const ImageFx<float> &grad_x,
 					   const ImageFx<float> &grad_y,
 					   const Point &point,
@@ -64,14 +70,25 @@ public:
 	/// @param dyadics Precomputed dyadic products of gradient vectors, stored in 3 channels: dx*dx, dx*dy, dy*dy.
 	/// @param point Point of interest.
 	/// @param mask Binary mask defining points that are allowed to contribute. When empty, all points are allowed.
+	/// @note Rows of @param dyadics are addressed via its stride, so views and padded images are fine.
 	Matrix2f calculate(const ImageFx<float> &dyadics,
 					   const Point &point,
 					   const MaskFx &mask) const;
 
+	/// Compute structure tensor at the given point.
+	/// @param dyadics Precomputed dyadic products of gradient vectors stored in tiles, 3 channels: dx*dx, dx*dy, dy*dy.
+	/// @param point Point of interest.
+	/// @param mask Binary mask defining points that are allowed to contribute. When empty, all points are allowed.
+	Matrix2f calculate(const TiledImage<float> &dyadics,
+					   const Point &point,
+					   const MaskFx &mask) const;
+
 	/// Compute structure tensors at every point.
 	/// @param grad_x X component of an image gradient.
 	/// @param grad_y Y component of an image gradient.
 	/// @param mask Binary mask defining points that are allowed to contribute. When empty, all points are allowed.
+	/// @note Blocks of roughly equal predicted cost are processed in parallel by the shared thread pool.
+	/// @note Views and padded rows are supported, the components of the gradient should share the row stride.
 	Image<Matrix2f> calculate(const ImageFx<float> &grad_x,
 							  const ImageFx<float> &grad_y,
 							  const MaskFx &mask) const;
@@ -79,14 +96,33 @@ public:
 	/// Compute structure tensors at every point.
 	/// @param dyadics Precomputed dyadic products of gradient vectors, stored in 3 channels: dx*dx, dx*dy, dy*dy.
 	/// @param mask Binary mask defining points that are allowed to contribute. When empty, all points are allowed.
+	/// @note Blocks of roughly equal predicted cost are processed in parallel by the shared thread pool.
+	/// @note Dyadic products are copied into tiles first, if the tiled field layout is set.
+	/// @note Dyadic products may be a view or have padded rows.
 	Image<Matrix2f> calculate(const ImageFx<float> &dyadics,
 							  const MaskFx &mask) const;
 
+	/// Compute structure tensors at every point starting the scheme from given tensors (warm start),
+	/// e.g. from the tensors of the previous video frame warped along the optical flow (@see TensorWarping).
+	/// @param dyadics Precomputed dyadic products of gradient vectors, stored in 3 channels: dx*dx, dx*dy, dy*dy.
+	/// @param mask Binary mask defining points that are allowed to contribute. When empty, all points are allowed.
+	/// @param initial_tensors Tensors to start from. At points with zero tensors the scheme starts from the band.
+	/// @param refinement_iterations Max number of iterations following a given tensor (at most iterations_amount
+	///        iterations are run at points started from the band).
+	/// @note Where the scheme does not converge, it usually alternates between two states, so an even number
+	///       of refinement iterations keeps the state the initial tensors were in.
+	/// @note Dyadic products may be a view or have padded rows.
+	Image<Matrix2f> calculate(const ImageFx<float> &dyadics,
+							  const MaskFx &mask,
+							  const ImageFx<Matrix2f> &initial_tensors,
+							  int refinement_iterations) const;
+
 	/// Compute structure tensor for a given region (set of points).
 	/// @param grad_x X component of an image gradient.
 	/// @param grad_y Y component of an image gradient.
 	/// @param region Set of points (normally shape-adaptive patch) to be considered in the computation.
 	/// @param mask Binary mask defining points that are allowed to contribute. When empty, all points are allowed.
+	/// @note Gradient images may be views or have padded rows.
 	Matrix2f calculate(const ImageFx<float> &grad_x,
 					   const ImageFx<float> &grad_y,
 					   const std::vector<Point> &region,
@@ -96,6 +132,7 @@ public:
 	/// @param dyadics Precomputed dyadic products of gradient vectors, stored in 3 channels: dx*dx, dx*dy, dy*dy.
 	/// @param region Set of points (normally shape-adaptive patch) to be considered in the computation.
 	/// @param mask Binary mask defining points that are allowed to contribute. When empty, all points are allowed.
+	/// @note Dyadic products may be a view or have padded rows.
 	Matrix2f calculate(const ImageFx<float> &dyadics,
 					   const std::vector<Point> &region,
 					   const MaskFx &mask) const;
@@ -122,6 +159,13 @@ public:
 										const Shape &size,
 										float radius = -1.0f) const;
 
+	/// Calculate points of the elliptical region into a given vector (its previous content is discarded).
+	void calculate_region(const Matrix2f &tensor,
+						  const Point &point,
+						  const Shape &size,
+						  std::vector<Point> &region,
+						  float radius = -1.0f) const;
+
 	/// Compute intra-patch anisotropic Gaussian weights.
 	/// @param region Set of points (normally shape-adaptive patch), for which weights should be computed.
 	/// @param tensor Corresponding structure tensor.
@@ -168,13 +212,32 @@ public:
 	/// Set the maximum allowed radius of an elliptical region (circle) shall it appear in a uniform region.
 	void set_max_size_limit(float value);
 
+	FieldLayouts::FieldLayout field_layout() const;
+
+	/// Set the layout of dyadic products used by dense computations (whole field, bundles).
+	/// @note Tiles pay off for large regions, which span many rows of a wide image.
+	void set_field_layout(FieldLayouts::FieldLayout value);
+
+	Traversals::Traversal traversal() const;
+
+	/// Set the order, in which points of a block are visited by dense computations.
+	void set_traversal(Traversals::Traversal value);
+
+	int support_radius() const;
+
+	/// Restrict initial bands and elliptical regions to the square window of a given half-size around the point,
+	/// so that structure tensors depend only on the data within this window. 0 means no restriction (default).
+	/// @note Elliptical regions do not exceed max_size_limit anyway, except at the first iterations,
+	///       so the window of that size allows to process an image in tiles (@see StructureTensorTiles).
+	void set_support_radius(int value);
+
 private:
 	// Structure tensors can be computed using gradients or precomputed dyadic products,
 	// also using the original or modified scheme, one by one or all together.
 	// Following functors allow to abstract from these details
 	using CalcFirstFunc = std::function<Matrix2f(Point)>;
 	using CalcNextFunc = std::function<Matrix2f(Point, Matrix2f)>;
-	using RunSchemeFunc = std::function<Matrix2f(CalcFirstFunc &, CalcNextFunc &, const Point &)>;
+	using RunSchemeFunc = std::function<Matrix2f(CalcFirstFunc &, CalcNextFunc &, const Point &, int)>;
 
 	// Default values for parameters
 	constexpr static float DEFAULT_RADIUS = 300.0f;
@@ -182,6 +245,9 @@ private:
 	constexpr static float DEFAULT_GAMMA = 1.0f;		// original iterative scheme
 	constexpr static float DEFAULT_SIZE_LIMIT = 0.0f;	// no limit by default
 	constexpr static float DEFAULT_VARIATION_THRESHOLD = 0.0001f;
+	constexpr static FieldLayouts::FieldLayout DEFAULT_FIELD_LAYOUT = FieldLayouts::row_major;
+	constexpr static Traversals::Traversal DEFAULT_TRAVERSAL = Traversals::scanline;
+	constexpr static int DEFAULT_SUPPORT_RADIUS = 0;	// no restriction by default
 
 	constexpr static float EPS = 0.0001f;
 	constexpr static float MAX_EIGEN_RATIO = 100.0f;
@@ -192,29 +258,49 @@ private:
 	float _gamma;
 	float _max_size_limit;        // max allowed radius of an ellipse (circle) in a uniform region
 	float _variation_threshold;
+	FieldLayouts::FieldLayout _field_layout;
+	Traversals::Traversal _traversal;
+	int _support_radius;			// half-size of the window regions are restricted to (0 if not restricted)
 
 	RunSchemeFunc _run_scheme_func;    // NOTE: it depends on the value of _gamma and is defined in configure()
 
 	void configure();
 
+	template <class Layout>
+	Image<Matrix2f> calculate_field(const float *dyadics,
+									const Layout &layout,
+									Shape size,
+									const MaskFx &mask,
+									const CostModel &cost_model,
+									const ImageFx<Matrix2f> &initial_tensors = ImageFx<Matrix2f>(),
+									int refinement_iterations = 0) const;
+
+	inline void support_bounds(const Point &center, int size_x, int size_y,
+							   int &x_0, int &y_0, int &x_1, int &y_1) const;
+
 	inline Matrix2f run_original_scheme(CalcFirstFunc &calc_first,
 										CalcNextFunc &calc_next,
-										const Point &point) const;
+										const Point &point,
+										int iterations_amount) const;
 
 	inline Matrix2f run_stabilized_scheme(CalcFirstFunc &calc_first,
 										  CalcNextFunc &calc_next,
-										  const Point &point) const;
+										  const Point &point,
+										  int iterations_amount) const;
 
 	inline Matrix2f calculate_initial_tensor(const float *grad_x,
 											 const float *grad_y,
-											 const bool *mask,
+											 int stride,
+											 const BitMask *mask,
 											 int size_x,
 											 int size_y,
 											 float radius,
 											 const Point &center) const;
 
+	template <class Layout>
 	inline Matrix2f calculate_initial_tensor(const float *dyadics,
-											 const bool *mask,
+											 const Layout &layout,
+											 const BitMask *mask,
 											 int size_x,
 											 int size_y,
 											 float radius,
@@ -222,15 +308,18 @@ private:
 
 	inline Matrix2f calculate_next_tensor(const float *grad_x,
 										  const float *grad_y,
-										  const bool *mask,
+										  int stride,
+										  const BitMask *mask,
 										  int size_x,
 										  int size_y,
 										  float radius,
 										  const Point &center,
 										  const Matrix2f &tensor) const;
 
+	template <class Layout>
 	inline Matrix2f calculate_next_tensor(const float *dyadics,
-										  const bool *mask,
+										  const Layout &layout,
+										  const BitMask *mask,
 										  int size_x,
 										  int size_y,
 										  float radius,
@@ -13,11 +13,14 @@
 
 
 #include <vector>
+#include <mutex>
+#include <atomic>
 #include "structure_tensor.h"
 #include "image.h"
 #include "mask.h"
 #include "field_operations.h"
 #include "normalized_patch.h"
+#include "cost_model.h"
 
 namespace msas
 {
@@ -35,6 +38,9 @@ class StructureTensorBundle
 {
 public:
 	StructureTensorBundle();
+
+	/// @note The image is shared, not copied (including images wrapping external buffers),
+	///       only images with gaps between rows are copied into a contiguous buffer.
 	StructureTensorBundle(const ImageFx<float> &image,
 						  const StructureTensor &structure_tensor,
 						  const MaskFx &mask = MaskFx());
@@ -47,10 +53,27 @@ public:
 	/// Get embedded mask.
 	MaskFx mask() const;
 
+	/// Get mask of the points, which can be interpolated using their right and bottom neighbours.
+	/// @see EllipseNormalization::erode_mask()
+	MaskFx interpolation_mask() const;
+
 	/// Get computed gradient.
 	Image<float> gradient_x() const;
 	Image<float> gradient_y() const;
 
+	/// Get dyadic products of gradient vectors, stored in 3 channels: dx*dx, dx*dy, dy*dy.
+	ImageFx<float> dyadics() const;
+
+	/// Calculate the gradient and dyadic products in parallel tiles, unless they are already calculated.
+	/// @note Otherwise they are calculated on the first demand by a single thread.
+	void precompute_dyadics(TaskGroup &parent) const;
+
+	/// Get model predicting the cost of computations at every point of the field.
+	CostModel cost_model() const;
+
+	/// Get the calculator of structure tensors with its parameters.
+	const StructureTensor& structure_tensor() const;
+
 	/// Get size of the field.
 	int size_x() const;
 	int size_y() const;
@@ -71,6 +94,10 @@ public:
 	std::vector<Point> region(int x, int y, float radius) const;
 	std::vector<Point> region(Point p, float radius) const;
 
+	/// Calculate elliptical region at the given point using internal radius into a given vector.
+	/// @note The vector is left empty when the point is out of the domain.
+	void region(Point p, std::vector<Point> &region) const;
+
 	/// Calculate intra-patch anisotropic Gaussian weights for an elliptical region.
 	/// @param region Set of points (normally shape-adaptive patch).
 	/// @param center Central point of the elliptical region.
@@ -114,19 +141,27 @@ public:
 	std::vector<NormalizedPatch>* normalized_patch(int x, int y) const;
 
 private:
+	constexpr static int TILE_SIZE = 128;	// size of tiles the gradient is computed in
+
 	StructureTensor _structure_tensor;
 	ImageFx<float> _image;
 	MaskFx _mask;
+	MaskFx _interpolation_mask;
 	int _size_x, _size_y;
 	mutable Image<float> _gradient_x, _gradient_y;
 	mutable Image<float> _dyadics;
+	mutable TiledImage<float> _tiled_dyadics;	// copy of the dyadic products, if the tiled layout is used
+	mutable std::mutex _gradient_mutex;		// guards lazy calculation of the gradient and dyadic products
+	mutable std::atomic<bool> _has_dyadics;
 	mutable std::vector<DataEntry* > _data;
 	mutable Image<std::vector<NormalizedPatch > > _normalized_patches_cache;
 
 	DataEntry* get_or_calculate_data(int x, int y) const;
 	void calculate_gradient() const;
 	void calculate_dyadics() const;
+	static void calculate_dyadics(const ImageFx<float> &gradient_x, const ImageFx<float> &gradient_y, Image<float> &dyadics);
 	DataEntry* calculate_data(int x, int y) const;
+	inline void ensure_dyadics() const;
 
 	inline int index(int x, int y) const;
 	inline bool is_in_range(uint x, uint y) const;
@@ -0,0 +1,79 @@
+/**
+ * Copyright (C) 2016, Vadim Fedorov <coderiks@gmail.com>
+ *
+ * This program is free software: you can use, modify and/or
+ * redistribute it under the terms of the simplified BSD
+ * License. You should have received a copy of this license along
+ * this program. If not, see
+ * <http://www.opensource.org/licenses/bsd-license.html>.
+ */
+
+#ifndef STRUCTURE_TENSOR_TILES_H_
+#define STRUCTURE_TENSOR_TILES_H_
+
+#include <functional>
+#include "structure_tensor.h"
+#include "strip_reader.h"
+#include "image.h"
+#include "point.h"
+
+namespace msas
+{
+
+/**
+ * Computes structure tensors of an image, which does not fit into memory, tile by tile.
+ * The image is read in strips (rows of tiles) with a halo of rows above and below them. Tiles of a strip
+ * are processed in parallel, every tile gets its own gradient and dyadic products computed with a halo.
+ * The halo covers the support window of structure tensors (@see StructureTensor::set_support_radius())
+ * and the support of the gradient filter, so tensors are identical to the ones computed for the whole image
+ * with the same support window. Memory is bounded by the width of the image times the height of a strip
+ * with the halo, plus the size of a tile with the halo per thread.
+ */
+class StructureTensorTiles
+{
+public:
+	/// Tile of the image with computed structure tensors.
+	struct Tile
+	{
+		int x_0, y_0, x_1, y_1;		// bounds of the tile in the image, [x_0, x_1) x [y_0, y_1)
+		Point origin;				// position of the top left pixel of the dyadic products in the image
+		ImageFx<float> dyadics;		// dyadic products of the tile with the halo (clipped by the image)
+		Image<Matrix2f> tensors;	// structure tensors at the points of the tile, relative to (x_0, y_0)
+	};
+
+	/// Function processing a computed tile, called in parallel for tiles of the same strip.
+	typedef std::function<void(const Tile&)> TileFunc;
+
+	/// Function called after all tiles of the strip [y_0, y_1) have been processed.
+	typedef std::function<void(uint, uint)> StripFunc;
+
+	/// @param structure_tensor Calculator of structure tensors, its support radius is set to
+	///        the max_size_limit, unless it is set explicitly.
+	/// @note Throws std::invalid_argument exception, if neither of them is set, since the support is unbounded then.
+	StructureTensorTiles(const StructureTensor &structure_tensor, uint tile_size);
+
+	/// Get the calculator of structure tensors (with the support radius in effect).
+	const StructureTensor& structure_tensor() const;
+
+	uint tile_size() const;
+
+	/// Number of pixels around a tile, which its structure tensors depend on.
+	int halo() const;
+
+	/// Read the image strip by strip, compute structure tensors of all tiles and pass them to the functions.
+	/// @return false, if the image could not be read.
+	bool run(StripReader &reader, TileFunc tile_func, StripFunc strip_func) const;
+
+private:
+	constexpr static int GRADIENT_HALO = 2;		// radius of the centered gradient filter
+
+	StructureTensor _structure_tensor;
+	uint _tile_size;
+
+	void process_tile(const ImageFx<float> &strip, int strip_y, Shape size,
+					  int x_0, int y_0, int x_1, int y_1, TileFunc &tile_func) const;
+};
+
+}	// namespace msas
+
+#endif /* STRUCTURE_TENSOR_TILES_H_ */
@@ -0,0 +1,76 @@
+/**
+ * Copyright (C) 2016, Vadim Fedorov <coderiks@gmail.com>
+ *
+ * This program is free software: you can use, modify and/or
+ * redistribute it under the terms of the simplified BSD
+ * License. You should have received a copy of this license along
+ * this program. If not, see
+ * <http://www.opensource.org/licenses/bsd-license.html>.
+ */
+
+#ifndef TENSOR_WARPING_H_
+#define TENSOR_WARPING_H_
+
+#include "image.h"
+#include "matrix.h"
+
+namespace msas
+{
+
+/**
+ * Carries structure tensors of a video frame over to the next frame along the optical flow,
+ * so that the iterative scheme of the next frame can start from them (@see StructureTensor::calculate()).
+ * Every point x is moved to the nearest pixel of x + w(x) and its tensor is transformed by the local
+ * flow Jacobian J = I + grad(w) as affine covariant tensors are: T' = J^-T * T * J^-1.
+ * Points, where the flow is unreliable, are not carried over, so the next frame gets zero tensors there
+ * (the scheme starts from the band then):
+ * - unknown flow (e.g. marked by huge values in Middlebury .flo files) or flow leaving the frame;
+ * - strongly varying flow (motion boundaries), where the Frobenius norm of grad(w) exceeds max_flow_gradient;
+ * - pixels of the next frame reached by points with flows differing by more than max_flow_difference (occlusions);
+ * - pixels of the next frame not reached at all (disocclusions).
+ */
+class TensorWarping
+{
+public:
+	/// @param max_flow_gradient Max Frobenius norm of the flow gradient, at which the flow is considered reliable.
+	/// @param max_flow_difference Max difference of flows (in pixels) of points moved to the same pixel.
+	TensorWarping(float max_flow_gradient = DEFAULT_MAX_FLOW_GRADIENT,
+				  float max_flow_difference = DEFAULT_MAX_FLOW_DIFFERENCE);
+
+	/// Warp tensors of a frame to the next frame.
+	/// @param tensors Structure tensors of the frame.
+	/// @param flow Optical flow from the frame to the next one, 2 channels (of the same size as tensors).
+	/// @param number_of_warped [out] Number of points of the next frame, which got a tensor.
+	/// @return Tensors of the next frame, zero tensors at the points without a reliable counterpart.
+	Image<Matrix2f> warp(const ImageFx<Matrix2f> &tensors,
+						 const ImageFx<float> &flow,
+						 uint &number_of_warped) const;
+
+	float max_flow_gradient() const;
+
+	void set_max_flow_gradient(float value);
+
+	float max_flow_difference() const;
+
+	void set_max_flow_difference(float value);
+
+private:
+	constexpr static float DEFAULT_MAX_FLOW_GRADIENT = 0.5f;
+	constexpr static float DEFAULT_MAX_FLOW_DIFFERENCE = 1.0f;
+	constexpr static float UNKNOWN_FLOW_THRESHOLD = 1e9f;	// as in Middlebury .flo files
+
+	constexpr static int NO_SOURCE = -1;
+	constexpr static int CONFLICT = -2;
+
+	float _max_flow_gradient;
+	float _max_flow_difference;
+
+	inline bool is_known(const ImageFx<float> &flow, int x, int y) const;
+
+	inline bool transform(const ImageFx<float> &flow, int x, int y, const Matrix2f &tensor,
+						  Matrix2f &transformed) const;
+};
+
+}	// namespace msas
+
+#endif /* TENSOR_WARPING_H_ */
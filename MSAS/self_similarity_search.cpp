@@ -0,0 +1,295 @@
+/**
+ * Copyright (C) 2016, Vadim Fedorov <coderiks@gmail.com>
+ *
+ * This program is free software: you can use, modify and/or
+ * redistribute it under the terms of the simplified BSD
+ * License. You should have received a copy of this license along
+ * this program. If not, see
+ * <http://www.opensource.org/licenses/bsd-license.html>.
+ */
+
+#include "self_similarity_search.h"
+
+using std::vector;
+
+namespace msas
+{
+
+SelfSimilaritySearch::SelfSimilaritySearch(AffinePatchDistance &patch_distance,
+										   int search_radius,
+										   int number_of_neighbours)
+: _patch_distance(patch_distance),
+  _search_radius(std::max(search_radius, 1)),
+  _number_of_neighbours(std::max(number_of_neighbours, 1)),
+  _tile_size(DEFAULT_TILE_SIZE),
+  _filtering_parameter(DEFAULT_FILTERING_PARAMETER)
+{
+
+}
+
+
+void SelfSimilaritySearch::run(const StructureTensorBundle &bundle)
+{
+	TaskGroup group;
+	run(bundle, group);
+}
+
+
+void SelfSimilaritySearch::run(const StructureTensorBundle &bundle, TaskGroup &parent)
+{
+	_size = bundle.size();
+	_candidates = vector<Candidate>(_size.size_x * _size.size_y * _number_of_neighbours);
+	_counts = vector<int>(_size.size_x * _size.size_y, 0);
+
+	// NOTE: a tile touches pixels within the search radius around it. Tiles that are processed
+	//		 simultaneously are at least two tiles apart, so with tiles not smaller than the radius
+	//		 they never touch the same pixels (and the same cached normalized patches).
+	int tile_size = std::max(_tile_size, _search_radius);
+	int tiles_x = (_size.size_x + tile_size - 1) / tile_size;
+	int tiles_y = (_size.size_y + tile_size - 1) / tile_size;
+
+	for (int phase = 0; phase < 9; phase++) {
+		int phase_x = phase % 3;
+		int phase_y = phase / 3;
+		int phase_tiles_x = (tiles_x - phase_x + 2) / 3;
+		int phase_tiles_y = (tiles_y - phase_y + 2) / 3;
+
+		TaskGroup group(parent);
+		group.run_range(0, phase_tiles_x * phase_tiles_y, 1, [&] (int begin, int end) {
+			for (int k = begin; k < end && !group.is_cancelled(); k++) {
+				int x_0 = (phase_x + 3 * (k % phase_tiles_x)) * tile_size;
+				int y_0 = (phase_y + 3 * (k / phase_tiles_x)) * tile_size;
+				int x_1 = std::min(x_0 + tile_size, (int)_size.size_x);
+				int y_1 = std::min(y_0 + tile_size, (int)_size.size_y);
+				process_tile(bundle, x_0, y_0, x_1, y_1);
+			}
+		});
+		group.wait();
+	}
+
+	// Sort candidates of every pixel by distance
+	for (int index = 0; index < _counts.size(); index++) {
+		auto begin = _candidates.begin() + index * _number_of_neighbours;
+		std::sort_heap(begin, begin + _counts[index]);
+	}
+}
+
+
+Image<Point> SelfSimilaritySearch::neighbours() const
+{
+	Image<Point> neighbours(_size, (uint)_number_of_neighbours, Point(-1, -1));
+	Point *data = neighbours.raw();
+	for (int index = 0; index < _counts.size(); index++) {
+		for (int i = 0; i < _counts[index]; i++) {
+			data[index * _number_of_neighbours + i] = _candidates[index * _number_of_neighbours + i].point;
+		}
+	}
+
+	return neighbours;
+}
+
+
+Image<float> SelfSimilaritySearch::distances() const
+{
+	Image<float> distances(_size, (uint)_number_of_neighbours, std::numeric_limits<float>::max());
+	float *data = distances.raw();
+	for (int index = 0; index < _counts.size(); index++) {
+		for (int i = 0; i < _counts[index]; i++) {
+			data[index * _number_of_neighbours + i] = _candidates[index * _number_of_neighbours + i].distance;
+		}
+	}
+
+	return distances;
+}
+
+
+Image<float> SelfSimilaritySearch::weights() const
+{
+	Image<float> weights(_size, (uint)_number_of_neighbours, 0.0f);
+	float *data = weights.raw();
+	float h_squared = _filtering_parameter * _filtering_parameter;
+	for (int index = 0; index < _counts.size(); index++) {
+		const Candidate *candidates = _candidates.data() + index * _number_of_neighbours;
+		if (_counts[index] == 0) {
+			continue;
+		}
+
+		// NOTE: weights are shifted by the best distance to avoid underflow, it cancels out in normalization
+		double total_weight = 0.0;
+		for (int i = 0; i < _counts[index]; i++) {
+			float weight = std::exp(-(candidates[i].distance - candidates[0].distance) / h_squared);
+			data[index * _number_of_neighbours + i] = weight;
+			total_weight += weight;
+		}
+
+		for (int i = 0; i < _counts[index]; i++) {
+			data[index * _number_of_neighbours + i] /= total_weight;
+		}
+	}
+
+	return weights;
+}
+
+
+Image<float> SelfSimilaritySearch::filter(const ImageFx<float> &image) const
+{
+	if (image.size() != _size) {
+		return Image<float>();
+	}
+
+	uint number_of_channels = image.number_of_channels();
+	Image<float> weights = this->weights();
+	Image<float> result(_size, number_of_channels, 0.0f);
+	result.set_color_space(image.color_space());
+
+	for (uint y = 0; y < _size.size_y; y++) {
+		for (uint x = 0; x < _size.size_x; x++) {
+			int index = y * _size.size_x + x;
+			const Candidate *candidates = _candidates.data() + index * _number_of_neighbours;
+
+			// Pixel itself gets the weight of its best neighbour
+			float self_weight = (_counts[index] > 0) ? weights(x, y, 0) : 1.0f;
+			float total_weight = self_weight;
+			for (uint ch = 0; ch < number_of_channels; ch++) {
+				result(x, y, ch) = self_weight * image(x, y, ch);
+			}
+
+			for (int i = 0; i < _counts[index]; i++) {
+				float weight = weights(x, y, i);
+				for (uint ch = 0; ch < number_of_channels; ch++) {
+					result(x, y, ch) += weight * image(candidates[i].point, ch);
+				}
+				total_weight += weight;
+			}
+
+			for (uint ch = 0; ch < number_of_channels; ch++) {
+				result(x, y, ch) /= total_weight;
+			}
+		}
+	}
+
+	return result;
+}
+
+
+int SelfSimilaritySearch::search_radius() const
+{
+	return _search_radius;
+}
+
+
+void SelfSimilaritySearch::set_search_radius(int value)
+{
+	_search_radius = std::max(value, 1);
+}
+
+
+int SelfSimilaritySearch::number_of_neighbours() const
+{
+	return _number_of_neighbours;
+}
+
+
+void SelfSimilaritySearch::set_number_of_neighbours(int value)
+{
+	_number_of_neighbours = std::max(value, 1);
+}
+
+
+int SelfSimilaritySearch::tile_size() const
+{
+	return _tile_size;
+}
+
+
+void SelfSimilaritySearch::set_tile_size(int value)
+{
+	_tile_size = std::max(value, 1);
+}
+
+
+float SelfSimilaritySearch::filtering_parameter() const
+{
+	return _filtering_parameter;
+}
+
+
+void SelfSimilaritySearch::set_filtering_parameter(float value)
+{
+	_filtering_parameter = value;
+}
+
+/* Private */
+
+/**
+ * Compare every point of the tile with the points of the search window that come later in the scan order,
+ * and update candidates of both points.
+ */
+void SelfSimilaritySearch::process_tile(const StructureTensorBundle &bundle, int x_0, int y_0, int x_1, int y_1)
+{
+	int size_x = _size.size_x;
+	int size_y = _size.size_y;
+
+	for (int y = y_0; y < y_1; y++) {
+		for (int x = x_0; x < x_1; x++) {
+			Point point(x, y);
+			int index = y * size_x + x;
+
+			for (int qy = y; qy <= std::min(y + _search_radius, size_y - 1); qy++) {
+				int qx_0 = (qy == y) ? x + 1 : std::max(x - _search_radius, 0);
+				int qx_1 = std::min(x + _search_radius, size_x - 1);
+				for (int qx = qx_0; qx <= qx_1; qx++) {
+					Point other(qx, qy);
+					int other_index = qy * size_x + qx;
+
+					// The comparison matters only if it can improve candidates of at least one of the points
+					float bound = std::max(worst_distance(index), worst_distance(other_index));
+					DistanceInfo distance_info = _patch_distance.calculate(bundle, point, bundle, other, bound);
+					if (distance_info.distance >= bound) {
+						continue;
+					}
+
+					insert(index, distance_info.distance, other);
+					insert(other_index, distance_info.distance, point);
+				}
+			}
+		}
+	}
+}
+
+
+/**
+ * Get the largest distance among candidates of a given point (or infinity, if the set of candidates is not full).
+ */
+inline float SelfSimilaritySearch::worst_distance(int index) const
+{
+	if (_counts[index] < _number_of_neighbours) {
+		return std::numeric_limits<float>::max();
+	}
+
+	return _candidates[index * _number_of_neighbours].distance;
+}
+
+
+/**
+ * Insert a candidate into the heap of a given point, if it is better than the worst one.
+ */
+inline void SelfSimilaritySearch::insert(int index, float distance, Point point)
+{
+	auto begin = _candidates.begin() + index * _number_of_neighbours;
+	int &count = _counts[index];
+
+	if (count < _number_of_neighbours) {
+		begin[count].distance = distance;
+		begin[count].point = point;
+		count++;
+		std::push_heap(begin, begin + count);
+	} else if (distance < begin->distance) {
+		std::pop_heap(begin, begin + count);
+		begin[count - 1].distance = distance;
+		begin[count - 1].point = point;
+		std::push_heap(begin, begin + count);
+	}
+}
+
+}	// namespace msas
@@ -0,0 +1,457 @@
+/**
+ * Copyright (C) 2016, Vadim Fedorov <coderiks@gmail.com>
+ *
+ * This program is free software: you can use, modify and/or
+ * redistribute it under the terms of the simplified BSD
+ * License. You should have received a copy of this license along
+ * this program. If not, see
+ * <http://www.opensource.org/licenses/bsd-license.html>.
+ */
+
+#include <cmath>
+#include <mutex>
+#include <atomic>
+#include <limits>
+#include <algorithm>
+#include "similarity_map.h"
+#include "thread_pool.h"
+
+namespace msas
+{
+
+SimilarityMap::SimilarityMap(AffinePatchDistance &patch_distance)
+ : _patch_distance(patch_distance), _tile_size(DEFAULT_TILE_SIZE), _query_block_size(DEFAULT_QUERY_BLOCK_SIZE),
+   _coarse_stride(DEFAULT_COARSE_STRIDE), _refinement_radius(DEFAULT_REFINEMENT_RADIUS),
+   _number_of_basins(DEFAULT_NUMBER_OF_BASINS)
+{
+
+}
+
+
+void SimilarityMap::calculate(const StructureTensorBundle &source_bundle,
+							  Point source_point,
+							  const StructureTensorBundle &target_bundle,
+							  Image<float> &distances,
+							  TileFunc tile_func) const
+{
+	calculate(source_bundle, std::vector<Point>(1, source_point), target_bundle, distances, tile_func);
+}
+
+
+Image<float> SimilarityMap::calculate(const StructureTensorBundle &source_bundle,
+									  Point source_point,
+									  const StructureTensorBundle &target_bundle) const
+{
+	Image<float> distances;
+	calculate(source_bundle, source_point, target_bundle, distances);
+
+	return distances;
+}
+
+
+void SimilarityMap::calculate(const StructureTensorBundle &source_bundle,
+							  const std::vector<Point> &source_points,
+							  const StructureTensorBundle &target_bundle,
+							  Image<float> &distances,
+							  TileFunc tile_func) const
+{
+	calculate(source_bundle, source_points, target_bundle, Rectangle(target_bundle.size()), distances, tile_func);
+}
+
+
+void SimilarityMap::calculate(const StructureTensorBundle &source_bundle,
+							  const std::vector<Point> &source_points,
+							  const StructureTensorBundle &target_bundle,
+							  const Rectangle &area,
+							  Image<float> &distances,
+							  TileFunc tile_func) const
+{
+	Rectangle clipped_area = area.intersection(Rectangle(target_bundle.size()));
+	Shape size = clipped_area.size();
+	int number_of_points = source_points.size();
+	if (distances.size() != size || distances.number_of_channels() != (uint)number_of_points) {
+		distances = Image<float>(size, (uint)number_of_points);
+	}
+	if (number_of_points == 0 || size.is_empty()) {
+		return;
+	}
+
+	// NOTE: patches of the points of interest are used by all the tiles
+	for (auto it = source_points.begin(); it != source_points.end(); ++it) {
+		_patch_distance.normalize_patch(source_bundle, *it);
+	}
+
+	ThreadPool::shared().parallel_for_tiles(size, _tile_size, [&] (int x_0, int y_0, int x_1, int y_1) {
+		for (int block = 0; block < number_of_points; block += _query_block_size) {
+			int block_end = std::min(block + _query_block_size, number_of_points);
+			for (int y = y_0; y < y_1; ++y) {
+				float *distances_row = distances.row(y);
+				for (int x = x_0; x < x_1; ++x) {
+					Point target_point(clipped_area.x_0 + x, clipped_area.y_0 + y);
+					for (int i = block; i < block_end; i++) {
+						DistanceInfo distance_info = _patch_distance.calculate(source_bundle, source_points[i],
+																			   target_bundle, target_point);
+						distances_row[x * number_of_points + i] = std::sqrt(distance_info.distance);
+					}
+				}
+			}
+		}
+
+		if (tile_func) {
+			tile_func(x_0, y_0, x_1, y_1);
+		}
+	});
+}
+
+
+std::vector<DistanceInfo> SimilarityMap::find_best_matches(const StructureTensorBundle &source_bundle,
+														   Point source_point,
+														   const StructureTensorBundle &target_bundle,
+														   const Rectangle &area,
+														   int k,
+														   Point excluded_point) const
+{
+	std::vector<DistanceInfo> matches;
+	Rectangle clipped_area = area.intersection(Rectangle(target_bundle.size()));
+	if (k < 1 || clipped_area.is_empty()) {
+		return matches;
+	}
+	k = (int)std::min((long)k, (long)clipped_area.size_x() * clipped_area.size_y());
+	matches.reserve(k);
+
+	// NOTE: the patch of the point of interest is used by all the tiles
+	_patch_distance.normalize_patch(source_bundle, source_point);
+
+	std::mutex matches_mutex;
+	std::atomic<float> merged_bound(std::numeric_limits<float>::max());
+	ThreadPool::shared().parallel_for_tiles(clipped_area.size(), _tile_size, [&] (int x_0, int y_0, int x_1, int y_1) {
+		std::vector<DistanceInfo> heap;
+		heap.reserve(k);
+		for (int y = clipped_area.y_0 + y_0; y < clipped_area.y_0 + y_1; ++y) {
+			for (int x = clipped_area.x_0 + x_0; x < clipped_area.x_0 + x_1; ++x) {
+				if (Point(x, y) != excluded_point) {
+					match_point(source_bundle, source_point, target_bundle, Point(x, y), k, merged_bound, heap);
+				}
+			}
+		}
+
+		merge_matches(heap, k, matches, matches_mutex, merged_bound);
+	});
+
+	std::sort_heap(matches.begin(), matches.end(), is_better_match);
+	for (auto it = matches.begin(); it != matches.end(); ++it) {
+		it->distance = std::sqrt(it->distance);
+	}
+
+	return matches;
+}
+
+
+std::vector<DistanceInfo> SimilarityMap::find_best_matches_coarse_to_fine(const StructureTensorBundle &source_bundle,
+																		  Point source_point,
+																		  const StructureTensorBundle &target_bundle,
+																		  const Rectangle &area,
+																		  int k,
+																		  Point excluded_point) const
+{
+	uint number_of_evaluations;
+	return find_best_matches_coarse_to_fine(source_bundle, source_point, target_bundle, area, k,
+											excluded_point, number_of_evaluations);
+}
+
+
+std::vector<DistanceInfo> SimilarityMap::find_best_matches_coarse_to_fine(const StructureTensorBundle &source_bundle,
+																		  Point source_point,
+																		  const StructureTensorBundle &target_bundle,
+																		  const Rectangle &area,
+																		  int k,
+																		  Point excluded_point,
+																		  uint &number_of_evaluations) const
+{
+	std::vector<DistanceInfo> matches;
+	number_of_evaluations = 0;
+	Rectangle clipped_area = area.intersection(Rectangle(target_bundle.size()));
+	if (k < 1 || clipped_area.is_empty()) {
+		return matches;
+	}
+	k = (int)std::min((long)k, (long)clipped_area.size_x() * clipped_area.size_y());
+	matches.reserve(k);
+
+	// NOTE: the patch of the point of interest is used by all the comparisons
+	_patch_distance.normalize_patch(source_bundle, source_point);
+
+	// Compute distances at the nodes of the lattice (without bounds, since they are compared with each other)
+	int lattice_x = (clipped_area.size_x() + _coarse_stride - 1) / _coarse_stride;
+	int lattice_y = (clipped_area.size_y() + _coarse_stride - 1) / _coarse_stride;
+	std::vector<DistanceInfo> lattice(lattice_x * lattice_y);
+	ThreadPool::shared().parallel_for(0, lattice.size(), std::max(_tile_size * _tile_size / 4, 1), [&] (int begin, int end) {
+		for (int i = begin; i < end; i++) {
+			Point target_point(clipped_area.x_0 + (i % lattice_x) * _coarse_stride,
+							   clipped_area.y_0 + (i / lattice_x) * _coarse_stride);
+			if (target_point != excluded_point) {
+				lattice[i] = _patch_distance.calculate(source_bundle, source_point, target_bundle, target_point);
+			} else {
+				lattice[i].distance = std::numeric_limits<float>::max();
+				lattice[i].second_point = target_point;
+			}
+		}
+	});
+	number_of_evaluations = lattice.size();
+
+	// Basins are the nodes, which are not worse than any of their neighbours, the best of them are refined
+	std::vector<DistanceInfo> basins;
+	for (int i = 0; i < (int)lattice.size(); i++) {
+		if (lattice[i].distance == std::numeric_limits<float>::max()) {
+			continue;
+		}
+		push_match(matches, lattice[i], k);
+
+		int node_x = i % lattice_x;
+		int node_y = i / lattice_x;
+		bool is_basin = true;
+		for (int y = std::max(node_y - 1, 0); is_basin && y <= std::min(node_y + 1, lattice_y - 1); y++) {
+			for (int x = std::max(node_x - 1, 0); is_basin && x <= std::min(node_x + 1, lattice_x - 1); x++) {
+				is_basin = lattice[i].distance <= lattice[y * lattice_x + x].distance;
+			}
+		}
+		if (is_basin) {
+			push_match(basins, lattice[i], _number_of_basins);
+		}
+	}
+
+	// Compare densely around the basins, skipping the nodes, the best lattice matches bound the distances
+	std::vector<Point> target_points;
+	for (auto it = basins.begin(); it != basins.end(); ++it) {
+		Rectangle window = Rectangle::around(it->second_point, _refinement_radius).intersection(clipped_area);
+		for (int y = window.y_0; y < window.y_1; y++) {
+			for (int x = window.x_0; x < window.x_1; x++) {
+				bool is_node = (x - clipped_area.x_0) % _coarse_stride == 0 && (y - clipped_area.y_0) % _coarse_stride == 0;
+				if (!is_node && Point(x, y) != excluded_point) {
+					target_points.push_back(Point(x, y));
+				}
+			}
+		}
+	}
+	std::sort(target_points.begin(), target_points.end());
+	target_points.erase(std::unique(target_points.begin(), target_points.end()), target_points.end());
+	number_of_evaluations += target_points.size();
+
+	std::mutex matches_mutex;
+	std::atomic<float> merged_bound(((int)matches.size() == k) ? matches.front().distance
+															   : std::numeric_limits<float>::max());
+	ThreadPool::shared().parallel_for(0, target_points.size(), std::max(_tile_size * _tile_size, 1), [&] (int begin, int end) {
+		std::vector<DistanceInfo> heap;
+		heap.reserve(k);
+		for (int i = begin; i < end; i++) {
+			match_point(source_bundle, source_point, target_bundle, target_points[i], k, merged_bound, heap);
+		}
+
+		merge_matches(heap, k, matches, matches_mutex, merged_bound);
+	});
+
+	std::sort_heap(matches.begin(), matches.end(), is_better_match);
+	for (auto it = matches.begin(); it != matches.end(); ++it) {
+		it->distance = std::sqrt(it->distance);
+	}
+
+	return matches;
+}
+
+
+std::vector<RequiredPatches> SimilarityMap::plan(const StructureTensorBundle &source_bundle,
+												 const std::vector<Point> &source_points,
+												 const StructureTensorBundle &target_bundle,
+												 const Rectangle &area)
+{
+	std::vector<RequiredPatches> plan;
+	if (&source_bundle != &target_bundle) {
+		RequiredPatches source;
+		source.bundle = &source_bundle;
+		plan.push_back(source);
+	}
+	RequiredPatches target;
+	target.bundle = &target_bundle;
+	target.area = area.intersection(Rectangle(target_bundle.size()));
+	plan.push_back(target);
+
+	// NOTE: points of interest, which are within the area of the same bundle, are normalized along with it
+	RequiredPatches &source = plan.front();
+	for (auto it = source_points.begin(); it != source_points.end(); ++it) {
+		if (source_bundle.size().contains(*it) && !source.area.contains(*it)) {
+			source.points.push_back(*it);
+		}
+	}
+	std::sort(source.points.begin(), source.points.end());
+	source.points.erase(std::unique(source.points.begin(), source.points.end()), source.points.end());
+
+	return plan;
+}
+
+
+std::vector<LoadBalanceReport> SimilarityMap::precompute(const std::vector<RequiredPatches> &plan,
+														 TaskGroup &parent) const
+{
+	std::vector<LoadBalanceReport> reports(plan.size());
+	TaskGroup group(parent);
+	for (uint i = 0; i < plan.size(); i++) {
+		group.run([&, i] () {
+			if (!plan[i].area.is_empty()) {
+				reports[i] = _patch_distance.precompute_normalized_patches(*plan[i].bundle, plan[i].area, group);
+			}
+			_patch_distance.normalize_patches(*plan[i].bundle, plan[i].points, group);
+		});
+	}
+	group.wait();
+
+	return reports;
+}
+
+
+Rectangle SimilarityMap::search_area(const std::vector<Point> &source_points, int search_radius, Shape target_size)
+{
+	Rectangle domain(target_size);
+	if (search_radius < 0) {
+		return domain;
+	}
+
+	Rectangle area;
+	for (auto it = source_points.begin(); it != source_points.end(); ++it) {
+		area = area.bounding_box(Rectangle::around(*it, search_radius));
+	}
+
+	return area.intersection(domain);
+}
+
+
+int SimilarityMap::tile_size() const
+{
+	return _tile_size;
+}
+
+
+void SimilarityMap::set_tile_size(int value)
+{
+	_tile_size = std::max(value, 1);
+}
+
+
+int SimilarityMap::query_block_size() const
+{
+	return _query_block_size;
+}
+
+
+void SimilarityMap::set_query_block_size(int value)
+{
+	_query_block_size = std::max(value, 1);
+}
+
+
+int SimilarityMap::coarse_stride() const
+{
+	return _coarse_stride;
+}
+
+
+void SimilarityMap::set_coarse_stride(int value)
+{
+	_coarse_stride = std::max(value, 1);
+}
+
+
+int SimilarityMap::refinement_radius() const
+{
+	return _refinement_radius;
+}
+
+
+void SimilarityMap::set_refinement_radius(int value)
+{
+	_refinement_radius = std::max(value, 0);
+}
+
+
+int SimilarityMap::number_of_basins() const
+{
+	return _number_of_basins;
+}
+
+
+void SimilarityMap::set_number_of_basins(int value)
+{
+	_number_of_basins = std::max(value, 1);
+}
+
+
+/* Private */
+
+/**
+ * Order of matches: smaller distances first, equal distances in the scan order of the target points.
+ */
+inline bool SimilarityMap::is_better_match(const DistanceInfo &first, const DistanceInfo &second)
+{
+	return first.distance < second.distance ||
+		   (first.distance == second.distance && first.second_point < second.second_point);
+}
+
+
+/**
+ * Compare a point of the source with a point of the target and put the match into a heap of at most k matches.
+ * The comparison is bounded by the worst match of the heap (if it is full) and by the merged bound.
+ * @note Abandoned comparisons are not put into the heap.
+ */
+inline void SimilarityMap::match_point(const StructureTensorBundle &source_bundle,
+									   Point source_point,
+									   const StructureTensorBundle &target_bundle,
+									   Point target_point,
+									   int k,
+									   const std::atomic<float> &merged_bound,
+									   std::vector<DistanceInfo> &heap) const
+{
+	float bound = merged_bound.load(std::memory_order_relaxed);
+	if ((int)heap.size() == k) {
+		bound = std::min(bound, heap.front().distance);
+	}
+
+	DistanceInfo match = _patch_distance.calculate(source_bundle, source_point, target_bundle, target_point, bound);
+	if (match.distance < std::numeric_limits<float>::max()) {
+		push_match(heap, match, k);
+	}
+}
+
+
+/**
+ * Merge the matches of a task into the common heap and tighten the bound of the tasks still running.
+ */
+inline void SimilarityMap::merge_matches(const std::vector<DistanceInfo> &heap,
+										 int k,
+										 std::vector<DistanceInfo> &matches,
+										 std::mutex &matches_mutex,
+										 std::atomic<float> &merged_bound)
+{
+	std::lock_guard<std::mutex> lock(matches_mutex);
+	for (auto it = heap.begin(); it != heap.end(); ++it) {
+		push_match(matches, *it, k);
+	}
+	if ((int)matches.size() == k) {
+		merged_bound.store(matches.front().distance, std::memory_order_relaxed);
+	}
+}
+
+
+/**
+ * Put a match into a heap of at most k matches with the worst one on top, replacing the worst one if necessary.
+ */
+inline void SimilarityMap::push_match(std::vector<DistanceInfo> &heap, const DistanceInfo &match, int k)
+{
+	if ((int)heap.size() < k) {
+		heap.push_back(match);
+		std::push_heap(heap.begin(), heap.end(), is_better_match);
+	} else if (is_better_match(match, heap.front())) {
+		std::pop_heap(heap.begin(), heap.end(), is_better_match);
+		heap.back() = match;
+		std::push_heap(heap.begin(), heap.end(), is_better_match);
+	}
+}
+
+}	// namespace msas
@@ -8,19 +8,151 @@
  * <http://www.opensource.org/licenses/bsd-license.html>.
  */
 
+#include <limits>
+#include <stdexcept>
 #include "structure_tensor.h"
+#include "cost_model.h"
 
 using std::vector;
 
 namespace msas
 {
 
+namespace
+{
+	/**
+	 * Dyadic products stored row by row, every row in a single run (rows are 'stride' elements apart).
+	 */
+	struct RowMajorLayout
+	{
+		int stride;
+
+		explicit RowMajorLayout(int stride) : stride(stride) {}
+
+		inline int offset(int x, int y) const { return y * stride + 3 * x; }
+		inline int run_end(int x) const { return std::numeric_limits<int>::max(); }
+	};
+
+
+	/**
+	 * Dyadic products stored in tiles, a row is contiguous up to the end of a tile.
+	 */
+	struct TiledLayout
+	{
+		const TiledImage<float> &dyadics;
+
+		explicit TiledLayout(const TiledImage<float> &dyadics) : dyadics(dyadics) {}
+
+		inline int offset(int x, int y) const { return dyadics.offset(x, y); }
+		inline int run_end(int x) const { return dyadics.run_end(x); }
+	};
+
+
+	/**
+	 * Aggregate dyadic products at the points of y row between x_0 and x_1 (run by run).
+	 * @return Number of aggregated points.
+	 */
+	template <class Layout>
+	inline long add_dyadics(const float *dyadics, const Layout &layout, int y, int x_0, int x_1,
+							double &a, double &bc, double &d)
+	{
+		for (int x = x_0; x <= x_1;) {
+			int run_end = std::min(layout.run_end(x), x_1);
+			const float *values = dyadics + layout.offset(x, y);
+			for (; x <= run_end; ++x, values += 3) {
+				a += values[0];
+				bc += values[1];
+				d += values[2];
+			}
+		}
+
+		return std::max(x_1 - x_0 + 1, 0);
+	}
+
+
+	/**
+	 * Aggregate dyadic products at the masked points of y row between x_0 and x_1.
+	 * Mask words without masked points are skipped, runs of masked points are aggregated without per pixel tests.
+	 * @return Number of aggregated points.
+	 */
+	template <class Layout>
+	inline long add_dyadics(const float *dyadics, const Layout &layout, const BitMask *mask, int y, int x_0, int x_1,
+							double &a, double &bc, double &d)
+	{
+		if (!mask) {
+			return add_dyadics(dyadics, layout, y, x_0, x_1, a, bc, d);
+		}
+
+		long normalizer = 0;
+		if (x_0 <= x_1) {
+			mask->for_each_span(y, x_0, x_1, [&] (uint s_0, uint s_1) {
+				normalizer += add_dyadics(dyadics, layout, y, s_0, s_1, a, bc, d);
+			});
+		}
+
+		return normalizer;
+	}
+
+
+	/**
+	 * Compute and aggregate dyadic products of gradient vectors at the masked points of y row between x_0 and x_1.
+	 * @param stride Number of elements between the beginnings of consecutive rows of the gradient.
+	 * @return Number of aggregated points.
+	 */
+	inline long add_dyadics(const float *grad_x, const float *grad_y, const BitMask *mask, int stride, int y, int x_0, int x_1,
+							double &a, double &bc, double &d)
+	{
+		auto add_run = [&] (int s_0, int s_1) {
+			long row_index = (long)y * stride;
+			for (long index = row_index + s_0; index <= row_index + s_1; index++) {
+				a += grad_x[index] * grad_x[index];
+				bc += grad_x[index] * grad_y[index];
+				d += grad_y[index] * grad_y[index];
+			}
+		};
+
+		if (x_0 > x_1) {
+			return 0;
+		}
+		if (!mask) {
+			add_run(x_0, x_1);
+			return x_1 - x_0 + 1;
+		}
+
+		long normalizer = 0;
+		mask->for_each_span(y, x_0, x_1, [&] (uint s_0, uint s_1) {
+			add_run(s_0, s_1);
+			normalizer += s_1 - s_0 + 1;
+		});
+
+		return normalizer;
+	}
+
+
+	/**
+	 * Get the number of elements between the beginnings of consecutive rows of both gradient components.
+	 * @note Throws std::invalid_argument exception, if the components are stored with different strides.
+	 */
+	inline int gradient_stride(const ImageFx<float> &grad_x, const ImageFx<float> &grad_y)
+	{
+		if (grad_x.stride() != grad_y.stride()) {
+			throw std::invalid_argument("StructureTensor: components of the gradient should have the same row stride.");
+		}
+
+		return grad_x.stride();
+	}
+}
+
+
 StructureTensor::StructureTensor(float radius, int iterations_amount, float gamma)
 		: _radius(radius),
 		  _iterations_amount(iterations_amount),
 		  _gamma(gamma),
 		  _max_size_limit(DEFAULT_SIZE_LIMIT),
-		  _variation_threshold(DEFAULT_VARIATION_THRESHOLD)
+		  _variation_threshold(DEFAULT_VARIATION_THRESHOLD),
+		  _field_layout(DEFAULT_FIELD_LAYOUT),
+		  _traversal(DEFAULT_TRAVERSAL),
+		  _support_radius(DEFAULT_SUPPORT_RADIUS)
 {
 	configure();
 }
@@ -31,7 +163,10 @@ StructureTensor::StructureTensor(float radius, int iterations_amount)
 		  _iterations_amount(iterations_amount),
 		  _gamma(DEFAULT_GAMMA),
 		  _max_size_limit(DEFAULT_SIZE_LIMIT),
-		  _variation_threshold(DEFAULT_VARIATION_THRESHOLD)
+		  _variation_threshold(DEFAULT_VARIATION_THRESHOLD),
+		  _field_layout(DEFAULT_FIELD_LAYOUT),
+		  _traversal(DEFAULT_TRAVERSAL),
+		  _support_radius(DEFAULT_SUPPORT_RADIUS)
 {
 	configure();
 }
@@ -42,7 +177,10 @@ StructureTensor::StructureTensor(float radius)
 		  _iterations_amount(DEFAULT_ITERATIONS_AMOUNT),
 		  _gamma(DEFAULT_GAMMA),
 		  _max_size_limit(DEFAULT_SIZE_LIMIT),
-		  _variation_threshold(DEFAULT_VARIATION_THRESHOLD)
+		  _variation_threshold(DEFAULT_VARIATION_THRESHOLD),
+		  _field_layout(DEFAULT_FIELD_LAYOUT),
+		  _traversal(DEFAULT_TRAVERSAL),
+		  _support_radius(DEFAULT_SUPPORT_RADIUS)
 {
 	configure();
 }
@@ -53,7 +191,10 @@ StructureTensor::StructureTensor()
 	  _iterations_amount(DEFAULT_ITERATIONS_AMOUNT),
 	  _gamma(DEFAULT_GAMMA),
 	  _max_size_limit(DEFAULT_SIZE_LIMIT),
-	  _variation_threshold(DEFAULT_VARIATION_THRESHOLD)
+	  _variation_threshold(DEFAULT_VARIATION_THRESHOLD),
+	  _field_layout(DEFAULT_FIELD_LAYOUT),
+	  _traversal(DEFAULT_TRAVERSAL),
+	  _support_radius(DEFAULT_SUPPORT_RADIUS)
 {
 	configure();
 }
@@ -64,7 +205,10 @@ StructureTensor::StructureTensor(const StructureTensor &other)
 	  _iterations_amount(other._iterations_amount),
 	  _gamma(other._gamma),
 	  _max_size_limit(other._max_size_limit),
-	  _variation_threshold(other._variation_threshold)
+	  _variation_threshold(other._variation_threshold),
+	  _field_layout(other._field_layout),
+	  _traversal(other._traversal),
+	  _support_radius(other._support_radius)
 {
 	configure();
 }
@@ -77,6 +221,9 @@ StructureTensor& StructureTensor::operator= (const StructureTensor &other)
 	_gamma = other._gamma;
 	_max_size_limit = other._max_size_limit;
 	_variation_threshold = other._variation_threshold;
+	_field_layout = other._field_layout;
+	_traversal = other._traversal;
+	_support_radius = other._support_radius;
 
 	configure();
 }
@@ -88,20 +235,22 @@ Matrix2f StructureTensor::calculate(const ImageFx<float> &grad_x,
 									const MaskFx &mask) const
 {
 	Shape size = grad_x.size();
-	const bool* mask_data = (mask) ? mask.raw() : 0;
+	int stride = gradient_stride(grad_x, grad_y);
+	const BitMask *mask_bits = (mask) ? &mask.bits() : 0;
 
 	// Define functor for computing an initial structure tensor
 	CalcFirstFunc calc_first = [&] (Point p) {
-		return calculate_initial_tensor(grad_x.raw(), grad_y.raw(), mask_data, size.size_x, size.size_y, _radius, p);
+		return calculate_initial_tensor(grad_x.raw(), grad_y.raw(), stride, mask_bits, size.size_x, size.size_y,
+										_radius, p);
 	};
 
 	// Define functor for iterative computation of a structure tensor
 	CalcNextFunc  calc_next = [&] (Point p, Matrix2f tensor) {
-		return calculate_next_tensor(grad_x.raw(), grad_y.raw(), mask_data, size.size_x, size.size_y, _radius, p,
-									 tensor);
+		return calculate_next_tensor(grad_x.raw(), grad_y.raw(), stride, mask_bits, size.size_x, size.size_y,
+									 _radius, p, tensor);
 	};
 
-	return _run_scheme_func(calc_first, calc_next, point);
+	return _run_scheme_func(calc_first, calc_next, point, _iterations_amount);
 }
 
 
@@ -110,19 +259,42 @@ Matrix2f StructureTensor::calculate(const ImageFx<float> &dyadics,
 									const MaskFx &mask) const
 {
 	Shape size = dyadics.size();
-	const bool* mask_data = (mask) ? mask.raw() : 0;
+	const BitMask *mask_bits = (mask) ? &mask.bits() : 0;
+	RowMajorLayout layout(dyadics.stride());
 
 	// Define functor for computing an initial structure tensor
 	CalcFirstFunc calc_first = [&] (Point p) {
-		return calculate_initial_tensor(dyadics.raw(), mask_data, size.size_x, size.size_y, _radius, p);
+		return calculate_initial_tensor(dyadics.raw(), layout, mask_bits, size.size_x, size.size_y, _radius, p);
 	};
 
 	// Define functor for iterative computation of a structure tensor
 	CalcNextFunc  calc_next = [&] (Point p, Matrix2f tensor) {
-		return calculate_next_tensor(dyadics.raw(), mask_data, size.size_x, size.size_y, _radius, p, tensor);
+		return calculate_next_tensor(dyadics.raw(), layout, mask_bits, size.size_x, size.size_y, _radius, p, tensor);
 	};
 
-	return _run_scheme_func(calc_first, calc_next, point);
+	return _run_scheme_func(calc_first, calc_next, point, _iterations_amount);
+}
+
+
+Matrix2f StructureTensor::calculate(const TiledImage<float> &dyadics,
+									const Point &point,
+									const MaskFx &mask) const
+{
+	Shape size = dyadics.size();
+	const BitMask *mask_bits = (mask) ? &mask.bits() : 0;
+	TiledLayout layout(dyadics);
+
+	// Define functor for computing an initial structure tensor
+	CalcFirstFunc calc_first = [&] (Point p) {
+		return calculate_initial_tensor(dyadics.raw(), layout, mask_bits, size.size_x, size.size_y, _radius, p);
+	};
+
+	// Define functor for iterative computation of a structure tensor
+	CalcNextFunc  calc_next = [&] (Point p, Matrix2f tensor) {
+		return calculate_next_tensor(dyadics.raw(), layout, mask_bits, size.size_x, size.size_y, _radius, p, tensor);
+	};
+
+	return _run_scheme_func(calc_first, calc_next, point, _iterations_amount);
 }
 
 
@@ -131,27 +303,30 @@ Image<Matrix2f> StructureTensor::calculate(const ImageFx<float> &grad_x,
 										   const MaskFx &mask) const
 {
 	Shape size = grad_x.size();
-	const bool* mask_data = (mask) ? mask.raw() : 0;
+	int stride = gradient_stride(grad_x, grad_y);
+	const BitMask *mask_bits = (mask) ? &mask.bits() : 0;
 
 	// Define functor for computing an initial structure tensor
 	CalcFirstFunc calc_first = [&] (Point p) {
-		return calculate_initial_tensor(grad_x.raw(), grad_y.raw(), mask_data, size.size_x, size.size_y, _radius, p);
+		return calculate_initial_tensor(grad_x.raw(), grad_y.raw(), stride, mask_bits, size.size_x, size.size_y,
+										_radius, p);
 	};
 
 	// Define functor for iterative computation of a structure tensor
 	CalcNextFunc  calc_next = [&] (Point p, Matrix2f tensor) {
-		return calculate_next_tensor(grad_x.raw(), grad_y.raw(), mask_data, size.size_x, size.size_y, _radius, p,
-									 tensor);
+		return calculate_next_tensor(grad_x.raw(), grad_y.raw(), stride, mask_bits, size.size_x, size.size_y,
+									 _radius, p, tensor);
 	};
 
 	// Compute structure tensors for all points in the image
 	Image<Matrix2f> tensors(size.size_x, size.size_y);
-	for (uint y = 0; y < size.size_y; y++) {
-		for (uint x = 0; x < size.size_x; x++) {
-			Point p(x, y);
-			tensors(p) = _run_scheme_func(calc_first, calc_next, p);
+	CostModel(grad_x, grad_y, _radius, _max_size_limit).run([&] (int x_0, int y_0, int x_1, int y_1) {
+		vector<Point> points;
+		BlockTraversal::order(x_0, y_0, x_1, y_1, _traversal, points);
+		for (auto it = points.begin(); it != points.end(); ++it) {
+			tensors(*it) = _run_scheme_func(calc_first, calc_next, *it, _iterations_amount);
 		}
-	}
+	});
 
 	return tensors;
 }
@@ -160,29 +335,34 @@ Image<Matrix2f> StructureTensor::calculate(const ImageFx<float> &grad_x,
 Image<Matrix2f> StructureTensor::calculate(const ImageFx<float> &dyadics,
 										   const MaskFx &mask) const
 {
-	Shape size = dyadics.size();
-	const bool* mask_data = (mask) ? mask.raw() : 0;
+	CostModel cost_model(dyadics, _radius, _max_size_limit);
+	if (_field_layout == FieldLayouts::tiled) {
+		TiledImage<float> tiled_dyadics(dyadics);
+		return calculate_field(tiled_dyadics.raw(), TiledLayout(tiled_dyadics), dyadics.size(), mask, cost_model);
+	}
 
-	// Define functor for computing an initial structure tensor
-	CalcFirstFunc calc_first = [&] (Point p) {
-		return calculate_initial_tensor(dyadics.raw(), mask_data, size.size_x, size.size_y, _radius, p);
-	};
+	return calculate_field(dyadics.raw(), RowMajorLayout(dyadics.stride()), dyadics.size(), mask, cost_model);
+}
 
-	// Define functor for iterative computation of a structure tensor
-	CalcNextFunc  calc_next = [&] (Point p, Matrix2f tensor) {
-		return calculate_next_tensor(dyadics.raw(), mask_data, size.size_x, size.size_y, _radius, p, tensor);
-	};
 
-	// Compute structure tensors for all points in the image
-	Image<Matrix2f> tensors(size.size_x, size.size_y);
-	for (uint y = 0; y < size.size_y; y++) {
-		for (uint x = 0; x < size.size_x; x++) {
-			Point p(x, y);
-			tensors(p) = _run_scheme_func(calc_first, calc_next, p);
-		}
+Image<Matrix2f> StructureTensor::calculate(const ImageFx<float> &dyadics,
+										   const MaskFx &mask,
+										   const ImageFx<Matrix2f> &initial_tensors,
+										   int refinement_iterations) const
+{
+	if (!initial_tensors || initial_tensors.size() != dyadics.size()) {
+		return calculate(dyadics, mask);
 	}
 
-	return tensors;
+	CostModel cost_model(dyadics, _radius, _max_size_limit);
+	if (_field_layout == FieldLayouts::tiled) {
+		TiledImage<float> tiled_dyadics(dyadics);
+		return calculate_field(tiled_dyadics.raw(), TiledLayout(tiled_dyadics), dyadics.size(), mask, cost_model,
+							   initial_tensors, refinement_iterations);
+	}
+
+	return calculate_field(dyadics.raw(), RowMajorLayout(dyadics.stride()), dyadics.size(), mask, cost_model,
+						   initial_tensors, refinement_iterations);
 }
 
 
@@ -192,8 +372,6 @@ Matrix2f StructureTensor::calculate(const ImageFx<float> &grad_x,
 									const MaskFx &mask) const
 {
 	// Get raw pointers
-	const float *grad_x_data = grad_x.raw();
-	const float *grad_y_data = grad_y.raw();
 	const bool *mask_data = (mask) ? mask.raw() : 0;
 
 	// Compute sum of dyadic products
@@ -201,11 +379,12 @@ Matrix2f StructureTensor::calculate(const ImageFx<float> &grad_x,
 	long normalizer = 0;
 	uint size_x = grad_x.size_x();
 	for (auto it = region.begin(); it != region.end(); ++it) {
-		int index = it->y * size_x + it->x;
-		if (!mask_data || mask_data[index]) {
-			a += grad_x_data[index] * grad_x_data[index];
-			bc += grad_x_data[index] * grad_y_data[index];
-			d += grad_y_data[index] * grad_y_data[index];
+		if (!mask_data || mask_data[it->y * size_x + it->x]) {
+			float grad_x_value = grad_x.row(it->y)[it->x];
+			float grad_y_value = grad_y.row(it->y)[it->x];
+			a += grad_x_value * grad_x_value;
+			bc += grad_x_value * grad_y_value;
+			d += grad_y_value * grad_y_value;
 			normalizer += 1;
 		}
 	}
@@ -229,7 +408,6 @@ Matrix2f StructureTensor::calculate(const ImageFx<float> &dyadics,
 									const MaskFx &mask) const
 {
 	// Get raw pointers
-	const float *diadics_data = dyadics.raw();
 	const bool *mask_data = (mask) ? mask.raw() : 0;
 
 	// Compute sum of dyadic products
@@ -237,11 +415,11 @@ Matrix2f StructureTensor::calculate(const ImageFx<float> &dyadics,
 	long normalizer = 0;
 	uint size_x = dyadics.size_x();
 	for (auto it = region.begin(); it != region.end(); ++it) {
-		int index = it->y * size_x + it->x;
-		if (!mask_data || mask_data[index]) {
-			a += diadics_data[index * 3];
-			bc += diadics_data[index * 3 + 1];
-			d += diadics_data[index * 3 + 2];
+		if (!mask_data || mask_data[it->y * size_x + it->x]) {
+			const float *values = dyadics.row(it->y) + it->x * 3;
+			a += values[0];
+			bc += values[1];
+			d += values[2];
 			normalizer += 1;
 		}
 	}
@@ -275,16 +453,12 @@ vector<Point> StructureTensor::calculate_initial_region(const ImageFx<float> &gr
 
 	vector<Point> region;
 
-	// Get raw pointers and size
+	// Get size
 	Shape size = grad_x.size();
-	const float *grad_x_data = grad_x.raw();
-	const float *grad_y_data = grad_y.raw();
-	const bool *mask_data = (mask) ? mask.raw() : 0;
 
 	// Get gradient vector at the central point
-	int index_at_center = point.y * size.size_x + point.x;
-	float grad_x_at_center = grad_x_data[index_at_center];
-	float grad_y_at_center = grad_y_data[index_at_center];
+	float grad_x_at_center = grad_x(point);
+	float grad_y_at_center = grad_y(point);
 
 	// Calculate possible limits in Y dimension
 	int y_lower, y_upper;
@@ -367,13 +541,26 @@ vector<Point> StructureTensor::calculate_region(const Matrix2f &tensor,
 												const Point &point,
 												const Shape &size,
 												float radius) const
+{
+	vector<Point> region;
+	calculate_region(tensor, point, size, region, radius);
+
+	return region;
+}
+
+
+void StructureTensor::calculate_region(const Matrix2f &tensor,
+									   const Point &point,
+									   const Shape &size,
+									   vector<Point> &region,
+									   float radius) const
 {
 	// If radius parameter is not set, use internal value
 	if (radius < 0.0f) {
 		radius = _radius;
 	}
 
-	vector<Point> region;
+	region.clear();
 
 	// NOTE: we use tensor to locate two extreme points of the elliptical region in Y direction, we then
 	//		 use tensor again to locate boundaries at every row
@@ -386,7 +573,7 @@ vector<Point> StructureTensor::calculate_region(const Matrix2f &tensor,
 	double det = t_00 * t_11 - t_01 * t_01;
 	if (det <= 0.0 || trace * trace / det > EIGEN_RATIO_THRESHOLD) {
 		region.push_back(point);
-		return region;
+		return;
 	}
 
 	// Locate extrema in Y direction
@@ -399,9 +586,11 @@ vector<Point> StructureTensor::calculate_region(const Matrix2f &tensor,
 	double b = a * a - t_11 * inv_t_00;
 	double c = radius * radius * inv_t_00;
 
-	// Calculate limits in Y dimension
-	int y_0 = std::max(point.y - (int)std::floor(dy), (int)0);
-	int y_1 = std::min(point.y + (int)std::floor(dy), (int)size.size_y - 1);
+	// Calculate limits in Y dimension (within the support window, if it is set)
+	int lower_x, lower_y, upper_x, upper_y;
+	support_bounds(point, size.size_x, size.size_y, lower_x, lower_y, upper_x, upper_y);
+	int y_0 = std::max(point.y - (int)std::floor(dy), lower_y);
+	int y_1 = std::min(point.y + (int)std::floor(dy), upper_y);
 
 	// Scan rows between y_0 and y_1
 	for (int y = y_0; y <= y_1; ++y) {
@@ -410,16 +599,14 @@ vector<Point> StructureTensor::calculate_region(const Matrix2f &tensor,
 		double dis = std::sqrt(b * offset_y * offset_y + c);
 		int x_0 = (int)std::ceil((double)point.x - a * offset_y - dis);
 		int x_1 = (int)std::floor((double)point.x - a * offset_y + dis);
-		x_0 = std::max(x_0, 0);
-		x_1 = std::min(x_1, (int)size.size_x - 1);
+		x_0 = std::max(x_0, lower_x);
+		x_1 = std::min(x_1, upper_x);
 
 		// Add points of y row between x_0 and x_1 to the region
 		for (int x = x_0; x <= x_1; ++x) {
 			region.push_back(Point(x, y));
 		}
 	}
-
-	return region;
 }
 
 
@@ -622,31 +809,139 @@ void StructureTensor::set_max_size_limit(float value)
     _max_size_limit = value;
 }
 
+
+FieldLayouts::FieldLayout StructureTensor::field_layout() const
+{
+	return _field_layout;
+}
+
+
+void StructureTensor::set_field_layout(FieldLayouts::FieldLayout value)
+{
+	_field_layout = value;
+}
+
+
+Traversals::Traversal StructureTensor::traversal() const
+{
+	return _traversal;
+}
+
+
+void StructureTensor::set_traversal(Traversals::Traversal value)
+{
+	_traversal = value;
+}
+
+
+int StructureTensor::support_radius() const
+{
+	return _support_radius;
+}
+
+
+void StructureTensor::set_support_radius(int value)
+{
+	_support_radius = std::max(value, 0);
+}
+
 /* Private */
 
 void StructureTensor::configure()
 {
 	// Choose one of two schemes depending on the value of _gamma
 	if (_gamma > 0.0f && _gamma < 1.0f) {
-		_run_scheme_func = [this] (CalcFirstFunc &calc_first, CalcNextFunc &calc_next, const Point &point) {
-			return run_stabilized_scheme(calc_first, calc_next, point);
+		_run_scheme_func = [this] (CalcFirstFunc &calc_first, CalcNextFunc &calc_next, const Point &point,
+								   int iterations_amount) {
+			return run_stabilized_scheme(calc_first, calc_next, point, iterations_amount);
 		};
 	} else {
-		_run_scheme_func = [this] (CalcFirstFunc &calc_first, CalcNextFunc &calc_next, const Point &point) {
-			return run_original_scheme(calc_first, calc_next, point);
+		_run_scheme_func = [this] (CalcFirstFunc &calc_first, CalcNextFunc &calc_next, const Point &point,
+								   int iterations_amount) {
+			return run_original_scheme(calc_first, calc_next, point, iterations_amount);
 		};
 	}
 }
 
 
+/**
+ * Compute structure tensors at every point using dyadic products stored with a given layout.
+ * Points with non-zero initial tensors (if given) start from them and run refinement iterations only.
+ */
+template <class Layout>
+Image<Matrix2f> StructureTensor::calculate_field(const float *dyadics,
+												 const Layout &layout,
+												 Shape size,
+												 const MaskFx &mask,
+												 const CostModel &cost_model,
+												 const ImageFx<Matrix2f> &initial_tensors,
+												 int refinement_iterations) const
+{
+	const BitMask *mask_bits = (mask) ? &mask.bits() : 0;
+
+	// Define functor for computing an initial structure tensor
+	CalcFirstFunc calc_first = [&] (Point p) {
+		return calculate_initial_tensor(dyadics, layout, mask_bits, size.size_x, size.size_y, _radius, p);
+	};
+
+	// Define functor for iterative computation of a structure tensor
+	CalcNextFunc  calc_next = [&] (Point p, Matrix2f tensor) {
+		return calculate_next_tensor(dyadics, layout, mask_bits, size.size_x, size.size_y, _radius, p, tensor);
+	};
+
+	// Define functor returning the initial tensor (warm start), the first iteration is counted as well
+	CalcFirstFunc warm_first = [&] (Point p) {
+		return initial_tensors(p);
+	};
+	int warm_iterations_amount = std::min(std::max(refinement_iterations, 0) + 1, _iterations_amount);
+
+	// Compute structure tensors for all points in the image
+	Image<Matrix2f> tensors(size.size_x, size.size_y);
+	cost_model.run([&] (int x_0, int y_0, int x_1, int y_1) {
+		vector<Point> points;
+		BlockTraversal::order(x_0, y_0, x_1, y_1, _traversal, points);
+		for (auto it = points.begin(); it != points.end(); ++it) {
+			const Matrix2f *initial = (initial_tensors) ? &initial_tensors(*it) : 0;
+			if (initial && ((*initial)[0] != 0.0f || (*initial)[1] != 0.0f || (*initial)[3] != 0.0f)) {
+				tensors(*it) = _run_scheme_func(warm_first, calc_next, *it, warm_iterations_amount);
+			} else {
+				tensors(*it) = _run_scheme_func(calc_first, calc_next, *it, _iterations_amount);
+			}
+		}
+	});
+
+	return tensors;
+}
+
+
+/**
+ * Get the bounds of the domain, which regions at a given point are clipped to (including the support window).
+ */
+inline void StructureTensor::support_bounds(const Point &center, int size_x, int size_y,
+											int &x_0, int &y_0, int &x_1, int &y_1) const
+{
+	x_0 = 0;
+	y_0 = 0;
+	x_1 = size_x - 1;
+	y_1 = size_y - 1;
+	if (_support_radius > 0) {
+		x_0 = std::max(x_0, center.x - _support_radius);
+		y_0 = std::max(y_0, center.y - _support_radius);
+		x_1 = std::min(x_1, center.x + _support_radius);
+		y_1 = std::min(y_1, center.y + _support_radius);
+	}
+}
+
+
 inline Matrix2f StructureTensor::run_original_scheme(CalcFirstFunc &calc_first,
 													 CalcNextFunc &calc_next,
-													 const Point &point) const
+													 const Point &point,
+													 int iterations_amount) const
 {
 	// Calculate structure tensor at the first iteration
 	Matrix2f tensor = calc_first(point);
 
-	for (int i = 1; i < _iterations_amount; i++) {
+	for (int i = 1; i < iterations_amount; i++) {
 		Matrix2f next_tensor = calc_next(point, tensor);
 
 		// Compute the difference
@@ -670,18 +965,19 @@ inline Matrix2f StructureTensor::run_original_scheme(CalcFirstFunc &calc_first,
 
 inline Matrix2f StructureTensor::run_stabilized_scheme(CalcFirstFunc &calc_first,
 													   CalcNextFunc &calc_next,
-													   const Point &point) const
+													   const Point &point,
+													   int iterations_amount) const
 {
 	// NOTE: the following three constants (5, 2.0 and 0.0001) were picked experimentally
 	float gamma = _gamma;
-	int gamma_decrease_step = std::max(_iterations_amount / 5, 1);
+	int gamma_decrease_step = std::max(iterations_amount / 5, 1);
 	float gamma_divider = 2.0f;
 
 	// Calculate tensor of the first iteration
 	Matrix2f tensor = calc_first(point);
 
 	Matrix2f proposed_tensor;
-	for (int i = 1; i < _iterations_amount; i++) {
+	for (int i = 1; i < iterations_amount; i++) {
 		proposed_tensor = calc_next(point, tensor);
 
 		// Update tensor using its previous value and the proposed tensor
@@ -711,13 +1007,14 @@ inline Matrix2f StructureTensor::run_stabilized_scheme(CalcFirstFunc &calc_first
 
 inline Matrix2f StructureTensor::calculate_initial_tensor(const float *grad_x,
 														  const float *grad_y,
-														  const bool *mask,
+														  int stride,
+														  const BitMask *mask,
 														  int size_x,
 														  int size_y,
 														  float radius,
 														  const Point &center) const
 {
-	int index_at_center = center.y * size_x + center.x;
+	int index_at_center = center.y * stride + center.x;
 	float grad_x_at_center = grad_x[index_at_center];
 	float grad_y_at_center = grad_y[index_at_center];
 	const int margin = 1;
@@ -738,14 +1035,23 @@ inline Matrix2f StructureTensor::calculate_initial_tensor(const float *grad_x,
 		y_upper = size_y - 1;
 	}
 
+	// Restrict the band to the support window, if it is set
+	// NOTE: all rows of the window are scanned then, since the limits above depend on the size of the domain
+	int lower_x, lower_y, upper_x, upper_y;
+	support_bounds(center, size_x, size_y, lower_x, lower_y, upper_x, upper_y);
+	if (_support_radius > 0) {
+		y_lower = lower_y;
+		y_upper = upper_y;
+	}
+
 	if (std::abs(grad_x_at_center) > EPS) {
 		// Scan rows between y_lower and y_upper
 		for (long y = y_lower; y <= y_upper; y++) {
 			// For every row compute possible limits in X dimension
 			float x_1 = (-radius - grad_y_at_center * (float) (y - center.y)) / grad_x_at_center + center.x;
 			float x_2 = (+radius - grad_y_at_center * (float) (y - center.y)) / grad_x_at_center + center.x;
-			long x_lower = std::max(0, (int) std::min(x_1, x_2) - margin);
-			long x_upper = std::min(size_x - 1, (int) std::max(x_1, x_2) + margin);
+			long x_lower = std::max(lower_x, (int) std::min(x_1, x_2) - margin);
+			long x_upper = std::min(upper_x, (int) std::max(x_1, x_2) + margin);
 
 			// Find exact lower limit in X dimension
 			for (; x_lower <= x_upper; x_lower++) {
@@ -764,21 +1070,13 @@ inline Matrix2f StructureTensor::calculate_initial_tensor(const float *grad_x,
 			}
 
 			// Compute and aggregate dyadic products at the points of y row between x_lower and x_upper
-			for (long x = x_lower; x <= x_upper; x++) {
-				long index = y * size_x + x;
-				if (!mask || mask[index]) {
-					a += grad_x[index] * grad_x[index];
-					bc += grad_x[index] * grad_y[index];
-					d += grad_y[index] * grad_y[index];
-					normalizer += 1;
-				}
-			}
+			normalizer += add_dyadics(grad_x, grad_y, mask, stride, y, x_lower, x_upper, a, bc, d);
 		}    // for(int y = y_lower; y <= y_upper; y++)
 	} else {    // grad_x_at_center <= EPS
 		// Scan complete rows between y_lower and y_upper
 		for (long y = y_lower; y <= y_upper; y++) {
-			long x_lower = 0;
-			long x_upper = size_x - 1;
+			long x_lower = lower_x;
+			long x_upper = upper_x;
 
 			// Find exact lower limit in X dimension
 			for (; x_lower <= x_upper; x_lower++) {
@@ -797,15 +1095,7 @@ inline Matrix2f StructureTensor::calculate_initial_tensor(const float *grad_x,
 			}
 
 			// Compute and aggregate dyadic products at the points of y row between x_lower and x_upper
-			for (long x = x_lower; x <= x_upper; x++) {
-				long index = y * size_x + x;
-				if (!mask || mask[index]) {
-					a += grad_x[index] * grad_x[index];
-					bc += grad_x[index] * grad_y[index];
-					d += grad_y[index] * grad_y[index];
-					normalizer += 1;
-				}
-			}
+			normalizer += add_dyadics(grad_x, grad_y, mask, stride, y, x_lower, x_upper, a, bc, d);
 		}    // for(int y = y_lower; y <= y_upper; y++)
 	}
 
@@ -823,14 +1113,16 @@ inline Matrix2f StructureTensor::calculate_initial_tensor(const float *grad_x,
 }
 
 
+template <class Layout>
 inline Matrix2f StructureTensor::calculate_initial_tensor(const float *dyadics,
-														  const bool *mask,
+														  const Layout &layout,
+														  const BitMask *mask,
 														  int size_x,
 														  int size_y,
 														  float radius,
 														  const Point &center) const
 {
-	int index_at_center = 3 * (center.y * size_x + center.x);
+	int index_at_center = layout.offset(center.x, center.y);
 	float grad_x_at_center = std::sqrt(dyadics[index_at_center]);
 	float grad_y_at_center = (dyadics[index_at_center + 1] >= 0) ? std::sqrt(dyadics[index_at_center + 2])
 																 : -std::sqrt(dyadics[index_at_center + 2]);
@@ -852,14 +1144,23 @@ inline Matrix2f StructureTensor::calculate_initial_tensor(const float *dyadics,
 		y_upper = size_y - 1;
 	}
 
+	// Restrict the band to the support window, if it is set
+	// NOTE: all rows of the window are scanned then, since the limits above depend on the size of the domain
+	int lower_x, lower_y, upper_x, upper_y;
+	support_bounds(center, size_x, size_y, lower_x, lower_y, upper_x, upper_y);
+	if (_support_radius > 0) {
+		y_lower = lower_y;
+		y_upper = upper_y;
+	}
+
 	if (std::abs(grad_x_at_center) > EPS) {
 		// Scan rows between y_lower and y_upper
 		for (long y = y_lower; y <= y_upper; y++) {
 			// For every row compute possible limits in X dimension
 			float x_1 = (-radius - grad_y_at_center * (float) (y - center.y)) / grad_x_at_center + center.x;
 			float x_2 = (+radius - grad_y_at_center * (float) (y - center.y)) / grad_x_at_center + center.x;
-			long x_lower = std::max(0, (int) std::min(x_1, x_2) - margin);
-			long x_upper = std::min(size_x - 1, (int) std::max(x_1, x_2) + margin);
+			long x_lower = std::max(lower_x, (int) std::min(x_1, x_2) - margin);
+			long x_upper = std::min(upper_x, (int) std::max(x_1, x_2) + margin);
 
 			// Find exact lower limit in X dimension
 			for (; x_lower <= x_upper; x_lower++) {
@@ -878,21 +1179,13 @@ inline Matrix2f StructureTensor::calculate_initial_tensor(const float *dyadics,
 			}
 
 			// Aggregate dyadic products at the points of y row between x_lower and x_upper
-			for (long x = x_lower; x <= x_upper; x++) {
-				long index = y * size_x + x;
-				if (!mask || mask[index]) {
-					a += dyadics[index * 3];
-					bc += dyadics[index * 3 + 1];
-					d += dyadics[index * 3 + 2];
-					normalizer += 1;
-				}
-			}
+			normalizer += add_dyadics(dyadics, layout, mask, y, x_lower, x_upper, a, bc, d);
 		}    // for(int y = y_lower; y <= y_upper; y++)
 	} else {    // grad_x_at_center <= EPS
 		// Scan complete rows between y_lower and y_upper
 		for (long y = y_lower; y <= y_upper; y++) {
-			long x_lower = 0;
-			long x_upper = size_x - 1;
+			long x_lower = lower_x;
+			long x_upper = upper_x;
 
 			// Find exact lower limit in X dimension
 			for (; x_lower <= x_upper; x_lower++) {
@@ -911,15 +1204,7 @@ inline Matrix2f StructureTensor::calculate_initial_tensor(const float *dyadics,
 			}
 
 			// Aggregate dyadic products at the points of y row between x_lower and x_upper
-			for (long x = x_lower; x <= x_upper; x++) {
-				long index = y * size_x + x;
-				if (!mask || mask[index]) {
-					a += dyadics[index * 3];
-					bc += dyadics[index * 3 + 1];
-					d += dyadics[index * 3 + 2];
-					normalizer += 1;
-				}
-			}
+			normalizer += add_dyadics(dyadics, layout, mask, y, x_lower, x_upper, a, bc, d);
 		}    // for(int y = y_lower; y <= y_upper; y++)
 	}
 
@@ -939,7 +1224,8 @@ inline Matrix2f StructureTensor::calculate_initial_tensor(const float *dyadics,
 
 inline Matrix2f StructureTensor::calculate_next_tensor(const float *grad_x,
 													   const float *grad_y,
-													   const bool *mask,
+													   int stride,
+													   const BitMask *mask,
 													   int size_x,
 													   int size_y,
 													   float radius,
@@ -957,7 +1243,7 @@ inline Matrix2f StructureTensor::calculate_next_tensor(const float *grad_x,
 	double trace = t_00 + t_11;
 	double det = t_00 * t_11 - t_01 * t_01;
 	if (det <= 0.0 || trace * trace / det > EIGEN_RATIO_THRESHOLD) {
-		int index = center.y * size_x + center.x;
+		int index = center.y * stride + center.x;
 		Matrix2f new_tensor;
 		new_tensor[0] = grad_x[index] * grad_x[index];
 		new_tensor[2] = new_tensor[1] = grad_x[index] * grad_y[index];
@@ -979,9 +1265,11 @@ inline Matrix2f StructureTensor::calculate_next_tensor(const float *grad_x,
 	double b = a * a - t_11 * inv_t_00;
 	double c = radius * radius * inv_t_00;
 
-	// Calculate limits in Y dimension
-	int y_0 = std::max(center.y - (int)std::floor(dy), 0);
-	int y_1 = std::min(center.y + (int)std::floor(dy), size_y - 1);
+	// Calculate limits in Y dimension (within the support window, if it is set)
+	int lower_x, lower_y, upper_x, upper_y;
+	support_bounds(center, size_x, size_y, lower_x, lower_y, upper_x, upper_y);
+	int y_0 = std::max(center.y - (int)std::floor(dy), lower_y);
+	int y_1 = std::min(center.y + (int)std::floor(dy), upper_y);
 
 	// Scan rows between y_0 and y_1
 	for (int y = y_0; y <= y_1; ++y) {
@@ -990,19 +1278,11 @@ inline Matrix2f StructureTensor::calculate_next_tensor(const float *grad_x,
 		double dis = std::sqrt(b * offset_y * offset_y + c);
 		int x_0 = (int)std::ceil((double)center.x - a * offset_y - dis);
 		int x_1 = (int)std::floor((double)center.x - a * offset_y + dis);
-		x_0 = std::max(x_0, 0);
-		x_1 = std::min(x_1, size_x - 1);
+		x_0 = std::max(x_0, lower_x);
+		x_1 = std::min(x_1, upper_x);
 
 		// Compute and aggregate dyadic products at the points of y row between x_0 and x_1
-		for (int x = x_0; x <= x_1; ++x) {
-			int index = y * size_x + x;
-			if (!mask || mask[index]) {
-				nt_00 += grad_x[index] * grad_x[index];
-				nt_01 += grad_x[index] * grad_y[index];
-				nt_11 += grad_y[index] * grad_y[index];
-				normalizer += 1;
-			}
-		}
+		normalizer += add_dyadics(grad_x, grad_y, mask, stride, y, x_0, x_1, nt_00, nt_01, nt_11);
 	}
 
 	// Normalize
@@ -1023,8 +1303,10 @@ inline Matrix2f StructureTensor::calculate_next_tensor(const float *grad_x,
 }
 
 
+template <class Layout>
 inline Matrix2f StructureTensor::calculate_next_tensor(const float *dyadics,
-													   const bool *mask,
+													   const Layout &layout,
+													   const BitMask *mask,
 													   int size_x,
 													   int size_y,
 													   float radius,
@@ -1042,7 +1324,7 @@ inline Matrix2f StructureTensor::calculate_next_tensor(const float *dyadics,
 	double trace = t_00 + t_11;
 	double det = t_00 * t_11 - t_01 * t_01;
 	if (det <= 0.0 || trace * trace / det > EIGEN_RATIO_THRESHOLD) {
-		int index = 3 * (center.y * size_x + center.x);
+		int index = layout.offset(center.x, center.y);
 		Matrix2f new_tensor;
 		new_tensor[0] = dyadics[index];
 		new_tensor[2] = new_tensor[1] = dyadics[index + 1];
@@ -1064,9 +1346,11 @@ inline Matrix2f StructureTensor::calculate_next_tensor(const float *dyadics,
 	double b = a * a - t_11 * inv_t_00;
 	double c = radius * radius * inv_t_00;
 
-	// Calculate limits in Y dimension
-	int y_0 = std::max(center.y - (int)std::floor(dy), 0);
-	int y_1 = std::min(center.y + (int)std::floor(dy), size_y - 1);
+	// Calculate limits in Y dimension (within the support window, if it is set)
+	int lower_x, lower_y, upper_x, upper_y;
+	support_bounds(center, size_x, size_y, lower_x, lower_y, upper_x, upper_y);
+	int y_0 = std::max(center.y - (int)std::floor(dy), lower_y);
+	int y_1 = std::min(center.y + (int)std::floor(dy), upper_y);
 
 	// Scan rows between y_0 and y_1
 	for (int y = y_0; y <= y_1; ++y) {
@@ -1075,19 +1359,12 @@ inline Matrix2f StructureTensor::calculate_next_tensor(const float *dyadics,
 		double dis = std::sqrt(b * offset_y * offset_y + c);
 		int x_0 = (int)std::ceil((double)center.x - a * offset_y - dis);
 		int x_1 = (int)std::floor((double)center.x - a * offset_y + dis);
-		x_0 = std::max(x_0, 0);
-		x_1 = std::min(x_1, size_x - 1);
+		x_0 = std::max(x_0, lower_x);
+		x_1 = std::min(x_1, upper_x);
 
-		// Aggregate dyadic products at the points of y row between x_0 and x_1
-		for (int x = x_0; x <= x_1; ++x) {
-			int index = y * size_x + x;
-			if (!mask || mask[index]) {
-				nt_00 += dyadics[index * 3];
-				nt_01 += dyadics[index * 3 + 1];
-				nt_11 += dyadics[index * 3 + 2];
-				normalizer += 1;
-			}
-		}
+		// Aggregate dyadic products at the points of y row between x_0 and x_1,
+		// masked rows are processed word by word (@see BitMask)
+		normalizer += add_dyadics(dyadics, layout, mask, y, x_0, x_1, nt_00, nt_01, nt_11);
 	}
 
 	// Normalize
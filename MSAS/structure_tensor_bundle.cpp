@@ -10,6 +10,7 @@
 
 #include <io_utility.h>
 #include "structure_tensor_bundle.h"
+#include "ellipse_normalization.h"
 
 using std::vector;
 
@@ -17,7 +18,8 @@ namespace msas
 {
 
 StructureTensorBundle::StructureTensorBundle()
-: _structure_tensor(0)
+: _structure_tensor(0),
+  _has_dyadics(false)
 {
 	_data = vector<DataEntry* >();
 }
@@ -26,15 +28,23 @@ StructureTensorBundle::StructureTensorBundle(const ImageFx<float> &image,
 											 const StructureTensor &structure_tensor,
 											 const MaskFx &mask)
 : _structure_tensor(structure_tensor),
-  _image(image)
+  _image(image),
+  _has_dyadics(false)
 {
+	// NOTE: images wrapping external buffers are shared as well, unless their rows are not contiguous
+	if (!_image.is_contiguous()) {
+		_image = _image.clone();
+	}
+
 	_size_x = _image.size_x();
 	_size_y = _image.size_y();
 
 	if (!mask.is_empty() && mask.size() == _image.size()) {
 		_mask = mask;
+		_interpolation_mask = EllipseNormalization::erode_mask(mask);
 	} else {
 		_mask = MaskFx();
+		_interpolation_mask = MaskFx();
 	}
 
 	_data = vector<DataEntry* >(_size_x * _size_y, (DataEntry*)0);
@@ -47,8 +57,10 @@ StructureTensorBundle::StructureTensorBundle(const StructureTensorBundle &other)
 : _structure_tensor(other._structure_tensor),
   _image(other._image),
   _mask(other._mask),
+  _interpolation_mask(other._interpolation_mask),
   _size_x(other._size_x),
-  _size_y(other._size_y)
+  _size_y(other._size_y),
+  _has_dyadics(false)
 {
 	_data = vector<DataEntry* >(_size_x * _size_y, (DataEntry*)0);
 
@@ -78,6 +90,12 @@ MaskFx StructureTensorBundle::mask() const
 }
 
 
+MaskFx StructureTensorBundle::interpolation_mask() const
+{
+	return _interpolation_mask;
+}
+
+
 Image<float> StructureTensorBundle::gradient_x() const
 {
 	if (_gradient_x.is_empty()) {
@@ -98,6 +116,73 @@ Image<float> StructureTensorBundle::gradient_y() const
 }
 
 
+ImageFx<float> StructureTensorBundle::dyadics() const
+{
+	ensure_dyadics();
+
+	return _dyadics;
+}
+
+
+void StructureTensorBundle::precompute_dyadics(TaskGroup &parent) const
+{
+	if (_has_dyadics || !_image) {
+		return;
+	}
+
+	{
+		// Gradient provided by populate_gradient_cache() is used as is
+		std::lock_guard<std::mutex> lock(_gradient_mutex);
+		if (!_gradient_x.is_empty()) {
+			if (_dyadics.is_empty()) {
+				calculate_dyadics();
+			}
+			_has_dyadics = true;
+			return;
+		}
+	}
+
+	// NOTE: tiles are computed without holding the lock, because a thread waiting for them
+	//		 may execute other tasks, which need the dyadic products of this bundle
+	ImageFx<float> image = (_image.number_of_channels() != 1) ? IOUtility::to_mono(_image) : _image;
+	Image<float> gradient_x(_image.size(), 0.0f);
+	Image<float> gradient_y(_image.size(), 0.0f);
+	Image<float> dyadics(_image.size(), (uint)3);
+	TaskGroup group(parent);
+	group.run_tiles(_image.size(), TILE_SIZE, [&] (int x_0, int y_0, int x_1, int y_1) {
+		Image<float> tile_gradient_x = gradient_x.view(x_0, y_0, x_1 - x_0, y_1 - y_0);
+		Image<float> tile_gradient_y = gradient_y.view(x_0, y_0, x_1 - x_0, y_1 - y_0);
+		Image<float> tile_dyadics = dyadics.view(x_0, y_0, x_1 - x_0, y_1 - y_0);
+		FieldOperations::centered_gradient(image.view(x_0, y_0, x_1 - x_0, y_1 - y_0), tile_gradient_x, tile_gradient_y);
+		calculate_dyadics(tile_gradient_x, tile_gradient_y, tile_dyadics);
+	});
+	group.wait();
+
+	std::lock_guard<std::mutex> lock(_gradient_mutex);
+	if (_dyadics.is_empty()) {
+		_gradient_x = gradient_x;
+		_gradient_y = gradient_y;
+		_dyadics = dyadics;
+		if (_structure_tensor.field_layout() == FieldLayouts::tiled) {
+			_tiled_dyadics = TiledImage<float>(_dyadics);
+		}
+	}
+	_has_dyadics = true;
+}
+
+
+CostModel StructureTensorBundle::cost_model() const
+{
+	return CostModel(dyadics(), _structure_tensor.radius(), _structure_tensor.max_size_limit());
+}
+
+
+const StructureTensor& StructureTensorBundle::structure_tensor() const
+{
+	return _structure_tensor;
+}
+
+
 int StructureTensorBundle::size_x() const
 {
 	return _size_x;
@@ -160,6 +245,18 @@ vector<Point> StructureTensorBundle::region(Point p) const
 }
 
 
+void StructureTensorBundle::region(Point p, vector<Point> &region) const
+{
+	if (!is_in_range(p.x, p.y)) {
+		region.clear();
+		return;
+	}
+
+	DataEntry *data = get_or_calculate_data(p.x, p.y);
+	_structure_tensor.calculate_region(data->tensor, p, _image.size(), region);
+}
+
+
 vector<Point> StructureTensorBundle::region(int x, int y, float radius) const
 {
 	if (!is_in_range(x, y)) {
@@ -347,13 +444,9 @@ void StructureTensorBundle::calculate_gradient() const
 	}
 
 	// Convert image to gray, if it is multichannel
-	Image<float> image = (_image.number_of_channels() != 1) ? IOUtility::to_mono(_image) : _image;
+	ImageFx<float> image = (_image.number_of_channels() != 1) ? IOUtility::to_mono(_image) : _image;
 
-	FieldOperations::centered_gradient(image.raw(),
-									   _gradient_x.raw(),
-									   _gradient_y.raw(),
-									   _image.size_x(),
-									   _image.size_y());
+	FieldOperations::centered_gradient(image, _gradient_x, _gradient_y);
 }
 
 
@@ -363,18 +456,51 @@ void StructureTensorBundle::calculate_gradient() const
 void StructureTensorBundle::calculate_dyadics() const
 {
 	_dyadics = Image<float>(_gradient_x.size(), (uint)3);
-	int size_x = _gradient_x.size_x();
-	int size_y = _gradient_x.size_y();
-	float *dyadics_data = _dyadics.raw();
-	float *grad_x_data = _gradient_x.raw();
-	float *grad_y_data = _gradient_y.raw();
-	for (uint y = 0; y < size_y; ++y) {
-		for (uint x = 0; x < size_x; ++x) {
-			int index = size_x * y + x;
-			dyadics_data[index * 3] = 		grad_x_data[index] * grad_x_data[index];
-			dyadics_data[index * 3 + 1] = 	grad_x_data[index] * grad_y_data[index];
-			dyadics_data[index * 3 + 2] = 	grad_y_data[index] * grad_y_data[index];
+	calculate_dyadics(_gradient_x, _gradient_y, _dyadics);
+
+	if (_structure_tensor.field_layout() == FieldLayouts::tiled) {
+		_tiled_dyadics = TiledImage<float>(_dyadics);
+	}
+}
+
+
+/**
+ * Compute dyadic products of gradient vectors given by images or views of the same size.
+ */
+void StructureTensorBundle::calculate_dyadics(const ImageFx<float> &gradient_x,
+											  const ImageFx<float> &gradient_y,
+											  Image<float> &dyadics)
+{
+	int size_x = gradient_x.size_x();
+	int size_y = gradient_x.size_y();
+	for (int y = 0; y < size_y; ++y) {
+		const float *grad_x_data = gradient_x.row(y);
+		const float *grad_y_data = gradient_y.row(y);
+		float *dyadics_data = dyadics.row(y);
+		for (int x = 0; x < size_x; ++x) {
+			dyadics_data[x * 3] = 		grad_x_data[x] * grad_x_data[x];
+			dyadics_data[x * 3 + 1] = 	grad_x_data[x] * grad_y_data[x];
+			dyadics_data[x * 3 + 2] = 	grad_y_data[x] * grad_y_data[x];
+		}
+	}
+}
+
+
+/**
+ * Make sure that the gradient and dyadic products are calculated.
+ * They are calculated once, by the first thread that needs them.
+ */
+inline void StructureTensorBundle::ensure_dyadics() const
+{
+	if (!_has_dyadics) {
+		std::lock_guard<std::mutex> lock(_gradient_mutex);
+		if (_dyadics.is_empty()) {
+			if (_gradient_x.is_empty()) {
+				calculate_gradient();
+			}
+			calculate_dyadics();
 		}
+		_has_dyadics = true;
 	}
 }
 
@@ -384,16 +510,13 @@ void StructureTensorBundle::calculate_dyadics() const
  */
 DataEntry* StructureTensorBundle::calculate_data(int x, int y) const
 {
-    #pragma omp critical (GRADIENT)
-	if (_gradient_x.is_empty()) {
-        calculate_gradient();
-		calculate_dyadics();
-	}
+	ensure_dyadics();
 
 	DataEntry *data = new DataEntry();
 
 //	data->tensor = _structure_tensor.calculate_stabilized(_gradient_x, _gradient_y, Point(x, y), _mask);
-	data->tensor = _structure_tensor.calculate(_dyadics, Point(x, y), _mask);
+	data->tensor = (_tiled_dyadics) ? _structure_tensor.calculate(_tiled_dyadics, Point(x, y), _mask)
+									: _structure_tensor.calculate(_dyadics, Point(x, y), _mask);
 	data->transform = _structure_tensor.calculate_transformation(data->tensor, data->angle);
 
 	return data;
@@ -0,0 +1,150 @@
+/**
+ * Copyright (C) 2016, Vadim Fedorov <coderiks@gmail.com>
+ *
+ * This program is free software: you can use, modify and/or
+ * redistribute it under the terms of the simplified BSD
+ * License. You should have received a copy of this license along
+ * this program. If not, see
+ * <http://www.opensource.org/licenses/bsd-license.html>.
+ */
+
+#include <cmath>
+#include <vector>
+#include <stdexcept>
+#include <algorithm>
+#include "structure_tensor_tiles.h"
+#include "field_operations.h"
+#include "block_traversal.h"
+#include "thread_pool.h"
+#include "tiled_image.h"
+
+using std::vector;
+
+namespace msas
+{
+
+StructureTensorTiles::StructureTensorTiles(const StructureTensor &structure_tensor, uint tile_size)
+ : _structure_tensor(structure_tensor), _tile_size(std::max(tile_size, 1u))
+{
+	// NOTE: elliptical regions do not exceed max_size_limit (except at the first iterations)
+	if (_structure_tensor.support_radius() == 0) {
+		if (_structure_tensor.max_size_limit() < 1.0f) {
+			throw std::invalid_argument("StructureTensorTiles: support of structure tensors is unbounded, "
+										"max_size_limit or support radius should be set.");
+		}
+		_structure_tensor.set_support_radius((int)std::ceil(_structure_tensor.max_size_limit()));
+	}
+}
+
+
+const StructureTensor& StructureTensorTiles::structure_tensor() const
+{
+	return _structure_tensor;
+}
+
+
+uint StructureTensorTiles::tile_size() const
+{
+	return _tile_size;
+}
+
+
+int StructureTensorTiles::halo() const
+{
+	return _structure_tensor.support_radius();
+}
+
+
+bool StructureTensorTiles::run(StripReader &reader, TileFunc tile_func, StripFunc strip_func) const
+{
+	if (!reader.is_open()) {
+		return false;
+	}
+
+	Shape size = reader.size();
+	int halo = this->halo();
+	int tile_size = _tile_size;
+	int number_of_tiles = (size.size_x + tile_size - 1) / tile_size;
+
+	for (int y_0 = 0; y_0 < (int)size.size_y; y_0 += tile_size) {
+		int y_1 = std::min(y_0 + tile_size, (int)size.size_y);
+
+		// Read the strip with rows needed by the tensors and by the gradient at the rows of the halo
+		// NOTE: rows of the halo are read again for the next strip, only one strip is kept in memory
+		int strip_y_0 = std::max(y_0 - halo - GRADIENT_HALO, 0);
+		int strip_y_1 = std::min(y_1 + halo + GRADIENT_HALO, (int)size.size_y);
+		Image<float> strip = reader.read(strip_y_0, strip_y_1);
+		if (!strip) {
+			return false;
+		}
+
+		ThreadPool::shared().parallel_for(0, number_of_tiles, 1, [&] (int begin, int end) {
+			for (int tile = begin; tile < end; tile++) {
+				int x_0 = tile * tile_size;
+				int x_1 = std::min(x_0 + tile_size, (int)size.size_x);
+				process_tile(strip, strip_y_0, size, x_0, y_0, x_1, y_1, tile_func);
+			}
+		});
+
+		strip_func(y_0, y_1);
+	}
+
+	return true;
+}
+
+
+/* Private */
+
+/**
+ * Compute the gradient and dyadic products of a tile with the halo and structure tensors at the points of the tile.
+ * @param strip Rows of the image starting at strip_y, which include the halo of the tile.
+ */
+void StructureTensorTiles::process_tile(const ImageFx<float> &strip, int strip_y, Shape size,
+										int x_0, int y_0, int x_1, int y_1, TileFunc &tile_func) const
+{
+	int halo = this->halo();
+
+	Tile tile;
+	tile.x_0 = x_0;
+	tile.y_0 = y_0;
+	tile.x_1 = x_1;
+	tile.y_1 = y_1;
+	tile.origin = Point(std::max(x_0 - halo, 0), std::max(y_0 - halo, 0));
+	int size_x = std::min(x_1 + halo, (int)size.size_x) - tile.origin.x;
+	int size_y = std::min(y_1 + halo, (int)size.size_y) - tile.origin.y;
+
+	// The view reaches the rest of the strip, so the gradient is the same as for the whole image
+	Image<float> gradient_x(size_x, size_y);
+	Image<float> gradient_y(size_x, size_y);
+	FieldOperations::centered_gradient(strip.view(tile.origin.x, tile.origin.y - strip_y, size_x, size_y),
+									   gradient_x, gradient_y);
+
+	Image<float> dyadics(size_x, size_y, (uint)3);
+	for (int y = 0; y < size_y; y++) {
+		float *dyadics_data = dyadics.row(y);
+		const float *grad_x_data = gradient_x.row(y);
+		const float *grad_y_data = gradient_y.row(y);
+		for (int x = 0; x < size_x; x++) {
+			dyadics_data[x * 3] = grad_x_data[x] * grad_x_data[x];
+			dyadics_data[x * 3 + 1] = grad_x_data[x] * grad_y_data[x];
+			dyadics_data[x * 3 + 2] = grad_y_data[x] * grad_y_data[x];
+		}
+	}
+	tile.dyadics = dyadics;
+
+	// Compute structure tensors at the points of the tile (coordinates relative to the origin)
+	TiledImage<float> tiled_dyadics = (_structure_tensor.field_layout() == FieldLayouts::tiled) ?
+									  TiledImage<float>(dyadics) : TiledImage<float>();
+	tile.tensors = Image<Matrix2f>(x_1 - x_0, y_1 - y_0);
+	vector<Point> points;
+	BlockTraversal::order(x_0, y_0, x_1, y_1, _structure_tensor.traversal(), points);
+	for (auto it = points.begin(); it != points.end(); ++it) {
+		Point p(it->x - tile.origin.x, it->y - tile.origin.y);
+		tile.tensors(it->x - x_0, it->y - y_0) = (tiled_dyadics) ? _structure_tensor.calculate(tiled_dyadics, p, MaskFx())
+																 : _structure_tensor.calculate(dyadics, p, MaskFx());
+	}
+
+	tile_func(tile);
+}
+
+}	// namespace msas
@@ -0,0 +1,186 @@
+/**
+ * Copyright (C) 2016, Vadim Fedorov <coderiks@gmail.com>
+ *
+ * This program is free software: you can use, modify and/or
+ * redistribute it under the terms of the simplified BSD
+ * License. You should have received a copy of this license along
+ * this program. If not, see
+ * <http://www.opensource.org/licenses/bsd-license.html>.
+ */
+
+#include <cmath>
+#include <vector>
+#include "tensor_warping.h"
+#include "thread_pool.h"
+
+using std::vector;
+
+namespace msas
+{
+
+TensorWarping::TensorWarping(float max_flow_gradient, float max_flow_difference)
+ : _max_flow_gradient(max_flow_gradient), _max_flow_difference(max_flow_difference)
+{
+
+}
+
+
+Image<Matrix2f> TensorWarping::warp(const ImageFx<Matrix2f> &tensors,
+									const ImageFx<float> &flow,
+									uint &number_of_warped) const
+{
+	number_of_warped = 0;
+	Matrix2f zero_tensor = {{0.0f, 0.0f, 0.0f, 0.0f}};
+	if (!tensors || !flow || flow.size() != tensors.size() || flow.number_of_channels() != 2) {
+		return Image<Matrix2f>(tensors.size_x(), tensors.size_y(), zero_tensor);
+	}
+
+	int size_x = tensors.size_x();
+	int size_y = tensors.size_y();
+
+	// Transform tensors and find the pixels they are moved to (independently for every point)
+	vector<int> targets(size_x * size_y, NO_SOURCE);
+	Image<Matrix2f> transformed(size_x, size_y, zero_tensor);
+	ThreadPool::shared().parallel_for(0, size_y, 1, [&] (int begin, int end) {
+		for (int y = begin; y < end; y++) {
+			for (int x = 0; x < size_x; x++) {
+				if (!is_known(flow, x, y) || !transform(flow, x, y, tensors(x, y), transformed(x, y))) {
+					continue;
+				}
+
+				int target_x = (int)std::floor(x + flow(x, y, 0) + 0.5f);
+				int target_y = (int)std::floor(y + flow(x, y, 1) + 0.5f);
+				if (target_x >= 0 && target_x < size_x && target_y >= 0 && target_y < size_y) {
+					targets[y * size_x + x] = target_y * size_x + target_x;
+				}
+			}
+		}
+	});
+
+	// Assign sources to pixels of the next frame, pixels reached by inconsistent flows are occluded
+	vector<int> sources(size_x * size_y, NO_SOURCE);
+	float max_difference_sqr = _max_flow_difference * _max_flow_difference;
+	for (int source = 0; source < size_x * size_y; source++) {
+		int target = targets[source];
+		if (target == NO_SOURCE || sources[target] == CONFLICT) {
+			continue;
+		}
+
+		int other = sources[target];
+		if (other == NO_SOURCE) {
+			sources[target] = source;
+			continue;
+		}
+
+		float d_x = flow(source % size_x, source / size_x, 0) - flow(other % size_x, other / size_x, 0);
+		float d_y = flow(source % size_x, source / size_x, 1) - flow(other % size_x, other / size_x, 1);
+		if (d_x * d_x + d_y * d_y > max_difference_sqr) {
+			sources[target] = CONFLICT;
+		}
+	}
+
+	Image<Matrix2f> warped(size_x, size_y, zero_tensor);
+	for (int target = 0; target < size_x * size_y; target++) {
+		int source = sources[target];
+		if (source >= 0) {
+			warped(target % size_x, target / size_x) = transformed(source % size_x, source / size_x);
+			number_of_warped++;
+		}
+	}
+
+	return warped;
+}
+
+
+float TensorWarping::max_flow_gradient() const
+{
+	return _max_flow_gradient;
+}
+
+
+void TensorWarping::set_max_flow_gradient(float value)
+{
+	_max_flow_gradient = value;
+}
+
+
+float TensorWarping::max_flow_difference() const
+{
+	return _max_flow_difference;
+}
+
+
+void TensorWarping::set_max_flow_difference(float value)
+{
+	_max_flow_difference = value;
+}
+
+
+/* Private */
+
+inline bool TensorWarping::is_known(const ImageFx<float> &flow, int x, int y) const
+{
+	float u = flow(x, y, 0);
+	float v = flow(x, y, 1);
+
+	return std::isfinite(u) && std::isfinite(v) &&
+		   std::fabs(u) < UNKNOWN_FLOW_THRESHOLD && std::fabs(v) < UNKNOWN_FLOW_THRESHOLD;
+}
+
+
+/**
+ * Transform a tensor by the flow Jacobian J at a given point: T' = J^-T * T * J^-1.
+ * @return false, if the flow gradient can not be estimated or exceeds the max_flow_gradient.
+ */
+inline bool TensorWarping::transform(const ImageFx<float> &flow, int x, int y, const Matrix2f &tensor,
+									 Matrix2f &transformed) const
+{
+	if (tensor[0] == 0.0f && tensor[1] == 0.0f && tensor[3] == 0.0f) {
+		return false;
+	}
+
+	// Central differences, one-sided ones at the borders
+	int x_0 = (x > 0) ? x - 1 : x;
+	int x_1 = (x + 1 < (int)flow.size_x()) ? x + 1 : x;
+	int y_0 = (y > 0) ? y - 1 : y;
+	int y_1 = (y + 1 < (int)flow.size_y()) ? y + 1 : y;
+	if (x_0 == x_1 || y_0 == y_1 || !is_known(flow, x_0, y) || !is_known(flow, x_1, y) ||
+		!is_known(flow, x, y_0) || !is_known(flow, x, y_1)) {
+		return false;
+	}
+
+	float du_dx = (flow(x_1, y, 0) - flow(x_0, y, 0)) / (x_1 - x_0);
+	float du_dy = (flow(x, y_1, 0) - flow(x, y_0, 0)) / (y_1 - y_0);
+	float dv_dx = (flow(x_1, y, 1) - flow(x_0, y, 1)) / (x_1 - x_0);
+	float dv_dy = (flow(x, y_1, 1) - flow(x, y_0, 1)) / (y_1 - y_0);
+	float gradient_norm_sqr = du_dx * du_dx + du_dy * du_dy + dv_dx * dv_dx + dv_dy * dv_dy;
+	if (gradient_norm_sqr > _max_flow_gradient * _max_flow_gradient) {
+		return false;
+	}
+
+	// NOTE: J is invertible, since the norm of grad(w) is below 1 (for reasonable values of max_flow_gradient)
+	double j_00 = 1.0 + du_dx, j_01 = du_dy;
+	double j_10 = dv_dx, j_11 = 1.0 + dv_dy;
+	double det = j_00 * j_11 - j_01 * j_10;
+	if (det <= 0.0) {
+		return false;
+	}
+
+	// A = J^-1
+	double a_00 = j_11 / det, a_01 = -j_01 / det;
+	double a_10 = -j_10 / det, a_11 = j_00 / det;
+
+	// T' = A^T * T * A
+	double t_00 = tensor[0], t_01 = tensor[1], t_11 = tensor[3];
+	double ta_00 = t_00 * a_00 + t_01 * a_10;
+	double ta_01 = t_00 * a_01 + t_01 * a_11;
+	double ta_10 = t_01 * a_00 + t_11 * a_10;
+	double ta_11 = t_01 * a_01 + t_11 * a_11;
+	transformed[0] = a_00 * ta_00 + a_10 * ta_10;
+	transformed[1] = transformed[2] = a_00 * ta_01 + a_10 * ta_11;
+	transformed[3] = a_01 * ta_01 + a_11 * ta_11;
+
+	return true;
+}
+
+}	// namespace msas
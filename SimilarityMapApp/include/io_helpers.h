@@ -11,9 +11,20 @@
 #ifndef IO_HELPERS_H_H
 #define IO_HELPERS_H_H
 
+#include <cmath>
+#include <limits>
 #include <string>
+#include <vector>
+#include <sstream>
 #include <fstream>
+#include <iostream>
+#include <algorithm>
 #include "point.h"
+#include "rectangle.h"
+#include "image.h"
+#include "io_utility.h"
+#include "cost_model.h"
+#include "distance_info.h"
 
 namespace iohelpers {
 
@@ -38,6 +49,105 @@ static Point parse_point(std::string str)
 }
 
 
+/**
+ * Creates a Rectangle from 'x:y:w:h' string (top left point, width and height).
+ * @note An empty rectangle is returned, if the string has a wrong format.
+ */
+static Rectangle parse_rectangle(std::string str)
+{
+	std::istringstream stream(str);
+	std::string value;
+	int values[4];
+	for (int i = 0; i < 4; i++) {
+		if (!std::getline(stream, value, ':')) {
+			return Rectangle();
+		}
+		try {
+			values[i] = std::stoi(value);
+		} catch (...) {
+			return Rectangle();
+		}
+	}
+	if (std::getline(stream, value, ':')) {
+		return Rectangle();
+	}
+
+	return Rectangle(values[0], values[1], values[0] + values[2], values[1] + values[3]);
+}
+
+
+/**
+ * Reads points in 'x:y' format from a text file, one per line. Empty lines and lines starting with '#' are skipped.
+ * @note Lines in a wrong format are returned as Point(-1, -1).
+ */
+static std::vector<Point> read_points(std::string filename)
+{
+	std::vector<Point> points;
+	std::ifstream file(filename.c_str());
+	std::string line;
+	while (std::getline(file, line)) {
+		line.erase(0, line.find_first_not_of(" \t"));
+		line.erase(line.find_last_not_of(" \t\r") + 1);
+		if (!line.empty() && line[0] != '#') {
+			points.push_back(parse_point(line));
+		}
+	}
+
+	return points;
+}
+
+
+/**
+ * Extracts a given channel of an image.
+ */
+static Image<float> channel(const ImageFx<float> &image, uint channel)
+{
+	Image<float> result(image.size_x(), image.size_y());
+	for (uint y = 0; y < image.size_y(); y++) {
+		for (uint x = 0; x < image.size_x(); x++) {
+			result(x, y) = image(x, y, channel);
+		}
+	}
+
+	return result;
+}
+
+
+/**
+ * Converts distances to a given point into similarities and saves them as an image for visualization.
+ * @param viz Visualization coefficient: the range of distances is mapped to Gaussian with sigma = range / viz.
+ * @note The row and the column of the point are skipped, when the minimum distance is found.
+ */
+static void save_similarities(std::string filename, const ImageFx<float> &distances, Point point, float viz)
+{
+	// Find the range of distances
+	float min_distance = std::numeric_limits<float>::max();
+	float max_distance = 0.0f;
+	for (uint y = 0; y < distances.size_y(); ++y) {
+		for (uint x = 0; x < distances.size_x(); ++x) {
+			if ((int)x != point.x && (int)y != point.y) {
+				min_distance = std::min(min_distance, distances(x, y));
+			}
+			max_distance = std::max(max_distance, distances(x, y));
+		}
+	}
+
+	// Convert distances into similarities
+	Image<float> similarities(distances.size());
+	similarities.set_color_space(ColorSpaces::mono);
+	float sigma = (max_distance - min_distance) / viz;
+	float denominator = 2.0f * sigma * sigma;
+	for (uint y = 0; y < distances.size_y(); ++y) {
+		for (uint x = 0; x < distances.size_x(); ++x) {
+			float offset = distances(x, y) - min_distance;
+			similarities(x, y) = 255.0f * std::exp(-offset * offset / denominator);
+		}
+	}
+
+	IOUtility::write_mono_image(filename, similarities);
+}
+
+
 /**
  * Writes a single-channeled image into a text file.
  * @note Each row of an image is in a separate line, values are separated by the ' ' character.
@@ -65,6 +175,78 @@ static void write_as_text(std::string filename, const ImageFx<T> &data)
 	file.close();
 }
 
+
+/**
+ * Writes matches into a text file as a table: x, y, distance, transforms of the source and target patches.
+ */
+static void write_matches(std::string filename, const std::vector<msas::DistanceInfo> &matches)
+{
+	std::ofstream file(filename.c_str(), std::ios_base::out);
+
+	if (!file.is_open()) {
+		return;
+	}
+
+	file << "x y distance A(0,0) A(0,1) A(1,0) A(1,1) B(0,0) B(0,1) B(1,0) B(1,1)" << '\n';
+	for (auto it = matches.begin(); it != matches.end(); ++it) {
+		file << it->second_point.x << ' ' << it->second_point.y << ' ' << it->distance;
+		for (int i = 0; i < 4; i++) {
+			file << ' ' << it->first_transform[i];
+		}
+		for (int i = 0; i < 4; i++) {
+			file << ' ' << it->second_transform[i];
+		}
+		file << '\n';
+	}
+
+	file.close();
+}
+
+
+/**
+ * Prints how well approximate best matches of points agree with the exact ones: the fraction of the exact matches
+ * found (recall), the fraction of points with the exact best match and the mean excess of the best distance.
+ * @param evaluations_ratio Number of distance evaluations relative to the exact search.
+ */
+static void print_validation(const std::vector<std::vector<msas::DistanceInfo> > &matches,
+							 const std::vector<std::vector<msas::DistanceInfo> > &exact_matches,
+							 double evaluations_ratio)
+{
+	double recall = 0.0, best_found = 0.0, best_excess = 0.0;
+	for (uint i = 0; i < exact_matches.size(); i++) {
+		std::vector<Point> found;
+		for (auto it = matches[i].begin(); it != matches[i].end(); ++it) {
+			found.push_back(it->second_point);
+		}
+		int number_found = 0;
+		for (auto it = exact_matches[i].begin(); it != exact_matches[i].end(); ++it) {
+			number_found += std::count(found.begin(), found.end(), it->second_point);
+		}
+		if (!exact_matches[i].empty() && !matches[i].empty()) {
+			recall += (double)number_found / exact_matches[i].size();
+			best_found += (matches[i][0].second_point == exact_matches[i][0].second_point) ? 1.0 : 0.0;
+			best_excess += matches[i][0].distance - exact_matches[i][0].distance;
+		}
+	}
+
+	double number_of_points = std::max((double)exact_matches.size(), 1.0);
+	std::cout << "Validation: " << exact_matches.size() << " points, recall of the best matches "
+			  << recall / number_of_points << ", best match found for " << 100.0 * best_found / number_of_points
+			  << "% of points, mean excess of the best distance " << best_excess / number_of_points
+			  << ", distance evaluations " << 100.0 * evaluations_ratio << "% of the dense search" << std::endl;
+}
+
+
+/**
+ * Prints predicted versus actual costs of the blocks processed by a dense pass.
+ */
+static void print_load_balance(const msas::LoadBalanceReport &report)
+{
+	std::cout << "Load balance: " << report.number_of_blocks << " blocks, correlation of predicted and actual costs "
+			  << report.correlation << ", max/mean block time " << report.actual_imbalance
+			  << " (predicted " << report.predicted_imbalance << ")." << std::endl;
+}
+
 }	// namespace iohelpers
 
 #endif // IO_HELPERS_H_H
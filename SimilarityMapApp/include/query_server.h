@@ -0,0 +1,109 @@
+/**
+ * Copyright (C) 2016, Vadim Fedorov <coderiks@gmail.com>
+ *
+ * This program is free software: you can use, modify and/or
+ * redistribute it under the terms of the simplified BSD
+ * License. You should have received a copy of this license along
+ * this program. If not, see
+ * <http://www.opensource.org/licenses/bsd-license.html>.
+ */
+
+#ifndef QUERY_SERVER_H_
+#define QUERY_SERVER_H_
+
+#include <map>
+#include <set>
+#include <mutex>
+#include <atomic>
+#include <memory>
+#include <string>
+#include <iostream>
+#include "structure_tensor.h"
+#include "structure_tensor_bundle.h"
+#include "affine_patch_distance.h"
+#include "similarity_map.h"
+#include "field_writer.h"
+
+/**
+ * Answers similarity queries read line by line from a stream or from clients of a Unix domain socket.
+ * Loaded images are kept in memory as bundles with all their structure tensors and normalized patches,
+ * so that a query costs only the distance computations. Queries are computed in parallel by the shared
+ * thread pool, queries of different clients are computed simultaneously.
+ *
+ * Commands (every answer is terminated by a line starting with 'ok' or 'error'):
+ *   load <id> <image>                       - load an image (replaces the one with the same id)
+ *   unload <id>                             - release an image
+ *   list                                    - list loaded images, one per line
+ *   map <output> <source id> <x:y> [<target id>] - write the distance map of a point into a file
+ *   top <k> <source id> <x:y> [<target id>] - list k best matches of a point as 'x:y distance A B' lines,
+ *                                             A and B being the normalizing transforms (row-major)
+ *                                             of the source and target patches
+ *   help                                    - list commands
+ *   quit                                    - finish the session
+ *   shutdown                                - stop the server
+ */
+class QueryServer
+{
+public:
+	/// @param structure_tensor Calculator of structure tensors of the loaded images.
+	/// @param patch_distance Calculator of patch distances, its parameters shall not change while serving.
+	/// @param format Format of distance maps written by 'map': 'text', 'npy' or 'tiff'.
+	QueryServer(const msas::StructureTensor &structure_tensor,
+				msas::AffinePatchDistance &patch_distance,
+				const std::string &format);
+
+	QueryServer(const QueryServer &other) = delete;
+	QueryServer& operator= (const QueryServer &other) = delete;
+
+	/// Load an image, compute its normalized patches and keep them under a given id.
+	/// @param message [out] Description of the result.
+	bool load(const std::string &id, const std::string &image_name, std::string &message);
+
+	/// Execute a single command and write the answer.
+	/// @return false, if the session shall be finished.
+	bool execute(const std::string &command, std::ostream &output);
+
+	/// Answer commands read line by line until 'quit', 'shutdown' or the end of the input.
+	void serve(std::istream &input, std::ostream &output);
+
+	/// Accept clients at a Unix domain socket until one of them sends 'shutdown',
+	/// every client is served by its own thread.
+	/// @return false, if the socket could not be created.
+	bool serve_socket(const std::string &path);
+
+	/// Was 'shutdown' received.
+	bool is_shut_down() const;
+
+private:
+	struct Entry
+	{
+		std::string image_name;
+		Image<float> image;
+		std::shared_ptr<msas::StructureTensorBundle> bundle;
+	};
+
+	msas::StructureTensor _structure_tensor;
+	msas::AffinePatchDistance &_patch_distance;
+	msas::SimilarityMap _similarity_map;
+	std::string _format;
+	std::map<std::string, std::shared_ptr<Entry> > _entries;
+	mutable std::mutex _entries_mutex;
+	std::mutex _io_mutex;				// NOTE: IIO is not reentrant
+	std::atomic<bool> _is_shut_down;
+	int _listen_socket;
+	std::set<int> _client_sockets;
+	std::mutex _sockets_mutex;
+
+	std::shared_ptr<Entry> find(const std::string &id) const;
+
+	bool query_map(std::istream &arguments, std::ostream &output);
+	bool query_top(std::istream &arguments, std::ostream &output);
+
+	bool resolve(std::istream &arguments, std::shared_ptr<Entry> &source, Point &point,
+				 std::shared_ptr<Entry> &target, std::ostream &output) const;
+
+	void serve_client(int client_socket);
+	void shutdown();
+};
+
+#endif /* QUERY_SERVER_H_ */
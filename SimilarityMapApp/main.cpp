@@ -13,31 +13,67 @@
 #include <string>
 #include <fstream>
 #include <iostream>
+#include <mutex>
+#include <memory>
+#include <algorithm>
 #include <tclap/CmdLine.h>
 #include "io_utility.h"
 #include "structure_tensor.h"
 #include "ellipse_normalization.h"
 #include "structure_tensor_bundle.h"
 #include "affine_patch_distance.h"
+#include "similarity_map.h"
+#include "query_server.h"
 #include "io_helpers.h"
+#include "thread_pool.h"
+#include "field_writer.h"
+#include "field_stream.h"
 
 using std::vector;
 using std::string;
 
+constexpr int TILE_SIZE = 16;	// size of tiles processed as separate tasks
+
 int main(int argc, char* argv[])
 {
 	// Declare command line arguments
 	TCLAP::CmdLine cmd("Compute similarity (distance) map for a given point of interest in the source image and all the points in the target image.", ' ', "1.0");
 	TCLAP::ValueArg<float> size_limit_arg("", "size-limit", "Set the maximum allowed radius of an elliptical region (circle) shall it appear in a uniform region.", false, 0.0f, "float", cmd);
 	TCLAP::ValueArg<int> grid_size_arg("", "grid", "Set the interpolation grid size. Default: 21.", false, 21, "int", cmd);
+	TCLAP::ValueArg<float> node_tolerance_arg("", "node-tolerance", "Set the fraction of the total spatial weight, which may be discarded by dropping the least weighted grid nodes. Default: 0.0.", false, 0.0f, "float", cmd);
+	TCLAP::ValueArg<int> orientation_grid_arg("", "orientation-grid", "Set the size of the grid used to sample gradients for the dominant orientations. Large regions are then processed at fixed cost, at the expense of accuracy. If 0, all the pixels of a region are used. Default: 0.", false, 0, "int", cmd);
+	vector<string> formats_list;
+	formats_list.push_back("float32");
+	formats_list.push_back("uint8");
+	formats_list.push_back("float16");
+	TCLAP::ValuesConstraint<string> formats_constrain(formats_list);
+	TCLAP::ValueArg<string> patch_format_arg("", "patch-format", "Set the storage format of cached normalized patches. Compact formats reduce memory footprint at the cost of a quantization error. Default: float32.", false, "float32", &formats_constrain, cmd);
 	TCLAP::ValueArg<float> gamma_arg("g", "gamma", "Set the mixing coefficient for the experimental scheme of Structure Tensors computation. Should be in range (0.0, 1.0], where 1.0 corresponds to the original scheme. Default: 1.0.", false, 1.0f, "float", cmd);
 	TCLAP::ValueArg<int> iterations_arg("i", "iter", "Set the number of iterations for Structure Tensors. Default: 60.", false, 60, "int", cmd);
 	TCLAP::ValueArg<float> scale_arg("t", "scale", "Set the t ('scale') parameter. Default: 0.0001.", false, 0.0001f, "float", cmd);
 	TCLAP::ValueArg<float> radius_arg("r", "radius", "Set the R ('radius') parameter. Default: 100.0.", false, 100.0f, "float", cmd);
 	TCLAP::ValueArg<float> viz_arg("v", "viz", "Set the visualization coefficient for similarity values. Default: 3.0.", false, 3.0f, "float", cmd);
 	TCLAP::SwitchArg raw_arg("", "raw", "Output raw distances in txt format.", cmd);
+	vector<string> output_formats_list;
+	output_formats_list.push_back("text");
+	output_formats_list.push_back("npy");
+	output_formats_list.push_back("tiff");
+	TCLAP::ValuesConstraint<string> output_formats_constrain(output_formats_list);
+	TCLAP::ValueArg<string> format_arg("", "format", "Set the format of raw distances: 'text', 'npy' (NumPy array) or 'tiff' (float TIFF). Binary formats imply raw output and are written row by row while being computed. Default: text.", false, "text", &output_formats_constrain, cmd);
 	TCLAP::ValueArg<string> output_arg("o", "output", "Set the name for output file(s) without extension.", false, "out", "string", cmd);
-	TCLAP::ValueArg<string> point_arg("p", "point", "Set the point of interest (e.g. '-p 86:70').", true, "", "x:y", cmd);
+	TCLAP::SwitchArg serve_arg("", "serve", "Run as a server answering queries read from the standard input (or from clients of --socket) line by line, loaded images are kept in memory with all their normalized patches. Source and target images are loaded as 'source' and 'target' (if distinct). Send 'help' for the list of commands.", cmd);
+	TCLAP::ValueArg<string> socket_arg("", "socket", "Serve clients of a Unix domain socket at the given path instead of the standard input (see --serve), every client is served by its own thread.", false, string(), "path", cmd);
+	TCLAP::SwitchArg stack_arg("", "stack", "Write distance maps of all the points of interest into a single file with a channel per point (in a binary format only), instead of a file per point.", cmd);
+	TCLAP::ValueArg<int> query_block_arg("", "query-block", "Set the number of points of interest every target point is compared to at once, when maps of several points are computed. Default: 16.", false, 16, "int", cmd);
+	TCLAP::ValueArg<int> top_arg("", "top", "Find the given number of best matches of every point of interest instead of computing distance maps, the point itself is skipped within the same image. Matches are written as text tables to the output name followed by '_matches.txt' (by '_x_y_matches.txt' for several points).", false, 0, "int", cmd);
+	TCLAP::ValueArg<int> coarse_stride_arg("", "coarse-stride", "Find the best matches (see --top) by a coarse-to-fine search: compare the points of interest with the target points on a lattice with the given stride, then densely around the best basins (local minima) of the lattice. Default: 0 (dense search).", false, 0, "int", cmd);
+	TCLAP::ValueArg<int> refinement_radius_arg("", "refinement-radius", "Set the radius of windows around the basins, which are searched densely by the coarse-to-fine search. Default: the coarse stride.", false, 0, "int", cmd);
+	TCLAP::ValueArg<int> basins_arg("", "basins", "Set the number of the best basins refined by the coarse-to-fine search. Default: 8.", false, 8, "int", cmd);
+	TCLAP::SwitchArg validate_arg("", "validate", "Validate the coarse-to-fine search against the dense one for all the points of interest: report the recall of the dense best matches and the number of distance evaluations.", cmd);
+	TCLAP::ValueArg<int> search_radius_arg("", "search-radius", "Compare the points of interest only with the target points within the given distance (in pixels along each axis) from them. Maps cover the search area then (the bounding box of the windows of all the points), its position is printed. Default: -1 (whole image).", false, -1, "int", cmd);
+	TCLAP::ValueArg<string> roi_arg("", "roi", "Compare the points of interest only with the target points of the given region (top left point, width and height), maps cover the region then. Combined with --search-radius, their intersection is used.", false, string(), "x:y:w:h", cmd);
+	TCLAP::ValueArg<string> points_arg("", "points", "Compute maps for the points of interest listed in the given file ('x:y' per line) in addition to the ones set with -p. Maps of several points are computed in a single pass and named by the output name followed by '_x_y'.", false, string(), "file name", cmd);
+	TCLAP::MultiArg<string> point_arg("p", "point", "Set the point of interest (e.g. '-p 86:70'), may be repeated.", false, "x:y", cmd);
 	TCLAP::UnlabeledValueArg<string> source_image_arg("source", "Source image containing a point of interest.", true, string(), "file name", cmd);
 	TCLAP::UnlabeledValueArg<string> target_image_arg("target", "Target image for which similarity map should be computed. If omitted, source image is used instead.", false, string(), "file name", cmd);
 
@@ -57,15 +93,87 @@ int main(int argc, char* argv[])
 	bool distinct_images = source_image_name != target_image_name;
 
 	// Get parameters
-	Point point = iohelpers::parse_point(point_arg.getValue());
+	vector<string> point_strings = point_arg.getValue();
+	vector<Point> points;
+	for (auto it = point_strings.begin(); it != point_strings.end(); ++it) {
+		points.push_back(iohelpers::parse_point(*it));
+	}
+	if (points_arg.isSet()) {
+		vector<Point> file_points = iohelpers::read_points(points_arg.getValue());
+		if (file_points.empty()) {
+			std::cerr << "No points found in '" << points_arg.getValue() << "'" << std::endl;
+			return 1;
+		}
+		points.insert(points.end(), file_points.begin(), file_points.end());
+		point_strings.resize(points.size(), points_arg.getValue());
+	}
 	float radius = radius_arg.getValue();
 	float scale = scale_arg.getValue();
 	int number_of_iterations = iterations_arg.getValue();
 	float gamma = gamma_arg.getValue();
 	float max_size_limit = size_limit_arg.getValue();
 	int grid_size = grid_size_arg.getValue();
+	float node_tolerance = node_tolerance_arg.getValue();
+	string patch_format = patch_format_arg.getValue();
+	int orientation_grid_size = orientation_grid_arg.getValue();
 	float viz = viz_arg.getValue();
-	bool is_raw_output = raw_arg.getValue();
+	bool is_binary_output = format_arg.getValue() != "text";
+	bool is_raw_output = raw_arg.getValue() || is_binary_output;
+	FieldFormats::FieldFormat field_format = (format_arg.getValue() == "tiff") ? FieldFormats::tiff
+																			  : FieldFormats::npy;
+
+	int coarse_stride = coarse_stride_arg.getValue();
+	bool is_coarse_to_fine = coarse_stride > 1;
+	if ((is_coarse_to_fine || validate_arg.getValue()) && top_arg.getValue() < 1) {
+		std::cerr << "Coarse-to-fine search is applicable only to the best matches (see --top)" << std::endl;
+		return 1;
+	}
+
+	bool is_server = serve_arg.getValue() || socket_arg.isSet();
+	if (!is_server && points.empty()) {
+		std::cerr << "Point of interest is required, unless --serve is set" << std::endl;
+		return 1;
+	}
+
+	// Create StructureTensor calculator
+	msas::StructureTensor structure_tensor(radius, number_of_iterations, gamma);
+	structure_tensor.set_max_size_limit(max_size_limit);
+
+	// Create patch distance calculator
+	msas::AffinePatchDistance patch_distance(grid_size);
+	patch_distance.set_scale(scale);
+	patch_distance.set_node_tolerance(node_tolerance);
+	patch_distance.set_orientation_grid_size(orientation_grid_size);
+	if (patch_format == "uint8") {
+		patch_distance.set_patch_format(msas::PatchFormats::uint8);
+	} else if (patch_format == "float16") {
+		patch_distance.set_patch_format(msas::PatchFormats::float16);
+	}
+	if (node_tolerance > 0.0f) {
+		std::cout << "Grid nodes used: " << patch_distance.normalized_patch_length() << ", discarded weight: "
+				  << patch_distance.pruning_error() << std::endl;
+	}
+
+	// Answer queries keeping the images in memory
+	if (is_server) {
+		QueryServer server(structure_tensor, patch_distance, format_arg.getValue());
+		string message;
+		bool is_loaded = server.load("source", source_image_name, message);
+		std::cerr << message << std::endl;
+		if (is_loaded && distinct_images) {
+			is_loaded = server.load("target", target_image_name, message);
+			std::cerr << message << std::endl;
+		}
+		if (!is_loaded) {
+			return 1;
+		}
+
+		if (socket_arg.isSet()) {
+			return (server.serve_socket(socket_arg.getValue())) ? 0 : 1;
+		}
+		server.serve(std::cin, std::cout);
+		return 0;
+	}
 
 	// Read the images
 	Image<float> source_image = IOUtility::read_mono_image(source_image_name);
@@ -80,18 +188,46 @@ int main(int argc, char* argv[])
 		return 1;
 	}
 
-	if (point.x < 0) {
-		point.x = source_image.size_x() / 2;
-		point.y = source_image.size_y() / 2;
-		std::cout << "Wrong format of point argument: '" << point_arg.getValue() << "'.\n";
-		std::cout << "Use central point " << point.x << ":" << point.y << " instead.\n";
+	for (uint i = 0; i < points.size(); i++) {
+		if (points[i].x < 0) {
+			points[i].x = source_image.size_x() / 2;
+			points[i].y = source_image.size_y() / 2;
+			std::cout << "Wrong format of point argument: '" << point_strings[i] << "'.\n";
+			std::cout << "Use central point " << points[i].x << ":" << points[i].y << " instead.\n";
+		}
+	}
+	if (stack_arg.getValue() && !is_binary_output) {
+		std::cerr << "Stacked maps can be written only in a binary format (see --format)" << std::endl;
+		return 1;
 	}
 
-	auto time_start = std::chrono::system_clock::now();
+	// Restrict computations to the search area, only tensors and patches of its points are computed
+	Rectangle area = msas::SimilarityMap::search_area(points, search_radius_arg.getValue(), target_image.size());
+	if (roi_arg.isSet()) {
+		Rectangle roi = iohelpers::parse_rectangle(roi_arg.getValue());
+		if (roi.is_empty()) {
+			std::cerr << "Wrong format of region of interest: '" << roi_arg.getValue() << "'" << std::endl;
+			return 1;
+		}
+		area = area.intersection(roi);
+	}
+	if (area.is_empty()) {
+		std::cerr << "Search area does not overlap the target image" << std::endl;
+		return 1;
+	}
+	if (area != Rectangle(target_image.size())) {
+		std::cout << "Search area: " << area.x_0 << ":" << area.y_0 << ":" << area.size_x() << ":"
+				  << area.size_y() << std::endl;
+	}
 
-	// Create StructureTensor calculator
-	msas::StructureTensor structure_tensor(radius, number_of_iterations, gamma);
-    structure_tensor.set_max_size_limit(max_size_limit);
+	// Name outputs: a single map is named by the output name, several maps are named after their points
+	bool is_single_map = points.size() == 1 || stack_arg.getValue();
+	vector<string> map_names;
+	for (auto it = points.begin(); it != points.end(); ++it) {
+		map_names.push_back(output_name + "_" + std::to_string(it->x) + "_" + std::to_string(it->y));
+	}
+
+	auto time_start = std::chrono::system_clock::now();
 
 	// Create Structure Tensor bundles (fields)
 	msas::StructureTensorBundle source_bundle(source_image, structure_tensor);
@@ -99,31 +235,85 @@ int main(int argc, char* argv[])
 												 new msas::StructureTensorBundle(target_image, structure_tensor) :
 												 &source_bundle;
 
-	// Create patch distance calculator
-	msas::AffinePatchDistance patch_distance(grid_size);
-	patch_distance.set_scale(scale);
-	patch_distance.precompute_normalized_patches(source_bundle);
-	if (distinct_images) {
-		patch_distance.precompute_normalized_patches(*target_bundle);
-	}
+	msas::SimilarityMap similarity_map(patch_distance);
+	similarity_map.set_tile_size(TILE_SIZE);
+	similarity_map.set_query_block_size(query_block_arg.getValue());
+	similarity_map.set_coarse_stride(coarse_stride);
+	similarity_map.set_refinement_radius((refinement_radius_arg.isSet()) ? refinement_radius_arg.getValue() : coarse_stride);
+	similarity_map.set_number_of_basins(basins_arg.getValue());
 
-	// Compute distances
-	Image<float> distances(source_image.size());
-	float min_distance = std::numeric_limits<float>::max();
-	float max_distance = 0.0f;
-	#pragma omp parallel for schedule(dynamic,1) collapse(2) shared(distances) reduction(max:max_distance), reduction(min:min_distance)
-	for (uint y = 0; y < source_image.size_y(); ++y) {
-		for (uint x = 0; x < source_image.size_x(); ++x) {
-			msas::DistanceInfo distance_info = patch_distance.calculate(source_bundle, point, *target_bundle, Point(x, y));
-			float distance = std::sqrt(distance_info.distance);
+	// Normalize only the patches, which are compared: at the points of interest of the source and within the search
+	// area of the target (their union, if the images coincide), patches of both bundles are normalized simultaneously
+	// NOTE: the coarse-to-fine search compares a small fraction of the area, so its patches are normalized on demand
+	Rectangle planned_area = (is_coarse_to_fine) ? Rectangle() : area;
+	vector<msas::RequiredPatches> plan = msas::SimilarityMap::plan(source_bundle, points, *target_bundle, planned_area);
+	TaskGroup precompute_group;
+	vector<msas::LoadBalanceReport> precompute_reports = similarity_map.precompute(plan, precompute_group);
 
-			if (x != point.x && y != point.y) {
-				min_distance = std::min(min_distance, distance);
+	int number_of_points = points.size();
+	// NOTE: there are no more matches than points in the search area
+	int number_of_matches = (int)std::min((long)top_arg.getValue(), (long)area.size_x() * area.size_y());
+	vector<vector<msas::DistanceInfo> > matches;
+	Image<float> distances;
+	vector<std::unique_ptr<FieldStream<float> > > distances_streams;
+	uint number_of_evaluations = 0;
+	if (number_of_matches > 0) {
+		// Find the best matches of every point, no distance map is allocated
+		for (auto it = points.begin(); it != points.end(); ++it) {
+			Point excluded_point = (distinct_images) ? Point(-1, -1) : *it;
+			if (is_coarse_to_fine) {
+				uint point_evaluations;
+				matches.push_back(similarity_map.find_best_matches_coarse_to_fine(source_bundle, *it, *target_bundle,
+																				  area, number_of_matches,
+																				  excluded_point, point_evaluations));
+				number_of_evaluations += point_evaluations;
+			} else {
+				matches.push_back(similarity_map.find_best_matches(source_bundle, *it, *target_bundle, area,
+																   number_of_matches, excluded_point));
+			}
+		}
+	} else {
+		// Compute distances of all the points in a single pass, binary ones are written tile by tile
+		// NOTE: distances of a pixel are stored together, a stream gets the first one and takes the channels it needs
+		distances = Image<float>(area.size(), (uint)number_of_points);
+		if (is_binary_output && is_single_map) {
+			distances_streams.emplace_back(new FieldStream<float>(output_name, field_format, distances, number_of_points,
+					[number_of_points] (const float &distance, float *values) {
+						std::copy(&distance, &distance + number_of_points, values);
+					}));
+		} else if (is_binary_output) {
+			for (int i = 0; i < number_of_points; i++) {
+				distances_streams.emplace_back(new FieldStream<float>(map_names[i], field_format, distances, 1,
+						[i] (const float &distance, float *values) { values[0] = (&distance)[i]; }));
+			}
+		}
+		similarity_map.calculate(source_bundle, points, *target_bundle, area, distances,
+								 [&] (int x_0, int y_0, int x_1, int y_1) {
+			for (auto it = distances_streams.begin(); it != distances_streams.end(); ++it) {
+				(*it)->complete(x_0, y_0, x_1, y_1);
 			}
-			max_distance = std::max(max_distance, distance);
+		});
+	}
+
+	auto time_end = std::chrono::system_clock::now();
+	std::chrono::duration<double> elapsed_seconds = time_end - time_start;
+	std::cout << "Computation has finished in " << elapsed_seconds.count() << " seconds." << std::endl;
+	for (auto it = precompute_reports.begin(); it != precompute_reports.end(); ++it) {
+		if (it->number_of_blocks > 0) {
+			iohelpers::print_load_balance(*it);
+		}
+	}
 
-			distances(x, y) = distance;
+	// Compare the coarse-to-fine matches with the dense ones
+	if (is_coarse_to_fine && validate_arg.getValue()) {
+		vector<vector<msas::DistanceInfo> > dense_matches;
+		for (auto it = points.begin(); it != points.end(); ++it) {
+			Point excluded_point = (distinct_images) ? Point(-1, -1) : *it;
+			dense_matches.push_back(similarity_map.find_best_matches(source_bundle, *it, *target_bundle, area,
+																	 number_of_matches, excluded_point));
 		}
+		double dense_evaluations = (double)area.size_x() * area.size_y() * number_of_points;
+		iohelpers::print_validation(matches, dense_matches, number_of_evaluations / dense_evaluations);
 	}
 
 	// Release target bundle, if it does not point to source bundle
@@ -131,29 +321,32 @@ int main(int argc, char* argv[])
 		delete target_bundle;
 	}
 
-	auto time_end = std::chrono::system_clock::now();
-	std::chrono::duration<double> elapsed_seconds = time_end - time_start;
-	std::cout << "Computation has finished in " << elapsed_seconds.count() << " seconds." << std::endl;
-
-	if (!is_raw_output) {
-		// Convert distances into similarities for visualization
-		Image<float> similarities(source_image.size());
-		similarities.set_color_space(ColorSpaces::mono);
-		float *sim_data = similarities.raw();
-		float *dist_data = distances.raw();
-		float sigma = (max_distance - min_distance) / viz;
-		float denominator = 2.0f * sigma * sigma;
-		for (int i = 0; i < distances.raw_length(); ++i) {
-			sim_data[i] = 255.0f * std::exp(-(dist_data[i] - min_distance) * (dist_data[i] - min_distance) / denominator);
+	if (number_of_matches > 0) {
+		for (int i = 0; i < number_of_points; i++) {
+			string name = (number_of_points == 1) ? output_name : map_names[i];
+			iohelpers::write_matches(name + "_matches.txt", matches[i]);
+		}
+	} else if (is_binary_output) {
+		// Finish raw distances written while being computed
+		for (auto it = distances_streams.begin(); it != distances_streams.end(); ++it) {
+			(*it)->close();
+		}
+	} else if (is_single_map) {
+		if (!is_raw_output) {
+			iohelpers::save_similarities(output_name + ".png", distances, points[0] - area.origin(), viz);
+		} else {
+			iohelpers::write_as_text(output_name + ".txt", distances);
 		}
-
-		// Draw similarities
-		string sim_name = output_name + ".png";
-		IOUtility::write_mono_image(sim_name, similarities);
 	} else {
-		// Output raw distances
-		string dist_name = output_name + ".txt";
-		iohelpers::write_as_text(dist_name, distances);
+		// Output a visualization or raw distances of every point
+		for (int i = 0; i < number_of_points; i++) {
+			Image<float> point_distances = iohelpers::channel(distances, i);
+			if (!is_raw_output) {
+				iohelpers::save_similarities(map_names[i] + ".png", point_distances, points[i] - area.origin(), viz);
+			} else {
+				iohelpers::write_as_text(map_names[i] + ".txt", point_distances);
+			}
+		}
 	}
 
 	return 0;
@@ -0,0 +1,377 @@
+/**
+ * Copyright (C) 2016, Vadim Fedorov <coderiks@gmail.com>
+ *
+ * This program is free software: you can use, modify and/or
+ * redistribute it under the terms of the simplified BSD
+ * License. You should have received a copy of this license along
+ * this program. If not, see
+ * <http://www.opensource.org/licenses/bsd-license.html>.
+ */
+
+#include <chrono>
+#include <thread>
+#include <vector>
+#include <sstream>
+#include <algorithm>
+#include <exception>
+#include <cstring>
+#include <cerrno>
+#include <unistd.h>
+#include <sys/socket.h>
+#include <sys/un.h>
+#include "query_server.h"
+#include "io_utility.h"
+#include "io_helpers.h"
+
+using std::string;
+using std::vector;
+
+
+QueryServer::QueryServer(const msas::StructureTensor &structure_tensor,
+						 msas::AffinePatchDistance &patch_distance,
+						 const string &format)
+ : _structure_tensor(structure_tensor), _patch_distance(patch_distance), _similarity_map(patch_distance),
+   _format(format), _is_shut_down(false), _listen_socket(-1)
+{
+
+}
+
+
+bool QueryServer::load(const string &id, const string &image_name, string &message)
+{
+	auto time_start = std::chrono::system_clock::now();
+
+	std::shared_ptr<Entry> entry = std::make_shared<Entry>();
+	entry->image_name = image_name;
+	{
+		std::lock_guard<std::mutex> lock(_io_mutex);
+		entry->image = IOUtility::read_mono_image(image_name);
+	}
+	if (!entry->image) {
+		message = "could not open image '" + image_name + "'";
+		return false;
+	}
+
+	// NOTE: all the patches are normalized at once, so that queries only read the caches
+	entry->bundle = std::make_shared<msas::StructureTensorBundle>(entry->image, _structure_tensor);
+	_patch_distance.precompute_normalized_patches(*entry->bundle);
+
+	{
+		std::lock_guard<std::mutex> lock(_entries_mutex);
+		_entries[id] = entry;
+	}
+
+	std::chrono::duration<double> elapsed_seconds = std::chrono::system_clock::now() - time_start;
+	std::ostringstream stream;
+	stream << "loaded '" << id << "' (" << entry->image.size_x() << "x" << entry->image.size_y() << ") in "
+		   << elapsed_seconds.count() << " s";
+	message = stream.str();
+
+	return true;
+}
+
+
+bool QueryServer::execute(const string &command, std::ostream &output)
+{
+	std::istringstream arguments(command);
+	string name;
+	if (!(arguments >> name) || name[0] == '#') {
+		return true;
+	}
+
+	// NOTE: a failing command (e.g. out of memory) is reported to its client, the other sessions go on
+	try {
+		if (name == "load") {
+			string id, image_name, message;
+			if (!(arguments >> id) || !std::getline(arguments >> std::ws, image_name) || image_name.empty()) {
+				output << "error usage: load <id> <image>" << std::endl;
+			} else if (load(id, image_name, message)) {
+				output << "ok " << message << std::endl;
+			} else {
+				output << "error " << message << std::endl;
+			}
+		} else if (name == "unload") {
+			string id;
+			arguments >> id;
+			std::lock_guard<std::mutex> lock(_entries_mutex);
+			if (_entries.erase(id) > 0) {
+				output << "ok unloaded '" << id << "'" << std::endl;
+			} else {
+				output << "error unknown image '" << id << "'" << std::endl;
+			}
+		} else if (name == "list") {
+			std::lock_guard<std::mutex> lock(_entries_mutex);
+			for (auto it = _entries.begin(); it != _entries.end(); ++it) {
+				output << it->first << " " << it->second->image.size_x() << "x" << it->second->image.size_y() << " "
+					   << it->second->image_name << "\n";
+			}
+			output << "ok " << _entries.size() << " images" << std::endl;
+		} else if (name == "map") {
+			query_map(arguments, output);
+		} else if (name == "top") {
+			query_top(arguments, output);
+		} else if (name == "help") {
+			output << "load <id> <image>\n"
+				   << "unload <id>\n"
+				   << "list\n"
+				   << "map <output> <source id> <x:y> [<target id>]\n"
+				   << "top <k> <source id> <x:y> [<target id>]\n"
+				   << "quit\n"
+				   << "shutdown\n"
+				   << "ok" << std::endl;
+		} else if (name == "quit") {
+			output << "ok bye" << std::endl;
+			return false;
+		} else if (name == "shutdown") {
+			output << "ok shutting down" << std::endl;
+			shutdown();
+			return false;
+		} else {
+			output << "error unknown command '" << name << "', see 'help'" << std::endl;
+		}
+	} catch (const std::exception &e) {
+		output << "error " << e.what() << std::endl;
+	}
+
+	return true;
+}
+
+
+void QueryServer::serve(std::istream &input, std::ostream &output)
+{
+	string command;
+	while (!_is_shut_down && std::getline(input, command)) {
+		if (!execute(command, output)) {
+			break;
+		}
+	}
+}
+
+
+bool QueryServer::serve_socket(const string &path)
+{
+	sockaddr_un address;
+	if (path.size() >= sizeof(address.sun_path)) {
+		std::cerr << "Socket path '" << path << "' is too long" << std::endl;
+		return false;
+	}
+	std::memset(&address, 0, sizeof(address));
+	address.sun_family = AF_UNIX;
+	std::strncpy(address.sun_path, path.c_str(), sizeof(address.sun_path) - 1);
+
+	_listen_socket = socket(AF_UNIX, SOCK_STREAM, 0);
+	unlink(path.c_str());
+	if (_listen_socket < 0 || bind(_listen_socket, (sockaddr*)&address, sizeof(address)) < 0 ||
+		listen(_listen_socket, SOMAXCONN) < 0) {
+		std::cerr << "Could not listen at '" << path << "': " << std::strerror(errno) << std::endl;
+		if (_listen_socket >= 0) {
+			close(_listen_socket);
+		}
+		return false;
+	}
+
+	// Clients block on their sockets, so they are served by dedicated threads rather than by the pool
+	vector<std::thread> clients;
+	while (!_is_shut_down) {
+		int client_socket = accept(_listen_socket, 0, 0);
+		if (client_socket < 0) {
+			if (errno == EINTR) {
+				continue;
+			}
+			break;
+		}
+
+		std::lock_guard<std::mutex> lock(_sockets_mutex);
+		if (_is_shut_down) {
+			close(client_socket);
+			break;
+		}
+		_client_sockets.insert(client_socket);
+		clients.push_back(std::thread(&QueryServer::serve_client, this, client_socket));
+	}
+
+	for (auto it = clients.begin(); it != clients.end(); ++it) {
+		it->join();
+	}
+	close(_listen_socket);
+	unlink(path.c_str());
+
+	return true;
+}
+
+
+bool QueryServer::is_shut_down() const
+{
+	return _is_shut_down;
+}
+
+
+/* Private */
+
+std::shared_ptr<QueryServer::Entry> QueryServer::find(const string &id) const
+{
+	std::lock_guard<std::mutex> lock(_entries_mutex);
+	auto it = _entries.find(id);
+
+	return (it != _entries.end()) ? it->second : std::shared_ptr<Entry>();
+}
+
+
+/**
+ * Parse '<source id> <x:y> [<target id>]' and find the images.
+ */
+bool QueryServer::resolve(std::istream &arguments, std::shared_ptr<Entry> &source, Point &point,
+						  std::shared_ptr<Entry> &target, std::ostream &output) const
+{
+	string source_id, point_string, target_id;
+	arguments >> source_id >> point_string;
+	if (!(arguments >> target_id)) {
+		target_id = source_id;
+	}
+
+	source = find(source_id);
+	target = find(target_id);
+	point = iohelpers::parse_point(point_string);
+	if (!source || !target) {
+		output << "error unknown image '" << ((!source) ? source_id : target_id) << "'" << std::endl;
+		return false;
+	}
+	if (!source->bundle->size().contains(point)) {
+		output << "error point '" << point_string << "' is out of the source image" << std::endl;
+		return false;
+	}
+
+	return true;
+}
+
+
+bool QueryServer::query_map(std::istream &arguments, std::ostream &output)
+{
+	string output_name;
+	std::shared_ptr<Entry> source, target;
+	Point point;
+	if (!(arguments >> output_name) || !resolve(arguments, source, point, target, output)) {
+		return false;
+	}
+
+	auto time_start = std::chrono::system_clock::now();
+	Image<float> distances = _similarity_map.calculate(*source->bundle, point, *target->bundle);
+	std::chrono::duration<double> elapsed_seconds = std::chrono::system_clock::now() - time_start;
+
+	float min_distance = *std::min_element(distances.raw(), distances.raw() + distances.raw_length());
+	float max_distance = *std::max_element(distances.raw(), distances.raw() + distances.raw_length());
+
+	string file_name = output_name;
+	if (_format == "text") {
+		file_name += ".txt";
+		iohelpers::write_as_text(file_name, distances);
+	} else {
+		FieldFormats::FieldFormat format = (_format == "tiff") ? FieldFormats::tiff : FieldFormats::npy;
+		file_name += FieldWriter::extension(format);
+		std::lock_guard<std::mutex> lock(_io_mutex);
+		FieldWriter::write(file_name, format, distances);
+	}
+
+	output << "ok " << file_name << " min " << min_distance << " max " << max_distance << " in "
+		   << elapsed_seconds.count() << " s" << std::endl;
+
+	return true;
+}
+
+
+bool QueryServer::query_top(std::istream &arguments, std::ostream &output)
+{
+	int k = 0;
+	std::shared_ptr<Entry> source, target;
+	Point point;
+	if (!(arguments >> k) || k < 1) {
+		output << "error usage: top <k> <source id> <x:y> [<target id>]" << std::endl;
+		return false;
+	}
+	if (!resolve(arguments, source, point, target, output)) {
+		return false;
+	}
+
+	// Find the best matches without a distance map, the point of interest itself is skipped within the same image
+	auto time_start = std::chrono::system_clock::now();
+	Point excluded_point = (source == target) ? point : Point(-1, -1);
+	vector<msas::DistanceInfo> matches = _similarity_map.find_best_matches(*source->bundle, point, *target->bundle,
+																		   Rectangle(target->bundle->size()), k,
+																		   excluded_point);
+	std::chrono::duration<double> elapsed_seconds = std::chrono::system_clock::now() - time_start;
+
+	for (auto it = matches.begin(); it != matches.end(); ++it) {
+		output << it->second_point.x << ":" << it->second_point.y << " " << it->distance;
+		for (int i = 0; i < 4; i++) {
+			output << " " << it->first_transform[i];
+		}
+		for (int i = 0; i < 4; i++) {
+			output << " " << it->second_transform[i];
+		}
+		output << "\n";
+	}
+	output << "ok " << matches.size() << " matches in " << elapsed_seconds.count() << " s" << std::endl;
+
+	return true;
+}
+
+
+/**
+ * Answer commands of a socket client until it disconnects or finishes the session.
+ */
+void QueryServer::serve_client(int client_socket)
+{
+	string buffer;
+	char chunk[4096];
+	bool is_active = true;
+	while (is_active) {
+		ssize_t length = recv(client_socket, chunk, sizeof(chunk), 0);
+		if (length <= 0) {
+			if (length < 0 && errno == EINTR) {
+				continue;
+			}
+			break;
+		}
+		buffer.append(chunk, length);
+
+		// Execute all the complete lines received so far
+		std::size_t end;
+		while (is_active && (end = buffer.find('\n')) != string::npos) {
+			string command = buffer.substr(0, end);
+			buffer.erase(0, end + 1);
+
+			std::ostringstream answer;
+			is_active = execute(command, answer);
+			string text = answer.str();
+			for (std::size_t sent = 0; sent < text.size(); ) {
+				ssize_t count = send(client_socket, text.data() + sent, text.size() - sent, MSG_NOSIGNAL);
+				if (count <= 0) {
+					is_active = false;
+					break;
+				}
+				sent += count;
+			}
+		}
+	}
+
+	std::lock_guard<std::mutex> lock(_sockets_mutex);
+	_client_sockets.erase(client_socket);
+	close(client_socket);
+}
+
+
+/**
+ * Stop accepting clients and disconnect the connected ones (their current commands are finished).
+ */
+void QueryServer::shutdown()
+{
+	_is_shut_down = true;
+
+	std::lock_guard<std::mutex> lock(_sockets_mutex);
+	if (_listen_socket >= 0) {
+		::shutdown(_listen_socket, SHUT_RDWR);
+	}
+	for (auto it = _client_sockets.begin(); it != _client_sockets.end(); ++it) {
+		::shutdown(*it, SHUT_RD);
+	}
+}
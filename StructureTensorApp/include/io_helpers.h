@@ -12,8 +12,13 @@
 #define IO_HELPERS_H_H
 
 #include <string>
+#include <sstream>
 #include <fstream>
+#include <iostream>
 #include "matrix.h"
+#include "rectangle.h"
+#include "cost_model.h"
+#include "field_writer.h"
 
 namespace iohelpers {
 
@@ -28,6 +33,33 @@ struct TransformInfo
 	Matrix2f transform;
 };
 
+/**
+ * Creates a Rectangle from 'x:y:w:h' string (top left point, width and height).
+ * @note An empty rectangle is returned, if the string has a wrong format.
+ */
+Rectangle parse_rectangle(string str)
+{
+	std::istringstream stream(str);
+	string value;
+	int values[4];
+	for (int i = 0; i < 4; i++) {
+		if (!std::getline(stream, value, ':')) {
+			return Rectangle();
+		}
+		try {
+			values[i] = std::stoi(value);
+		} catch (...) {
+			return Rectangle();
+		}
+	}
+	if (std::getline(stream, value, ':')) {
+		return Rectangle();
+	}
+
+	return Rectangle(values[0], values[1], values[0] + values[2], values[1] + values[3]);
+}
+
+
 vector<Point> read_points(string filename)
 {
 	if (filename.empty()) {
@@ -163,6 +195,88 @@ void save_transforms(string filename, const vector<TransformInfo> &transforms)
 	file.close();
 }
 
+
+/**
+ * Saves structure tensors in a binary format as a table with 6 columns: x, y, T(0,0), T(0,1), T(1,0), T(1,1).
+ */
+void save_tensors(string filename, FieldFormats::FieldFormat format, const vector<pair<Point, Matrix2f> > &tensors)
+{
+	Image<float> table(6, tensors.size());
+	for (uint i = 0; i < tensors.size(); i++) {
+		float *row = table.row(i);
+		row[0] = tensors[i].first.x;
+		row[1] = tensors[i].first.y;
+		std::copy(tensors[i].second.begin(), tensors[i].second.end(), row + 2);
+	}
+
+	FieldWriter::write(filename, format, table);
+}
+
+
+/**
+ * Saves transforms in a binary format as a table with 6 columns: x, y, A(0,0), A(0,1), A(1,0), A(1,1).
+ */
+void save_transforms(string filename, FieldFormats::FieldFormat format, const vector<TransformInfo> &transforms)
+{
+	Image<float> table(6, transforms.size());
+	for (uint i = 0; i < transforms.size(); i++) {
+		float *row = table.row(i);
+		row[0] = transforms[i].x;
+		row[1] = transforms[i].y;
+		std::copy(transforms[i].transform.begin(), transforms[i].transform.end(), row + 2);
+	}
+
+	FieldWriter::write(filename, format, table);
+}
+
+
+/**
+ * Saves structure tensors in a binary format with 3 channels: T(0,0), T(0,1), T(1,1).
+ */
+void save_tensors(string filename, FieldFormats::FieldFormat format, const Image<Matrix2f> &tensors)
+{
+	Image<float> field(tensors.size_x(), tensors.size_y(), (uint)3);
+	for (uint y = 0; y < tensors.size_y(); y++) {
+		float *row = field.row(y);
+		for (uint x = 0; x < tensors.size_x(); x++) {
+			row[x * 3] = tensors(x, y)[0];
+			row[x * 3 + 1] = tensors(x, y)[1];
+			row[x * 3 + 2] = tensors(x, y)[3];
+		}
+	}
+
+	FieldWriter::write(filename, format, field);
+}
+
+
+/**
+ * Composes the name of outputs for an image processed in a batch: the prefix is followed by the name
+ * of the image without folders and extension, separated by '_' unless the prefix is a folder.
+ */
+string batch_output_name(const string &prefix, const string &image_name)
+{
+	std::size_t name_begin = image_name.find_last_of("/\\");
+	name_begin = (name_begin == string::npos) ? 0 : name_begin + 1;
+	std::size_t name_end = image_name.find_last_of('.');
+	if (name_end == string::npos || name_end < name_begin) {
+		name_end = image_name.size();
+	}
+
+	bool is_folder = !prefix.empty() && (prefix.back() == '/' || prefix.back() == '\\');
+	return prefix + ((is_folder || prefix.empty()) ? "" : "_") + image_name.substr(name_begin, name_end - name_begin);
+}
+
+
+/**
+ * Prints predicted versus actual costs of the blocks processed by a dense pass.
+ */
+void print_load_balance(const msas::LoadBalanceReport &report)
+{
+	std::cout << "Load balance: " << report.number_of_blocks << " blocks, correlation of predicted and actual costs "
+			  << report.correlation << ", max/mean block time " << report.actual_imbalance
+			  << " (predicted " << report.predicted_imbalance << ")." << std::endl;
+}
+
 }	// namespace iohelpers
 
 #endif //IO_HELPERS_H_H
@@ -8,11 +8,18 @@
  * <http://www.opensource.org/licenses/bsd-license.html>.
  */
 
+#include <cmath>
 #include <chrono>
 #include <vector>
 #include <string>
 #include <fstream>
 #include <iostream>
+#include <mutex>
+#include <memory>
+#include <thread>
+#include <atomic>
+#include <algorithm>
+#include <stdexcept>
 #include <tclap/CmdLine.h>
 #include "io_utility.h"
 #include "structure_tensor.h"
@@ -20,17 +27,70 @@
 #include "ellipse_normalization.h"
 #include "io_helpers.h"
 #include "matrix.h"
+#include "thread_pool.h"
+#include "bounded_queue.h"
+#include "cost_model.h"
+#include "tiled_image.h"
+#include "block_traversal.h"
+#include "field_writer.h"
+#include "field_stream.h"
+#include "strip_reader.h"
+#include "structure_tensor_tiles.h"
+#include "tensor_warping.h"
 
 using std::vector;
 using std::pair;
 using std::string;
 
+constexpr int TILE_SIZE = 128;	// size of tiles the gradient is computed in
+
+/**
+ * Image of a batch passed between the stages of the pipeline (decoding, computation and writing).
+ */
+struct BatchItem
+{
+	uint index;
+	string name;
+	Image<float> image;
+	Image<Matrix2f> tensors;
+	Image<float> sizes;
+	uint number_of_warped;	// number of points started from the tensors of the previous frame
+	double decode_time;		// in seconds
+	double compute_time;
+};
+
+
+/**
+ * Compute image gradient and tensor products in parallel tiles (views of the whole images).
+ */
+void calculate_dyadics(const Image<float> &image, Image<float> &gradient_x, Image<float> &gradient_y,
+					   Image<float> &dyadics)
+{
+	ThreadPool::shared().parallel_for_tiles(image.size(), TILE_SIZE, [&] (int x_0, int y_0, int x_1, int y_1) {
+		Image<float> tile_gradient_x = gradient_x.view(x_0, y_0, x_1 - x_0, y_1 - y_0);
+		Image<float> tile_gradient_y = gradient_y.view(x_0, y_0, x_1 - x_0, y_1 - y_0);
+		FieldOperations::centered_gradient(image.view(x_0, y_0, x_1 - x_0, y_1 - y_0), tile_gradient_x, tile_gradient_y);
+
+		for (int y = y_0; y < y_1; y++) {
+			float *dyadics_data = dyadics.row(y);
+			const float *grad_x_data = gradient_x.row(y);
+			const float *grad_y_data = gradient_y.row(y);
+			for (int x = x_0; x < x_1; x++) {
+				dyadics_data[x * 3] = grad_x_data[x] * grad_x_data[x];
+				dyadics_data[x * 3 + 1] = grad_x_data[x] * grad_y_data[x];
+				dyadics_data[x * 3 + 2] = grad_y_data[x] * grad_y_data[x];
+			}
+		}
+	});
+}
+
+
 int main(int argc, char* argv[])
 {
 	// Declare command line arguments
 	TCLAP::CmdLine cmd("In default mode compute Affine Covariant Structure Tensors for given image and parameters. "
 					   "See 'modes' argument for other available options.", ' ', "1.0");
-	TCLAP::UnlabeledValueArg<string> image_arg("image", "Load the given image.", true, string(), "file name", cmd);
+	TCLAP::UnlabeledValueArg<string> image_arg("image", "Load the given image.", false, string(), "file name", cmd);
 	TCLAP::ValueArg<float> hue_arg("", "hue", "Set the Hue [0, 360] for drawing regions in the 'ellipses' mode. Default: 60.0.", false, 60.0f, "float", cmd);
 	TCLAP::ValueArg<float> saturation_arg("", "saturation", "Set the Saturation [0.0, 1.0] for drawing regions in the 'ellipses' mode. Default: 1.0.", false, 1.0f, "float", cmd);
 	TCLAP::ValueArg<float> size_limit_arg("", "size-limit", "Set the maximum allowed radius of an elliptical region (circle) shall it appear in a uniform region. Default: 0.0.", false, 0.0f, "float", cmd);
@@ -40,12 +100,39 @@ int main(int argc, char* argv[])
 	TCLAP::ValueArg<int> step_arg("s", "step", "Set the step between the points of interest. Applicable in the 'avg_size' and 'ellipses' modes. Default: 50.", false, 50, "int", cmd);
 	TCLAP::ValueArg<string> points_arg("", "points", "Load the given text file with a set of points of interest (one point per line: 'X Y'). Applicable in the 'ellipses' mode.", false, string(), "string", cmd);
 	TCLAP::ValueArg<string> output_arg("o", "output", "Set the name for output file(s) without extension.", false, "out", "string", cmd);
+	vector<string> layouts_list;
+	layouts_list.push_back("row-major");
+	layouts_list.push_back("tiled");
+	TCLAP::ValuesConstraint<string> layouts_constrain(layouts_list);
+	TCLAP::ValueArg<string> layout_arg("", "layout", "Set the storage layout of dyadic products. Tiles reduce cache misses for large regions. Default: row-major.", false, "row-major", &layouts_constrain, cmd);
+	vector<string> traversals_list;
+	traversals_list.push_back("scanline");
+	traversals_list.push_back("morton");
+	traversals_list.push_back("hilbert");
+	TCLAP::ValuesConstraint<string> traversals_constrain(traversals_list);
+	TCLAP::ValueArg<string> traversal_arg("", "traversal", "Set the order of visiting points within blocks in the dense modes. Default: scanline.", false, "scanline", &traversals_constrain, cmd);
+	vector<string> formats_list;
+	formats_list.push_back("text");
+	formats_list.push_back("npy");
+	formats_list.push_back("tiff");
+	TCLAP::ValuesConstraint<string> formats_constrain(formats_list);
+	TCLAP::ValueArg<int> support_radius_arg("", "support-radius", "Restrict initial bands and elliptical regions to the square window of the given half-size around every point, so that results depend only on the data within this window. Applies to the whole image and to tiles alike. Default: 0 (no restriction), the size limit rounded up with --tile-size.", false, 0, "int", cmd);
+	TCLAP::ValueArg<int> tile_size_arg("", "tile-size", "Process the image tile by tile with a halo given by the support radius, instead of loading it entirely. Results are identical to the ones computed for the whole image with the same --support-radius, which defaults to the size limit rounded up here (the whole image is not restricted by default). Strips of tiles are read from binary PGM/PPM and NPY files and results are written after every strip. Requires a non-zero support radius and a binary format. Applicable in the default and 'sizes' modes. Default: 0 (whole image).", false, 0, "int", cmd);
+	TCLAP::ValueArg<string> batch_arg("", "batch", "Process all images in the given folder or listed in the given text file (one per line) instead of a single image, which is ignored then. Images are decoded, processed and written in a pipeline, outputs are named by the prefix set with -o followed by the image name (e.g. '-o results/'). Applicable in the default and 'sizes' modes.", false, string(), "folder or file", cmd);
+	TCLAP::ValueArg<int> jobs_arg("", "jobs", "Set the number of images processed simultaneously in the batch mode (every image is processed in parallel as well). Default: 2.", false, 2, "int", cmd);
+	TCLAP::ValueArg<int> decoders_arg("", "decoders", "Set the number of threads decoding images in the batch mode. Default: 2.", false, 2, "int", cmd);
+	TCLAP::ValueArg<int> queue_size_arg("", "queue-size", "Set the number of decoded images and of computed results, which may wait for the next stage in the batch mode. Default: 4.", false, 4, "int", cmd);
+	TCLAP::ValueArg<string> flows_arg("", "flows", "Treat images of the batch as consecutive frames of a video and start computations at every frame from the tensors of the previous frame warped along the optical flow. The folder should contain .flo files (the i-th one maps frame i to frame i+1), frames are processed one at a time then.", false, string(), "folder", cmd);
+	TCLAP::ValueArg<int> refinement_iterations_arg("", "refinement-iterations", "Set the max number of iterations at points started from the previous frame (see --flows). Even numbers keep the phase of points, where the scheme alternates between two states. Default: 6.", false, 6, "int", cmd);
+	TCLAP::ValueArg<string> format_arg("", "format", "Set the format of output tensors, transforms, angles and region sizes: 'text', 'npy' (NumPy array) or 'tiff' (multi-channel float TIFF). Binary fields are written row by row while being computed. Default: text.", false, "text", &formats_constrain, cmd);
+	TCLAP::ValueArg<string> roi_arg("", "roi", "Compute only at the points of the given region (top left point, width and height), output fields cover the region then. Applicable in the default, 'sizes' and 'transforms' modes.", false, string(), "x:y:w:h", cmd);
 	vector<string>  modes_list;
 	modes_list.push_back("sizes");
 	modes_list.push_back("avg_size");
 	modes_list.push_back("transforms");
 	modes_list.push_back("ellipses");
 	modes_list.push_back("ellipses+tensors");
+	modes_list.push_back("benchmark");
 	TCLAP::ValuesConstraint<string> modes_constrain(modes_list);
 	TCLAP::ValueArg<string> mode_arg("m", "mode",
 									 "Specify what should be done instead of computing Affine Covariant Structure Tensors:\n"
@@ -53,7 +140,8 @@ int main(int argc, char* argv[])
 									 "'avg_size' - compute the average size of Affine Covariant Regions;\n"
 									 "'transforms' - compute transformations that normalize elliptical Affine Covariant Regions to a disk;\n"
 									 "'ellipses' - draw Affine Covariant Regions over the image."
-									 "'ellipses+tensors' - draw Affine Covariant Regions over the image and output their corresponding Structure Tensors.",
+									 "'ellipses+tensors' - draw Affine Covariant Regions over the image and output their corresponding Structure Tensors.\n"
+									 "'benchmark' - compare the time of computing all Structure Tensors for all layouts and traversals, using R/4, R/2, R and 2R.",
 									 false, string(), &modes_constrain, cmd);
 
 	// Parse command line arguments
@@ -76,8 +164,306 @@ int main(int argc, char* argv[])
 	int step = std::max(step_arg.getValue(), 1);
 	string mode = mode_arg.getValue();
 	float max_size_limit = size_limit_arg.getValue();
+	int support_radius = std::max(support_radius_arg.getValue(), 0);
 	float hue = std::max(0.0f, std::min(360.0f, hue_arg.getValue()));
 	float saturation = std::max(0.0f, std::min(1.0f, saturation_arg.getValue()));
+	FieldLayouts::FieldLayout field_layout = (layout_arg.getValue() == "tiled") ? FieldLayouts::tiled
+																			   : FieldLayouts::row_major;
+	Traversals::Traversal traversal = Traversals::scanline;
+	if (traversal_arg.getValue() == "morton") {
+		traversal = Traversals::morton;
+	} else if (traversal_arg.getValue() == "hilbert") {
+		traversal = Traversals::hilbert;
+	}
+	bool is_binary_output = format_arg.getValue() != "text";
+	FieldFormats::FieldFormat field_format = (format_arg.getValue() == "tiff") ? FieldFormats::tiff
+																			  : FieldFormats::npy;
+
+	if (roi_arg.isSet() && ((!mode.empty() && mode != "sizes" && mode != "transforms") ||
+							batch_arg.isSet() || tile_size_arg.getValue() > 0)) {
+		std::cerr << "Region of interest is applicable only to a single image in the default, 'sizes' and 'transforms' modes"
+				  << std::endl;
+		return 1;
+	}
+
+	// Process a batch of images in a pipeline: decoding -> computation -> writing,
+	// every stage waits when the queue to the next one is full, so memory is bounded by the queue sizes
+	if (batch_arg.isSet()) {
+		if (!mode.empty() && mode != "sizes") {
+			std::cerr << "Batches can be processed only in the default and 'sizes' modes" << std::endl;
+			return 1;
+		}
+
+		vector<string> names = IOUtility::list_files(batch_arg.getValue());
+		if (names.empty()) {
+			std::cerr << "No images found in '" << batch_arg.getValue() << "'" << std::endl;
+			return 1;
+		}
+
+		msas::StructureTensor structure_tensor(radius, number_of_iterations, gamma);
+		structure_tensor.set_max_size_limit(max_size_limit);
+		structure_tensor.set_support_radius(support_radius);
+		structure_tensor.set_field_layout(field_layout);
+		structure_tensor.set_traversal(traversal);
+
+		bool is_sizes_mode = mode == "sizes";
+		int number_of_decoders = std::max(decoders_arg.getValue(), 1);
+		int number_of_jobs = std::max(jobs_arg.getValue(), 1);
+
+		// Frames of a video depend on the previous ones, so they are decoded and computed in order
+		vector<Image<float> > flows;
+		bool is_sequence = flows_arg.isSet();
+		if (is_sequence) {
+			flows = IOUtility::read_all_flows(flows_arg.getValue());
+			if (flows.size() + 1 < names.size()) {
+				std::cerr << "Only " << flows.size() << " flows found for " << names.size()
+						  << " frames, the rest of the frames is computed from scratch" << std::endl;
+			}
+			number_of_decoders = 1;
+			number_of_jobs = 1;
+		}
+		msas::TensorWarping tensor_warping;
+		int refinement_iterations = refinement_iterations_arg.getValue();
+		BoundedQueue<BatchItem> decoded(std::max(queue_size_arg.getValue(), 1));
+		BoundedQueue<BatchItem> computed(std::max(queue_size_arg.getValue(), 1));
+
+		std::cout << "Processing " << names.size() << " images..." << std::endl;
+		auto batch_start = std::chrono::system_clock::now();
+
+		// NOTE: IIO is not reentrant (e.g. errors are handled with a global jump buffer), so it is used
+		// by one thread at a time, while PGM/PPM and NPY files are decoded by StripReader concurrently
+		std::mutex iio_mutex;
+
+		// Decode images by dedicated threads, since decoding is mostly waiting for I/O
+		std::atomic<uint> next_index(0);
+		vector<std::thread> decoders;
+		for (int i = 0; i < number_of_decoders; i++) {
+			decoders.push_back(std::thread([&] () {
+				for (uint index = next_index++; index < names.size(); index = next_index++) {
+					auto time_start = std::chrono::system_clock::now();
+					BatchItem item;
+					item.index = index;
+					item.name = names[index];
+					std::unique_ptr<StripReader> reader;
+					{
+						std::lock_guard<std::mutex> lock(iio_mutex);
+						reader.reset(new StripReader(names[index]));
+					}
+					if (reader->is_open()) {
+						item.image = reader->read(0, reader->size_y());
+					}
+					item.decode_time = std::chrono::duration<double>(std::chrono::system_clock::now() - time_start).count();
+					item.compute_time = 0.0;
+					item.number_of_warped = 0;
+					decoded.push(item);
+				}
+			}));
+		}
+
+		// Compute several images at once, every one in parallel tiles and blocks on the shared pool
+		vector<std::thread> jobs;
+		for (int i = 0; i < number_of_jobs; i++) {
+			jobs.push_back(std::thread([&] () {
+				BatchItem item;
+				Image<Matrix2f> previous_tensors;	// of the previous frame of a sequence
+				uint previous_index = 0;
+				while (decoded.pop(item)) {
+					if (item.image) {
+						auto time_start = std::chrono::system_clock::now();
+
+						Image<float> gradient_x(item.image.size_x(), item.image.size_y(), 0.0f);
+						Image<float> gradient_y(item.image.size_x(), item.image.size_y(), 0.0f);
+						Image<float> dyadics(item.image.size(), (uint)3);
+						calculate_dyadics(item.image, gradient_x, gradient_y, dyadics);
+
+						// Start from the tensors of the previous frame, if it was computed and the flow is known
+						Image<Matrix2f> initial_tensors;
+						if (is_sequence && previous_tensors && previous_index + 1 == item.index &&
+							previous_index < flows.size() && previous_tensors.size() == item.image.size()) {
+							initial_tensors = tensor_warping.warp(previous_tensors, flows[previous_index],
+																  item.number_of_warped);
+						}
+						item.tensors = structure_tensor.calculate(dyadics, MaskFx(), initial_tensors, refinement_iterations);
+						previous_tensors = item.tensors;
+						previous_index = item.index;
+
+						if (is_sizes_mode) {
+							Shape size = item.image.size();
+							item.sizes = Image<float>(size.size_x, size.size_y);
+							ThreadPool::shared().parallel_for(0, size.size_y, 1, [&] (int begin, int end) {
+								vector<Point> region;
+								for (int y = begin; y < end; y++) {
+									for (uint x = 0; x < size.size_x; x++) {
+										structure_tensor.calculate_region(item.tensors(x, y), Point(x, y), size, region);
+										item.sizes(x, y) = region.size();
+									}
+								}
+							});
+						}
+
+						// Release the image before waiting for the writer
+						item.image = Image<float>();
+						item.compute_time = std::chrono::duration<double>(std::chrono::system_clock::now() - time_start).count();
+					}
+					computed.push(item);
+				}
+			}));
+		}
+
+		// Encode and write results by a dedicated thread, reporting per image timings
+		uint number_of_failures = 0;
+		double total_decode_time = 0.0, total_compute_time = 0.0, total_write_time = 0.0;
+		std::thread writer([&] () {
+			uint number_of_written = 0;
+			BatchItem item;
+			while (computed.pop(item)) {
+				number_of_written++;
+				if (!item.tensors) {
+					std::cerr << "[" << number_of_written << "/" << names.size() << "] Could not open image '"
+							  << item.name << "'" << std::endl;
+					number_of_failures++;
+					continue;
+				}
+
+				auto time_start = std::chrono::system_clock::now();
+				string name = iohelpers::batch_output_name(output_name, item.name);
+				if (is_sizes_mode && is_binary_output) {
+					std::lock_guard<std::mutex> lock(iio_mutex);
+					FieldWriter::write(name + "_region_sizes", field_format, item.sizes);
+				} else if (is_sizes_mode) {
+					iohelpers::save_floats(name + "_region_sizes.txt", item.sizes);
+				} else if (is_binary_output) {
+					std::lock_guard<std::mutex> lock(iio_mutex);
+					iohelpers::save_tensors(name + "_structure_tensors", field_format, item.tensors);
+				} else {
+					iohelpers::save_tensors(name + "_structure_tensors.txt", item.tensors);
+				}
+				double write_time = std::chrono::duration<double>(std::chrono::system_clock::now() - time_start).count();
+
+				total_decode_time += item.decode_time;
+				total_compute_time += item.compute_time;
+				total_write_time += write_time;
+				std::cout << "[" << number_of_written << "/" << names.size() << "] " << item.name << ": decoding "
+						  << item.decode_time << " s, computation " << item.compute_time << " s, writing "
+						  << write_time << " s";
+				if (is_sequence) {
+					std::cout << ", started from the previous frame at "
+							  << 100.0 * item.number_of_warped / (item.tensors.size_x() * item.tensors.size_y()) << "% of points";
+				}
+				std::cout << "." << std::endl;
+			}
+		});
+
+		// Close every queue once all its producers are finished
+		for (auto it = decoders.begin(); it != decoders.end(); ++it) {
+			it->join();
+		}
+		decoded.close();
+		for (auto it = jobs.begin(); it != jobs.end(); ++it) {
+			it->join();
+		}
+		computed.close();
+		writer.join();
+
+		std::chrono::duration<double> elapsed_seconds = std::chrono::system_clock::now() - batch_start;
+		std::cout << "Batch has finished in " << elapsed_seconds.count() << " seconds: "
+				  << names.size() - number_of_failures << " of " << names.size() << " images processed ("
+				  << (names.size() - number_of_failures) / elapsed_seconds.count() << " images per second)." << std::endl;
+		std::cout << "Total time of stages: decoding " << total_decode_time << " s, computation "
+				  << total_compute_time << " s, writing " << total_write_time << " s." << std::endl;
+
+		return (number_of_failures == 0) ? 0 : 1;
+	}
+
+	if (image_name.empty()) {
+		std::cerr << "Either an image or --batch should be given" << std::endl;
+		return 1;
+	}
+
+	// Process the image tile by tile, so that it does not have to fit into memory
+	int tile_size = tile_size_arg.getValue();
+	if (tile_size > 0) {
+		if (!mode.empty() && mode != "sizes") {
+			std::cerr << "Tiles can be processed only in the default and 'sizes' modes" << std::endl;
+			return 1;
+		}
+		if (!is_binary_output) {
+			std::cerr << "Tiles can be processed only with a binary output format (npy or tiff)" << std::endl;
+			return 1;
+		}
+		// NOTE: elliptical regions do not exceed the size limit except at the first iterations, so its window is the default support
+		if (!support_radius_arg.isSet() && max_size_limit >= 1.0f) {
+			support_radius = (int)std::ceil(max_size_limit);
+		}
+		if (support_radius == 0) {
+			std::cerr << "Tiles can not be processed without a support radius (either --size-limit or --support-radius)" << std::endl;
+			return 1;
+		}
+
+		StripReader reader(image_name);
+		if (!reader.is_open()) {
+			std::cerr << "Could not open image '" << image_name << "'" << std::endl;
+			return 1;
+		}
+		if (!reader.is_streamed()) {
+			std::cout << "WARNING: image '" << image_name << "' can not be read by strips and is loaded entirely." << std::endl;
+		}
+
+		msas::StructureTensor structure_tensor(radius, number_of_iterations, gamma);
+		structure_tensor.set_max_size_limit(max_size_limit);
+		structure_tensor.set_support_radius(support_radius);
+		structure_tensor.set_field_layout(field_layout);
+		structure_tensor.set_traversal(traversal);
+
+		std::unique_ptr<msas::StructureTensorTiles> tiles;
+		tiles.reset(new msas::StructureTensorTiles(structure_tensor, tile_size));
+
+		std::cout << "Computing " << ((mode == "sizes") ? "sizes of Affine Covariant Regions" : "Affine Covariant Structure Tensors")
+				  << " in tiles of " << tile_size << " pixels with a halo of " << tiles->halo() << " pixels "
+				  << "(equivalent to --support-radius " << support_radius << " for the whole image)..." << std::endl;
+		auto time_start = std::chrono::system_clock::now();
+
+		// Fill rows of a strip by tiles and write them once the strip is complete,
+		// sizes of regions are written in one channel, tensors in three: T(0,0), T(0,1), T(1,1)
+		bool is_sizes_mode = mode == "sizes";
+		uint number_of_channels = (is_sizes_mode) ? 1 : 3;
+		FieldWriter writer(output_name + ((is_sizes_mode) ? "_region_sizes" : "_structure_tensors"), field_format,
+						   reader.size_x(), reader.size_y(), number_of_channels);
+		Image<float> strip(reader.size_x(), (uint)tile_size, number_of_channels);
+		const msas::StructureTensor &tiles_tensor = tiles->structure_tensor();
+		bool is_read = tiles->run(reader, [&] (const msas::StructureTensorTiles::Tile &tile) {
+			vector<Point> region;
+			for (int y = tile.y_0; y < tile.y_1; y++) {
+				float *values = strip.row(y - tile.y_0);
+				for (int x = tile.x_0; x < tile.x_1; x++) {
+					const Matrix2f &tensor = tile.tensors(x - tile.x_0, y - tile.y_0);
+					if (is_sizes_mode) {
+						Point p(x - tile.origin.x, y - tile.origin.y);
+						tiles_tensor.calculate_region(tensor, p, tile.dyadics.size(), region);
+						values[x] = region.size();
+					} else {
+						values[x * 3] = tensor[0];
+						values[x * 3 + 1] = tensor[1];
+						values[x * 3 + 2] = tensor[3];
+					}
+				}
+			}
+		}, [&] (uint y_0, uint y_1) {
+			writer.write_rows(strip.row(0), y_1 - y_0, strip.stride());
+		});
+		writer.close();
+
+		if (!is_read) {
+			std::cerr << "Could not read image '" << image_name << "'" << std::endl;
+			return 1;
+		}
+
+		auto time_end = std::chrono::system_clock::now();
+		std::chrono::duration<double> elapsed_seconds = time_end - time_start;
+		std::cout << "Computation has finished in " << elapsed_seconds.count() << " seconds." << std::endl;
+
+		return 0;
+	}
 
 	// Read the image
 	Image<float> image = IOUtility::read_mono_image(image_name);
@@ -87,33 +473,39 @@ int main(int argc, char* argv[])
 		return 1;
 	}
 
-	// Compute image gradient
+	// Restrict dense passes to the region of interest, so that tensors are computed only at its points
+	Rectangle roi(image.size());
+	if (roi_arg.isSet()) {
+		roi = iohelpers::parse_rectangle(roi_arg.getValue()).intersection(roi);
+		if (roi.is_empty()) {
+			std::cerr << "Region of interest '" << roi_arg.getValue() << "' is either wrong or out of the image" << std::endl;
+			return 1;
+		}
+	}
+
+	// Compute image gradient and tensor products
 	Image<float> gradient_x(image.size_x(), image.size_y(), 0.0f);
 	Image<float> gradient_y(image.size_x(), image.size_y(), 0.0f);
-	FieldOperations::centered_gradient(image.raw(),
-									   gradient_x.raw(),
-									   gradient_y.raw(),
-									   image.size_x(),
-									   image.size_y());
-
-	// Compute tensor products
 	Image<float> dyadics(gradient_x.size(), (uint)3);
-	int size_x = gradient_x.size_x();
-	float *dyadics_data = dyadics.raw();
-	float *grad_x_data = gradient_x.raw();
-	float *grad_y_data = gradient_y.raw();
-	for (uint y = 0; y < image.size_y(); y++) {
-		for (uint x = 0; x < image.size_x(); x++) {
-			int index = size_x * y + x;
-			dyadics_data[index * 3] = grad_x_data[index] * grad_x_data[index];
-			dyadics_data[index * 3 + 1] = grad_x_data[index] * grad_y_data[index];
-			dyadics_data[index * 3 + 2] = grad_y_data[index] * grad_y_data[index];
-		}
-	}
+	calculate_dyadics(image, gradient_x, gradient_y, dyadics);
 
 	// Create StructureTensor calculator
 	msas::StructureTensor *structure_tensor = new msas::StructureTensor(radius, number_of_iterations, gamma);
 	structure_tensor->set_max_size_limit(max_size_limit);
+	structure_tensor->set_support_radius(support_radius);
+	structure_tensor->set_field_layout(field_layout);
+	structure_tensor->set_traversal(traversal);
+
+	// Create predictor of per-point costs, which dense passes are balanced with
+	msas::CostModel cost_model(dyadics, radius, max_size_limit);
+
+	// Copy dyadic products into tiles, if requested
+	TiledImage<float> tiled_dyadics = (field_layout == FieldLayouts::tiled) ? TiledImage<float>(dyadics)
+																			: TiledImage<float>();
+	auto calculate_tensor = [&] (const Point &p) {
+		return (tiled_dyadics) ? structure_tensor->calculate(tiled_dyadics, p, MaskFx())
+							   : structure_tensor->calculate(dyadics, p, MaskFx());
+	};
 
 	// Do processing according to the selected mode
 	if (mode == "sizes") {
@@ -121,21 +513,35 @@ int main(int argc, char* argv[])
 		auto time_start = std::chrono::system_clock::now();
 
 		// Compute sizes of regions at every point
-		Image<float> sizes(image.size_x(), image.size_y());
-		#pragma omp parallel for schedule(dynamic,1) collapse(2) shared(sizes)
-		for (uint y = 0; y < image.size_y(); ++y) {
-			for (uint x = 0; x < image.size_x(); ++x) {
-				Matrix2f tensor = structure_tensor->calculate(dyadics, Point(x, y), MaskFx());
-				vector<Point> region = structure_tensor->calculate_region(tensor, Point(x, y), image.size());
-				sizes(x, y) = region.size();
-			}
+		Image<float> sizes(roi.size());
+		std::unique_ptr<FieldStream<float> > sizes_stream;
+		if (is_binary_output) {
+			sizes_stream.reset(new FieldStream<float>(output_name + "_region_sizes", field_format, sizes, 1,
+													  [] (const float &size, float *values) { values[0] = size; }));
 		}
+		msas::LoadBalanceReport report = cost_model.run(roi, [&] (int x_0, int y_0, int x_1, int y_1) {
+			vector<Point> points;
+			BlockTraversal::order(x_0, y_0, x_1, y_1, traversal, points);
+			for (auto it = points.begin(); it != points.end(); ++it) {
+				Matrix2f tensor = calculate_tensor(*it);
+				vector<Point> region = structure_tensor->calculate_region(tensor, *it, image.size());
+				sizes(*it - roi.origin()) = region.size();
+			}
+			if (sizes_stream) {
+				sizes_stream->complete(x_0 - roi.x_0, y_0 - roi.y_0, x_1 - roi.x_0, y_1 - roi.y_0);
+			}
+		});
 
 		auto time_end = std::chrono::system_clock::now();
 		std::chrono::duration<double> elapsed_seconds = time_end - time_start;
 		std::cout << "Computation has finished in " << elapsed_seconds.count() << " seconds." << std::endl;
+		iohelpers::print_load_balance(report);
 
-		iohelpers::save_floats(output_name + "_region_sizes.txt", sizes);
+		if (sizes_stream) {
+			sizes_stream->close();
+		} else {
+			iohelpers::save_floats(output_name + "_region_sizes.txt", sizes);
+		}
 	} else if (mode == "avg_size") {
 		std::cout << "Computing average size of Affine Covariant Regions..." << std::endl;
 		auto time_start = std::chrono::system_clock::now();
@@ -145,17 +551,27 @@ int main(int argc, char* argv[])
 			step = 1;
 		}
 
-		// Compute average size of regions
+		// Compute average size of regions (row by row, the partial sums are added up afterwards)
+		int number_of_rows = (image.size_y() + step - 1) / step;
+		vector<double> row_totals(number_of_rows, 0.0);
+		vector<double> row_counts(number_of_rows, 0.0);
+		ThreadPool::shared().parallel_for(0, number_of_rows, 1, [&] (int begin, int end) {
+			for (int row = begin; row < end; ++row) {
+				uint y = row * step;
+				for (uint x = 0; x < image.size_x(); x += step) {
+					Matrix2f tensor = structure_tensor->calculate(dyadics, Point(x, y), MaskFx());
+					vector<Point> region = structure_tensor->calculate_region(tensor, Point(x, y), image.size());
+					row_totals[row] += region.size();
+					row_counts[row]++;
+				}
+			}
+		});
+
 		double total = 0.0;
 		double count = 0.0;
-		#pragma omp parallel for reduction(+:total,count)
-		for (uint y = 0; y < image.size_y(); y += step) {
-			for (uint x = 0; x < image.size_x(); x += step) {
-				Matrix2f tensor = structure_tensor->calculate(dyadics, Point(x, y), MaskFx());
-				vector<Point> region = structure_tensor->calculate_region(tensor, Point(x, y), image.size());
-				total += region.size();
-				count++;
-			}
+		for (int row = 0; row < number_of_rows; ++row) {
+			total += row_totals[row];
+			count += row_counts[row];
 		}
 
 		auto time_end = std::chrono::system_clock::now();
@@ -171,39 +587,71 @@ int main(int argc, char* argv[])
 		// Create elliptical patch normalization calculator
 		msas::EllipseNormalization normalization;
 
-		// At every point compute transformations that maps elliptical patches to a disk
+		// At every point compute transformations that maps elliptical patches to a disk,
+		// binary output also gets the field of angles between the major axes of the patches and 0Y axis
 		vector<iohelpers::TransformInfo> transforms;
-		#pragma omp parallel for schedule(dynamic,1) shared(transforms)
-		for (uint y = 0; y < image.size_y(); ++y) {
-			for (uint x = 0; x < image.size_x(); ++x) {
-				Matrix2f tensor = structure_tensor->calculate(dyadics, Point(x, y), MaskFx());
+		std::mutex transforms_mutex;
+		Image<float> angles;
+		std::unique_ptr<FieldStream<float> > angles_stream;
+		if (is_binary_output) {
+			angles = Image<float>(roi.size());
+			angles_stream.reset(new FieldStream<float>(output_name + "_angles", field_format, angles, 1,
+													   [] (const float &angle, float *values) { values[0] = angle; }));
+		}
+		msas::LoadBalanceReport report = cost_model.run(roi, [&] (int x_0, int y_0, int x_1, int y_1) {
+			vector<iohelpers::TransformInfo> block_transforms;
+			vector<Point> points;
+			BlockTraversal::order(x_0, y_0, x_1, y_1, traversal, points);
+			for (auto p_it = points.begin(); p_it != points.end(); ++p_it) {
+				Matrix2f tensor = calculate_tensor(*p_it);
 				float angle;
 				Matrix2f transform = structure_tensor->calculate_transformation(tensor, angle, radius);
-				vector<Point> region = structure_tensor->calculate_region(tensor, Point(x, y), image.size(), radius);
+				if (angles_stream) {
+					angles(*p_it - roi.origin()) = angle;
+				}
+				vector<Point> region = structure_tensor->calculate_region(tensor, *p_it, image.size(), radius);
 				vector<float> dominant_orientations = normalization.calculate_dominant_orientations(gradient_x,
 																									gradient_y, region,
 																									transform,
-																									Point(x, y));
+																									*p_it);
 
 				for (auto it = dominant_orientations.begin(); it != dominant_orientations.end(); ++it) {
 					Matrix2f rotation = normalization.rotation(*it);
 
 					iohelpers::TransformInfo info;
 					info.transform = Matrix::multiply(rotation, transform);
-					info.x = x;
-					info.y = y;
+					info.x = p_it->x;
+					info.y = p_it->y;
 
-					#pragma omp critical
-					transforms.push_back(info);
+					block_transforms.push_back(info);
 				}
 			}
-		}
+
+			if (angles_stream) {
+				angles_stream->complete(x_0 - roi.x_0, y_0 - roi.y_0, x_1 - roi.x_0, y_1 - roi.y_0);
+			}
+
+			std::lock_guard<std::mutex> lock(transforms_mutex);
+			transforms.insert(transforms.end(), block_transforms.begin(), block_transforms.end());
+		});
+
+		// Restore the scan order, so that the output does not depend on the order of execution
+		std::stable_sort(transforms.begin(), transforms.end(),
+						 [] (const iohelpers::TransformInfo &left, const iohelpers::TransformInfo &right) {
+			return left.y < right.y || (left.y == right.y && left.x < right.x);
+		});
 
 		auto time_end = std::chrono::system_clock::now();
 		std::chrono::duration<double> elapsed_seconds = time_end - time_start;
 		std::cout << "Computation has finished in " << elapsed_seconds.count() << " seconds." << std::endl;
+		iohelpers::print_load_balance(report);
 
-		iohelpers::save_transforms(output_name + "_transforms.txt", transforms);
+		if (is_binary_output) {
+			angles_stream->close();
+			iohelpers::save_transforms(output_name + "_transforms", field_format, transforms);
+		} else {
+			iohelpers::save_transforms(output_name + "_transforms.txt", transforms);
+		}
 	} else if (mode == "ellipses") {
 		std::cout << "Computing and drawing Affine Covariant Regions..." << std::endl;
 		auto time_start = std::chrono::system_clock::now();
@@ -344,25 +792,86 @@ int main(int argc, char* argv[])
 		std::cout << "Computation has finished in " << elapsed_seconds.count() << " seconds." << std::endl;
 
 		IOUtility::write_rgb_image(output_name + "_regions.png", canvas);
-		iohelpers::save_tensors(output_name + "_structure_tensors.txt", tensors);
+		if (is_binary_output) {
+			iohelpers::save_tensors(output_name + "_structure_tensors", field_format, tensors);
+		} else {
+			iohelpers::save_tensors(output_name + "_structure_tensors.txt", tensors);
+		}
+	} else if (mode == "benchmark") {
+		std::cout << "Benchmarking layouts of dyadic products and traversals..." << std::endl;
+
+		const char *layout_names[] = {"row-major", "tiled"};
+		const char *traversal_names[] = {"scanline", "morton", "hilbert"};
+		const float radius_factors[] = {0.25f, 0.5f, 1.0f, 2.0f};
+		for (int r = 0; r < 4; r++) {
+			msas::StructureTensor benchmark_tensor(radius * radius_factors[r], number_of_iterations, gamma);
+			benchmark_tensor.set_max_size_limit(max_size_limit);
+			benchmark_tensor.set_support_radius(support_radius);
+
+			Image<Matrix2f> reference;
+			for (int l = 0; l < 2; l++) {
+				for (int t = 0; t < 3; t++) {
+					benchmark_tensor.set_field_layout((FieldLayouts::FieldLayout)l);
+					benchmark_tensor.set_traversal((Traversals::Traversal)t);
+
+					auto time_start = std::chrono::system_clock::now();
+					Image<Matrix2f> tensors = benchmark_tensor.calculate(dyadics, MaskFx());
+					auto time_end = std::chrono::system_clock::now();
+					std::chrono::duration<double> elapsed_seconds = time_end - time_start;
+
+					// Results shall not depend on the layout and traversal
+					float max_difference = 0.0f;
+					if (!reference) {
+						reference = tensors;
+					}
+					for (uint i = 0; i < tensors.number_of_pixels(); i++) {
+						for (int k = 0; k < 4; k++) {
+							max_difference = std::max(max_difference, std::abs(tensors.raw()[i][k] - reference.raw()[i][k]));
+						}
+					}
+
+					std::cout << "R = " << benchmark_tensor.radius() << ", " << layout_names[l] << ", "
+							  << traversal_names[t] << ": " << elapsed_seconds.count() << " seconds"
+							  << " (max difference " << max_difference << ")" << std::endl;
+				}
+			}
+		}
 	} else {	// if default mode
 		std::cout << "Computing Affine Covariant Structure Tensors..." << std::endl;
 		auto time_start = std::chrono::system_clock::now();
 
-		// Compute affine covariant structure tensors for all the points
-		Image<Matrix2f> tensors(image.size_x(), image.size_y());
-		#pragma omp parallel for schedule(dynamic,1) collapse(2) shared(tensors)
-		for (uint y = 0; y < image.size_y(); ++y) {
-			for (uint x = 0; x < image.size_x(); ++x) {
-				Matrix2f tensor = structure_tensor->calculate(dyadics, Point(x, y), MaskFx());
-				tensors(x, y) = tensor;
-			}
+		// Compute affine covariant structure tensors for all the points,
+		// binary output gets the unique components T(0,0), T(0,1), T(1,1) of every tensor
+		Image<Matrix2f> tensors(roi.size());
+		std::unique_ptr<FieldStream<Matrix2f> > tensors_stream;
+		if (is_binary_output) {
+			tensors_stream.reset(new FieldStream<Matrix2f>(output_name + "_structure_tensors", field_format, tensors, 3,
+					[] (const Matrix2f &tensor, float *values) {
+				values[0] = tensor[0];
+				values[1] = tensor[1];
+				values[2] = tensor[3];
+			}));
 		}
+		msas::LoadBalanceReport report = cost_model.run(roi, [&] (int x_0, int y_0, int x_1, int y_1) {
+			vector<Point> points;
+			BlockTraversal::order(x_0, y_0, x_1, y_1, traversal, points);
+			for (auto it = points.begin(); it != points.end(); ++it) {
+				tensors(*it - roi.origin()) = calculate_tensor(*it);
+			}
+			if (tensors_stream) {
+				tensors_stream->complete(x_0 - roi.x_0, y_0 - roi.y_0, x_1 - roi.x_0, y_1 - roi.y_0);
+			}
+		});
 
 		auto time_end = std::chrono::system_clock::now();
 		std::chrono::duration<double> elapsed_seconds = time_end - time_start;
 		std::cout << "Computation has finished in " << elapsed_seconds.count() << " seconds." << std::endl;
+		iohelpers::print_load_balance(report);
 
-		iohelpers::save_tensors(output_name + "_structure_tensors.txt", tensors);
+		if (tensors_stream) {
+			tensors_stream->close();
+		} else {
+			iohelpers::save_tensors(output_name + "_structure_tensors.txt", tensors);
+		}
 	}
 }
\ No newline at end of file